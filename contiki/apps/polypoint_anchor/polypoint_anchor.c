@@ -54,23 +54,6 @@ void app_dw1000_txcallback (const dwt_callback_data_t *txd) {
 	//NOTE: No need for tx timestamping after-the-fact (everything's done beforehand)
 }
 
-static void insert_sorted(float arr[], float new, unsigned end) {
-	unsigned insert_at = 0;
-	while ((insert_at < end) && (new > arr[insert_at])) {
-		insert_at++;
-	}
-	if (insert_at == end) {
-		arr[insert_at] = new;
-	} else {
-		while (insert_at <= end) {
-			float temp = arr[insert_at];
-			arr[insert_at] = new;
-			new = temp;
-			insert_at++;
-		}
-	}
-}
-
 // Triggered when we receive a packet
 void app_dw1000_rxcallback (const dwt_callback_data_t *rxd) {
 	int err;
@@ -225,11 +208,7 @@ void app_dw1000_rxcallback (const dwt_callback_data_t *rxd) {
 				dist += ANCHOR_CAL_LEN;
 				dist -= txDelayCal[ANCHOR_EUI*NUM_CHANNELS + subseq_num_to_chan(global_subseq_num, true)];
 				DEBUG_P("dist*100 = %d\r\n", (int)(dist*100));
-#ifdef SORT_MEASUREMENTS
-				insert_sorted(fin_msg.distanceHist, (float)dist, global_subseq_num);
-#else
 				fin_msg.distanceHist[global_subseq_num] = (float)dist;
-#endif
 			}
 
 			// Get ready to receive next POLL
@@ -461,17 +440,21 @@ PROCESS_THREAD(polypoint_anchor, ev, data) {
 					const unsigned bot = NUM_MEASUREMENTS*TARGET_PERCENTILE;
 					const unsigned top = NUM_MEASUREMENTS*TARGET_PERCENTILE+1;
 					unsigned idx = 0;
-					while (fin_msg.distanceHist[idx] == 0) {
-						idx++;
-						if ((idx+top) == NUM_MEASUREMENTS) break;
+					unsigned k;
+					for (k=0; k < NUM_MEASUREMENTS; k++) {
+						if (fin_msg.distanceHist[k] == 0) idx++;
 					}
-					if ((idx+top) == NUM_MEASUREMENTS) {
+					if ((idx+top) >= NUM_MEASUREMENTS) {
 						// Didn't get enough valid measurements
-						fin_msg.distanceHist[0] = 0; /* actually, this should already be true */
+						fin_msg.distanceHist[0] = 0;
 					} else {
+						// The 0's select below all of the valid ranges, so
+						// they just shift the index we are looking for
+						float bot_value = select_kth_float(fin_msg.distanceHist, NUM_MEASUREMENTS, idx+bot);
+						float top_value = select_next_float(fin_msg.distanceHist, NUM_MEASUREMENTS, idx+bot);
 						fin_msg.distanceHist[0] =
-							fin_msg.distanceHist[idx+bot] +
-							fin_msg.distanceHist[idx+top] * (NUM_MEASUREMENTS*TARGET_PERCENTILE - (float) bot);
+							bot_value +
+							top_value * (NUM_MEASUREMENTS*TARGET_PERCENTILE - (float) bot);
 					}
 				}
 #endif
@@ -72,23 +72,6 @@ static struct pp_tag_poll pp_tag_poll_pkt;
 static struct uip_udp_conn *client_conn;
 
 
-static void insert_sorted(int arr[], int new, unsigned end) {
-	unsigned insert_at = 0;
-	while ((insert_at < end) && (new >= arr[insert_at])) {
-		insert_at++;
-	}
-	if (insert_at == end) {
-		arr[insert_at] = new;
-	} else {
-		while (insert_at <= end) {
-			int temp = arr[insert_at];
-			arr[insert_at] = new;
-			new = temp;
-			insert_at++;
-		}
-	}
-}
-
 static double dwtime_to_dist(double dwtime, unsigned anchor_id, unsigned subseq) {
 	double dist = dwtime * DWT_TIME_UNITS * SPEED_OF_LIGHT;
 	dist += ANCHOR_CAL_LEN;
@@ -169,12 +152,12 @@ static void compute_results() {
 #ifdef SORT_MEASUREMENTS
 			int dist_times_100 = (int)(dist*100);
 			// Convert invalid values to a large number so that they
-			// run through the sort algorithm in minimal time and
-			// are easy to discard when doing the %ile measurements
+			// always select above the valid ones and are easy to discard
+			// when doing the %ile measurements
 			if ((dist_times_100 < MIN_VALID_RANGE_IN_CM) || (dist_times_100 > MAX_VALID_RANGE_IN_CM)) {
 				dist_times_100 = MAX_VALID_RANGE_IN_CM;
 			}
-			insert_sorted(dists_times_100, dist_times_100, j);
+			dists_times_100[j] = dist_times_100;
 #else // SORT_MEASUREMENTS
 #ifdef DW_DEBUG
 			int64_t dist_times_1000000 = (int64_t)(dist*1000000);
@@ -195,9 +178,6 @@ static void compute_results() {
 			for (k=0; k < NUM_MEASUREMENTS; k++) {
 				if (dists_times_100[k] < MAX_VALID_RANGE_IN_CM) {
 					num_valid++;
-				} else {
-					// Can safely break b/c dists_times_100 is sorted
-					break;
 				}
 			}
 
@@ -211,10 +191,14 @@ static void compute_results() {
 				pkt_offset += 2;
 			} else {
 				unsigned bot = num_valid*TARGET_PERCENTILE;
-				unsigned top = num_valid*TARGET_PERCENTILE+1;
+				// Invalid values are all larger than valid ones, so selecting
+				// over the whole array gives the same result as over the
+				// valid values only
+				int bot_value = select_kth(dists_times_100, NUM_MEASUREMENTS, bot);
+				int top_value = select_next(dists_times_100, NUM_MEASUREMENTS, bot);
 				int perc =
-					dists_times_100[bot] +
-					(dists_times_100[top] - dists_times_100[bot]) * (NUM_MEASUREMENTS*TARGET_PERCENTILE - (float) bot);
+					bot_value +
+					(top_value - bot_value) * (NUM_MEASUREMENTS*TARGET_PERCENTILE - (float) bot);
 #ifdef REPORT_PERCENTILE_VIA_UART
 				printf("%d.%02d ", perc/100, perc%100);
 #endif
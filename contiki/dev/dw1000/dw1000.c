@@ -366,3 +366,60 @@ void decamutexoff (decaIrqStatus_t s) {
     dw1000_irq_onoff = 1;
   }
 }
+
+// Find the k-th smallest (starting at 0) of the num values in arr without
+// sorting the whole array (quickselect). arr is reordered such that arr[k]
+// holds the result, everything before it is no larger and everything after
+// it is no smaller. The int and float versions are identical apart from the
+// element type.
+#define SELECT_KTH(_name, _type)                                        \
+_type _name (_type arr[], unsigned num, unsigned k) {                   \
+  int lo = 0;                                                           \
+  int hi = num - 1;                                                     \
+  while (lo < hi) {                                                     \
+    /* Median of three pivot, also leaves sentinels at both ends */     \
+    int mid = lo + ((hi - lo) / 2);                                     \
+    _type temp;                                                         \
+    if (arr[mid] < arr[lo]) { temp = arr[mid]; arr[mid] = arr[lo]; arr[lo] = temp; } \
+    if (arr[hi] < arr[lo])  { temp = arr[hi];  arr[hi] = arr[lo];  arr[lo] = temp; } \
+    if (arr[hi] < arr[mid]) { temp = arr[hi];  arr[hi] = arr[mid]; arr[mid] = temp; } \
+    _type pivot = arr[mid];                                             \
+    int i = lo;                                                         \
+    int j = hi;                                                         \
+    while (i <= j) {                                                    \
+      while (arr[i] < pivot) i++;                                       \
+      while (arr[j] > pivot) j--;                                       \
+      if (i <= j) {                                                     \
+        temp = arr[i]; arr[i] = arr[j]; arr[j] = temp;                  \
+        i++;                                                            \
+        j--;                                                            \
+      }                                                                 \
+    }                                                                   \
+    if ((int) k <= j) {                                                 \
+      hi = j;                                                           \
+    } else if ((int) k >= i) {                                          \
+      lo = i;                                                           \
+    } else {                                                            \
+      break;                                                            \
+    }                                                                   \
+  }                                                                     \
+  return arr[k];                                                        \
+}
+
+SELECT_KTH(select_kth, int)
+SELECT_KTH(select_kth_float, float)
+
+// After select_kth(arr, num, k) returns, this gets the value that would be
+// at index k+1 if arr were sorted, which is just the smallest value after k.
+#define SELECT_NEXT(_name, _type)                                       \
+_type _name (_type arr[], unsigned num, unsigned k) {                   \
+  _type next = arr[k+1];                                                \
+  unsigned i;                                                           \
+  for (i=k+2; i<num; i++) {                                             \
+    if (arr[i] < next) next = arr[i];                                   \
+  }                                                                     \
+  return next;                                                          \
+}
+
+SELECT_NEXT(select_next, int)
+SELECT_NEXT(select_next_float, float)
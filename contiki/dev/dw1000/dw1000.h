@@ -6,5 +6,11 @@ void dw1000_reset ();
 void dw1000_choose_antenna (uint8_t antenna_number);
 void dw1000_populate_eui (uint8_t *eui_buf, uint8_t id);
 
+// Percentile helpers
+int   select_kth (int arr[], unsigned num, unsigned k);
+float select_kth_float (float arr[], unsigned num, unsigned k);
+int   select_next (int arr[], unsigned num, unsigned k);
+float select_next_float (float arr[], unsigned num, unsigned k);
+
 
 #endif
@@ -61,6 +61,10 @@ parser.add_argument('--gdp-rest-url', default='http://localhost:8080')
 parser.add_argument('--gdp-log', default='edu.umich.eecs.lab11.polypoint-test')
 parser.add_argument('-j', '--anchors_from_json', action="store_true")
 parser.add_argument('--anchor-url', default="http://j2x.us/ppts16")
+parser.add_argument('--skew-regression', action='store_true',
+		help="Fit the clock offset over all broadcasts (ONEWAY_SKEW_REGRESSION)")
+parser.add_argument('--no-repeated-broadcasts', action='store_true',
+		help="Tag was built with ONEWAY_NO_REPEATED_BROADCASTS")
 #parser.add_argument('-t', '--textfiles',action='store_true',
 #		help="Generate ASCII text files with the data")
 #parser.add_argument('-m', '--matfile',  action='store_true',
@@ -73,6 +77,9 @@ args = parser.parse_args()
 if args.subsample and (args.exact is not None):
 	raise NotImplementedError("Illegal flags -m + -e")
 
+if args.no_repeated_broadcasts and not args.skew_regression:
+	raise NotImplementedError("--no-repeated-broadcasts requires --skew-regression")
+
 #if not (args.textfiles or args.matfile or args.binfile):
 #	print("Error: Must specify at least one of -t, -m, or -n")
 #	print("")
@@ -383,8 +390,10 @@ good = 0
 bad = 0
 NUM_RANGING_CHANNELS = 3
 NUM_RANGING_BROADCASTS = 30
+if args.no_repeated_broadcasts:
+	NUM_RANGING_BROADCASTS = 27
 EUI_LEN = 8
-data_section_length = 8*NUM_RANGING_CHANNELS + 8+1+1+8+8+30*8
+data_section_length = 8*NUM_RANGING_CHANNELS + 8+1+1+8+8+NUM_RANGING_BROADCASTS*8
 
 
 if args.dump_full:
@@ -409,6 +418,44 @@ def oneway_get_ss_index_from_settings(anchor_antenna_index, window_num):
 	ret = antenna_and_channel_to_subsequence_number(tag_antenna_index, anchor_antenna_index, channel_index)
 	return ret
 
+# Least squares fit of the clock offset over every broadcast the anchor
+# received. Each channel gets its own intercept since the antenna delays are
+# different on each channel. Same as offset_regression() in oneway_range.c.
+def skew_regression(tag_poll_TOAs, send_times):
+	sum_xx = 0.0
+	sum_xr = 0.0
+	for ch in range(NUM_RANGING_CHANNELS):
+		ref = None
+		n = 0
+		sx = sr = sxx = sxr = 0.0
+		for jj in range(ch, NUM_RANGING_BROADCASTS, NUM_RANGING_CHANNELS):
+			if int(tag_poll_TOAs[jj]) & 0xFFFF == 0:
+				continue
+			if ref is None:
+				ref = jj
+			send_delta = int(send_times[jj]) - int(send_times[ref])
+			skew = int(tag_poll_TOAs[jj]) - int(tag_poll_TOAs[ref]) - send_delta
+			# Drop broadcasts with bad timestamps
+			if abs(skew) > (send_delta >> 10):
+				continue
+			x = float(send_delta)
+			r = float(skew)
+			n += 1
+			sx += x
+			sr += r
+			sxx += x*x
+			sxr += x*r
+		if n < 2:
+			continue
+		sum_xx += sxx - sx*sx/n
+		sum_xr += sxr - sx*sr/n
+	if sum_xx <= 0:
+		return None
+	skew = sum_xr/sum_xx
+	if abs(skew) > 1/1024:
+		return None
+	return 1 + skew
+
 def find_header():
 	b = useful_read(len(HEADER))
 	while b != HEADER:
@@ -469,7 +516,7 @@ try:
 
 			num_anchors, = struct.unpack("<B", useful_read(1))
 
-			ranging_broadcast_ss_send_times = np.array(struct.unpack("<30Q", useful_read(8*NUM_RANGING_BROADCASTS)))
+			ranging_broadcast_ss_send_times = np.array(struct.unpack("<"+str(NUM_RANGING_BROADCASTS)+"Q", useful_read(8*NUM_RANGING_BROADCASTS)))
 
 			if first_time is None:
 				first_time = ranging_broadcast_ss_send_times[15]
@@ -519,16 +566,21 @@ try:
 					tag_poll_TOAs[jj] = actual_toa
 
 				# Get the actual clock offset calculation
-				num_valid_offsets = 0
-				offset_cumsum = 0
-				for jj in range(NUM_RANGING_CHANNELS):
-					if(tag_poll_TOAs[jj] & 0xFFFF > 0 and tag_poll_TOAs[27+jj] & 0xFFFF > 0):
-						offset_cumsum = offset_cumsum + (tag_poll_TOAs[27+jj] - tag_poll_TOAs[jj])/(ranging_broadcast_ss_send_times[27+jj] - ranging_broadcast_ss_send_times[jj])
-						num_valid_offsets = num_valid_offsets + 1
-
-				if num_valid_offsets == 0:
-					continue
-				offset_anchor_over_tag = offset_cumsum/num_valid_offsets;
+				if args.skew_regression:
+					offset_anchor_over_tag = skew_regression(tag_poll_TOAs, ranging_broadcast_ss_send_times)
+					if offset_anchor_over_tag is None:
+						continue
+				else:
+					num_valid_offsets = 0
+					offset_cumsum = 0
+					for jj in range(NUM_RANGING_CHANNELS):
+						if(tag_poll_TOAs[jj] & 0xFFFF > 0 and tag_poll_TOAs[27+jj] & 0xFFFF > 0):
+							offset_cumsum = offset_cumsum + (tag_poll_TOAs[27+jj] - tag_poll_TOAs[jj])/(ranging_broadcast_ss_send_times[27+jj] - ranging_broadcast_ss_send_times[jj])
+							num_valid_offsets = num_valid_offsets + 1
+
+					if num_valid_offsets == 0:
+						continue
+					offset_anchor_over_tag = offset_cumsum/num_valid_offsets;
 
 				# Figure out what broadcast the received response belongs to
 				ss_index_matching = oneway_get_ss_index_from_settings(anchor_final_antenna_index, window_packet_recv)
@@ -11,8 +11,11 @@
 #include "port.h"
 #include "board.h"
 #include "dw1000.h"
+#include "dw1000_channel.h"
+#include "dw1000_spi.h"
 #include "delay.h"
 #include "firmware.h"
+#include "timer.h"
 
 
 /******************************************************************************/
@@ -47,11 +50,6 @@ const uint32_t txPower[DW1000_NUM_CHANNELS] = {
 // Data structures used in multiple functions
 /******************************************************************************/
 
-// These are for configuring the hardware peripherals on the STM32F0
-static DMA_InitTypeDef DMA_InitStructure;
-static DMA_InitTypeDef DMA_UART_InitStructure;
-static SPI_InitTypeDef SPI_InitStructure;
-
 // Setup TX/RX settings on the DW1000
 static dwt_config_t _dw1000_config;
 static dwt_txconfig_t global_tx_config;
@@ -62,6 +60,52 @@ static dw1000_programmed_values_t _prog_values;
 static uint32_t _last_dw_timestamp;
 static uint64_t _dw_timestamp_overflow;
 
+// The received frame being read in the background. The rest of a filtered
+// frame is read with the timestamp's transfer, which is done by then.
+static struct {
+	dw1000_spi_xfer_t  timestamp_xfer;
+	dw1000_spi_xfer_t  data_xfer;
+	uint8_t            timestamp_header[DW1000_SPI_HEADER_LEN];
+	uint8_t            data_header[DW1000_SPI_HEADER_LEN];
+	uint8_t            timestamp[RX_TIME_RX_STAMP_LEN];
+	uint8_t*           buf;
+	uint16_t           len;
+	uint16_t           head_len;
+	bool               busy;
+	dw1000_rx_filter   filter;
+	dw1000_rx_callback callback;
+} _rx_read;
+
+// Whether the DW1000 receives into either half of its RX buffer while the
+// other is read
+static bool _rx_double_buffer = FALSE;
+
+static dw1000_rx_stats_t _rx_stats = {0};
+
+// Registers that have to read the same after a warm wakeup as they did
+// before sleep. If they don't, the DW1000 lost its configuration.
+static const struct {
+	uint8_t reg;
+	uint8_t len;
+} _signature_regs[] = {
+	{ PANADR_ID,    4 },
+	{ SYS_CFG_ID,   4 },
+	{ TX_FCTRL_ID,  4 },
+	{ SYS_MASK_ID,  4 },
+	{ CHAN_CTRL_ID, 4 },
+};
+
+#define SIGNATURE_LEN 20
+
+static uint8_t _sleep_signature[SIGNATURE_LEN];
+static bool _sleep_signature_valid = FALSE;
+
+static dw1000_wakeup_stats_t _wakeup_stats = {0};
+
+// When the DW1000 was last woken up, and whether it has transmitted since
+static uint32_t _wakeup_us;
+static bool _wakeup_tx_pending = FALSE;
+
 /******************************************************************************/
 // Internal state for this file
 /******************************************************************************/
@@ -102,6 +146,23 @@ static void dw1000_interrupt_disable() {
 }
 
 // Configure SPI + GPIOs for SPI. Also preset some DMA constants.
+// Set up the SPI to the DW1000 at the given clock. The init structure is
+// made here each time rather than kept, to save the RAM.
+static void spi_init (uint16_t prescaler) {
+	SPI_InitTypeDef SPI_InitStructure;
+
+	SPI_InitStructure.SPI_Direction         = SPI_Direction_2Lines_FullDuplex;
+	SPI_InitStructure.SPI_DataSize          = SPI_DataSize_8b;
+	SPI_InitStructure.SPI_CPOL              = SPI_CPOL_Low;
+	SPI_InitStructure.SPI_CPHA              = SPI_CPHA_1Edge;
+	SPI_InitStructure.SPI_NSS               = SPI_NSS_Soft;
+	SPI_InitStructure.SPI_BaudRatePrescaler = prescaler;
+	SPI_InitStructure.SPI_FirstBit          = SPI_FirstBit_MSB;
+	SPI_InitStructure.SPI_CRCPolynomial     = 7;
+	SPI_InitStructure.SPI_Mode              = SPI_Mode_Master;
+	SPI_Init(SPI1, &SPI_InitStructure);
+}
+
 static void setup () {
 
 	GPIO_InitTypeDef GPIO_InitStructure;
@@ -150,16 +211,7 @@ static void setup () {
 
 	// SPI configuration
 	SPI_I2S_DeInit(SPI1);
-	SPI_InitStructure.SPI_Direction         = SPI_Direction_2Lines_FullDuplex;
-	SPI_InitStructure.SPI_DataSize          = SPI_DataSize_8b;
-	SPI_InitStructure.SPI_CPOL              = SPI_CPOL_Low;
-	SPI_InitStructure.SPI_CPHA              = SPI_CPHA_1Edge;
-	SPI_InitStructure.SPI_NSS               = SPI_NSS_Soft;
-	SPI_InitStructure.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_64;
-	SPI_InitStructure.SPI_FirstBit          = SPI_FirstBit_MSB;
-	SPI_InitStructure.SPI_CRCPolynomial     = 7;
-	SPI_InitStructure.SPI_Mode              = SPI_Mode_Master;
-	SPI_Init(SPI1, &SPI_InitStructure);
+	spi_init(SPI_BaudRatePrescaler_64);
 
 	// Initialize the FIFO threshold
 	// This is critical for 8 bit transfers
@@ -251,21 +303,10 @@ static void setup () {
 	GPIO_WriteBit(ANT_SEL1_PORT, ANT_SEL1_PIN, Bit_RESET);
 	GPIO_WriteBit(ANT_SEL2_PORT, ANT_SEL2_PIN, Bit_RESET);
 
-	// Pre-populate DMA fields that don't need to change
-	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) SPI1_DR_ADDRESS;
-	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
-	DMA_InitStructure.DMA_MemoryDataSize     = DMA_MemoryDataSize_Byte;
-	DMA_InitStructure.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
-	DMA_InitStructure.DMA_Mode               = DMA_Mode_Normal;
-	DMA_InitStructure.DMA_M2M                = DMA_M2M_Disable;
+	// SPI transfers run off the DMA interrupt
+	dw1000_spi_init();
 
 	SYSCFG->CFGR1 |= SYSCFG_DMARemap_USART1Tx;
-	DMA_UART_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) USART1_DR_ADDRESS;
-	DMA_UART_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
-	DMA_UART_InitStructure.DMA_MemoryDataSize     = DMA_MemoryDataSize_Byte;
-	DMA_UART_InitStructure.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
-	DMA_UART_InitStructure.DMA_Mode               = DMA_Mode_Normal;
-	DMA_UART_InitStructure.DMA_M2M                = DMA_M2M_Disable;
 	// Pull from flash the calibration values
 	memcpy(&_prog_values, (uint8_t*) INIT_FLASH_LOCATION, sizeof(dw1000_programmed_values_t));
 	if (_prog_values.magic != PROGRAMMED_MAGIC) {
@@ -282,16 +323,22 @@ static void setup () {
 
 // Functions to configure the SPI speed
 void dw1000_spi_fast () {
-	SPI_InitStructure.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_8;
-	SPI_Init(SPI1, &SPI_InitStructure);
+	spi_init(SPI_BaudRatePrescaler_8);
 }
 
 void dw1000_spi_slow () {
-	SPI_InitStructure.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_64;
-	SPI_Init(SPI1, &SPI_InitStructure);
+	spi_init(SPI_BaudRatePrescaler_64);
 }
 
 void uart_write(uint32_t length, const uint8_t* tx){
+	DMA_InitTypeDef DMA_UART_InitStructure;
+
+	DMA_UART_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) USART1_DR_ADDRESS;
+	DMA_UART_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_UART_InitStructure.DMA_MemoryDataSize     = DMA_MemoryDataSize_Byte;
+	DMA_UART_InitStructure.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
+	DMA_UART_InitStructure.DMA_Mode               = DMA_Mode_Normal;
+	DMA_UART_InitStructure.DMA_M2M                = DMA_M2M_Disable;
 	DMA_UART_InitStructure.DMA_BufferSize = length;
 	DMA_UART_InitStructure.DMA_MemoryBaseAddr = (uint32_t) tx;
 	DMA_UART_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
@@ -307,80 +354,13 @@ void uart_write(uint32_t length, const uint8_t* tx){
 	USART_DMACmd(USART1, USART_DMAReq_Tx, DISABLE);
 }
 
-// Only write data to the DW1000, and use DMA to do it.
-static void setup_dma_write (uint32_t length, const uint8_t* tx) {
-	static uint8_t throwAway;
-
-	DMA_InitStructure.DMA_BufferSize = length;
-	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) &throwAway;
-	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
-	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
-	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
-	DMA_Init(SPI1_RX_DMA_CHANNEL, &DMA_InitStructure);
-
-	// DMA channel Tx of SPI Configuration
-	DMA_InitStructure.DMA_BufferSize = length;
-	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) tx;
-	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
-	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
-	DMA_Init(SPI1_TX_DMA_CHANNEL, &DMA_InitStructure);
-}
-
-// Setup just a read over SPI using DMA.
-static void setup_dma_read (uint32_t length, uint8_t* rx) {
-
-	//volatile uint8_t throw = SPI1->DR;
-	//throw = SPI1->SR;
-	// DMA channel Rx of SPI Configuration
-	DMA_InitStructure.DMA_BufferSize = length;
-	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) rx;
-	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
-	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
-	DMA_Init(SPI1_RX_DMA_CHANNEL, &DMA_InitStructure);
-
-	static uint8_t tx = 0;
-	// DMA channel Tx of SPI Configuration
-	DMA_InitStructure.DMA_BufferSize = length;
-	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) &tx;
-	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
-	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
-	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
-	DMA_Init(SPI1_TX_DMA_CHANNEL, &DMA_InitStructure);
-}
-
-// Setup full duplex SPI over DMA.
-// Commenting out for no compiler warning. May still want to try it out
-// at some point.
-// TODO: Determine if memcpy() plus 1 dma is better than no memcpy and
-//       2 dma.
-// static void setup_dma (uint32_t length, uint8_t* rx, uint8_t* tx) {
-
-// 	// DMA channel Rx of SPI Configuration
-// 	DMA_InitStructure.DMA_BufferSize = length;
-// 	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) rx;
-// 	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
-// 	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-// 	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
-// 	DMA_Init(SPI1_RX_DMA_CHANNEL, &DMA_InitStructure);
-
-// 	// DMA channel Tx of SPI Configuration
-// 	DMA_InitStructure.DMA_BufferSize = length;
-// 	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) tx;
-// 	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
-// 	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-// 	DMA_InitStructure.DMA_Priority = DMA_Priority_Low;
-// 	DMA_Init(SPI1_TX_DMA_CHANNEL, &DMA_InitStructure);
-// }
-
-
 /******************************************************************************/
 // Interrupt callbacks
 /******************************************************************************/
 
-// Not needed, but handle the interrupt from the SPI DMA
+// An SPI transfer with the DW1000 finished
 void DMA1_Channel2_3_IRQHandler(void) {
+	dw1000_spi_dma_interrupt();
 }
 
 
@@ -395,6 +375,31 @@ void EXTI2_3_IRQHandler (void) {
 	}
 }
 
+// After dwt_isr() has handled the frames it saw and handed their halves of
+// the RX buffer back, see whether the DW1000 ran out of room, or a frame came
+// into the other half while the one before was still being read and had its
+// status bits cleared along with that one's. Such a frame never interrupts,
+// and would hold its half until the DW1000 overruns, so give it back.
+static void rx_double_buffer_check () {
+	uint32_t status = dwt_read32bitreg(SYS_STATUS_ID);
+	bool held = ((status & SYS_STATUS_ICRBP) != 0) != ((status & SYS_STATUS_HSRBP) != 0);
+
+	if (status & SYS_STATUS_RXOVRR) {
+		// The receiver has to be reset after an overrun. Turning it on again
+		// lines the two halves back up.
+		_rx_stats.overruns++;
+		dwt_forcetrxoff();
+		dwt_rxreset();
+		dwt_write32bitreg(SYS_STATUS_ID, SYS_STATUS_RXOVRR);
+		dwt_rxenable(0);
+
+	} else if (held && !(status & (SYS_STATUS_RXFCG | SYS_STATUS_ALL_RX_ERR))) {
+		uint8_t toggle = 1;
+		_rx_stats.swap_races++;
+		dwt_writetodevice(SYS_CTRL_ID, SYS_CTRL_HRBT_OFFSET, 1, &toggle);
+	}
+}
+
 // Main thread interrupt handler for the interrupt from the DW1000. Basically
 // just passes knowledge of the interrupt on to the DW1000 library.
 void dw1000_interrupt_fired () {
@@ -413,88 +418,27 @@ void dw1000_interrupt_fired () {
 		// Not much we can do here but reset everything.
 		polypoint_reset();
 	}
+
+	if (_rx_double_buffer) {
+		rx_double_buffer_check();
+	}
 }
 
 /******************************************************************************/
 // Required API implementation for the DecaWave library
 /******************************************************************************/
 
-// Blocking SPI transfer
-static int spi_transfer () {
-	uint32_t loop = 0;
-
-	// Enable NSS output for master mode
-	SPI_SSOutputCmd(SPI1, ENABLE);
-
-	// Enable DMA1 Channel1 Transfer Complete interrupt
-	//DMA_ITConfig(SPI1_TX_DMA_CHANNEL, DMA_IT_TC, ENABLE);
-
-	// Enable the DMA channels
-	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Rx, ENABLE);
-	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, ENABLE);
-	DMA_Cmd(SPI1_RX_DMA_CHANNEL, ENABLE);
-	DMA_Cmd(SPI1_TX_DMA_CHANNEL, ENABLE);
-
-	// Wait for everything to finish
-	while ((DMA_GetFlagStatus(SPI1_RX_DMA_FLAG_TC) == RESET) && loop < 100000) {
-		loop++;
-	};
-	if (loop < 100000) {
-		while ((DMA_GetFlagStatus(SPI1_TX_DMA_FLAG_TC) == RESET));
-		/* The BSY flag can be monitored to ensure that the SPI communication is complete.
-		This is required to avoid corrupting the last transmission before disabling
-		the SPI or entering the Stop mode. The software must first wait until TXE=1
-		and then until BSY=0.*/
-		while ((SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_TXE) == RESET));
-		while ((SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY) == SET));
-	}
-
-	// End the SPI transaction and DMA
-	// Clear DMA1 global flags
-	DMA_ClearFlag(SPI1_TX_DMA_FLAG_GL);
-	DMA_ClearFlag(SPI1_RX_DMA_FLAG_GL);
-
-	// Disable the DMA channels
-	DMA_Cmd(SPI1_RX_DMA_CHANNEL, DISABLE);
-	DMA_Cmd(SPI1_TX_DMA_CHANNEL, DISABLE);
-
-	// Disable the SPI Rx and Tx DMA requests
-	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Rx, DISABLE);
-	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, DISABLE);
-
-	if (loop >= 100000) {
-		return -1;
-	} else {
-		return 0;
-	}
-}
-
 // Called by the DW1000 library to issue a read command to the DW1000.
+// Anything already queued goes first.
 int readfromspi (uint16_t headerLength,
                  const uint8_t *headerBuffer,
                  uint32_t readlength,
                  uint8_t *readBuffer) {
-	int ret;
-
-	SPI_Cmd(SPI1, ENABLE);
-	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_RESET);
-	setup_dma_write(headerLength, headerBuffer);
-	ret = spi_transfer();
-	if (ret) goto error;
-
-	setup_dma_read(readlength, readBuffer);
-	ret = spi_transfer();
-	if (ret) goto error;
-
-	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_SET);
-	SPI_Cmd(SPI1, DISABLE);
+	if (dw1000_spi_read(headerLength, headerBuffer, readlength, readBuffer)) {
+		polypoint_reset();
+		return -1;
+	}
 	return 0;
-
-error:
-	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_SET);
-	SPI_Cmd(SPI1, DISABLE);
-	polypoint_reset();
-	return -1;
 }
 
 // Called by the DW1000 library to issue a write to the DW1000.
@@ -502,27 +446,11 @@ int writetospi (uint16_t headerLength,
                 const uint8_t *headerBuffer,
                 uint32_t bodylength,
                 const uint8_t *bodyBuffer) {
-	int ret;
-
-	SPI_Cmd(SPI1, ENABLE);
-	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_RESET);
-	setup_dma_write(headerLength, headerBuffer);
-	ret = spi_transfer();
-	if (ret) goto error;
-
-	setup_dma_write(bodylength, bodyBuffer);
-	ret = spi_transfer();
-	if (ret) goto error;
-
-	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_SET);
-	SPI_Cmd(SPI1, DISABLE);
+	if (dw1000_spi_write(headerLength, headerBuffer, bodylength, bodyBuffer)) {
+		polypoint_reset();
+		return -1;
+	}
 	return 0;
-
-error:
-	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_SET);
-	SPI_Cmd(SPI1, DISABLE);
-	polypoint_reset();
-	return -1;
 }
 
 // Atomic blocks for the DW1000 library
@@ -561,6 +489,7 @@ void dw1000_reset () {
 	mDelay(100);
 	GPIO_WriteBit(DW_RESET_PORT, DW_RESET_PIN, Bit_SET);
 
+	dw1000_channel_forget();
 	_dw1000_asleep = FALSE;
 }
 
@@ -716,6 +645,8 @@ dw1000_err_e dw1000_configure_settings () {
 
 	// Initialize the dw1000 hardware
 	uint32_t err;
+	dw1000_channel_forget();
+	_rx_double_buffer = FALSE;
 	err = dwt_initialise(DWT_LOADUCODE |
 	                     DWT_LOADLDO |
 	                     DWT_LOADTXCONFIG |
@@ -749,7 +680,6 @@ dw1000_err_e dw1000_configure_settings () {
 	                 DWT_INT_ARFE, 1);
 
 	// Set the parameters of ranging and channel and whatnot
-	_dw1000_config.chan           = 2;
 	_dw1000_config.prf            = DWT_PRF_64M;
 	_dw1000_config.txPreambLength = DW1000_PREAMBLE_LENGTH;
 	_dw1000_config.rxPAC          = DW1000_PAC_SIZE;
@@ -760,6 +690,18 @@ dw1000_err_e dw1000_configure_settings () {
 	_dw1000_config.phrMode        = DWT_PHRMODE_EXT; //Enable extended PHR mode (up to 1024-byte packets)
 	_dw1000_config.smartPowerEn   = DW1000_SMART_PWR_EN;
 	_dw1000_config.sfdTO          = DW1000_SFD_TO;//(1025 + 64 - 32);
+
+	// Configure each of the channels we hop between once, so that
+	// dw1000_update_channel() knows what they set and only has to write what
+	// changes. They are remembered across sleep.
+	for (uint8_t chan = 1; chan <= DW1000_CHANNEL_FAST_MAX; chan++) {
+		if (!dw1000_channel_learned(chan)) {
+			_dw1000_config.chan = chan;
+			dw1000_reset_configuration();
+		}
+	}
+
+	_dw1000_config.chan           = 2;
 #if DW1000_USE_OTP
 	dwt_configure(&_dw1000_config, (DWT_LOADANTDLY | DWT_LOADXTALTRIM));
 #else
@@ -783,6 +725,7 @@ dw1000_err_e dw1000_configure_settings () {
 	dwt_setrxantennadelay(DW1000_ANTENNA_DELAY_RX);
 	dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
 #endif
+	dw1000_channel_configured(_dw1000_config.chan);
 
 	// Set this node's ID and the PAN ID for our DW1000 ranging system
 	uint8_t eui_array[8];
@@ -796,6 +739,16 @@ dw1000_err_e dw1000_configure_settings () {
 	return DW1000_NO_ERR;
 }
 
+// Read the registers that show whether the DW1000 kept its configuration
+static void read_signature (uint8_t* signature) {
+	uint8_t i;
+
+	for (i = 0; i < sizeof(_signature_regs) / sizeof(_signature_regs[0]); i++) {
+		dwt_readfromdevice(_signature_regs[i].reg, 0, _signature_regs[i].len, signature);
+		signature += _signature_regs[i].len;
+	}
+}
+
 // Put the DW1000 into sleep mode
 void dw1000_sleep () {
 	if (_dw1000_asleep) {
@@ -806,14 +759,65 @@ void dw1000_sleep () {
 	// Don't need the DW1000 to be in TX or RX mode
 	dwt_forcetrxoff();
 
+	// Remember how it is configured, to check after waking it up
+	read_signature(_sleep_signature);
+	_sleep_signature_valid = TRUE;
+
 	// Put the TAG into sleep mode at this point.
 	// The chip will need to come out of sleep mode
 	dwt_entersleep();
+	dw1000_channel_forget();
 
 	// Mark that we put the DW1000 to sleep.
 	_dw1000_asleep = TRUE;
 }
 
+// Wake the DW1000 with one pulse and wait until it says it is ready instead
+// of for as long as it could take. The sleep configuration has it keep its
+// settings in the always-on memory and load them back, so if they read the
+// same as before sleep there is nothing to configure.
+static dw1000_err_e warm_wakeup () {
+	uint8_t signature[SIGNATURE_LEN];
+	uint32_t waited_us = 0;
+	bool ready = FALSE;
+
+	if (!_sleep_signature_valid) {
+		return DW1000_WAKEUP_ERR;
+	}
+
+	GPIO_WriteBit(DW_WAKEUP_PORT, DW_WAKEUP_PIN, Bit_SET);
+	uDelay(DW1000_WAKEUP_PULSE_US);
+	GPIO_WriteBit(DW_WAKEUP_PORT, DW_WAKEUP_PIN, Bit_RESET);
+
+	// The clock PLL locks once the DW1000 is in IDLE with its configuration
+	// back. Until then it only takes the SPI slow.
+	dw1000_spi_slow();
+	while (!ready && waited_us < DW1000_WAKEUP_TIMEOUT_US) {
+		uDelay(DW1000_WAKEUP_POLL_US);
+		waited_us += DW1000_WAKEUP_POLL_US;
+		ready = dwt_readdevid() == DWT_DEVICE_ID &&
+		        (dwt_read32bitreg(SYS_STATUS_ID) & SYS_STATUS_CPLOCK);
+	}
+	if (!ready) {
+		return DW1000_WAKEUP_ERR;
+	}
+	dw1000_spi_fast();
+
+	// Clear them so the next wakeup waits for them again
+	dwt_write32bitreg(SYS_STATUS_ID, SYS_STATUS_CPLOCK | SYS_STATUS_SLP2INIT);
+
+	read_signature(signature);
+	if (memcmp(signature, _sleep_signature, SIGNATURE_LEN) != 0) {
+		return DW1000_WAKEUP_ERR;
+	}
+
+	// The TX antenna delay isn't kept through sleep
+#if DW1000_USE_OTP == 0
+	dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
+#endif
+	return DW1000_NO_ERR;
+}
+
 // Wake the DW1000 from sleep by asserting the WAKEUP pin
 dw1000_err_e dw1000_wakeup () {
 
@@ -822,6 +826,19 @@ dw1000_err_e dw1000_wakeup () {
 		return DW1000_NO_ERR;
 	}
 
+	_wakeup_us = timer_now();
+	_wakeup_tx_pending = TRUE;
+
+	if (warm_wakeup() == DW1000_NO_ERR) {
+		_dw1000_asleep = FALSE;
+		_wakeup_stats.warm++;
+		return DW1000_WAKEUP_SUCCESS;
+	}
+
+	// It didn't keep its configuration, or didn't come up when it should
+	// have. Do it the slow way.
+	_wakeup_stats.full++;
+
 	// Assert the WAKEUP pin. There seems to be some weirdness where a single
 	// WAKEUP assert can get missed, so we do it multiple times to make
 	// sure the DW1000 is awake.
@@ -881,10 +898,32 @@ dw1000_err_e dw1000_wakeup () {
 	return DW1000_WAKEUP_SUCCESS;
 }
 
-// Call to change the DW1000 channel and force set all of the configs
-// that are needed when changing channels.
+const dw1000_wakeup_stats_t* dw1000_wakeup_stats () {
+	return &_wakeup_stats;
+}
+
+// Receive into one half of the RX buffer while the frame in the other is
+// read. With auto RX re-enable the receiver then stays on through frames
+// that come in back to back. dw1000_read_rx() reads a frame before
+// dwt_isr() gives its half back, so the callbacks always get the half that
+// was just filled.
+void dw1000_rx_double_buffer (bool enable) {
+	_rx_double_buffer = enable;
+	dwt_setdblrxbuffmode(enable);
+}
+
+const dw1000_rx_stats_t* dw1000_rx_stats () {
+	return &_rx_stats;
+}
+
+// Call to change the DW1000 channel. Only the registers that differ between
+// the old and new channel are written if dw1000_channel.c knows them,
+// otherwise all of the configs that are needed when changing channels are.
 void dw1000_update_channel (uint8_t chan) {
 	_dw1000_config.chan = chan;
+	if (dw1000_channel_switch(chan)) {
+		return;
+	}
 	dw1000_reset_configuration();
 }
 
@@ -903,58 +942,112 @@ void dw1000_reset_configuration () {
 	dwt_setrxantennadelay(DW1000_ANTENNA_DELAY_RX);
 	dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
 #endif
+	dw1000_channel_configured(_dw1000_config.chan);
 }
 
+static uint64_t extend_rx_timestamp (uint64_t cur_dw_timestamp) {
+	// Check to see if an overflow has occurred.
+	if(cur_dw_timestamp < _last_dw_timestamp){
+		_dw_timestamp_overflow += 0x10000000000ULL;
+	}
+	_last_dw_timestamp = cur_dw_timestamp;
 
-/******************************************************************************/
-// Decawave specific utility functions
-/******************************************************************************/
+	return _dw_timestamp_overflow + cur_dw_timestamp;
+}
 
-// Convert a time of flight measurement to millimeters
-int dwtime_to_millimeters (double dwtime) {
-	// Get meters using the speed of light
-	double dist = dwtime * DWT_TIME_UNITS * SPEED_OF_LIGHT;
+uint64_t dw1000_readrxtimestamp(){
+	uint64_t cur_dw_timestamp = 0;
+	dwt_readrxtimestamp(&cur_dw_timestamp);
+	return extend_rx_timestamp(cur_dw_timestamp);
+}
 
-	// And return millimeters
-	return (int) (dist*1000.0);
+static void rx_read_done (dw1000_spi_xfer_t* x) {
+	uint64_t cur_dw_timestamp = 0;
+	(void) x;
+
+	_rx_read.busy = FALSE;
+	memcpy(&cur_dw_timestamp, _rx_read.timestamp, RX_TIME_RX_STAMP_LEN);
+	_rx_read.callback(extend_rx_timestamp(cur_dw_timestamp), _rx_read.buf, _rx_read.len);
 }
 
+// The first bytes of the frame are in. Called from the SPI interrupt, so
+// the rest is read before the DW1000 can move on to the next frame. Read it
+// only if the filter wants it, otherwise the callback just gets the head.
+static dw1000_spi_xfer_t* rx_head_follow (dw1000_spi_xfer_t* x) {
+	uint16_t want = _rx_read.filter(_rx_read.buf, _rx_read.head_len, _rx_read.len);
 
-/******************************************************************************/
-// Misc Utility
-/******************************************************************************/
+	if (want <= _rx_read.head_len) {
+		_rx_read.len = _rx_read.head_len;
+		x->callback = rx_read_done;
+		return NULL;
+	}
 
-// Shoved this here for now.
-// Insert an element into a sorted array.
-// end is the number of elements in the array.
-void insert_sorted (int arr[], int new, unsigned end) {
-	unsigned insert_at = 0;
-	while ((insert_at < end) && (new >= arr[insert_at])) {
-		insert_at++;
-	}
-	if (insert_at == end) {
-		arr[insert_at] = new;
-	} else {
-		while (insert_at <= end) {
-			int temp = arr[insert_at];
-			arr[insert_at] = new;
-			new = temp;
-			insert_at++;
+	_rx_read.len = MIN(want, _rx_read.len);
+	_rx_read.timestamp_xfer.header = _rx_read.timestamp_header;
+	_rx_read.timestamp_xfer.header_len =
+		dw1000_spi_header(_rx_read.timestamp_header, FALSE, RX_BUFFER_ID, _rx_read.head_len);
+	_rx_read.timestamp_xfer.rx = _rx_read.buf + _rx_read.head_len;
+	_rx_read.timestamp_xfer.tx = NULL;
+	_rx_read.timestamp_xfer.body_len = _rx_read.len - _rx_read.head_len;
+	_rx_read.timestamp_xfer.callback = rx_read_done;
+	_rx_read.timestamp_xfer.follow = NULL;
+	x->callback = NULL;
+	return &_rx_read.timestamp_xfer;
+}
+
+// Read the timestamp and the first len bytes of the frame that was just
+// received, without waiting for the SPI. The callback gets them from the main
+// loop once they are in. Call from the DW1000 rx callback: the frame stays
+// put until the receiver is enabled again, and that waits behind these reads.
+//
+// With a filter, only the first head_len bytes are read along with the
+// timestamp. The filter looks at them from the SPI interrupt and says how
+// much of the frame to read, so frames that are going to be dropped anyway
+// aren't read in full.
+void dw1000_read_rx (uint8_t* buf, uint16_t len, uint16_t head_len,
+                     dw1000_rx_filter filter, dw1000_rx_callback callback) {
+	// One frame at a time. Finish the one before so they are handled in
+	// order.
+	if (_rx_read.busy) {
+		if (dw1000_spi_flush()) {
+			polypoint_reset();
+			return;
 		}
 	}
-}
 
-uint64_t dw1000_readrxtimestamp(){
-	uint64_t cur_dw_timestamp = 0;
-	dwt_readrxtimestamp(&cur_dw_timestamp);
-	
-	// Check to see if an overflow has occurred.
-	if(cur_dw_timestamp < _last_dw_timestamp){
-		_dw_timestamp_overflow += 0x10000000000ULL;
+	if (filter == NULL || head_len >= len) {
+		filter = NULL;
+		head_len = len;
 	}
-	_last_dw_timestamp = cur_dw_timestamp;
 
-	return _dw_timestamp_overflow + cur_dw_timestamp;
+	_rx_stats.frames++;
+	_rx_read.busy = TRUE;
+	_rx_read.buf = buf;
+	_rx_read.len = len;
+	_rx_read.head_len = head_len;
+	_rx_read.filter = filter;
+	_rx_read.callback = callback;
+
+	_rx_read.timestamp_xfer.header = _rx_read.timestamp_header;
+	_rx_read.timestamp_xfer.header_len =
+		dw1000_spi_header(_rx_read.timestamp_header, FALSE, RX_TIME_ID, RX_TIME_RX_STAMP_OFFSET);
+	_rx_read.timestamp_xfer.rx = _rx_read.timestamp;
+	_rx_read.timestamp_xfer.tx = NULL;
+	_rx_read.timestamp_xfer.body_len = RX_TIME_RX_STAMP_LEN;
+	_rx_read.timestamp_xfer.callback = NULL;
+	_rx_read.timestamp_xfer.follow = NULL;
+
+	_rx_read.data_xfer.header = _rx_read.data_header;
+	_rx_read.data_xfer.header_len =
+		dw1000_spi_header(_rx_read.data_header, FALSE, RX_BUFFER_ID, 0);
+	_rx_read.data_xfer.rx = buf;
+	_rx_read.data_xfer.tx = NULL;
+	_rx_read.data_xfer.body_len = head_len;
+	_rx_read.data_xfer.callback = filter ? NULL : rx_read_done;
+	_rx_read.data_xfer.follow = filter ? rx_head_follow : NULL;
+
+	dw1000_spi_queue(&_rx_read.timestamp_xfer);
+	dw1000_spi_queue(&_rx_read.data_xfer);
 }
 
 uint64_t dw1000_setdelayedtrxtime(uint32_t delay_time){
@@ -967,6 +1060,14 @@ uint64_t dw1000_setdelayedtrxtime(uint32_t delay_time){
 	_last_dw_timestamp = cur_dw_timestamp;
 	
 	dwt_setdelayedtrxtime(delay_time);
+
+	// This comes right before each delayed TX, so the first one since a
+	// wakeup says how long the DW1000 took to get going
+	if (_wakeup_tx_pending) {
+		_wakeup_tx_pending = FALSE;
+		_wakeup_stats.last_tx_us = timer_now() - _wakeup_us;
+		_wakeup_stats.max_tx_us = MAX(_wakeup_stats.max_tx_us, _wakeup_stats.last_tx_us);
+	}
 }
 
 uint64_t dw1000_gettimestampoverflow(){
@@ -39,6 +39,13 @@
 // line (this may happen because it thinks we switched the interrupt polarity).
 #define DW1000_NUM_CONSECUTIVE_INTERRUPTS_BEFORE_RESET 10
 
+// Waking up warm: how long to hold WAKEUP, how often to check whether the
+// DW1000 is ready again, and how long to wait for it before waking it up the
+// full way instead
+#define DW1000_WAKEUP_PULSE_US   600
+#define DW1000_WAKEUP_POLL_US    100
+#define DW1000_WAKEUP_TIMEOUT_US 5000
+
 // In case we don't have a value calculated and stored.
 // This represents the sum of the TX and RX delays.
 #define DW1000_DEFAULT_CALIBRATION 33000
@@ -149,6 +156,31 @@ typedef enum {
 	DW1000_WAKEUP_SUCCESS,
 } dw1000_err_e;
 
+// How the DW1000 has been woken up since the TriPoint started
+typedef struct {
+	uint32_t warm;           // Kept its configuration
+	uint32_t full;           // Had to be configured again
+	uint32_t last_tx_us;     // From the last wakeup to the first TX after it
+	uint32_t max_tx_us;
+} dw1000_wakeup_stats_t;
+
+// What happened to received frames since the TriPoint started. Overruns and
+// swap races only happen with the double buffer (dw1000_rx_double_buffer()).
+typedef struct {
+	uint32_t frames;         // Read with dw1000_read_rx()
+	uint32_t overruns;       // Times a frame came in with both halves full
+	uint32_t swap_races;     // Frames that came in while the one before was
+	                         // read, and lost their interrupt
+} dw1000_rx_stats_t;
+
+// Gets a received frame once dw1000_read_rx() has read it in
+typedef void (*dw1000_rx_callback)(uint64_t dw_rx_timestamp, uint8_t* buf, uint16_t len);
+
+// Says how much of a received frame of len bytes dw1000_read_rx() should
+// read, from its first head_len bytes in head. Called from the SPI
+// interrupt, so it has to be quick.
+typedef uint16_t (*dw1000_rx_filter)(const uint8_t* head, uint16_t head_len, uint16_t len);
+
 
 /******************************************************************************/
 // Structs for data stored in the flash
@@ -168,7 +200,8 @@ typedef struct {
 
 // Utility
 int  dwtime_to_millimeters (double dwtime);
-void insert_sorted (int arr[], int new, unsigned end);
+int  select_kth (int arr[], unsigned num, unsigned k);
+int  select_percentile (int arr[], unsigned num, unsigned numerator, unsigned denominator);
 uint16_t dw1000_preamble_time_in_us();
 uint32_t dw1000_packet_data_time_in_us(uint16_t data_len);
 
@@ -187,9 +220,14 @@ void          dw1000_set_mode (dw1000_role_e role);
 dw1000_role_e dw1000_get_mode ();
 void          dw1000_sleep ();
 dw1000_err_e  dw1000_wakeup ();
+const dw1000_wakeup_stats_t* dw1000_wakeup_stats ();
+void          dw1000_rx_double_buffer (bool enable);
+const dw1000_rx_stats_t* dw1000_rx_stats ();
 void          dw1000_update_channel (uint8_t chan);
 void          dw1000_reset_configuration ();
 uint64_t      dw1000_readrxtimestamp();
+void          dw1000_read_rx (uint8_t* buf, uint16_t len, uint16_t head_len,
+                              dw1000_rx_filter filter, dw1000_rx_callback callback);
 uint64_t      dw1000_setdelayedtrxtime(uint32_t delay_time);
 uint64_t      dw1000_gettimestampoverflow();
 
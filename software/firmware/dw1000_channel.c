@@ -0,0 +1,219 @@
+#include <string.h>
+
+#include "deca_regs.h"
+
+#include "dw1000_channel.h"
+#include "dw1000_spi.h"
+#include "firmware.h"
+
+// The parts of the DW1000 configuration that dwt_configure() and
+// dwt_configuretxrf() set differently for each channel. Everything else they
+// write is the same on every channel. Fields that sit next to each other in
+// a register file are kept as one so they can be written in one transfer.
+typedef struct {
+	uint8_t  reg;
+	uint16_t offset;
+	uint8_t  len;
+} channel_field_t;
+
+static const channel_field_t _fields[] = {
+	{ CHAN_CTRL_ID, 0,                 4 }, // CHAN_CTRL
+	{ TX_POWER_ID,  0,                 4 }, // TX_POWER
+	{ RF_CONF_ID,   RF_RXCTRLH_OFFSET, 5 }, // RF_RXCTRLH, RF_TXCTRL
+	{ TX_CAL_ID,    TC_PGDELAY_OFFSET, 1 }, // TC_PGDELAY
+	{ FS_CTRL_ID,   FS_PLLCFG_OFFSET,  5 }, // FS_PLLCFG, FS_PLLTUNE
+};
+
+#define NUM_FIELDS (sizeof(_fields) / sizeof(channel_field_t))
+
+// All the fields one after the other
+#define FIELDS_LEN 19
+
+// What each channel puts in the fields, read back from the DW1000 the first
+// time it was fully configured for that channel
+static uint8_t _values[DW1000_CHANNEL_FAST_MAX][FIELDS_LEN];
+static bool _learned[DW1000_CHANNEL_FAST_MAX] = {FALSE};
+
+// The channel whose fields the DW1000 holds right now, or 0 if that isn't
+// known. Switching to it again doesn't write anything.
+static uint8_t _current = 0;
+
+// The writes of one switch but the last, which dw1000_channel_switch()
+// waits on itself. Each one sets up the next in the other transfer when it
+// is done, so the two of them do for any number of fields.
+static dw1000_spi_xfer_t _xfers[2];
+static uint8_t _headers[2][DW1000_SPI_HEADER_LEN];
+
+// What the switch in progress writes: the channel, each field's
+// field_delta(), and the fields the chain above is at and ends before
+static uint8_t _to;
+static uint8_t _deltas[NUM_FIELDS];
+static uint8_t _chain_field;
+static uint8_t _last_field;
+
+/******************************************************************************/
+// Helper functions
+/******************************************************************************/
+
+static bool is_fast (uint8_t chan) {
+	return chan >= 1 && chan <= DW1000_CHANNEL_FAST_MAX;
+}
+
+// The bytes of a field that differ between two channels: the first in the
+// high nibble and how many in the low one, or 0 when they are the same.
+// Working this out on every switch is quicker than the SPI writes it saves,
+// and keeping it for every pair of channels would take RAM.
+static uint8_t field_delta (const uint8_t* a, const uint8_t* b, uint8_t len) {
+	int8_t first = -1;
+	int8_t last = -1;
+
+	for (uint8_t i = 0; i < len; i++) {
+		if (a[i] != b[i]) {
+			if (first < 0) first = i;
+			last = i;
+		}
+	}
+	if (first < 0) {
+		return 0;
+	}
+	return (first << 4) | (last - first + 1);
+}
+
+// Where field f starts in a channel's values
+static uint8_t field_pos (uint8_t f) {
+	uint8_t pos = 0;
+	while (f > 0) {
+		pos += _fields[--f].len;
+	}
+	return pos;
+}
+
+// The field after f that differs, or NUM_FIELDS
+static uint8_t next_field (uint8_t f) {
+	do {
+		f++;
+	} while (f < NUM_FIELDS && _deltas[f] == 0);
+	return f;
+}
+
+// Set x up to write the bytes of field f that differ
+static void fill_write (dw1000_spi_xfer_t* x, uint8_t* header, uint8_t f) {
+	uint8_t first = _deltas[f] >> 4;
+
+	memset(x, 0, sizeof(dw1000_spi_xfer_t));
+	x->header_len = dw1000_spi_header(header, TRUE, _fields[f].reg, _fields[f].offset + first);
+	x->header = header;
+	x->tx = _values[_to-1] + field_pos(f) + first;
+	x->body_len = _deltas[f] & 0x0F;
+}
+
+// From the DMA interrupt when a write of the chain is done: the next one,
+// in the transfer that isn't in use, unless that would be the last
+static dw1000_spi_xfer_t* chain_next (dw1000_spi_xfer_t* x) {
+	uint8_t i = (x == &_xfers[0]) ? 1 : 0;
+
+	_chain_field = next_field(_chain_field);
+	if (_chain_field >= _last_field) {
+		return NULL;
+	}
+	fill_write(&_xfers[i], _headers[i], _chain_field);
+	_xfers[i].follow = chain_next;
+	return &_xfers[i];
+}
+
+// Read what the DW1000 was just configured with for chan
+static int learn (uint8_t chan) {
+	uint8_t header[DW1000_SPI_HEADER_LEN];
+	uint8_t pos = 0;
+
+	for (uint8_t f = 0; f < NUM_FIELDS; f++) {
+		uint8_t header_len = dw1000_spi_header(header, FALSE, _fields[f].reg, _fields[f].offset);
+		if (dw1000_spi_read(header_len, header, _fields[f].len, _values[chan-1] + pos)) {
+			return -1;
+		}
+		pos += _fields[f].len;
+	}
+
+	_learned[chan-1] = TRUE;
+	return 0;
+}
+
+/******************************************************************************/
+// API functions
+/******************************************************************************/
+
+// The DW1000 was just fully configured for chan. The first time, read back
+// what that channel sets.
+void dw1000_channel_configured (uint8_t chan) {
+	_current = 0;
+
+	if (!is_fast(chan)) {
+		return;
+	}
+	if (!_learned[chan-1] && learn(chan)) {
+		polypoint_reset();
+		return;
+	}
+	_current = chan;
+}
+
+bool dw1000_channel_learned (uint8_t chan) {
+	return is_fast(chan) && _learned[chan-1];
+}
+
+// Switch the DW1000 to chan by writing only the fields that differ from the
+// channel it is on. Returns FALSE if that isn't known, and the DW1000 needs
+// the full configuration instead.
+bool dw1000_channel_switch (uint8_t chan) {
+	uint8_t header[DW1000_SPI_HEADER_LEN];
+	uint8_t pos = 0;
+	dw1000_spi_xfer_t last;
+
+	if (!is_fast(chan) || !_learned[chan-1] || _current == 0) {
+		return FALSE;
+	}
+	if (chan == _current) {
+		return TRUE;
+	}
+
+	_to = chan;
+	_chain_field = NUM_FIELDS;
+	_last_field = NUM_FIELDS;
+	for (uint8_t f = 0; f < NUM_FIELDS; f++) {
+		_deltas[f] = field_delta(_values[_current-1] + pos, _values[chan-1] + pos, _fields[f].len);
+		if (_deltas[f]) {
+			if (_chain_field == NUM_FIELDS) {
+				_chain_field = f;
+			}
+			_last_field = f;
+		}
+		pos += _fields[f].len;
+	}
+
+	if (_last_field == NUM_FIELDS) {
+		_current = chan;
+		return TRUE;
+	}
+
+	// Write them as one burst: all but the last go back to back, one
+	// starting the next from the interrupt, and the last waits for the rest.
+	if (_chain_field < _last_field) {
+		fill_write(&_xfers[0], _headers[0], _chain_field);
+		_xfers[0].follow = chain_next;
+		dw1000_spi_queue(&_xfers[0]);
+	}
+	_current = 0;
+	fill_write(&last, header, _last_field);
+	if (dw1000_spi_write(last.header_len, last.header, last.body_len, last.tx)) {
+		polypoint_reset();
+		return TRUE;
+	}
+	_current = chan;
+	return TRUE;
+}
+
+// The DW1000 may no longer hold what it was configured with, because it was
+// reset or went to sleep
+void dw1000_channel_forget () {
+	_current = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __DW1000_CHANNEL_H
+#define __DW1000_CHANNEL_H
+
+#include "system.h"
+
+// Channels 1 up to this one can be switched to by writing only what differs
+// from the channel before. They are the ones ranging and Glossy use. Others
+// always get the full configuration.
+#define DW1000_CHANNEL_FAST_MAX 4
+
+void dw1000_channel_configured (uint8_t chan);
+bool dw1000_channel_learned (uint8_t chan);
+bool dw1000_channel_switch (uint8_t chan);
+void dw1000_channel_forget ();
+
+#endif
@@ -0,0 +1,359 @@
+#include <string.h>
+
+#include "stm32f0xx.h"
+
+#include "board.h"
+#include "dw1000_spi.h"
+#include "firmware.h"
+
+// Transfers with the DW1000 go through one queue, in the order they were
+// asked for. The one at the front is on the bus. Its DMA interrupts when the
+// last byte is in, which ends it and starts the next. Blocking transfers wait
+// their turn behind any that were queued before them, so a register write
+// can't overtake a read of the frame it is about to replace.
+static dw1000_spi_xfer_t* _queue_head = NULL;
+static dw1000_spi_xfer_t* _queue_tail = NULL;
+
+// Finished transfers whose callbacks the main loop hasn't called yet
+static dw1000_spi_xfer_t* _done_head = NULL;
+static dw1000_spi_xfer_t* _done_tail = NULL;
+
+typedef enum {
+	PHASE_IDLE,
+	PHASE_WHOLE,  // Header and body together from the stage buffers
+	PHASE_HEADER, // Header of a transfer too long for the stage buffers
+	PHASE_BODY    // And then its body, straight to or from the caller
+} spi_phase_e;
+
+static volatile spi_phase_e _phase = PHASE_IDLE;
+
+// Both directions of a staged transfer use the one buffer. The tx channel
+// has always read a byte out before the rx channel writes the byte that
+// came back in its place.
+static uint8_t _stage[DW1000_SPI_STAGE_LEN];
+
+/******************************************************************************/
+// Helper functions
+/******************************************************************************/
+
+static uint32_t enter_critical () {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+}
+
+static void exit_critical (uint32_t primask) {
+	__set_PRIMASK(primask);
+}
+
+// Point both channels at one transfer and go. Without a buffer, rx bytes
+// are thrown away and tx sends the same byte over, which the DW1000 ignores
+// while it is reading out.
+static void dma_start (uint32_t length, uint8_t* rx, const uint8_t* tx) {
+	static uint8_t throw_away;
+	static uint8_t filler = 0;
+	DMA_InitTypeDef DMA_InitStructure;
+
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) SPI1_DR_ADDRESS;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize     = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_Mode               = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_M2M                = DMA_M2M_Disable;
+	DMA_InitStructure.DMA_Priority           = DMA_Priority_High;
+
+	DMA_InitStructure.DMA_BufferSize = length;
+	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) (rx ? rx : &throw_away);
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+	DMA_InitStructure.DMA_MemoryInc = rx ? DMA_MemoryInc_Enable : DMA_MemoryInc_Disable;
+	DMA_Init(SPI1_RX_DMA_CHANNEL, &DMA_InitStructure);
+
+	DMA_InitStructure.DMA_BufferSize = length;
+	DMA_InitStructure.DMA_MemoryBaseAddr = (uint32_t) (tx ? tx : &filler);
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+	DMA_InitStructure.DMA_MemoryInc = tx ? DMA_MemoryInc_Enable : DMA_MemoryInc_Disable;
+	DMA_Init(SPI1_TX_DMA_CHANNEL, &DMA_InitStructure);
+
+	// Only the rx channel interrupts. When it has the last byte, the tx side
+	// is done too.
+	DMA_ITConfig(SPI1_RX_DMA_CHANNEL, DMA_IT_TC, ENABLE);
+
+	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Rx, ENABLE);
+	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, ENABLE);
+	DMA_Cmd(SPI1_RX_DMA_CHANNEL, ENABLE);
+	DMA_Cmd(SPI1_TX_DMA_CHANNEL, ENABLE);
+}
+
+static void dma_stop () {
+	DMA_ClearFlag(SPI1_TX_DMA_FLAG_GL);
+	DMA_ClearFlag(SPI1_RX_DMA_FLAG_GL);
+	DMA_Cmd(SPI1_RX_DMA_CHANNEL, DISABLE);
+	DMA_Cmd(SPI1_TX_DMA_CHANNEL, DISABLE);
+	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Rx, DISABLE);
+	SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, DISABLE);
+}
+
+// Put the transfer at the front of the queue on the bus
+static void start (dw1000_spi_xfer_t* x) {
+	uint32_t length = x->header_len + x->body_len;
+
+	SPI_SSOutputCmd(SPI1, ENABLE);
+	SPI_Cmd(SPI1, ENABLE);
+	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_RESET);
+
+	if (length <= DW1000_SPI_STAGE_LEN) {
+		memcpy(_stage, x->header, x->header_len);
+		if (x->tx) {
+			memcpy(_stage + x->header_len, x->tx, x->body_len);
+		}
+		_phase = PHASE_WHOLE;
+		dma_start(length, x->rx ? _stage : NULL, _stage);
+	} else {
+		_phase = PHASE_HEADER;
+		dma_start(x->header_len, NULL, x->header);
+	}
+}
+
+// The DMA got the last byte of a transfer. Called with interrupts masked or
+// from the DMA interrupt.
+static void transfer_done () {
+	dw1000_spi_xfer_t* x = _queue_head;
+
+	// The last byte is in, so this doesn't wait long. It is what the
+	// reference manual asks for before taking away the SPI.
+	while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_TXE) == RESET);
+	while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY) == SET);
+	dma_stop();
+
+	if (_phase == PHASE_HEADER) {
+		_phase = PHASE_BODY;
+		dma_start(x->body_len, x->rx, x->tx);
+		return;
+	}
+
+	if (_phase == PHASE_WHOLE && x->rx) {
+		memcpy(x->rx, _stage + x->header_len, x->body_len);
+	}
+	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_SET);
+	SPI_Cmd(SPI1, DISABLE);
+
+	_queue_head = x->next;
+	if (_queue_head == NULL) {
+		_queue_tail = NULL;
+	}
+
+	// A follow up goes first, before a later write can change what it reads
+	if (x->follow) {
+		dw1000_spi_xfer_t* f = x->follow(x);
+		if (f) {
+			f->next = _queue_head;
+			f->queued = TRUE;
+			f->done = FALSE;
+			_queue_head = f;
+			if (_queue_tail == NULL) {
+				_queue_tail = f;
+			}
+		}
+	}
+
+	if (x->callback) {
+		// One event covers everything on the done list
+		x->next = NULL;
+		if (_done_tail) {
+			_done_tail->next = x;
+		} else {
+			_done_head = x;
+			mark_interrupt(INTERRUPT_DW1000_SPI);
+		}
+		_done_tail = x;
+	} else {
+		x->queued = FALSE;
+	}
+	x->done = TRUE;
+
+	if (_queue_head) {
+		start(_queue_head);
+	} else {
+		_phase = PHASE_IDLE;
+	}
+}
+
+// Finish the transfer on the bus if the DMA is done with it, in case the
+// interrupt can't run
+static void poll () {
+	uint32_t primask = enter_critical();
+	if (_phase != PHASE_IDLE && DMA_GetFlagStatus(SPI1_RX_DMA_FLAG_TC) != RESET) {
+		transfer_done();
+	}
+	exit_critical(primask);
+}
+
+// The SPI stopped answering. Drop everything so the DW1000 can be reset.
+static void abort_all () {
+	uint32_t primask = enter_critical();
+	dw1000_spi_xfer_t* x;
+
+	dma_stop();
+	GPIO_WriteBit(SPI1_NSS_GPIO_PORT, SPI1_NSS_PIN, Bit_SET);
+	SPI_Cmd(SPI1, DISABLE);
+
+	for (x = _queue_head; x != NULL; x = x->next) {
+		x->queued = FALSE;
+		x->done = TRUE;
+	}
+	for (x = _done_head; x != NULL; x = x->next) {
+		x->queued = FALSE;
+	}
+	_queue_head = _queue_tail = NULL;
+	_done_head = _done_tail = NULL;
+	_phase = PHASE_IDLE;
+	exit_critical(primask);
+}
+
+static int wait (dw1000_spi_xfer_t* x) {
+	uint32_t loop = 0;
+
+	while (!x->done) {
+		poll();
+		if (++loop >= DW1000_SPI_WAIT_LOOPS) {
+			abort_all();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int transfer (uint16_t header_len, const uint8_t* header,
+                     uint32_t len, uint8_t* rx, const uint8_t* tx) {
+	dw1000_spi_xfer_t x = {
+		.header     = header,
+		.header_len = header_len,
+		.rx         = rx,
+		.tx         = tx,
+		.body_len   = len,
+		.callback   = NULL,
+		.follow     = NULL,
+	};
+
+	dw1000_spi_queue(&x);
+	return wait(&x);
+}
+
+/******************************************************************************/
+// API functions
+/******************************************************************************/
+
+void dw1000_spi_init () {
+	NVIC_InitTypeDef nvic_init = {
+		SPI1_DMA_IRQn, // Channel
+		0x01,          // Priority
+		ENABLE         // Enable or disable
+	};
+
+	NVIC_Init(&nvic_init);
+}
+
+// Fill in the header for reading or writing a DW1000 register starting at
+// offset. Returns its length.
+uint8_t dw1000_spi_header (uint8_t* header, bool write, uint8_t reg, uint16_t offset) {
+	header[0] = (write ? 0x80 : 0x00) | (reg & 0x3F);
+	if (offset == 0) {
+		return 1;
+	}
+
+	header[0] |= 0x40;
+	if (offset <= 0x7F) {
+		header[1] = offset;
+		return 2;
+	}
+
+	header[1] = 0x80 | (offset & 0x7F);
+	header[2] = offset >> 7;
+	return 3;
+}
+
+// Start a transfer once those before it are done, and return right away.
+// Its callback is called from the main loop when it is finished.
+void dw1000_spi_queue (dw1000_spi_xfer_t* x) {
+	uint32_t primask = enter_critical();
+
+	x->next = NULL;
+	x->queued = TRUE;
+	x->done = FALSE;
+
+	if (_queue_tail) {
+		_queue_tail->next = x;
+		_queue_tail = x;
+	} else {
+		_queue_head = _queue_tail = x;
+		start(x);
+	}
+
+	exit_critical(primask);
+}
+
+// Read after everything already queued, and wait for it
+int dw1000_spi_read (uint16_t header_len, const uint8_t* header, uint32_t len, uint8_t* rx) {
+	return transfer(header_len, header, len, rx, NULL);
+}
+
+// Write after everything already queued, and wait for it
+int dw1000_spi_write (uint16_t header_len, const uint8_t* header, uint32_t len, const uint8_t* tx) {
+	return transfer(header_len, header, len, NULL, tx);
+}
+
+// Wait for everything queued, and call the callbacks
+int dw1000_spi_flush () {
+	uint32_t loop = 0;
+
+	while (_queue_head != NULL) {
+		poll();
+		if (++loop >= DW1000_SPI_WAIT_LOOPS) {
+			abort_all();
+			return -1;
+		}
+	}
+
+	dw1000_spi_fired();
+	return 0;
+}
+
+// Whether the DMA is still using the SPI
+bool dw1000_spi_busy () {
+	return _queue_head != NULL;
+}
+
+/******************************************************************************/
+// Interrupt handling
+/******************************************************************************/
+
+// Called from the main loop after transfers with callbacks finish
+void dw1000_spi_fired () {
+	while (1) {
+		uint32_t primask = enter_critical();
+		dw1000_spi_xfer_t* x = _done_head;
+		if (x) {
+			_done_head = x->next;
+			if (_done_head == NULL) {
+				_done_tail = NULL;
+			}
+			x->queued = FALSE;
+		}
+		exit_critical(primask);
+
+		if (x == NULL) {
+			break;
+		}
+		x->callback(x);
+	}
+}
+
+void dw1000_spi_dma_interrupt () {
+	if (DMA_GetITStatus(SPI1_RX_DMA_IT_TC) != RESET) {
+		if (_phase != PHASE_IDLE) {
+			transfer_done();
+		} else {
+			DMA_ClearITPendingBit(SPI1_RX_DMA_IT_TC);
+		}
+	}
+}
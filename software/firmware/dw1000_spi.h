@@ -0,0 +1,57 @@
+#ifndef __DW1000_SPI_H
+#define __DW1000_SPI_H
+
+#include "system.h"
+
+// Transfers whose header and body both fit in this many bytes are copied
+// into one buffer and run as one DMA transfer on each channel. Longer ones
+// run as two, started one after the other from the interrupt. Register
+// accesses fit; frames mostly don't, which is one more DMA interrupt each
+// but keeps the buffer from taking RAM the scratchspace needs.
+#define DW1000_SPI_STAGE_LEN 32
+
+// Longest DW1000 SPI header: register, sub-index, extended sub-index
+#define DW1000_SPI_HEADER_LEN 3
+
+// How many times the blocking functions check on a transfer before giving up
+// on the SPI
+#define DW1000_SPI_WAIT_LOOPS 100000
+
+struct dw1000_spi_xfer;
+typedef void (*dw1000_spi_callback)(struct dw1000_spi_xfer* x);
+
+// Called from the DMA interrupt when a transfer is done, for reads that
+// decide what to read next. Returns a transfer to run right after it, ahead
+// of anything else queued, or NULL.
+typedef struct dw1000_spi_xfer* (*dw1000_spi_follow)(struct dw1000_spi_xfer* x);
+
+// One SPI transaction with the DW1000: a header, then a body that is either
+// read into rx or written from tx. The header and body have to stay where
+// they are until the transfer is done. The small fields go last so they
+// pack into one word.
+typedef struct dw1000_spi_xfer {
+	struct dw1000_spi_xfer* next;
+	const uint8_t*          header;
+	uint8_t*                rx;       // NULL for a write
+	const uint8_t*          tx;       // NULL for a read
+	dw1000_spi_callback     callback; // Called from the main loop, or NULL
+	dw1000_spi_follow       follow;   // Called from the interrupt, or NULL
+	uint16_t                body_len;
+	uint8_t                 header_len;
+	volatile bool           queued;
+	volatile bool           done;
+} dw1000_spi_xfer_t;
+
+void dw1000_spi_init ();
+uint8_t dw1000_spi_header (uint8_t* header, bool write, uint8_t reg, uint16_t offset);
+void dw1000_spi_queue (dw1000_spi_xfer_t* x);
+int  dw1000_spi_read (uint16_t header_len, const uint8_t* header, uint32_t len, uint8_t* rx);
+int  dw1000_spi_write (uint16_t header_len, const uint8_t* header, uint32_t len, const uint8_t* tx);
+int  dw1000_spi_flush ();
+bool dw1000_spi_busy ();
+
+// Only used for interrupt handling
+void dw1000_spi_fired ();
+void dw1000_spi_dma_interrupt ();
+
+#endif
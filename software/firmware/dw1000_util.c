@@ -0,0 +1,105 @@
+#include "deca_device_api.h"
+
+#include "dw1000.h"
+
+// Utility functions that don't touch the DW1000. They are kept out of
+// dw1000.c so that the range calculation can be built and checked on a PC
+// (see software/simulation/range_check.c).
+
+/******************************************************************************/
+// Decawave specific utility functions
+/******************************************************************************/
+
+// Convert a time of flight measurement to millimeters
+int dwtime_to_millimeters (double dwtime) {
+	// Get meters using the speed of light
+	double dist = dwtime * DWT_TIME_UNITS * SPEED_OF_LIGHT;
+
+	// And return millimeters
+	return (int) (dist*1000.0);
+}
+
+
+/******************************************************************************/
+// Misc Utility
+/******************************************************************************/
+
+// Find the k-th smallest (starting at 0) of the num values in arr without
+// sorting the whole array. This is a quickselect, so arr is reordered such
+// that arr[k] holds the result, everything before it is no larger and
+// everything after it is no smaller.
+int select_kth (int arr[], unsigned num, unsigned k) {
+	int lo = 0;
+	int hi = num - 1;
+
+	while (lo < hi) {
+		// Use the median of the first, middle, and last values as the pivot
+		// so that already sorted (or reverse sorted) ranges are not the
+		// worst case. This also leaves sentinels at both ends for the
+		// partition loops below.
+		int mid = lo + ((hi - lo) / 2);
+		int temp;
+		if (arr[mid] < arr[lo]) { temp = arr[mid]; arr[mid] = arr[lo]; arr[lo] = temp; }
+		if (arr[hi] < arr[lo])  { temp = arr[hi];  arr[hi] = arr[lo];  arr[lo] = temp; }
+		if (arr[hi] < arr[mid]) { temp = arr[hi];  arr[hi] = arr[mid]; arr[mid] = temp; }
+		int pivot = arr[mid];
+
+		// Partition so that arr[lo..j] <= pivot and arr[i..hi] >= pivot.
+		// Anything between j and i is equal to the pivot.
+		int i = lo;
+		int j = hi;
+		while (i <= j) {
+			while (arr[i] < pivot) i++;
+			while (arr[j] > pivot) j--;
+			if (i <= j) {
+				temp = arr[i];
+				arr[i] = arr[j];
+				arr[j] = temp;
+				i++;
+				j--;
+			}
+		}
+
+		// Only keep looking in the side that has the k-th value
+		if ((int) k <= j) {
+			hi = j;
+		} else if ((int) k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+
+	return arr[k];
+}
+
+// Calculate the numerator/denominator percentile of the num values in arr,
+// interpolating between the two values on either side of it. This reorders
+// arr. num must be at least one.
+int select_percentile (int arr[], unsigned num, unsigned numerator, unsigned denominator) {
+	unsigned bot = (num*numerator)/denominator;
+	unsigned top = bot+1;
+
+	int bot_value = select_kth(arr, num, bot);
+	if (top >= num) {
+		return bot_value;
+	}
+
+	// After the select everything past bot is no smaller than it, so the
+	// next value in sorted order is just the smallest of those.
+	int top_value = arr[top];
+	for (unsigned i=top+1; i<num; i++) {
+		if (arr[i] < top_value) {
+			top_value = arr[i];
+		}
+	}
+
+	// bot represents the whole index of the item at the percentile.
+	// Then we are going to use the remainder decimal portion to get
+	// a scaled value to add to that base. And we are going to do this
+	// without floating point, so buckle up.
+	// EXAMPLE: if the 90th percentile would be index 3.4, we do:
+	//                  distances[3] + 0.4*(distances[4]-distances[3])
+	return bot_value +
+		(((top_value-bot_value) * (int) ((numerator*num) - (bot*denominator))) / (int) denominator);
+}
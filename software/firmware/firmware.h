@@ -12,15 +12,28 @@ typedef enum {
 
 // All of the possible interrupt sources.
 typedef enum {
-	INTERRUPT_TIMER_17,
-	INTERRUPT_TIMER_16,
+	INTERRUPT_TIMER,
 	INTERRUPT_DW1000,
 	INTERRUPT_I2C_RX,
 	INTERRUPT_I2C_TX,
 	INTERRUPT_I2C_TIMEOUT,
+	INTERRUPT_DW1000_SPI,
 	NUMBER_INTERRUPT_SOURCES
 } interrupt_source_e;
 
+// An interrupt for the main loop to handle
+typedef struct {
+	uint8_t  source;  // interrupt_source_e
+	uint32_t time_us; // timer_now() when it fired
+} interrupt_event_t;
+
+// How long events of one source waited in the main loop's queues, in us
+typedef struct {
+	uint32_t handled;
+	uint32_t max_latency_us;
+	uint32_t total_latency_us;
+} event_stats_t;
+
 // Enum for what ranging application to run on this node
 typedef enum {
 	APP_ONEWAY = 0,
@@ -47,7 +60,7 @@ typedef enum {
 /******************************************************************************/
 // Main firmware application functions.
 /******************************************************************************/
-void polypoint_configure_app (polypoint_application_e app, void* app_config);
+bool polypoint_configure_app (polypoint_application_e app, void* app_config);
 void polypoint_start ();
 void polypoint_stop ();
 void polypoint_reset ();
@@ -58,5 +71,7 @@ void polypoint_tag_do_range ();
 // OS functions.
 /******************************************************************************/
 void mark_interrupt (interrupt_source_e src);
+const event_stats_t* event_stats ();
+void events_dropped (uint16_t* radio, uint16_t* host);
 
 #endif
@@ -1,6 +1,7 @@
 #include "dw1000.h"
 #include "deca_regs.h"
 #include "glossy.h"
+#include "glossy_clock.h"
 #include "oneway_common.h"
 #include "timer.h"
 #include "prng.h"
@@ -27,36 +28,542 @@ static bool _sending_sync;
 static uint32_t _lwb_counter;
 static bool _lwb_valid;
 static uint8_t _cur_glossy_depth;
+static uint8_t _glossy_relays;
+static uint8_t _flood_max_depth;
+static bool _flood_depth_learned;
+static uint8_t _flood_depth_seen;
+static uint32_t _glossy_syncs_sent;
 static bool _glossy_currently_flooding;
 
 static bool _lwb_sched_en;
 static bool _lwb_scheduled;
-static uint32_t _lwb_num_timeslots;
+// A schedule request went out and the next sync will say if it got through
+static bool _lwb_req_sent;
+// Unanswered requests in a row, and contention slots to let pass before the
+// next one
+static uint8_t _lwb_req_tries;
+static uint32_t _lwb_req_backoff;
+static uint8_t _lwb_update_rate;
 static uint32_t _lwb_timeslot;
-static uint32_t _lwb_mod_timeslot;
+// Time to tell the master which anchors this tag has been reaching
+static bool _lwb_report_due;
+static uint8_t _lwb_anchors_heard[LWB_ANCHOR_SIG_LEN];
+// The interval the tag is in. The schedule from the last sync, which is
+// enough to work out the turns in the intervals that follow it too, is kept
+// in _sync_pkt, which a slave doesn't otherwise use until it relays the sync.
+static uint16_t _lwb_interval;
+// This tag's turns in the current interval: which ranging events its zone's
+// color gets, and its place among the slower tags in its zone that range in
+// it, or among the tags in rate class 0 that share the rest of the events
+static uint32_t _lwb_color_events;
+static bool _lwb_ranging_now;
+static uint8_t _lwb_rate_class;
+static uint8_t _lwb_num_slow;
+static uint8_t _lwb_slow_place;
+static uint8_t _lwb_num_fast;
+static uint8_t _lwb_fast_place;
+// How many events the tags in rate class 0 had before this interval
+static uint32_t _lwb_fast_first;
 static void (*_lwb_schedule_callback)(void);
 static double _clock_offset;
 
-static uint8_t _sched_euis[MAX_SCHED_TAGS][EUI_LEN];
-static uint8_t _tag_timeout[MAX_SCHED_TAGS];
+// The master's schedule, in the anchor's scratchspace. NULL on slaves.
+static glossy_sched_t* _sched;
 
 static ranctx _prng_state;
 
+#ifdef GLOSSY_CLOCK_TRACKER
+static glossy_clock_t _clock;
+// Intervals started since the last sync flood was sent or heard
+static uint32_t _lwb_intervals_coasted;
+// How long after the sync is sent the glossy timer starts the interval
+static int64_t _lwb_boundary_lag;
+#endif
+
 #ifdef GLOSSY_PER_TEST
 static uint32_t _total_syncs_sent;
 static uint32_t _total_syncs_received;
 #endif
 
-uint8_t uint64_count_ones(uint64_t number){
+static bool sched_bit(const uint8_t* bits, uint8_t slot){
+	return (bits[slot >> 3] >> (slot & 7)) & 1;
+}
+
+static void sched_set_bit(uint8_t* bits, uint8_t slot, bool val){
+	if(val) bits[slot >> 3] |= (1 << (slot & 7));
+	else bits[slot >> 3] &= ~(1 << (slot & 7));
+}
+
+static uint8_t sched_rate_class(const uint8_t* classes, uint8_t slot){
+	return (classes[slot >> 2] >> ((slot & 3) * LWB_RATE_CLASS_BITS)) & (LWB_RATE_CLASSES-1);
+}
+
+static void sched_set_rate_class(uint8_t* classes, uint8_t slot, uint8_t rate_class){
+	classes[slot >> 2] &= ~((LWB_RATE_CLASSES-1) << ((slot & 3) * LWB_RATE_CLASS_BITS));
+	classes[slot >> 2] |= rate_class << ((slot & 3) * LWB_RATE_CLASS_BITS);
+}
+
+static uint8_t sched_zone_color(const uint8_t* colors, uint8_t zone){
+	return (colors[zone >> 1] >> ((zone & 1) * LWB_COLOR_BITS)) & (LWB_REUSE_ZONES-1);
+}
+
+static void sched_set_zone_color(uint8_t* colors, uint8_t zone, uint8_t color){
+	colors[zone >> 1] &= ~(0x0F << ((zone & 1) * LWB_COLOR_BITS));
+	colors[zone >> 1] |= color << ((zone & 1) * LWB_COLOR_BITS);
+}
+
+static uint8_t sched_count_bits(uint32_t bits){
+	uint8_t num = 0;
+
+	for(; bits; bits &= bits-1)
+		num++;
+	return num;
+}
+
+// Split the ranging events of an interval between the colors, in proportion
+// to the most tags any zone of each color has, and interleaved. Every color
+// with tags gets at least one. Sets a bit for each event a color gets.
+static void sched_split_events(const uint8_t* mask, const uint8_t* colors, uint32_t* color_events){
+	uint8_t load[LWB_REUSE_ZONES] = { 0 };
+	uint8_t given[LWB_REUSE_ZONES] = { 0 };
+	uint32_t ii, cc, total = 0, waiting = 0;
+
+	memset(color_events, 0, LWB_REUSE_ZONES*sizeof(uint32_t));
+
+	for(ii = 0; ii < LWB_REUSE_ZONES; ii++){
+		uint8_t num = 0, jj;
+		for(jj = 0; jj < LWB_ZONE_SLOTS; jj++)
+			num += sched_bit(mask, ii*LWB_ZONE_SLOTS + jj);
+		cc = sched_zone_color(colors, ii);
+		if(num > load[cc])
+			load[cc] = num;
+	}
+	for(cc = 0; cc < LWB_REUSE_ZONES; cc++){
+		total += load[cc];
+		waiting += (load[cc] > 0);
+	}
+
+	for(ii = 0; ii < LWB_RANGING_EVENTS; ii++){
+		int best = -1;
+		int32_t best_owed = 0;
+		for(cc = 0; cc < LWB_REUSE_ZONES; cc++){
+			if(!load[cc])
+				continue;
+			// Once there are only enough events left for the colors that
+			// haven't had one, they go first
+			if(LWB_RANGING_EVENTS - ii <= waiting && given[cc])
+				continue;
+			int32_t owed = (int32_t)(load[cc]*(ii+1)) - (int32_t)(given[cc]*total);
+			if(best < 0 || owed > best_owed){
+				best = cc;
+				best_owed = owed;
+			}
+		}
+		if(best < 0)
+			best = 0;
+		if(load[best] && !given[best])
+			waiting--;
+		given[best]++;
+		color_events[best] |= 1 << ii;
+	}
+}
+
+// Whether the tag in this slot ranges in the given interval. Slower tags
+// take their turns in different intervals depending on their slot.
+static bool sched_slot_ranges(const uint8_t* mask, const uint8_t* classes, uint16_t interval, uint8_t slot){
+	if(!sched_bit(mask, slot))
+		return FALSE;
+	return ((interval + slot) & ((1 << sched_rate_class(classes, slot)) - 1)) == 0;
+}
+
+// Count the slower tags in a zone that range in each interval of the cycle
+// their turns repeat in
+static void sched_count_slow(const uint8_t* mask, const uint8_t* classes, uint8_t zone, uint8_t* slow){
+	uint32_t ii, jj;
+
+	memset(slow, 0, LWB_RATE_CYCLE);
+	for(ii = zone*LWB_ZONE_SLOTS; ii < (uint32_t)(zone+1)*LWB_ZONE_SLOTS; ii++){
+		if(!sched_bit(mask, ii) || sched_rate_class(classes, ii) == 0)
+			continue;
+		for(jj = 0; jj < LWB_RATE_CYCLE; jj++){
+			if(sched_slot_ranges(mask, classes, jj, ii))
+				slow[jj]++;
+		}
+	}
+}
+
+// Slower tags get the first ranging events of the intervals they range in.
+// A tag can only be one if they still fit in LWB_SLOW_EVENTS of the events
+// their zone gets, in every zone.
+static bool sched_slow_fits(){
+	uint8_t slow[LWB_RATE_CYCLE];
+	uint32_t color_events[LWB_REUSE_ZONES];
+	uint32_t ii, jj;
+
+	sched_split_events(_sync_pkt.tag_ranging_mask, _sync_pkt.zone_colors, color_events);
+	for(ii = 0; ii < LWB_REUSE_ZONES; ii++){
+		uint8_t events = sched_count_bits(color_events[sched_zone_color(_sync_pkt.zone_colors, ii)]);
+		sched_count_slow(_sync_pkt.tag_ranging_mask, _sync_pkt.tag_rate_classes, ii, slow);
+		for(jj = 0; jj < LWB_RATE_CYCLE; jj++){
+			if(slow[jj] > LWB_SLOW_EVENTS(events))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// The slowest rate class that still ranges update_rate (in 0.1 Hz) times a second
+static uint8_t sched_rate_class_for(uint8_t update_rate){
+	uint8_t rate_class = 0;
+	uint32_t period;
+
+	if(update_rate == 0)
+		return 0;
+
+	// Intervals between the ranging events the tag asked for
+	period = (uint32_t)(10*1e6/GLOSSY_UPDATE_INTERVAL_US) / update_rate;
+	while(rate_class+1 < LWB_RATE_CLASSES && (2u << rate_class) <= period)
+		rate_class++;
+	return rate_class;
+}
+
+static uint8_t sched_hash(const uint8_t* eui){
+	return ((uint16_t)((eui[0] | (eui[1] << 8)) * 40503u) >> 8) & (LWB_ZONE_SLOTS-1);
+}
+
+// The slot after this one in the same zone
+static uint8_t sched_zone_next(uint8_t slot, int8_t step){
+	return (slot & ~(LWB_ZONE_SLOTS-1)) | ((slot + step) & (LWB_ZONE_SLOTS-1));
+}
+
+// Find the slot a tag has in a zone. If it doesn't have one, return -1 and
+// set free_slot to where it could go, or -1 if the zone is full.
+static int sched_find_in_zone(const uint8_t* eui, uint8_t zone, int* free_slot){
+	uint8_t slot = zone*LWB_ZONE_SLOTS + sched_hash(eui);
 	int ii;
-	uint8_t ret = 0;
-	for(ii = 0; ii < 64; ii++){
-		if(number & (1 << ii)) ret++;
+
+	*free_slot = -1;
+	for(ii = 0; ii < LWB_ZONE_SLOTS; ii++, slot = sched_zone_next(slot, 1)){
+		if(sched_bit(_sync_pkt.tag_ranging_mask, slot)){
+			if(memcmp(_sched->tags[slot].eui, eui, LWB_SCHED_EUI_LEN) == 0)
+				return slot;
+		} else {
+			if(*free_slot < 0) *free_slot = slot;
+			// Nothing was ever placed past an empty slot
+			if(!sched_bit(_sched->removed, slot)) break;
+		}
+	}
+	return -1;
+}
+
+// Find the slot a tag has in any zone, or -1
+static int sched_find(const uint8_t* eui){
+	int ii, slot, free_slot;
+
+	for(ii = 0; ii < LWB_REUSE_ZONES; ii++){
+		slot = sched_find_in_zone(eui, ii, &free_slot);
+		if(slot >= 0)
+			return slot;
+	}
+	return -1;
+}
+
+// Give a tag a slot in a zone. Returns it, or -1 if the zone is full.
+static int sched_insert(const uint8_t* eui, uint8_t check, uint8_t zone){
+	int slot;
+
+	if(sched_find_in_zone(eui, zone, &slot) >= 0 || slot < 0)
+		return -1;
+	memcpy(_sched->tags[slot].eui, eui, LWB_SCHED_EUI_LEN);
+	_sched->checks[slot] = check;
+	sched_set_bit(_sync_pkt.tag_ranging_mask, slot, TRUE);
+	sched_set_bit(_sched->removed, slot, FALSE);
+	sched_set_rate_class(_sync_pkt.tag_rate_classes, slot, 0);
+	_sched->num_tags++;
+	_sched->zone_tags[zone]++;
+	return slot;
+}
+
+// Tell the tags about a slot assignment for the next few sync packets
+static void sched_announce(uint8_t slot){
+	struct pp_sched_entry entries[LWB_SCHED_DELTA_ENTRIES];
+	int ii, num = 1;
+	bool already_new = FALSE;
+
+	// Newest first, and only once
+	entries[0].slot = slot;
+	memcpy(entries[0].tag_sched_eui, _sched->tags[slot].eui, LWB_SCHED_EUI_LEN);
+	entries[0].tag_sched_check = _sched->checks[slot];
+	for(ii = 0; ii < _sync_pkt.num_sched_entries; ii++){
+		if(_sync_pkt.sched_entries[ii].slot != slot){
+			if(num < LWB_SCHED_DELTA_ENTRIES)
+				entries[num++] = _sync_pkt.sched_entries[ii];
+		} else if(ii < _sched->new_entries){
+			already_new = TRUE;
+		}
+	}
+	memcpy(_sync_pkt.sched_entries, entries, sizeof(entries));
+	_sync_pkt.num_sched_entries = num;
+	if(!already_new)
+		_sched->new_entries++;
+}
+
+static void sched_remove(uint8_t slot){
+	int ii, jj;
+
+	sched_set_bit(_sync_pkt.tag_ranging_mask, slot, FALSE);
+	sched_set_bit(_sched->removed, slot, TRUE);
+	_sched->num_tags--;
+	_sched->zone_tags[slot / LWB_ZONE_SLOTS]--;
+
+	// If nothing follows, lookups don't need to get past this any more
+	if(!sched_bit(_sync_pkt.tag_ranging_mask, sched_zone_next(slot, 1)) &&
+	   !sched_bit(_sched->removed, sched_zone_next(slot, 1))){
+		while(sched_bit(_sched->removed, slot)){
+			sched_set_bit(_sched->removed, slot, FALSE);
+			slot = sched_zone_next(slot, -1);
+		}
+	}
+
+	// Stop announcing it
+	for(ii = jj = 0; ii < _sync_pkt.num_sched_entries; ii++){
+		if(sched_bit(_sync_pkt.tag_ranging_mask, _sync_pkt.sched_entries[ii].slot))
+			_sync_pkt.sched_entries[jj++] = _sync_pkt.sched_entries[ii];
+		else if(ii < _sched->new_entries)
+			_sched->new_entries--;
+	}
+	_sync_pkt.num_sched_entries = jj;
+}
+
+// Move a tag to a slot in another zone, keeping its rate class. Returns the
+// slot it has afterwards.
+static uint8_t sched_move(uint8_t slot, uint8_t zone){
+	int new_slot = sched_insert(_sched->tags[slot].eui, _sched->checks[slot], zone);
+
+	if(new_slot < 0)
+		return slot;
+	sched_set_rate_class(_sync_pkt.tag_rate_classes, new_slot, sched_rate_class(_sync_pkt.tag_rate_classes, slot));
+	sched_remove(slot);
+	return new_slot;
+}
+
+// The bit an anchor sets in a tag's report
+static uint8_t sched_anchor_bit(const uint8_t* anchor_eui){
+	return ((uint16_t)((anchor_eui[0] | (anchor_eui[1] << 8)) * 40503u) >> 8) & (LWB_ANCHOR_SIG_LEN*8-1);
+}
+
+// How many anchors a report has in common with what a zone's tags reported
+static uint8_t sched_zone_overlap(uint8_t zone, const uint8_t* anchor_sig){
+	uint8_t num = 0;
+	int ii;
+
+	for(ii = 0; ii < LWB_ANCHOR_SIG_LEN*8; ii++){
+		if(sched_bit(anchor_sig, ii) &&
+		   (sched_bit(_sched->zone_anchors[zone], ii) || sched_bit(_sched->zone_anchors_last[zone], ii)))
+			num++;
+	}
+	return num;
+}
+
+static bool sched_zone_has_anchors(uint8_t zone){
+	int ii;
+
+	for(ii = 0; ii < LWB_ANCHOR_SIG_LEN; ii++){
+		if(_sched->zone_anchors[zone][ii] || _sched->zone_anchors_last[zone][ii])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Which zone a tag that reported these anchors should be in. cur_zone is the
+// one it's in, or -1. Tags go where the most of their anchors already are,
+// or else to a zone nobody has reported anchors for, so that tags that
+// don't reach the same anchors end up in different zones. Returns -1 if
+// there's no room anywhere.
+static int sched_pick_zone(const uint8_t* anchor_sig, int cur_zone){
+	int best = cur_zone, ii;
+	uint8_t best_overlap = (cur_zone >= 0) ? sched_zone_overlap(cur_zone, anchor_sig) : 0;
+	bool best_empty = (cur_zone >= 0) ? !sched_zone_has_anchors(cur_zone) : FALSE;
+	bool reported = FALSE;
+
+	for(ii = 0; ii < LWB_ANCHOR_SIG_LEN; ii++)
+		reported |= (anchor_sig[ii] != 0);
+	if(!reported && cur_zone >= 0)
+		return cur_zone;
+
+	for(ii = 0; ii < LWB_REUSE_ZONES; ii++){
+		if(ii == cur_zone || _sched->zone_tags[ii] >= LWB_ZONE_SLOTS)
+			continue;
+		uint8_t overlap = sched_zone_overlap(ii, anchor_sig);
+		bool empty = !sched_zone_has_anchors(ii);
+
+		if(best < 0 ||
+		   overlap > best_overlap ||
+		   // Nothing in common with anyone yet, so start a zone of its own
+		   (reported && overlap == 0 && best_overlap == 0 && empty && !best_empty) ||
+		   // Otherwise fill the zones evenly
+		   (cur_zone < 0 && overlap == best_overlap && (!reported || empty == best_empty) && _sched->zone_tags[ii] < _sched->zone_tags[best])){
+			best = ii;
+			best_overlap = overlap;
+			best_empty = empty;
+		}
+	}
+	return best;
+}
+
+// Whether the tags in two zones could get in each other's way. A zone with
+// tags that haven't reported any anchors yet could be anywhere.
+static bool sched_zones_conflict(uint8_t a, uint8_t b){
+	int ii;
+
+	if(!_sched->zone_tags[a] || !_sched->zone_tags[b])
+		return FALSE;
+	if(!sched_zone_has_anchors(a) || !sched_zone_has_anchors(b))
+		return TRUE;
+	for(ii = 0; ii < LWB_ANCHOR_SIG_LEN; ii++){
+		if((_sched->zone_anchors[a][ii] | _sched->zone_anchors_last[a][ii]) & (_sched->zone_anchors[b][ii] | _sched->zone_anchors_last[b][ii]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Color the zones so that ones that could get in each other's way differ.
+// There are as many colors as zones, so there's always one.
+static void sched_update_colors(){
+	uint8_t color[LWB_REUSE_ZONES];
+	int ii, jj;
+
+	// Forget anchors that haven't been reported for a while
+	if((_sync_pkt.interval % (2*LWB_ANCHOR_REPORT_INTERVALS)) == 0){
+		memcpy(_sched->zone_anchors_last, _sched->zone_anchors, sizeof(_sched->zone_anchors));
+		memset(_sched->zone_anchors, 0, sizeof(_sched->zone_anchors));
+	}
+
+	for(ii = 0; ii < LWB_REUSE_ZONES; ii++){
+		uint32_t taken = 0;
+
+		for(jj = 0; jj < ii; jj++){
+			if(sched_zones_conflict(ii, jj))
+				taken |= 1 << color[jj];
+		}
+		color[ii] = 0;
+		while(taken & (1 << color[ii]))
+			color[ii]++;
+		sched_set_zone_color(_sync_pkt.zone_colors, ii, color[ii]);
 	}
-	return ret;
 }
 
-void glossy_init(glossy_role_e role){
+// Whether to send a schedule request in this contention slot
+static bool lwb_contend(){
+	// A deschedule goes out as soon as possible
+	if(_sched_req_pkt.deschedule_flag)
+		return TRUE;
+	// Until a sync is heard there are no contention slots, only guesses
+	// that could land on the master's next sync
+	if(!_lwb_valid || !_lwb_sched_en || _lwb_req_sent || (_lwb_scheduled && !_lwb_report_due))
+		return FALSE;
+	if(_lwb_req_backoff){
+		_lwb_req_backoff--;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// The first sync after a schedule request says whether it got through. If it
+// didn't, double the number of contention slots to pick the next one from.
+static void lwb_req_answered(){
+	if(!_lwb_req_sent)
+		return;
+	_lwb_req_sent = FALSE;
+
+	if(_lwb_scheduled){
+		_lwb_req_tries = 0;
+		_lwb_req_backoff = ranval(&_prng_state) % LWB_CONTENTION_SLOTS;
+	} else {
+		if(_lwb_req_tries < LWB_BACKOFF_MAX_EXP)
+			_lwb_req_tries++;
+		_lwb_req_backoff = ranval(&_prng_state) % ((uint32_t)(LWB_CONTENTION_SLOTS) << _lwb_req_tries);
+	}
+}
+
+// Work out this tag's turns in interval _lwb_interval from the last schedule.
+// It takes turns with the other tags in its zone, in the events its zone's
+// color gets.
+static void lwb_plan_interval(){
+	uint8_t slow[LWB_RATE_CYCLE];
+	uint32_t color_events[LWB_REUSE_ZONES];
+	uint8_t zone = _lwb_timeslot / LWB_ZONE_SLOTS;
+	uint32_t ii, jj, events;
+
+	sched_split_events(_sync_pkt.tag_ranging_mask, _sync_pkt.zone_colors, color_events);
+	_lwb_color_events = color_events[sched_zone_color(_sync_pkt.zone_colors, zone)];
+	events = sched_count_bits(_lwb_color_events);
+
+	_lwb_ranging_now = FALSE;
+	_lwb_num_slow = 0;
+	_lwb_num_fast = 0;
+	for(ii = zone*LWB_ZONE_SLOTS; ii < (uint32_t)(zone+1)*LWB_ZONE_SLOTS; ii++){
+		if(!sched_bit(_sync_pkt.tag_ranging_mask, ii))
+			continue;
+		uint8_t rate_class = sched_rate_class(_sync_pkt.tag_rate_classes, ii);
+		if(ii == _lwb_timeslot){
+			_lwb_rate_class = rate_class;
+			_lwb_ranging_now = sched_slot_ranges(_sync_pkt.tag_ranging_mask, _sync_pkt.tag_rate_classes, _lwb_interval, ii);
+			_lwb_slow_place = _lwb_num_slow;
+			_lwb_fast_place = _lwb_num_fast;
+		}
+		if(rate_class == 0)
+			_lwb_num_fast++;
+		else if(sched_slot_ranges(_sync_pkt.tag_ranging_mask, _sync_pkt.tag_rate_classes, _lwb_interval, ii))
+			_lwb_num_slow++;
+	}
+	sched_count_slow(_sync_pkt.tag_ranging_mask, _sync_pkt.tag_rate_classes, zone, slow);
+
+	// The events the slower tags leave are shared by the others in turn,
+	// carrying on from where the last interval stopped
+	uint32_t cycle = 0, before = 0;
+	for(jj = 0; jj < LWB_RATE_CYCLE; jj++){
+		uint32_t fast_events = (slow[jj] < events) ? events - slow[jj] : 0;
+		cycle += fast_events;
+		if(jj < (_lwb_interval & (LWB_RATE_CYCLE-1)))
+			before += fast_events;
+	}
+	_lwb_fast_first = (uint32_t)(_lwb_interval / LWB_RATE_CYCLE) * cycle + before;
+}
+
+// Whether ranging event number ev of this interval is ours. Of the events
+// for our zone's color, the slower tags whose turn it is go first, then the
+// tags in rate class 0 share the rest.
+static bool lwb_my_event(uint32_t ev){
+	if(!(_lwb_color_events & (1 << ev)))
+		return FALSE;
+	ev = sched_count_bits(_lwb_color_events & ((1 << ev) - 1));
+	if(ev < _lwb_num_slow)
+		return _lwb_rate_class != 0 && _lwb_ranging_now && ev == _lwb_slow_place;
+	if(_lwb_rate_class != 0 || _lwb_num_fast == 0)
+		return FALSE;
+	return (_lwb_fast_first + ev - _lwb_num_slow) % _lwb_num_fast == _lwb_fast_place;
+}
+
+#ifdef GLOSSY_CLOCK_TRACKER
+// Difference between two DW1000 times, allowing for the clock wrapping
+static int64_t dw_time_diff(uint64_t a, uint64_t b){
+	return ((int64_t)((a - b) << 24)) >> 24;
+}
+
+// Called two slots before the end of the interval. Move the glossy timer so
+// the next interval starts when the sync for it is sent (plus the usual lag),
+// which corrects for the MCU clock drifting from the DW1000's.
+static void lwb_align_boundary(uint64_t sync_time){
+	uint64_t now = (uint64_t)(dwt_readsystimestamphi32()) << 8;
+	double remaining_us = dw_time_diff(sync_time + _lwb_boundary_lag, now) * DWT_TIME_UNITS * 1e6;
+	double val = 2*LWB_SLOT_US - remaining_us;
+	if(val >= 0 && val < LWB_SLOT_US)
+		timer_reset(_glossy_timer, (uint32_t)(val));
+}
+#endif
+
+void glossy_init(glossy_role_e role, glossy_sched_t* sched){
 	_sync_pkt = (struct pp_sched_flood) {
 		.header = {
 			.frameCtrl = {
@@ -75,14 +582,21 @@ void glossy_init(glossy_role_e role){
 			.sourceAddr = { 0 },
 		},
 		.message_type = MSG_TYPE_PP_GLOSSY_SYNC,
-		.tag_ranging_mask = 0,
-		.tag_sched_idx = 0,
-		.tag_sched_eui = { 0 }
+		.max_depth = GLOSSY_MAX_DEPTH,
+		.tag_ranging_mask = { 0 },
+		.tag_rate_classes = { 0 },
+		.zone_colors = { 0 },
+		.interval = 0,
+		.num_sched_entries = 0,
 	};
 
 	_sched_req_pkt.header = _sync_pkt.header;
 	_sched_req_pkt.message_type = MSG_TYPE_PP_GLOSSY_SCHED_REQ;
 	_sched_req_pkt.deschedule_flag = 0;
+	_sched_req_pkt.report_flag = 0;
+	_sched_req_pkt.update_rate = _lwb_update_rate;
+	_sched_req_pkt.sync_depth = 0;
+	memset(_sched_req_pkt.anchor_sig, 0, sizeof(_sched_req_pkt.anchor_sig));
 	dw1000_read_eui(_sched_req_pkt.tag_sched_eui);
 
 	// TODO: We're currently using the same EUI throughout...
@@ -97,14 +611,31 @@ void glossy_init(glossy_role_e role){
 	_role = role;
 	_sending_sync = FALSE;
 	_lwb_counter = 0;
-	memset(_tag_timeout, 0, sizeof(_tag_timeout));
+#ifdef GLOSSY_CLOCK_TRACKER
+	glossy_clock_init(&_clock);
+	_lwb_boundary_lag = 0;
+	// The master starts with a sync
+	_lwb_intervals_coasted = (role == GLOSSY_MASTER) ? GLOSSY_SYNC_INTERVALS-1 : 0;
+#endif
+	_sched = (role == GLOSSY_MASTER) ? sched : NULL;
+	if(_sched)
+		memset(_sched, 0, sizeof(glossy_sched_t));
 	_glossy_flood_timeslot_corrected_us = (uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8;
 
 	_lwb_valid = FALSE;
 	_lwb_sched_en = FALSE;
 	_lwb_scheduled = FALSE;
+	_lwb_req_sent = FALSE;
+	_lwb_req_tries = 0;
+	_lwb_req_backoff = ranval(&_prng_state) % LWB_CONTENTION_SLOTS;
+	_lwb_report_due = FALSE;
+	memset(_lwb_anchors_heard, 0, sizeof(_lwb_anchors_heard));
 	_lwb_schedule_callback = NULL;
 	_glossy_currently_flooding = FALSE;
+	_flood_max_depth = GLOSSY_MAX_DEPTH;
+	_flood_depth_learned = FALSE;
+	_flood_depth_seen = 0;
+	_glossy_syncs_sent = 0;
 
 #ifdef GLOSSY_PER_TEST
 	_total_syncs_sent = 0;
@@ -123,18 +654,17 @@ void glossy_init(glossy_role_e role){
 	}
 
 	// The glossy timer acts to synchronize everyone to a common timebase
-	_glossy_timer = timer_init();
+	if(_glossy_timer == NULL)
+		_glossy_timer = timer_init();
 	timer_start(_glossy_timer, LWB_SLOT_US, glossy_sync_task);
 }
 
 void increment_sched_timeout(){
 	for(int ii=0; ii < MAX_SCHED_TAGS; ii++){
-		if(_sync_pkt.tag_ranging_mask & ((uint64_t)(1) << ii)){
-			_tag_timeout[ii]++;
-			if(_tag_timeout[ii] == TAG_SCHED_TIMEOUT)
-				_sync_pkt.tag_ranging_mask &= ~((uint64_t)(1) << ii);
-		} else {
-			_tag_timeout[ii] = 0;
+		if(sched_bit(_sync_pkt.tag_ranging_mask, ii)){
+			_sched->tags[ii].timeout++;
+			if(_sched->tags[ii].timeout == TAG_SCHED_TIMEOUT)
+				sched_remove(ii);
 		}
 	}
 }
@@ -154,8 +684,30 @@ void glossy_sync_task(){
 			dw1000_choose_antenna(1);
 #endif
 
+#ifdef GLOSSY_CLOCK_TRACKER
+		} else if(_lwb_counter == (GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US)-2){
+			lwb_align_boundary((uint64_t)(_last_time_sent + GLOSSY_UPDATE_INTERVAL_DW) << 8);
+
+		// No sync was sent this interval, so start the next one ourselves
+		} else if(_lwb_counter == (GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US) && !_sending_sync){
+			_lwb_counter = 0;
+#endif
+
 		// Last timeslot is used by the master to schedule the next glossy sync packet
 		} else if(_lwb_counter == (GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US)-1){
+			increment_sched_timeout();
+
+			_sync_pkt.interval++;
+			sched_update_colors();
+
+			_last_time_sent += GLOSSY_UPDATE_INTERVAL_DW;
+
+#ifdef GLOSSY_CLOCK_TRACKER
+			if(++_lwb_intervals_coasted < GLOSSY_SYNC_INTERVALS)
+				return;
+			_lwb_intervals_coasted = 0;
+#endif
+
 			dwt_forcetrxoff();
 		
 		#ifdef GLOSSY_PER_TEST
@@ -170,13 +722,35 @@ void glossy_sync_task(){
 			dw1000_update_channel(1);
 			dw1000_choose_antenna(0);
 
-			increment_sched_timeout();
-		
-			_last_time_sent += GLOSSY_UPDATE_INTERVAL_DW;
+			// Only flood as deep as the furthest tag needs, except for the
+			// occasional probe
+			if(_flood_depth_learned && (_glossy_syncs_sent % GLOSSY_DEPTH_PROBE_SYNCS) >= 2){
+				_sync_pkt.max_depth = _flood_depth_seen + 1 + GLOSSY_DEPTH_MARGIN;
+				if(_sync_pkt.max_depth > GLOSSY_MAX_DEPTH)
+					_sync_pkt.max_depth = GLOSSY_MAX_DEPTH;
+			} else {
+				_sync_pkt.max_depth = GLOSSY_MAX_DEPTH;
+			}
+			_glossy_syncs_sent++;
+
 			send_sync(_last_time_sent);
 			_sending_sync = TRUE;
+			_sched->new_entries = 0;
 		}
 	} else {
+#ifdef GLOSSY_CLOCK_TRACKER
+		// The sync for this interval hasn't come (yet). Start the interval
+		// anyway if the clock model can still be trusted, taking turns in
+		// the schedule like the master does.
+		if(_lwb_valid && _lwb_counter == (GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US) &&
+		   _clock.valid && _lwb_intervals_coasted+1 < GLOSSY_CLOCK_MAX_INTERVALS){
+			_lwb_counter = 0;
+			_lwb_intervals_coasted++;
+			_lwb_interval++;
+			lwb_plan_interval();
+		}
+#endif
+
 		// Force ourselves into RX mode if we still haven't received any sync floods...
 		// TODO: This is a hack... :(
 		if((!_lwb_valid || (_lwb_counter > (GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US))) && ((_lwb_counter % 5) == 0)) {
@@ -188,13 +762,30 @@ void glossy_sync_task(){
 
 		else {
 			// Check to see if it's our turn to do a ranging event!
-			// LWB Slot 1: Contention slot
-			if(_lwb_counter == 1){
+			// LWB Slots 1-LWB_CONTENTION_SLOTS: Contention slots
+			if(_lwb_counter >= 1 && _lwb_counter < LWB_FIRST_RANGING_SLOT){
+				// Tags with a slot take turns telling the master which
+				// anchors they reach
+				if(_lwb_counter == 1 && _lwb_scheduled &&
+				   ((_lwb_interval + _lwb_timeslot) % LWB_ANCHOR_REPORT_INTERVALS) == 0){
+					_lwb_report_due = TRUE;
+					_lwb_req_backoff = ranval(&_prng_state) % LWB_CONTENTION_SLOTS;
+				}
+
+				// Don't cut off a schedule request flood from the last slot
+				// that's still being relayed
+				if(_lwb_counter > 1 && _glossy_currently_flooding)
+					return;
+
 				dw1000_update_channel(1);
 				dw1000_choose_antenna(0);
-				if((!_lwb_scheduled && _lwb_sched_en) || _sched_req_pkt.deschedule_flag){
+				if(lwb_contend()){
 					dwt_forcetrxoff();
 
+					_sched_req_pkt.report_flag = _lwb_scheduled;
+					memcpy(_sched_req_pkt.anchor_sig, _lwb_anchors_heard, LWB_ANCHOR_SIG_LEN);
+					memset(_lwb_anchors_heard, 0, sizeof(_lwb_anchors_heard));
+
 					uint16_t frame_len = sizeof(struct pp_sched_req_flood);
 					dwt_writetxfctrl(frame_len, 0);
 
@@ -208,7 +799,11 @@ void glossy_sync_task(){
 					_sched_req_pkt.turnaround_time = (uint64_t)(turnaround_time);
 					dw1000_choose_antenna(1);
 #else
-					uint32_t sched_req_time = (ranval(&_prng_state) % (uint32_t)(LWB_SLOT_US-2*GLOSSY_FLOOD_TIMESLOT_US)) + GLOSSY_FLOOD_TIMESLOT_US;
+					// Leave room for the flood to finish within the slot
+					uint32_t window_us = GLOSSY_FLOOD_TIMESLOT_US;
+					if(LWB_SLOT_US > (_flood_max_depth+2)*GLOSSY_FLOOD_TIMESLOT_US)
+						window_us = LWB_SLOT_US - (_flood_max_depth+1)*GLOSSY_FLOOD_TIMESLOT_US;
+					uint32_t sched_req_time = (ranval(&_prng_state) % window_us) + GLOSSY_FLOOD_TIMESLOT_US;
 					uint32_t delay_time = (dwt_readsystimestamphi32() + DW_DELAY_FROM_PKT_LEN(sizeof(struct pp_sched_req_flood)) + DW_DELAY_FROM_US(sched_req_time)) & 0xFFFFFFFE;
 #endif
 
@@ -218,16 +813,20 @@ void glossy_sync_task(){
 					dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
 					dwt_writetxdata(sizeof(struct pp_sched_req_flood), (uint8_t*) &_sched_req_pkt, 0);
 
+					if(_lwb_scheduled)
+						_lwb_report_due = FALSE;
+					else if(!_sched_req_pkt.deschedule_flag)
+						_lwb_req_sent = TRUE;
 					_sched_req_pkt.deschedule_flag = 0;
-				} else {
+				} else if(_lwb_counter == 1){
 					dwt_rxenable(0);
 				}
 
-			// LWB Slots 2-N-2: Ranging slots
-			} else if(_lwb_counter < (GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US - LWB_SLOTS_PER_RANGE)) {
+			// LWB Slots after those until N-2: Ranging slots
+			} else if(_lwb_counter < LWB_FIRST_RANGING_SLOT + LWB_RANGING_EVENTS*LWB_SLOTS_PER_RANGE) {
 				if(_lwb_schedule_callback && _lwb_scheduled && 
-				   (((_lwb_counter - 2)/LWB_SLOTS_PER_RANGE) % _lwb_num_timeslots == _lwb_mod_timeslot) && 
-				   ((_lwb_counter - 2) % LWB_SLOTS_PER_RANGE == 0)){
+				   ((_lwb_counter - LWB_FIRST_RANGING_SLOT) % LWB_SLOTS_PER_RANGE == 0) &&
+				   lwb_my_event((_lwb_counter - LWB_FIRST_RANGING_SLOT)/LWB_SLOTS_PER_RANGE)){
 					// Our scheduled timeslot!  Call the timeslot callback which will likely kick off a ranging event
 					_lwb_schedule_callback();
 				}
@@ -240,6 +839,10 @@ void glossy_sync_task(){
 				dw1000_update_channel(1);
 				dw1000_choose_antenna(0);
 				dwt_rxenable(0);
+#ifdef GLOSSY_CLOCK_TRACKER
+				if(_clock.valid)
+					lwb_align_boundary(glossy_clock_predict(&_clock, _lwb_intervals_coasted+1));
+#endif
 			}
 		}
 	}
@@ -249,16 +852,41 @@ void lwb_set_sched_request(bool sched_en){
 	_lwb_sched_en = sched_en;
 }
 
+// How often the tag wants to range, in 0.1 Hz. 0 is as often as the
+// schedule allows.
+void lwb_set_update_rate(uint8_t update_rate){
+	_lwb_update_rate = update_rate;
+	_sched_req_pkt.update_rate = update_rate;
+}
+
 void lwb_set_sched_callback(void (*callback)(void)){
 	_lwb_schedule_callback = callback;
 }
 
+// The tag reached this anchor in a ranging event. It goes in the next report
+// to the master.
+void lwb_note_anchor(const uint8_t* anchor_eui){
+	sched_set_bit(_lwb_anchors_heard, sched_anchor_bit(anchor_eui), TRUE);
+}
+
+// Folds the EUI bytes the schedule doesn't carry into one. Tags made in the
+// same batch differ in the lowest of these, so no two of those share it.
+uint8_t lwb_sched_check(const uint8_t* eui){
+	uint8_t check = 0;
+	for(int ii = LWB_SCHED_EUI_LEN; ii < EUI_LEN; ii++)
+		check ^= eui[ii];
+	return check;
+}
+
 void glossy_process_txcallback(){
 	if(_role == GLOSSY_MASTER && _sending_sync){
 		// Sync has sent, set the timer to send the next one at a later time
 		timer_reset(_glossy_timer, 0);
 		_lwb_counter = 0;
 		_sending_sync = FALSE;
+#ifdef GLOSSY_CLOCK_TRACKER
+		_lwb_boundary_lag = dw_time_diff((uint64_t)(dwt_readsystimestamphi32()) << 8, (uint64_t)(_last_time_sent) << 8);
+#endif
 	} else if(_role == GLOSSY_SLAVE){
 		if(_glossy_currently_flooding){
 			// We're flooding, keep doing it until the max depth!
@@ -267,7 +895,8 @@ void glossy_process_txcallback(){
 			_last_delay_time = delay_time;
 
 			_cur_glossy_depth++;
-			if (_cur_glossy_depth < GLOSSY_MAX_DEPTH){
+			_glossy_relays++;
+			if (_cur_glossy_depth < _flood_max_depth && _glossy_relays < GLOSSY_RELAY_COUNT){
 				dwt_forcetrxoff();
 				dwt_setrxaftertxdelay(LWB_SLOT_US);
 				dwt_setdelayedtrxtime(delay_time);
@@ -296,17 +925,22 @@ void send_sync(uint32_t delay_time){
 	dwt_writetxdata(sizeof(_sync_pkt), (uint8_t*) &_sync_pkt, 0);
 }
 
-#define CW_CAL_12PF ((3.494350-3.494173)/3.4944*1e6/30)
-#define CW_CAL_22PF ((3.494078-3.493998)/3.4944*1e6/30)
-#define CW_CAL_33PF ((3.493941-3.493891)/3.4944*1e6/30)
 int8_t clock_offset_to_trim_diff(double ppm_offset){
        return (int8_t) (floor(ppm_offset/CW_CAL_12PF + 0.5));
 }
 
-void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
+void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf, uint16_t len){
 	struct pp_sched_flood *in_glossy_sync = (struct pp_sched_flood *) buf;
 	struct pp_sched_req_flood *in_glossy_sched_req = (struct pp_sched_req_flood *) buf;
 
+	// A truncated frame would have us read (and relay) whatever was left in
+	// the buffer from the last packet
+	if(in_glossy_sync->message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ){
+		if(len < sizeof(struct pp_sched_req_flood)) return;
+	} else if(len < sizeof(struct pp_sched_flood)){
+		return;
+	}
+
 	// Due to frequent overflow in the decawave system time counter, we must keep a running total
 	// of the number of times it's overflown
 	if(dw_timestamp < _last_overall_timestamp)
@@ -335,25 +969,64 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 			dw1000_choose_antenna(1);
 			dwt_rxenable(0);
 #else
-			int ii, candidate_slot;
-			for(ii = 0; ii < MAX_SCHED_TAGS; ii++){
-				if(memcmp(_sched_euis[ii], in_glossy_sched_req->tag_sched_eui, EUI_LEN) == 0){
-					_sync_pkt.tag_sched_idx = ii;
-					candidate_slot = ii;
-					break;
-				} else if((_sync_pkt.tag_ranging_mask & ((uint64_t)(1) << ii)) == 0){
-					candidate_slot = ii;
-				}
+			int slot = sched_find(in_glossy_sched_req->tag_sched_eui);
+			uint8_t check = lwb_sched_check(in_glossy_sched_req->tag_sched_eui);
+
+			// Learn how far the floods have to go to reach every tag
+			if(!_flood_depth_learned || in_glossy_sched_req->sync_depth > _flood_depth_seen){
+				_flood_depth_seen = in_glossy_sched_req->sync_depth;
+				_flood_depth_learned = TRUE;
 			}
 
-			memcpy(_sched_euis[candidate_slot], in_glossy_sched_req->tag_sched_eui, EUI_LEN);
-			memcpy(_sync_pkt.tag_sched_eui, _sched_euis[candidate_slot], EUI_LEN);
-			if(in_glossy_sched_req->deschedule_flag)
-				_sync_pkt.tag_ranging_mask &= ~((uint64_t)(1) << candidate_slot);
-			else
-				_sync_pkt.tag_ranging_mask |= (uint64_t)(1) << candidate_slot;
-			_sync_pkt.tag_sched_idx = candidate_slot;
-			_tag_timeout[candidate_slot] = 0;
+			// Another tag with the same last two bytes of EUI has this
+			// slot. It keeps it; this one would answer to its schedule
+			// entries, so it doesn't get one until that tag is gone.
+			if(slot >= 0 && _sched->checks[slot] != check)
+				return;
+
+			if(in_glossy_sched_req->deschedule_flag){
+				if(slot >= 0)
+					sched_remove(slot);
+			} else {
+				int cur_zone = (slot >= 0) ? slot / LWB_ZONE_SLOTS : -1;
+				int zone = sched_pick_zone(in_glossy_sched_req->anchor_sig, cur_zone);
+				// A tag that only reported its anchors doesn't need to hear
+				// back unless it was moved
+				bool announce = !in_glossy_sched_req->report_flag || zone != cur_zone;
+
+				// The next sync can only answer so many requests. Tags that
+				// don't hear back back off and ask again.
+				if(announce && _sched->new_entries >= LWB_SCHED_DELTA_ENTRIES)
+					return;
+
+				if(slot < 0){
+					// No room in the schedule, the tag will have to ask again later
+					if(zone < 0)
+						return;
+					slot = sched_insert(in_glossy_sched_req->tag_sched_eui, check, zone);
+					if(slot < 0)
+						return;
+				} else if(zone != cur_zone){
+					// Over to the tags that reach the same anchors
+					slot = sched_move(slot, zone);
+				}
+
+				// The tag may ask for a different rate than it did before. If
+				// there's no room for another slower tag, it shares the
+				// events left over with the tags in class 0 instead.
+				sched_set_rate_class(_sync_pkt.tag_rate_classes, slot, sched_rate_class_for(in_glossy_sched_req->update_rate));
+				if(!sched_slow_fits())
+					sched_set_rate_class(_sync_pkt.tag_rate_classes, slot, 0);
+
+				for(int ii = 0; ii < LWB_ANCHOR_SIG_LEN; ii++)
+					_sched->zone_anchors[slot / LWB_ZONE_SLOTS][ii] |= in_glossy_sched_req->anchor_sig[ii];
+
+				// Announce it even if the tag had it already, since it must
+				// have missed hearing about it
+				if(announce)
+					sched_announce(slot);
+				_sched->tags[slot].timeout = 0;
+			}
 #endif
 		}
 
@@ -366,8 +1039,14 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 	else if(_role == GLOSSY_SLAVE){
 		if(in_glossy_sync->message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ){
 #ifndef GLOSSY_ANCHOR_SYNC_TEST
+			// Nodes that already finished this flood hear copies from further
+			// away. Relaying those too would keep the request going forever.
+			if(in_glossy_sched_req->header.seqNum+1 >= _flood_max_depth)
+				return;
+
 			// Increment depth counter
 			_cur_glossy_depth = ++in_glossy_sched_req->header.seqNum;
+			_glossy_relays = 0;
 			_glossy_currently_flooding = TRUE;
 
 			uint16_t frame_len = sizeof(struct pp_sched_req_flood);
@@ -386,75 +1065,128 @@ void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf){
 #endif
 		} else {
 			// First check to see if this sync packet contains a schedule update for this node
-			if(memcmp(in_glossy_sync->tag_sched_eui, _sched_req_pkt.tag_sched_eui, EUI_LEN) == 0){
-				_lwb_timeslot = in_glossy_sync->tag_sched_idx;
-				_lwb_scheduled = TRUE;
+			for(int ii = 0; ii < in_glossy_sync->num_sched_entries && ii < LWB_SCHED_DELTA_ENTRIES; ii++){
+				if(memcmp(in_glossy_sync->sched_entries[ii].tag_sched_eui, _sched_req_pkt.tag_sched_eui, LWB_SCHED_EUI_LEN) == 0 &&
+				   in_glossy_sync->sched_entries[ii].tag_sched_check == lwb_sched_check(_sched_req_pkt.tag_sched_eui)){
+					_lwb_timeslot = in_glossy_sync->sched_entries[ii].slot % MAX_SCHED_TAGS;
+					_lwb_scheduled = TRUE;
+				}
 			}
 			// Next, make sure the tag is still scheduled
-			if(_lwb_scheduled && ((in_glossy_sync->tag_ranging_mask & ((uint64_t)(1) << _lwb_timeslot)) == 0))
+			if(_lwb_scheduled && !sched_bit(in_glossy_sync->tag_ranging_mask, _lwb_timeslot))
 				_lwb_scheduled = FALSE;
-			_lwb_num_timeslots = uint64_count_ones(in_glossy_sync->tag_ranging_mask);
-			_lwb_mod_timeslot = uint64_count_ones(in_glossy_sync->tag_ranging_mask & (((uint64_t)(1) << _lwb_timeslot) - 1));
+			memcpy(_sync_pkt.tag_ranging_mask, in_glossy_sync->tag_ranging_mask, sizeof(_sync_pkt.tag_ranging_mask));
+			memcpy(_sync_pkt.tag_rate_classes, in_glossy_sync->tag_rate_classes, sizeof(_sync_pkt.tag_rate_classes));
+			memcpy(_sync_pkt.zone_colors, in_glossy_sync->zone_colors, sizeof(_sync_pkt.zone_colors));
+			_lwb_interval = in_glossy_sync->interval;
+			lwb_plan_interval();
+			lwb_req_answered();
 
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
 			_sched_req_pkt.sync_depth = in_glossy_sync->header.seqNum;
 #endif
 
+			bool new_sync = FALSE;
+			double clock_offset_ppm = 0;
+
+#ifdef GLOSSY_CLOCK_TRACKER
+			// The clock model knows which interval the sync belongs to, so it
+			// can be used even if the ones before it were missed
+			uint64_t sync_time = dw_timestamp - (_glossy_flood_timeslot_corrected_us * in_glossy_sync->header.seqNum);
+			switch(glossy_clock_update(&_clock, sync_time, in_glossy_sync->header.seqNum)){
+				case GLOSSY_CLOCK_UPDATED:
+					new_sync = TRUE;
+					clock_offset_ppm = glossy_clock_ppm(&_clock);
+					break;
+				case GLOSSY_CLOCK_RESTARTED:
+					// We lost sync :(
+					_currently_syncd = 0;
+					_lwb_intervals_coasted = 0;
+					break;
+				default:
+					// Another packet in the same flood, or one that doesn't
+					// fit the model
+					break;
+			}
+#else
 			if(_last_sync_timestamp + ((uint64_t)(DW_DELAY_FROM_US(GLOSSY_UPDATE_INTERVAL_US * 0.5)) << 8) < dw_timestamp){
 				if(_last_sync_timestamp + ((uint64_t)(DW_DELAY_FROM_US(GLOSSY_UPDATE_INTERVAL_US * 1.5)) << 8) > dw_timestamp){
 					// If we're between 0.5 to 1.0 times the update interval, we are now able to update our clock and perpetuate the flood!
 			
 					// Calculate the ppm offset from the last two received sync messages
-					double clock_offset_ppm = (((double)(dw_timestamp - 
-					                                     ((uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8)*(in_glossy_sync->header.seqNum) - 
-					                                     _last_sync_timestamp) / ((uint64_t)(GLOSSY_UPDATE_INTERVAL_DW) << 8)) - 1.0) * 1e6;
+					clock_offset_ppm = (((double)(dw_timestamp - 
+					                              ((uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8)*(in_glossy_sync->header.seqNum) - 
+					                              _last_sync_timestamp) / ((uint64_t)(GLOSSY_UPDATE_INTERVAL_DW) << 8)) - 1.0) * 1e6;
+					new_sync = TRUE;
+				} else {
+					// We lost sync :(
+					_currently_syncd = 0;
+				}
+			} else {
+				// We've just received a following packet in the flood
+				// This really shouldn't happen, but for now let's ignore it
+			}
+#endif
+
+			if(new_sync){
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
-					_sched_req_pkt.clock_offset_ppm = clock_offset_ppm;
+				_sched_req_pkt.clock_offset_ppm = clock_offset_ppm;
+#endif
+				
+				_clock_offset = (clock_offset_ppm/1e6)+1.0;
+				_glossy_flood_timeslot_corrected_us = (uint64_t)((double)((uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8)*_clock_offset);
+
+				// Great, we're still sync'd!
+				_last_sync_depth = in_glossy_sync->header.seqNum;
+				_sched_req_pkt.sync_depth = _last_sync_depth;
+				_currently_syncd = 1;
+
+				// Since we're sync'd, we should make sure to reset our LWB window timer
+				_lwb_counter = 0;
+				_lwb_valid = TRUE;
+				timer_reset(_glossy_timer, ((uint32_t)(in_glossy_sync->header.seqNum))*GLOSSY_FLOOD_TIMESLOT_US);
+#ifdef GLOSSY_CLOCK_TRACKER
+				_lwb_intervals_coasted = 0;
+				_lwb_boundary_lag = dw_time_diff(((uint64_t)(dwt_readsystimestamphi32()) << 8) - _glossy_flood_timeslot_corrected_us * in_glossy_sync->header.seqNum,
+				                                 glossy_clock_predict(&_clock, 0));
+#endif
+
+				// Update DW1000's crystal trim to account for observed PPM offset
+				_last_xtal_trim = _xtal_trim;
+				int8_t trim_diff = clock_offset_to_trim_diff(clock_offset_ppm);
+				_xtal_trim += trim_diff;
+				if(_xtal_trim < 1) _xtal_trim = 1;
+				else if(_xtal_trim > 31) _xtal_trim = 31;
+				dwt_xtaltrim(_xtal_trim);
+#ifdef GLOSSY_CLOCK_TRACKER
+				// A higher trim slows the crystal down
+				glossy_clock_trim(&_clock, -(_xtal_trim - _last_xtal_trim) * CW_CAL_12PF);
 #endif
-					
-					_clock_offset = (clock_offset_ppm/1e6)+1.0;
-					_glossy_flood_timeslot_corrected_us = (uint64_t)((double)((uint64_t)(DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8)*_clock_offset);
-
-					// Great, we're still sync'd!
-					_last_sync_depth = in_glossy_sync->header.seqNum;
-					_currently_syncd = 1;
-
-					// Since we're sync'd, we should make sure to reset our LWB window timer
-					_lwb_counter = 0;
-					_lwb_valid = TRUE;
-					timer_reset(_glossy_timer, ((uint32_t)(in_glossy_sync->header.seqNum))*GLOSSY_FLOOD_TIMESLOT_US);
-
-					// Update DW1000's crystal trim to account for observed PPM offset
-					_last_xtal_trim = _xtal_trim;
-					int8_t trim_diff = clock_offset_to_trim_diff(clock_offset_ppm);
-					_xtal_trim += trim_diff;
-					if(_xtal_trim < 1) _xtal_trim = 1;
-					else if(_xtal_trim > 31) _xtal_trim = 31;
-					dwt_xtaltrim(_xtal_trim);
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
-					_sched_req_pkt.xtal_trim = trim_diff;
-					// Sync is invalidated if the xtal trim has changed (this won't happen often)
-					if(_last_xtal_trim != _xtal_trim)
-						_sched_req_pkt.sync_depth = 0xFF;
+				_sched_req_pkt.xtal_trim = trim_diff;
+				// Sync is invalidated if the xtal trim has changed (this won't happen often)
+				if(_last_xtal_trim != _xtal_trim)
+					_sched_req_pkt.sync_depth = 0xFF;
 #endif
 
-					// Perpetuate the flood!
-					memcpy(&_sync_pkt, in_glossy_sync, sizeof(struct pp_sched_flood));
-					_cur_glossy_depth = ++_sync_pkt.header.seqNum;
+				// Perpetuate the flood, unless it has gone as far as the master wants
+				memcpy(&_sync_pkt, in_glossy_sync, sizeof(struct pp_sched_flood));
+				_cur_glossy_depth = ++_sync_pkt.header.seqNum;
+				_flood_max_depth = _sync_pkt.max_depth;
+				if(_flood_max_depth > GLOSSY_MAX_DEPTH)
+					_flood_max_depth = GLOSSY_MAX_DEPTH;
 
+				if(_cur_glossy_depth < _flood_max_depth){
 					uint32_t delay_time = (dw_timestamp >> 8) + (DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE);
 					delay_time &= 0xFFFFFFFE;
 					dwt_forcetrxoff();
 					send_sync(delay_time);
 
+					_glossy_relays = 0;
 					_glossy_currently_flooding = TRUE;
 				} else {
-					// We lost sync :(
-					_currently_syncd = 0;
+					dwt_rxenable(0);
 				}
-			} else {
-				// We've just received a following packet in the flood
-				// This really shouldn't happen, but for now let's ignore it
 			}
 			_last_sync_timestamp = dw_timestamp - (_glossy_flood_timeslot_corrected_us * in_glossy_sync->header.seqNum);
 		}
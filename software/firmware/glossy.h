@@ -8,9 +8,67 @@
 
 #define LWB_SLOTS_PER_RANGE       8
 
-#define MAX_SCHED_TAGS            10
+// Tags that can be in the schedule at once. When there are more of them
+// than ranging events in an interval they take turns across intervals.
+// Must be a power of two.
+#define MAX_SCHED_TAGS            128
 #define GLOSSY_MAX_DEPTH          10
-#define TAG_SCHED_TIMEOUT         60
+// How many times a node sends each flood packet it relays. Once the
+// concurrent copies have gone past it, sending more doesn't reach anyone new.
+#define GLOSSY_RELAY_COUNT        2
+// Extra hops the master lets floods go past the deepest node it has heard
+// from, so that nodes further out can still join
+#define GLOSSY_DEPTH_MARGIN       2
+// Every this many syncs, two in a row go the full GLOSSY_MAX_DEPTH anyway so
+// that tags further out than the master knows of can find the network
+#define GLOSSY_DEPTH_PROBE_SYNCS  16
+// Intervals before the master drops a tag it hasn't heard from. Tags that
+// have a slot report in every LWB_ANCHOR_REPORT_INTERVALS, so this only
+// drops the ones that went away.
+#define TAG_SCHED_TIMEOUT         600
+
+// How many of the latest slot assignments each sync packet repeats, so a
+// tag that misses one still learns its slot. This is also how many schedule
+// requests the master can answer in one interval.
+#define LWB_SCHED_DELTA_ENTRIES   8
+
+// Slots at the start of each interval where tags send schedule requests.
+// Ranging starts after them.
+#ifndef LWB_CONTENTION_SLOTS
+#define LWB_CONTENTION_SLOTS      4
+#endif
+// A tag whose request isn't answered in the next sync waits a random number
+// of contention slots before asking again, up to LWB_CONTENTION_SLOTS doubled
+// for every request that went unanswered, at most this many times.
+#define LWB_BACKOFF_MAX_EXP       2
+
+#if LWB_CONTENTION_SLOTS < 1
+#error "LWB needs at least one contention slot"
+#endif
+
+// Tags that range at the same time only get in each other's way if they
+// reach the same anchors. The schedule is split into this many zones of
+// LWB_ZONE_SLOTS slots each, and the master moves tags that reach the same
+// anchors into the same zone. Each zone gets a color, different from the
+// zones whose tags reach any of the same anchors. Zones of the same color
+// range at the same time, each taking turns among its own tags, and the
+// colors split the ranging events of each interval. Must be a power of two.
+#ifndef LWB_REUSE_ZONES
+#define LWB_REUSE_ZONES           8
+#endif
+#define LWB_ZONE_SLOTS            (MAX_SCHED_TAGS/LWB_REUSE_ZONES)
+#define LWB_COLOR_BITS            4
+
+#if LWB_REUSE_ZONES < 1 || LWB_REUSE_ZONES > (1 << LWB_COLOR_BITS) || (LWB_REUSE_ZONES & (LWB_REUSE_ZONES-1))
+#error "LWB_REUSE_ZONES has to be a power of two no bigger than 16"
+#endif
+
+// Tags tell the master which anchors they reached as a bit for each, hashed
+// from the anchor's EUI into this many bytes
+#define LWB_ANCHOR_SIG_LEN        8
+// Tags that have a slot report their anchors about this often. The master
+// forgets anchors nobody has reported for twice as long.
+#define LWB_ANCHOR_REPORT_INTERVALS 64
 
 #ifdef GLOSSY_PER_TEST
 #define GLOSSY_UPDATE_INTERVAL_US 1e4
@@ -20,19 +78,69 @@
 
 #define GLOSSY_FLOOD_TIMESLOT_US  1e3
 
+// The master sends a sync flood every this many intervals, and the slaves
+// start the intervals in between from their clock model. All nodes must
+// agree on this.
+#ifndef GLOSSY_SYNC_INTERVALS
+#define GLOSSY_SYNC_INTERVALS     1
+#endif
+
+#if GLOSSY_SYNC_INTERVALS > 1 && !defined(GLOSSY_CLOCK_TRACKER)
+#error "GLOSSY_SYNC_INTERVALS needs GLOSSY_CLOCK_TRACKER"
+#endif
+
 #define GLOSSY_UPDATE_INTERVAL_DW (DW_DELAY_FROM_US(GLOSSY_UPDATE_INTERVAL_US) & 0xFFFFFFFE)
 
+// Ranging events start every LWB_SLOTS_PER_RANGE slots after the contention
+// slots, with the last one ending before the final two slots of the interval.
+// glossy.c keeps them in 32 bit masks, so there can be at most 32.
+#define LWB_FIRST_RANGING_SLOT    (1 + LWB_CONTENTION_SLOTS)
+#define LWB_RANGING_EVENTS        ((uint32_t)((GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US - 2 - LWB_FIRST_RANGING_SLOT)/LWB_SLOTS_PER_RANGE))
+
+// Tags in rate class k range every 2^k intervals. Tags in class 0 also get
+// any ranging events the others leave over.
+#define LWB_RATE_CLASSES          4
+#define LWB_RATE_CLASS_BITS       2
+// Intervals after which the slower tags' turns repeat
+#define LWB_RATE_CYCLE            (1 << (LWB_RATE_CLASSES-1))
+// Most of the ranging events a zone gets in an interval that go to slower
+// tags, so that the ones in class 0 always get some
+#define LWB_SLOW_EVENTS(_events)  (((_events)*3)/4)
+
+// Tags are identified in the schedule by the last two bytes of their EUI and
+// a check byte folded from the rest of it. The master turns away a tag whose
+// two bytes match a scheduled tag's but whose check doesn't.
+#define LWB_SCHED_EUI_LEN         2
+
 typedef enum {
 	GLOSSY_SLAVE = 0,
 	GLOSSY_MASTER = 1
 } glossy_role_e;
 
+// A tag was given a slot
+struct pp_sched_entry {
+	uint8_t slot;
+	uint8_t tag_sched_eui[LWB_SCHED_EUI_LEN];
+	uint8_t tag_sched_check;
+} __attribute__ ((__packed__));
+
 struct pp_sched_flood {
 	struct ieee154_header_broadcast header;
 	uint8_t message_type;
-	uint64_t tag_ranging_mask;
-	uint8_t tag_sched_idx;
-	uint8_t tag_sched_eui[EUI_LEN];
+	// Floods stop at this depth
+	uint8_t max_depth;
+	// Which slots have a tag. A tag's place in the ranging order is how
+	// many slots before its own range in the same interval.
+	uint8_t tag_ranging_mask[MAX_SCHED_TAGS/8];
+	// Rate class of the tag in each slot
+	uint8_t tag_rate_classes[MAX_SCHED_TAGS*LWB_RATE_CLASS_BITS/8];
+	// Color of each zone, LWB_COLOR_BITS each
+	uint8_t zone_colors[(LWB_REUSE_ZONES*LWB_COLOR_BITS+7)/8];
+	// Counts intervals. It decides which slower tags range in this one and
+	// which tag gets its first ranging event.
+	uint16_t interval;
+	uint8_t num_sched_entries;
+	struct pp_sched_entry sched_entries[LWB_SCHED_DELTA_ENTRIES];
 	struct ieee154_footer footer;
 } __attribute__ ((__packed__));
 
@@ -40,22 +148,69 @@ struct pp_sched_req_flood {
 	struct ieee154_header_broadcast header;
 	uint8_t message_type;
 	uint8_t deschedule_flag;
+	// The tag already has a slot and is only reporting its anchors
+	uint8_t report_flag;
 	uint8_t tag_sched_eui[EUI_LEN];
+	// How often the tag wants to range, in 0.1 Hz. 0 is as often as it can.
+	uint8_t update_rate;
+	// Depth the tag heard the last sync at, which tells the master how far
+	// the floods have to go
+	uint8_t sync_depth;
+	// Anchors the tag reached since its last report
+	uint8_t anchor_sig[LWB_ANCHOR_SIG_LEN];
 #ifdef GLOSSY_ANCHOR_SYNC_TEST
 	uint64_t turnaround_time;
 	double clock_offset_ppm;
-	uint8_t sync_depth;
 	int8_t xtal_trim;
 #endif
 	struct ieee154_footer footer;
 } __attribute__ ((__packed__));
 
-void glossy_init(glossy_role_e role);
+// A sync has to fit in one 127 byte frame, and in the tag's and anchor's
+// rx_buf. Its size is pinned here so that a change growing it has to update
+// this, and check those buffers and the RAM budget in the README, as it goes.
+_Static_assert(sizeof(struct pp_sched_flood) <= 127, "Glossy sync is longer than a frame");
+_Static_assert(sizeof(struct pp_sched_flood) == 106, "Glossy sync changed size, update this and check the rx buffers");
+#ifndef GLOSSY_ANCHOR_SYNC_TEST
+_Static_assert(sizeof(struct pp_sched_req_flood) == 38, "Glossy sched request changed size, update this and check the rx buffers");
+#endif
+
+// The master's schedule. Tags are placed in a zone by a hash of their EUI,
+// and where they end up is their slot. Which slots are in use is kept in the
+// sync packet's tag_ranging_mask. Slots that held a tag that was removed are
+// marked in removed so lookups continue past them. Only the master needs
+// this, so it is kept in the anchor's scratchspace instead of in glossy.c.
+typedef struct {
+	uint8_t eui[LWB_SCHED_EUI_LEN];
+	uint16_t timeout;
+} glossy_sched_tag_t;
+
+typedef struct {
+	glossy_sched_tag_t tags[MAX_SCHED_TAGS];
+	// lwb_sched_check() of each tag's EUI, kept apart from tags so the
+	// byte doesn't cost another one of padding per slot
+	uint8_t checks[MAX_SCHED_TAGS];
+	uint8_t removed[MAX_SCHED_TAGS/8];
+	uint8_t num_tags;
+	uint8_t zone_tags[LWB_REUSE_ZONES];
+	// Anchors the tags in each zone reported since zone_anchors was last
+	// cleared, and in the period before that
+	uint8_t zone_anchors[LWB_REUSE_ZONES][LWB_ANCHOR_SIG_LEN];
+	uint8_t zone_anchors_last[LWB_REUSE_ZONES][LWB_ANCHOR_SIG_LEN];
+	// How many of the sched_entries haven't been sent in a sync yet. Those
+	// are the answers to this interval's schedule requests.
+	uint8_t new_entries;
+} glossy_sched_t;
+
+void glossy_init(glossy_role_e role, glossy_sched_t* sched);
 void glossy_deschedule();
 void glossy_sync_task();
 void lwb_set_sched_request(bool sched_en);
+void lwb_set_update_rate(uint8_t update_rate);
 void lwb_set_sched_callback(void (*callback)(void));
-void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf);
+void lwb_note_anchor(const uint8_t* anchor_eui);
+uint8_t lwb_sched_check(const uint8_t* eui);
+void glossy_sync_process(uint64_t dw_timestamp, uint8_t *buf, uint16_t len);
 void glossy_process_txcallback();
 
 #endif
@@ -0,0 +1,99 @@
+#include <math.h>
+
+#include "glossy_clock.h"
+
+#define NOMINAL_INTERVAL ((double)((uint64_t)(GLOSSY_UPDATE_INTERVAL_DW) << 8))
+#define PPM_TO_TICKS(_ppm) ((_ppm) * 1e-6 * NOMINAL_INTERVAL)
+
+static void restart(glossy_clock_t* clk, uint64_t sync_time){
+	clk->valid = TRUE;
+	clk->rejects = 0;
+	clk->intervals = 0;
+	clk->sync_time = sync_time;
+	clk->sync_frac = 0;
+	clk->interval = NOMINAL_INTERVAL;
+	clk->p00 = GLOSSY_CLOCK_RX_NOISE * GLOSSY_CLOCK_RX_NOISE;
+	clk->p01 = 0;
+	clk->p11 = PPM_TO_TICKS(GLOSSY_CLOCK_INITIAL_PPM) * PPM_TO_TICKS(GLOSSY_CLOCK_INITIAL_PPM);
+}
+
+void glossy_clock_init(glossy_clock_t* clk){
+	clk->valid = FALSE;
+}
+
+// Fold in the time a sync left the master (the RX timestamp less the hops it
+// was relayed over). depth is how many hops that was.
+glossy_clock_result_e glossy_clock_update(glossy_clock_t* clk, uint64_t sync_time, uint8_t depth){
+	if(!clk->valid){
+		restart(clk, sync_time);
+		return GLOSSY_CLOCK_RESTARTED;
+	}
+
+	// Which interval this sync belongs to
+	double meas = (double)(int64_t)(sync_time - clk->sync_time);
+	int64_t n = llround((meas - clk->sync_frac) / clk->interval);
+	if(n == 0)
+		return GLOSSY_CLOCK_SAME_SYNC;
+	if(n < 0 || n > GLOSSY_CLOCK_MAX_INTERVALS){
+		restart(clk, sync_time);
+		return GLOSSY_CLOCK_RESTARTED;
+	}
+
+	// Predict n intervals ahead. The interval length wanders a bit every
+	// interval and takes the sync time along with it.
+	double drift = PPM_TO_TICKS(GLOSSY_CLOCK_DRIFT_PPM);
+	double q = drift * drift * n;
+	double pred = clk->sync_frac + n * clk->interval;
+	double p00 = clk->p00 + 2 * n * clk->p01 + n * n * clk->p11 + q * n * n / 3;
+	double p01 = clk->p01 + n * clk->p11 + q * n / 2;
+	double p11 = clk->p11 + q;
+
+	double r = GLOSSY_CLOCK_RX_NOISE * GLOSSY_CLOCK_RX_NOISE + depth * GLOSSY_CLOCK_HOP_NOISE * GLOSSY_CLOCK_HOP_NOISE;
+	double s = p00 + r;
+	double y = meas - pred;
+	// Outside GLOSSY_CLOCK_GATE_SIGMA * sqrt(s) + GLOSSY_CLOCK_GATE_US, compared
+	// squared. sqrt() would set errno, which links in newlib's reentrancy
+	// struct and its RAM.
+	double excess = fabs(y) - GLOSSY_CLOCK_GATE_US * 1e-6 / DWT_TIME_UNITS;
+	if(excess > 0 && excess * excess > GLOSSY_CLOCK_GATE_SIGMA * GLOSSY_CLOCK_GATE_SIGMA * s){
+		if(++clk->rejects >= GLOSSY_CLOCK_MAX_REJECTS){
+			restart(clk, sync_time);
+			return GLOSSY_CLOCK_RESTARTED;
+		}
+		return GLOSSY_CLOCK_REJECTED;
+	}
+
+	double k0 = p00 / s;
+	double k1 = p01 / s;
+	double est = pred + k0 * y;
+	clk->interval += k1 * y;
+	clk->p00 = (1 - k0) * p00;
+	clk->p01 = (1 - k0) * p01;
+	clk->p11 = p11 - k1 * p01;
+
+	// Keep the fraction small so it doesn't lose precision
+	double whole = floor(est);
+	clk->sync_time += (int64_t)whole;
+	clk->sync_frac = est - whole;
+	clk->intervals = n;
+	clk->rejects = 0;
+	return GLOSSY_CLOCK_UPDATED;
+}
+
+// The crystal trim was changed, which should make the clock ppm faster
+void glossy_clock_trim(glossy_clock_t* clk, double ppm){
+	double change = PPM_TO_TICKS(ppm);
+	double uncertainty = change * GLOSSY_CLOCK_TRIM_UNCERTAINTY;
+	clk->interval += change;
+	clk->p11 += uncertainty * uncertainty;
+}
+
+// When the sync this many intervals after the last one was (or will be) sent
+uint64_t glossy_clock_predict(glossy_clock_t* clk, uint32_t intervals){
+	return clk->sync_time + llround(clk->sync_frac + intervals * clk->interval);
+}
+
+// How much faster than the master's the local clock is
+double glossy_clock_ppm(glossy_clock_t* clk){
+	return (clk->interval / NOMINAL_INTERVAL - 1.0) * 1e6;
+}
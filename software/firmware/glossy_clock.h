@@ -0,0 +1,79 @@
+#ifndef __GLOSSY_CLOCK_H
+#define __GLOSSY_CLOCK_H
+
+#include "glossy.h"
+
+/******************************************************************************/
+// Slave clock model
+/******************************************************************************/
+
+// A glossy slave tracks when, on its own DW1000 clock, each sync flood left
+// the master, with a two state Kalman filter: that time and how many local
+// ticks one GLOSSY_UPDATE_INTERVAL_US of the master's takes. The master sends
+// its syncs exactly GLOSSY_UPDATE_INTERVAL_DW apart, so the model can say when
+// a sync should have been sent even if it was never heard, and a slave can
+// keep following the LWB schedule across missed floods.
+//
+// All times are in DW time units, with the overflows glossy.c counts.
+
+// Most intervals the model predicts across. Past this the crystal may have
+// drifted further than the model allows for, and the 40 bit DW1000 clock
+// wraps every ~17 s.
+#define GLOSSY_CLOCK_MAX_INTERVALS     8
+
+#if GLOSSY_SYNC_INTERVALS >= GLOSSY_CLOCK_MAX_INTERVALS
+#error "GLOSSY_SYNC_INTERVALS is longer than the clock model can predict"
+#endif
+
+// How much the sync timestamp jitters, and how much more it does for every
+// hop it was relayed over. In DW time units (~15.65 ps).
+#define GLOSSY_CLOCK_RX_NOISE          64.0
+#define GLOSSY_CLOCK_HOP_NOISE         64.0
+
+// How far the crystal can wander in one interval, in ppm. This covers
+// temperature changes, so no temperature model is needed.
+#define GLOSSY_CLOCK_DRIFT_PPM         0.05
+
+// How far off the crystal can be before the first syncs, in ppm
+#define GLOSSY_CLOCK_INITIAL_PPM       40.0
+
+// How far off the model thinks the size of a crystal trim step can be
+#define GLOSSY_CLOCK_TRIM_UNCERTAINTY  0.3
+
+// A sync further from the prediction than this many standard deviations (plus
+// GLOSSY_CLOCK_GATE_US) is ignored. After GLOSSY_CLOCK_MAX_REJECTS of them in
+// a row the model starts over.
+#define GLOSSY_CLOCK_GATE_SIGMA        5.0
+#define GLOSSY_CLOCK_GATE_US           2.0
+#define GLOSSY_CLOCK_MAX_REJECTS       3
+
+// How many ppm one step of the DW1000 crystal trim moves the clock, measured
+// with different load capacitors
+#define CW_CAL_12PF ((3.494350-3.494173)/3.4944*1e6/30)
+#define CW_CAL_22PF ((3.494078-3.493998)/3.4944*1e6/30)
+#define CW_CAL_33PF ((3.493941-3.493891)/3.4944*1e6/30)
+
+typedef enum {
+	GLOSSY_CLOCK_SAME_SYNC,  // Another copy of the last sync flood
+	GLOSSY_CLOCK_RESTARTED,  // Nothing to compare this sync with, so the model starts from it
+	GLOSSY_CLOCK_REJECTED,   // Too far from where the model expected it
+	GLOSSY_CLOCK_UPDATED
+} glossy_clock_result_e;
+
+typedef struct {
+	bool valid;
+	uint8_t rejects;
+	uint8_t intervals;       // Intervals between the last two syncs used
+	uint64_t sync_time;      // Whole part of when the last sync was sent
+	double sync_frac;        // And the rest
+	double interval;         // Local ticks per master interval
+	double p00, p01, p11;    // Covariance of (sync time, interval)
+} glossy_clock_t;
+
+void glossy_clock_init(glossy_clock_t* clk);
+glossy_clock_result_e glossy_clock_update(glossy_clock_t* clk, uint64_t sync_time, uint8_t depth);
+void glossy_clock_trim(glossy_clock_t* clk, double ppm);
+uint64_t glossy_clock_predict(glossy_clock_t* clk, uint32_t intervals);
+double glossy_clock_ppm(glossy_clock_t* clk);
+
+#endif
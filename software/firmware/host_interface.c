@@ -9,9 +9,16 @@
 #include "host_interface.h"
 #include "dw1000.h"
 #include "oneway_common.h"
-
-#define BUFFER_SIZE 128
-uint8_t rxBuffer[BUFFER_SIZE];
+#include "oneway_tag.h"
+#include "timer.h"
+
+// The host's longest write is SET_LOCATION, at 13 bytes. Responses are
+// longer: READ_INTERRUPT sends its length and reason, then a range for every
+// anchor the tag heard.
+#define RX_BUFFER_SIZE 32
+#define BUFFER_SIZE (2 + ONEWAY_ANCHOR_IDS_RANGES_LEN)
+_Static_assert(sizeof(uint32_t)*(2 + 3*NUMBER_INTERRUPT_SOURCES) <= BUFFER_SIZE, "READ_EVENTS does not fit txBuffer");
+uint8_t rxBuffer[RX_BUFFER_SIZE];
 uint8_t txBuffer[BUFFER_SIZE];
 
 
@@ -21,9 +28,9 @@ CPAL_TransferTypeDef txStructure;
 
 // Just pre-set the INFO response packet.
 // Last byte is the version. Set to 1 for now
-uint8_t INFO_PKT[3] = {0xb0, 0x1a, 1};
+const uint8_t INFO_PKT[3] = {0xb0, 0x1a, 1};
 // If we are not ready.
-uint8_t NULL_PKT[3] = {0xaa, 0xaa, 0};
+const uint8_t NULL_PKT[3] = {0xaa, 0xaa, 0};
 
 // Keep track of why we interrupted the host
 interrupt_reason_e _interrupt_reason;
@@ -49,7 +56,7 @@ uint32_t host_interface_init () {
 
 	// Start CPAL communication configuration
 	// Initialize local Reception structures
-	rxStructure.wNumData = BUFFER_SIZE;   /* Maximum Number of data to be received */
+	rxStructure.wNumData = RX_BUFFER_SIZE; /* Maximum Number of data to be received */
 	rxStructure.pbBuffer = rxBuffer;      /* Common Rx buffer for all received data */
 	rxStructure.wAddr1 = 0;               /* Not needed */
 	rxStructure.wAddr2 = 0;               /* Not needed */
@@ -97,30 +104,34 @@ static void interrupt_host_clear () {
 	GPIO_WriteBit(INTERRUPT_PORT, INTERRUPT_PIN, Bit_RESET);
 }
 
-// Send to the tag the ranges.
-void host_interface_notify_ranges (uint8_t* anchor_ids_ranges, uint8_t len) {
-
-	// TODO: this should be in an atomic block
-
-	// Save the relevant state for when the host asks for it
-	_interrupt_reason = HOST_IFACE_INTERRUPT_RANGES;
-	_interrupt_buffer = anchor_ids_ranges;
+// Save the relevant state for when the host asks for it, and let the host
+// know it should ask.
+static void interrupt_host_notify (interrupt_reason_e reason, uint8_t* buffer, uint8_t len) {
+	// The I2C interrupt reads these when the host asks, so it must not see
+	// the new reason with the old buffer. This can be called with interrupts
+	// already off, so put back whatever was there.
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	_interrupt_reason = reason;
+	_interrupt_buffer = buffer;
 	_interrupt_buffer_len = len;
+	__set_PRIMASK(primask);
 
-	// Let the host know it should ask
 	interrupt_host_set();
 }
 
-void host_interface_notify_calibration (uint8_t* calibration_data, uint8_t len) {
-	// TODO: this should be in an atomic block
+// Send to the tag the ranges.
+void host_interface_notify_ranges (uint8_t* anchor_ids_ranges, uint8_t len) {
+	interrupt_host_notify(HOST_IFACE_INTERRUPT_RANGES, anchor_ids_ranges, len);
+}
 
-	// Save the relevant state for when the host asks for it
-	_interrupt_reason = HOST_IFACE_INTERRUPT_CALIBRATION;
-	_interrupt_buffer = calibration_data;
-	_interrupt_buffer_len = len;
+void host_interface_notify_calibration (uint8_t* calibration_data, uint8_t len) {
+	interrupt_host_notify(HOST_IFACE_INTERRUPT_CALIBRATION, calibration_data, len);
+}
 
-	// Let the host know it should ask
-	interrupt_host_set();
+// Send the tag's location to the host
+void host_interface_notify_location (uint8_t* location, uint8_t len) {
+	interrupt_host_notify(HOST_IFACE_INTERRUPT_LOCATION, location, len);
 }
 
 // Doesn't block, but waits for an I2C master to initiate a WRITE.
@@ -128,7 +139,7 @@ uint32_t host_interface_wait () {
 	uint32_t ret;
 
 	// Setup the buffer to receive the contents of the WRITE in
-	rxStructure.wNumData = BUFFER_SIZE;     // Maximum Number of data to be received
+	rxStructure.wNumData = RX_BUFFER_SIZE;  // Maximum Number of data to be received
 	rxStructure.pbBuffer = rxBuffer;        // Common Rx buffer for all received data
 
 	// Device is ready, not clear if this is needed
@@ -163,6 +174,11 @@ uint32_t host_interface_respond (uint8_t length) {
 	return ret;
 }
 
+// Whether the host is in the middle of a transfer with us
+bool host_interface_busy () {
+	return I2C_GetFlagStatus(I2C1, I2C_FLAG_BUSY) != RESET;
+}
+
 // Called when the I2C interface receives a WRITE message on the bus.
 // Based on what was received, either act or setup a response
 void host_interface_rx_fired () {
@@ -218,8 +234,11 @@ void host_interface_rx_fired () {
 
 				// Now that we know how we should operate,
 				// call the main tag function to get things rollin'.
-				polypoint_configure_app(my_app, &oneway_config);
-				polypoint_start();
+				// A config that can't be used is ignored, and whatever was
+				// running before keeps going.
+				if (polypoint_configure_app(my_app, &oneway_config)) {
+					polypoint_start();
+				}
 
 			} else if (my_app == APP_CALIBRATION) {
 				//// Run the calibration application to find the TX and RX
@@ -271,12 +290,31 @@ void host_interface_rx_fired () {
 			polypoint_start();
 			break;
 
+		/**********************************************************************/
+		// Tell an anchor where it is so it can pass that on to tags.
+		/**********************************************************************/
+		case HOST_CMD_SET_LOCATION: {
+			// Keep listening for the next command.
+			host_interface_wait();
+
+			// x, y, and z in millimeters, each a little endian int32
+			int32_t location_mm[3];
+			memcpy(location_mm, rxBuffer+1, sizeof(location_mm));
+			oneway_set_my_location(location_mm[0], location_mm[1], location_mm[2]);
+			break;
+		}
+
 		/**********************************************************************/
 		// These are handled from the interrupt context.
 		/**********************************************************************/
 		case HOST_CMD_INFO:
 		case HOST_CMD_READ_INTERRUPT:
 		case HOST_CMD_READ_CALIBRATION:
+		case HOST_CMD_READ_IDLE:
+		case HOST_CMD_READ_WAKEUP:
+		case HOST_CMD_READ_RX:
+		case HOST_CMD_READ_RANGING:
+		case HOST_CMD_READ_EVENTS:
 			break;
 
 
@@ -373,6 +411,92 @@ void CPAL_I2C_RXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct) {
 			break;
 		}
 
+		/**********************************************************************/
+		// Respond with how long we have been awake, asleep, and stopped
+		/**********************************************************************/
+		case HOST_CMD_READ_IDLE: {
+			const timer_idle_stats_t* stats = timer_idle_stats();
+			uint32_t idle[4];
+
+			idle[0] = stats->run_us / 1000;
+			idle[1] = stats->sleep_us / 1000;
+			idle[2] = stats->stop_us / 1000;
+			idle[3] = stats->stops;
+			memcpy(txBuffer, idle, sizeof(idle));
+			host_interface_respond(sizeof(idle));
+			break;
+		}
+
+		/**********************************************************************/
+		// Respond with how the DW1000 has been woken up
+		/**********************************************************************/
+		case HOST_CMD_READ_WAKEUP: {
+			const dw1000_wakeup_stats_t* stats = dw1000_wakeup_stats();
+			uint32_t wakeup[4];
+
+			wakeup[0] = stats->warm;
+			wakeup[1] = stats->full;
+			wakeup[2] = stats->last_tx_us;
+			wakeup[3] = stats->max_tx_us;
+			memcpy(txBuffer, wakeup, sizeof(wakeup));
+			host_interface_respond(sizeof(wakeup));
+			break;
+		}
+
+		/**********************************************************************/
+		// Respond with how received frames have fared
+		/**********************************************************************/
+		case HOST_CMD_READ_RX: {
+			const dw1000_rx_stats_t* stats = dw1000_rx_stats();
+			uint32_t rx[3];
+
+			rx[0] = stats->frames;
+			rx[1] = stats->overruns;
+			rx[2] = stats->swap_races;
+			memcpy(txBuffer, rx, sizeof(rx));
+			host_interface_respond(sizeof(rx));
+			break;
+		}
+
+		/**********************************************************************/
+		// Respond with how long the tag takes to calculate and report ranges
+		/**********************************************************************/
+		case HOST_CMD_READ_RANGING: {
+			const oneway_tag_stats_t* stats = oneway_tag_stats();
+			uint32_t ranging[5];
+
+			ranging[0] = stats->ranges;
+			ranging[1] = stats->last_range_cycles;
+			ranging[2] = stats->max_range_cycles;
+			ranging[3] = stats->last_report_us;
+			ranging[4] = stats->max_report_us;
+			memcpy(txBuffer, ranging, sizeof(ranging));
+			host_interface_respond(sizeof(ranging));
+			break;
+		}
+
+		/**********************************************************************/
+		// Respond with how long events waited in the main loop's queues
+		/**********************************************************************/
+		case HOST_CMD_READ_EVENTS: {
+			const event_stats_t* stats = event_stats();
+			uint32_t events[2 + 3*NUMBER_INTERRUPT_SOURCES];
+			uint16_t radio_dropped, host_dropped;
+			uint8_t i;
+
+			events_dropped(&radio_dropped, &host_dropped);
+			events[0] = radio_dropped;
+			events[1] = host_dropped;
+			for (i = 0; i < NUMBER_INTERRUPT_SOURCES; i++) {
+				events[2 + 3*i]     = stats[i].handled;
+				events[2 + 3*i + 1] = stats[i].max_latency_us;
+				events[2 + 3*i + 2] = stats[i].total_latency_us;
+			}
+			memcpy(txBuffer, events, sizeof(events));
+			host_interface_respond(sizeof(events));
+			break;
+		}
+
 		/**********************************************************************/
 		// All of the following do not require a response and can be handled
 		// on the main thread.
@@ -381,6 +505,7 @@ void CPAL_I2C_RXTC_UserCallback(CPAL_InitTypeDef* pDevInitStruct) {
 		case HOST_CMD_DO_RANGE:
 		case HOST_CMD_SLEEP:
 		case HOST_CMD_RESUME:
+		case HOST_CMD_SET_LOCATION:
 
 			// Just go back to waiting for a WRITE after a config message
 			host_interface_wait();
@@ -1,6 +1,8 @@
 #ifndef __HOST_INTERFACE_H
 #define __HOST_INTERFACE_H
 
+#include "system.h"
+
 // List of command byte opcodes for messages from the I2C master to us
 #define HOST_CMD_INFO             0x01
 #define HOST_CMD_CONFIG           0x02
@@ -10,6 +12,11 @@
 #define HOST_CMD_RESUME           0x06
 #define HOST_CMD_SET_LOCATION     0x07
 #define HOST_CMD_READ_CALIBRATION 0x08
+#define HOST_CMD_READ_IDLE        0x09
+#define HOST_CMD_READ_WAKEUP      0x0A
+#define HOST_CMD_READ_RX          0x0B
+#define HOST_CMD_READ_RANGING     0x0C
+#define HOST_CMD_READ_EVENTS      0x0D
 
 
 // Structs for parsing the messages for each command
@@ -31,14 +38,17 @@
 typedef enum {
 	HOST_IFACE_INTERRUPT_RANGES = 0x01,
 	HOST_IFACE_INTERRUPT_CALIBRATION = 0x02,
+	HOST_IFACE_INTERRUPT_LOCATION = 0x03,
 } interrupt_reason_e;
 
 
 uint32_t host_interface_init();
 uint32_t host_interface_wait ();
 uint32_t host_interface_respond (uint8_t length);
+bool     host_interface_busy ();
 void host_interface_notify_ranges (uint8_t* anchor_ids_ranges, uint8_t len);
 void host_interface_notify_calibration (uint8_t* calibration_data, uint8_t len);
+void host_interface_notify_location (uint8_t* location, uint8_t len);
 
 
 // Interrupt callbacks
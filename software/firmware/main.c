@@ -9,6 +9,7 @@
 
 #include "host_interface.h"
 #include "dw1000.h"
+#include "dw1000_spi.h"
 #include "oneway_common.h"
 #include "oneway_tag.h"
 #include "oneway_anchor.h"
@@ -20,10 +21,36 @@
 // OS state
 /******************************************************************************/
 
-// Array of interrupt sources. When an interrupt fires, this array gets marked
-// noting that the interrupt fired. The main thread then processes this array
-// to get all of the functions it should call.
-bool interrupts_triggered[NUMBER_INTERRUPT_SOURCES]  = {FALSE};
+// When an interrupt fires, it adds an event to one of these queues. The main
+// thread then takes them out in order and calls the function for each. The
+// DW1000 and the timers go in their own queue, which is always emptied before
+// an event from the host is handled.
+//
+// Interrupts of different priorities add to the same queue, and the M0 has no
+// LDREX/STREX, so adding masks interrupts for a moment. Only the main thread
+// takes events out, so it doesn't have to.
+//
+// EVENT_QUEUE_LEN has to be a power of two, since the indexes wrap at 256.
+// READ_EVENTS shows whether it is long enough: a queue that is too short
+// drops events. The sources and times are kept apart so the sources don't
+// get padded out to a word each.
+#define EVENT_QUEUE_LEN 8
+
+typedef struct {
+	uint8_t sources[EVENT_QUEUE_LEN];
+	uint32_t times_us[EVENT_QUEUE_LEN];
+	volatile uint8_t head;       // Where the next event goes
+	volatile uint8_t tail;       // The next event to handle
+	volatile uint32_t overflows; // Sources whose events didn't fit, one bit each
+	uint16_t dropped;            // How many events didn't fit
+} event_queue_t;
+
+static event_queue_t _radio_events;
+static event_queue_t _host_events;
+
+// How long events wait in the queues, by source. The host reads these and the
+// dropped counts with READ_EVENTS.
+static event_stats_t _event_stats[NUMBER_INTERRUPT_SOURCES];
 
 
 /******************************************************************************/
@@ -46,10 +73,116 @@ void start_dw1000 ();
 /******************************************************************************/
 
 // This gets called from interrupt context.
-// TODO: Changing interrupts_triggered should be in an atomic block as it is
-//       also read from the main loop on the main thread.
 void mark_interrupt (interrupt_source_e src) {
-	interrupts_triggered[src] = TRUE;
+	event_queue_t* q = (src == INTERRUPT_DW1000 || src == INTERRUPT_TIMER || src == INTERRUPT_DW1000_SPI) ?
+	                   &_radio_events : &_host_events;
+	uint32_t time_us = timer_now();
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	if ((uint8_t) (q->head - q->tail) < EVENT_QUEUE_LEN) {
+		q->sources[q->head % EVENT_QUEUE_LEN] = src;
+		q->times_us[q->head % EVENT_QUEUE_LEN] = time_us;
+		q->head++;
+	} else {
+		// No room. The main thread still handles this source once after
+		// the events that did fit, which is all the old flags did.
+		q->overflows |= 1 << src;
+		q->dropped++;
+	}
+	__set_PRIMASK(primask);
+}
+
+// Take the oldest event out of a queue. Sources that overflowed come after
+// the events that fit.
+static bool next_event (event_queue_t* q, interrupt_event_t* ev) {
+	if (q->head != q->tail) {
+		ev->source = q->sources[q->tail % EVENT_QUEUE_LEN];
+		ev->time_us = q->times_us[q->tail % EVENT_QUEUE_LEN];
+		q->tail++;
+		return TRUE;
+	}
+
+	if (q->overflows) {
+		uint32_t primask = __get_PRIMASK();
+		uint8_t src = 0;
+
+		__disable_irq();
+		while (!(q->overflows & (1 << src))) src++;
+		q->overflows &= ~(1 << src);
+		__set_PRIMASK(primask);
+
+		// How long it waited isn't known
+		ev->source = src;
+		ev->time_us = timer_now();
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+// Indexed by interrupt_source_e
+const event_stats_t* event_stats () {
+	return _event_stats;
+}
+
+void events_dropped (uint16_t* radio, uint16_t* host) {
+	*radio = _radio_events.dropped;
+	*host = _host_events.dropped;
+}
+
+static bool events_pending () {
+	return _radio_events.head != _radio_events.tail || _radio_events.overflows ||
+	       _host_events.head != _host_events.tail || _host_events.overflows;
+}
+
+static void handle_event (interrupt_event_t* ev) {
+	event_stats_t* stats = &_event_stats[ev->source];
+	uint32_t latency_us = timer_now() - ev->time_us;
+
+	stats->handled++;
+	stats->total_latency_us += latency_us;
+	if (latency_us > stats->max_latency_us) {
+		stats->max_latency_us = latency_us;
+	}
+
+	// Frames still being read came in before this event. Handle them first,
+	// like when they were read right away.
+	if (ev->source == INTERRUPT_TIMER || ev->source == INTERRUPT_DW1000) {
+		if (dw1000_spi_flush()) {
+			polypoint_reset();
+			return;
+		}
+	}
+
+	switch (ev->source) {
+		case INTERRUPT_TIMER:
+			timer_fired();
+			break;
+
+		case INTERRUPT_DW1000:
+			dw1000_interrupt_fired();
+			break;
+
+		case INTERRUPT_DW1000_SPI:
+			dw1000_spi_fired();
+			break;
+
+		case INTERRUPT_I2C_RX:
+			host_interface_rx_fired();
+			break;
+
+		case INTERRUPT_I2C_TX:
+			host_interface_tx_fired();
+			break;
+
+		case INTERRUPT_I2C_TIMEOUT:
+			host_interface_timeout_fired();
+			break;
+
+		default:
+			break;
+	}
 }
 
 static void error () {
@@ -70,9 +203,22 @@ union app_scratchspace {
 // If this is called while the application is stopped, it will not be
 // automatically started.
 // If this is called when the app is running, the app will be restarted.
-void polypoint_configure_app (polypoint_application_e app, void* app_config) {
+// Returns FALSE, and leaves the app as it was, if the app can't use
+// app_config.
+bool polypoint_configure_app (polypoint_application_e app, void* app_config) {
 	bool resume = FALSE;
 
+	switch (app) {
+		case APP_ONEWAY:
+			if (!oneway_config_ok((oneway_config_t*) app_config)) {
+				return FALSE;
+			}
+			break;
+
+		default:
+			break;
+	}
+
 	// Check if this application is running.
 	if (_state == APPSTATE_RUNNING) {
 		// Resume with new settings.
@@ -88,7 +234,7 @@ void polypoint_configure_app (polypoint_application_e app, void* app_config) {
 	_current_app = app;
 	switch (_current_app) {
 		case APP_ONEWAY:
-			oneway_configure((oneway_config_t*) app_config, NULL, (void*)&_app_scratchspace);
+			oneway_configure((oneway_config_t*) app_config, _app_timer, (void*)&_app_scratchspace);
 			break;
 
 		default:
@@ -100,6 +246,8 @@ void polypoint_configure_app (polypoint_application_e app, void* app_config) {
 	if (resume) {
 		polypoint_start();
 	}
+
+	return TRUE;
 }
 
 
@@ -155,7 +303,7 @@ void polypoint_reset () {
 	_state = APPSTATE_NOT_INITED;
 
 	// Stop the timer in case it was in use.
-	//timer_stop(_app_timer);
+	timer_stop(_app_timer);
 
 	// Init the dw1000, and loop until it works.
 	// start does a reset.
@@ -182,6 +330,48 @@ bool polypoint_ready () {
 	return _state != APPSTATE_NOT_INITED;
 }
 
+// Give the application a chance to do work that doesn't need to happen
+// right when an interrupt fires. Returns TRUE if it has more to do, in
+// which case we shouldn't go to sleep.
+static bool polypoint_background_work () {
+	if (_state != APPSTATE_RUNNING) {
+		return FALSE;
+	}
+
+	switch (_current_app) {
+		case APP_ONEWAY:
+			return oneway_background_work();
+
+		default:
+			return FALSE;
+	}
+}
+
+// Whether the MCU can go into stop mode while idle. The clocks take a while
+// to come back, which the timers plan for, but interrupts from the DW1000
+// are handled that much later.
+static bool polypoint_idle_stop_ok () {
+	// Stop mode would cut off a transfer the host is in the middle of, or
+	// the DMA to the DW1000
+	if (host_interface_busy() || dw1000_spi_busy()) {
+		return FALSE;
+	}
+
+	switch (_state) {
+		case APPSTATE_STOPPED:
+			return TRUE;
+
+		case APPSTATE_RUNNING:
+			if (_current_app == APP_ONEWAY) {
+				return oneway_idle_stop_ok();
+			}
+			return FALSE;
+
+		default:
+			return FALSE;
+	}
+}
+
 // Assuming we are a TAG, and we are in on-demand ranging mode, tell
 // the dw1000 algorithm to perform a range.
 void polypoint_tag_do_range () {
@@ -257,6 +447,7 @@ void start_dw1000 () {
 int main () {
 	uint32_t err;
 	bool interrupt_triggered = FALSE;
+	bool background_work_pending = FALSE;
 
 	// Enable PWR APB clock
 	// Not entirely sure why.
@@ -308,7 +499,7 @@ int main () {
 
 	// In case we need a timer, get one. This is used for things like periodic
 	// ranging events.
-	//_app_timer = timer_init();
+	_app_timer = timer_init();
 
 	// Next up do some preliminary setup of the DW1000. This mostly configures
 	// pins and hardware peripherals, as well as straightening out some
@@ -344,56 +535,43 @@ int main () {
 	// MAIN LOOP
 	while (1) {
 
-		PWR_EnterSleepMode(PWR_SLEEPEntry_WFI);
-		// PWR_EnterSTOPMode(PWR_Regulator_LowPower, PWR_STOPEntry_WFI);
+		// Only sleep if the application doesn't have anything left to do.
+		// With interrupts masked, an event can't be queued between checking
+		// and sleeping, but it still wakes us up.
+		if (!background_work_pending) {
+			__disable_irq();
+			if (!events_pending()) {
+				timer_idle(polypoint_idle_stop_ok());
+			}
+			__enable_irq();
+		}
 
 		GPIO_WriteBit(STM_GPIO3_PORT, STM_GPIO3_PIN, Bit_SET);
 		GPIO_WriteBit(STM_GPIO3_PORT, STM_GPIO3_PIN, Bit_RESET);
 
 		// When an interrupt fires we end up here.
-		// Check all of the interrupt "queues" and call the appropriate
-		// callbacks for all of the interrupts that have fired.
-		// Do this in a loop in case we get an interrupt during the
-		// checks.
+		// Handle all of the events the interrupts queued, the radio's
+		// before each one from the host. Do this in a loop in case we get
+		// an interrupt while handling them.
 		do {
+			interrupt_event_t ev;
 			interrupt_triggered = FALSE;
 
-			if (interrupts_triggered[INTERRUPT_TIMER_17] == TRUE) {
-				interrupts_triggered[INTERRUPT_TIMER_17] = FALSE;
-				interrupt_triggered = TRUE;
-				timer_17_fired();
-			}
-
-			if (interrupts_triggered[INTERRUPT_TIMER_16] == TRUE) {
-				interrupts_triggered[INTERRUPT_TIMER_16] = FALSE;
+			while (next_event(&_radio_events, &ev)) {
 				interrupt_triggered = TRUE;
-				timer_16_fired();
+				handle_event(&ev);
 			}
 
-			if (interrupts_triggered[INTERRUPT_DW1000] == TRUE) {
-				interrupts_triggered[INTERRUPT_DW1000] = FALSE;
+			if (next_event(&_host_events, &ev)) {
 				interrupt_triggered = TRUE;
-				dw1000_interrupt_fired();
-			}
-
-			if (interrupts_triggered[INTERRUPT_I2C_RX] == TRUE) {
-				interrupts_triggered[INTERRUPT_I2C_RX] = FALSE;
-				interrupt_triggered = TRUE;
-				host_interface_rx_fired();
-			}
-
-			if (interrupts_triggered[INTERRUPT_I2C_TX] == TRUE) {
-				interrupts_triggered[INTERRUPT_I2C_TX] = FALSE;
-				interrupt_triggered = TRUE;
-				host_interface_tx_fired();
-			}
-
-			if (interrupts_triggered[INTERRUPT_I2C_TIMEOUT] == TRUE) {
-				interrupts_triggered[INTERRUPT_I2C_TIMEOUT] = FALSE;
-				interrupt_triggered = TRUE;
-				host_interface_timeout_fired();
+				handle_event(&ev);
 			}
 		} while (interrupt_triggered == TRUE);
+
+		// Now that all of the interrupts have been handled, do a small
+		// piece of any background work. We loop back around to check for
+		// interrupts again before doing more.
+		background_work_pending = polypoint_background_work();
 	}
 
 	return 0;
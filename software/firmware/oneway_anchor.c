@@ -11,9 +11,20 @@
 #include "delay.h"
 #include "firmware.h"
 
+_Static_assert(sizeof(struct pp_tag_poll) <= ONEWAY_ANCHOR_MAX_RX_PKT_LEN, "TAG_POLL does not fit rx_buf");
+_Static_assert(sizeof(struct pp_sched_flood) <= ONEWAY_ANCHOR_MAX_RX_PKT_LEN, "Glossy sync does not fit rx_buf");
+_Static_assert(sizeof(struct pp_sched_req_flood) <= ONEWAY_ANCHOR_MAX_RX_PKT_LEN, "Glossy sched request does not fit rx_buf");
+
 static void ranging_listening_window_setup();
+static void record_poll (struct pp_tag_poll* rx_poll_pkt, uint64_t toa);
+#ifdef ONEWAY_ANCHOR_RANGING
+static void record_tag_poll (struct pp_tag_poll* rx_poll_pkt, uint8_t subsequence, uint64_t toa);
+static void prepare_anc_final_range ();
+#endif
 static void anchor_txcallback (const dwt_callback_data_t *txd);
 static void anchor_rxcallback (const dwt_callback_data_t *rxd);
+static uint16_t anchor_rx_filter (const uint8_t* head, uint16_t head_len, uint16_t len);
+static void anchor_rx_frame (uint64_t dw_rx_timestamp, uint8_t* buf, uint16_t len);
 
 
 void oneway_anchor_init (void *app_scratchspace) {
@@ -59,15 +70,25 @@ void oneway_anchor_init (void *app_scratchspace) {
 	// dwt_seteui(eui_array);
 	// dwt_setpanid(POLYPOINT_PANID);
 
-	// Automatically go back to receive
+	// Automatically go back to receive. With ONEWAY_ANCHOR_RX_DOUBLE_BUFFER
+	// also keep receiving into the other half of the RX buffer while a frame
+	// is read. Polls come a broadcast period apart with a channel change in
+	// between, and flood copies a timeslot apart, so mostly that makes no
+	// difference. Only a request flood deeper than a contention slot, which
+	// runs into the first polls of the next ranging event, gets more of the
+	// event heard with it (see rxbuf_sim).
 	dwt_setautorxreenable(TRUE);
+#ifdef ONEWAY_ANCHOR_RX_DOUBLE_BUFFER
+	dw1000_rx_double_buffer(TRUE);
+#else
+	dw1000_rx_double_buffer(FALSE);
+#endif
 
-	// Don't use these
-	dwt_setdblrxbuffmode(FALSE);
+	// Don't use this
 	dwt_setrxtimeout(FALSE);
 
 	// Load our EUI into the outgoing packet
-	dw1000_read_eui(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.sourceAddr);
+	memcpy(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.sourceAddr, eui_array, EUI_LEN);
 
 	// Need a timer
 	if (oa_scratch->anchor_timer == NULL) {
@@ -181,9 +202,20 @@ static void ranging_listening_window_task () {
 			// Prepare the outgoing packet to send back to the
 			// tag with our TOAs.
 			oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.seqNum = ranval(&(oa_scratch->prng_state)) & 0xFF;
-			const uint16_t frame_len = sizeof(struct pp_anc_final);
-			// const uint16_t frame_len = sizeof(struct pp_anc_final) - (sizeof(uint64_t)*NUM_RANGING_BROADCASTS);
-			dwt_writetxfctrl(frame_len, 0);
+
+			// Let the tag know where we are, if the host has told us
+			memcpy(&(oa_scratch->pp_anc_final_pkt.anchor_location), oneway_get_my_location(), sizeof(struct pp_anchor_location));
+
+#if defined(ONEWAY_ANCHOR_RANGING)
+			uint16_t frame_len = sizeof(struct pp_anc_final_range);
+#elif defined(ONEWAY_COMPACT_ANC_FINAL)
+			// We don't know if the timestamps can be delta coded until we
+			// know when the packet goes out, so plan for the longest it
+			// could be.
+			uint16_t frame_len = oneway_anc_final_compact_max_len(&(oa_scratch->pp_anc_final_pkt));
+#else
+			uint16_t frame_len = sizeof(struct pp_anc_final);
+#endif
 	
 			// Pick a slot to respond in. Generate a random number and mod it
 			// by the number of slots
@@ -206,13 +238,26 @@ static void ranging_listening_window_task () {
 			// Record the outgoing time in the packet. Do not take calibration into
 			// account here, as that is done on all of the RX timestamps.
 			oa_scratch->pp_anc_final_pkt.dw_time_sent = (((uint64_t) delay_time) << 8) + dw1000_gettimestampoverflow() + oneway_get_txdelay_from_ranging_listening_window(oa_scratch->ranging_listening_window_num);
+
+#if defined(ONEWAY_ANCHOR_RANGING)
+			// The result depends on which broadcast matches this window
+			prepare_anc_final_range();
+			uint8_t* frame = (uint8_t*) &(oa_scratch->pp_anc_final_range_pkt);
+#elif defined(ONEWAY_COMPACT_ANC_FINAL)
+			// Now that everything is known, pack the response
+			frame_len = oneway_anc_final_compact_encode(&(oa_scratch->pp_anc_final_pkt), &(oa_scratch->pp_anc_final_compact_pkt));
+			uint8_t* frame = (uint8_t*) &(oa_scratch->pp_anc_final_compact_pkt);
+#else
+			uint8_t* frame = (uint8_t*) &(oa_scratch->pp_anc_final_pkt);
+#endif
+			dwt_writetxfctrl(frame_len, 0);
 	
 			// Send the response packet
 			// TODO: handle if starttx errors. I'm not sure what to do about it,
 			//       other than just wait for the next slot.
 			dwt_starttx(DWT_START_TX_DELAYED | DWT_RESPONSE_EXPECTED);
 			dwt_settxantennadelay(DW1000_ANTENNA_DELAY_TX);
-			dwt_writetxdata(frame_len, (uint8_t*) &(oa_scratch->pp_anc_final_pkt), 0);
+			dwt_writetxdata(frame_len, frame, 0);
 		}
 
 		oa_scratch->ranging_listening_window_num++;
@@ -246,6 +291,14 @@ static void ranging_listening_window_setup () {
 	}
 	oa_scratch->pp_anc_final_pkt.final_antenna = max_index;
 
+#ifdef ONEWAY_ANCHOR_RANGING
+	// Do our part of the range calculation. This is the same for every
+	// window, so it only has to be done once.
+	oneway_anchor_calculate_range(oa_scratch->tag_poll_TOAs,
+	                              oa_scratch->tag_poll_send_times,
+	                              &(oa_scratch->range_result));
+#endif
+
 	// Now we need to setup a timer to iterate through
 	// the response windows so we can send a packet
 	// back to the tag
@@ -254,6 +307,83 @@ static void ranging_listening_window_setup () {
 	            ranging_listening_window_task);
 }
 
+// Save the TOA of a broadcast from the tag we are ranging with. This must
+// have been sent with the settings we are listening with. toa already has
+// the RX delay taken out.
+static void record_poll (struct pp_tag_poll* rx_poll_pkt, uint64_t toa) {
+	uint8_t subsequence = rx_poll_pkt->subsequence;
+
+	oa_scratch->pp_anc_final_pkt.TOAs[subsequence] = toa & 0xFFFF;
+	oa_scratch->pp_anc_final_pkt.last_rxd_toa = toa;
+	oa_scratch->pp_anc_final_pkt.last_rxd_idx = subsequence;
+#ifdef ONEWAY_ANCHOR_RANGING
+	record_tag_poll(rx_poll_pkt, subsequence, toa);
+#endif
+
+	// Update the statistics we keep about which antenna
+	// receives the most packets from the tag
+	uint8_t recv_antenna_index = oneway_subsequence_number_to_antenna(ANCHOR, subsequence);
+	oa_scratch->anchor_antenna_recv_num[recv_antenna_index]++;
+}
+
+#ifdef ONEWAY_ANCHOR_RANGING
+// Keep the full TOA of a tag broadcast and when the tag sent it. The send
+// time in the packet is only 40 bits, so it is put back together relative
+// to the first broadcast we got from this tag.
+static void record_tag_poll (struct pp_tag_poll* rx_poll_pkt, uint8_t subsequence, uint64_t toa) {
+	uint64_t send_time = 0;
+	memcpy(&send_time, rx_poll_pkt->dw_time_sent, sizeof(rx_poll_pkt->dw_time_sent));
+
+	uint8_t first_idx = oa_scratch->pp_anc_final_pkt.first_rxd_idx;
+	if (subsequence != first_idx) {
+		uint64_t first_send_time = oa_scratch->tag_poll_send_times[first_idx];
+		send_time = first_send_time + ((send_time - first_send_time) & 0xFFFFFFFFFFULL);
+	}
+
+	oa_scratch->tag_poll_TOAs[subsequence] = toa;
+	oa_scratch->tag_poll_send_times[subsequence] = send_time;
+}
+
+// Fill in the short response for the current listening window. Needs
+// dw_time_sent in pp_anc_final_pkt to already be set.
+static void prepare_anc_final_range () {
+	struct pp_anc_final_range* anc_final = &(oa_scratch->pp_anc_final_range_pkt);
+
+	memcpy(&(anc_final->ieee154_header_unicast), &(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast), sizeof(struct ieee154_header_unicast));
+	anc_final->message_type   = MSG_TYPE_PP_NOSLOTS_ANC_FINAL_RANGE;
+	anc_final->final_antenna  = oa_scratch->pp_anc_final_pkt.final_antenna;
+	memcpy(&(anc_final->anchor_location), &(oa_scratch->pp_anc_final_pkt.anchor_location), sizeof(struct pp_anchor_location));
+	anc_final->num_ranges     = 0;
+	anc_final->clock_offset   = 0;
+	anc_final->tof_percentile = 0;
+	anc_final->reply_delay    = 0;
+
+	if (oa_scratch->range_result.num_ranges == 0) {
+		// No clock offset, so there is nothing to tell the tag
+		return;
+	}
+
+	// The tag uses the broadcast sent with the same settings as this window
+	uint8_t ss_index_matching = oneway_get_ss_index_from_settings(oa_scratch->pp_anc_final_pkt.final_antenna,
+	                                                              oa_scratch->ranging_listening_window_num);
+	oneway_tof_t tof_percentile;
+	if (!oneway_anchor_range_tof_percentile(&(oa_scratch->range_result),
+	                                        oa_scratch->tag_poll_TOAs,
+	                                        oa_scratch->tag_poll_send_times,
+	                                        ss_index_matching,
+	                                        &tof_percentile)) {
+		return;
+	}
+	if (tof_percentile > INT32_MAX || tof_percentile < INT32_MIN) {
+		return;
+	}
+
+	anc_final->num_ranges     = oa_scratch->range_result.num_ranges;
+	anc_final->clock_offset   = oa_scratch->range_result.offset;
+	anc_final->tof_percentile = tof_percentile;
+	anc_final->reply_delay    = oa_scratch->pp_anc_final_pkt.dw_time_sent - oa_scratch->tag_poll_TOAs[ss_index_matching];
+}
+#endif
 
 // Called after a packet is transmitted. We don't need this so it is
 // just empty.
@@ -261,11 +391,147 @@ static void anchor_txcallback (const dwt_callback_data_t *txd) {
 	glossy_process_txcallback();
 }
 
+// A whole TAG_POLL comes in with the first read, so polls don't need a
+// second one
+#define ANCHOR_RX_HEAD_LEN sizeof(struct pp_tag_poll)
+
+// Decides from the first ANCHOR_RX_HEAD_LEN bytes of a packet whether to read
+// the rest. Anything but polls and Glossy packets, like other anchors'
+// ANC_FINALs, is dropped by anchor_rx_frame() from the message type alone.
+static uint16_t anchor_rx_filter (const uint8_t* head, uint16_t head_len, uint16_t len) {
+	uint8_t message_type = head[offsetof(struct pp_tag_poll, message_type)];
+
+	if (message_type == MSG_TYPE_PP_NOSLOTS_TAG_POLL ||
+	    message_type == MSG_TYPE_PP_GLOSSY_SYNC ||
+	    message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ) {
+		return len;
+	}
+	return head_len;
+}
+
+// Called from the main loop with a packet the anchor received, once it has
+// been read from the DW1000.
+static void anchor_rx_frame (uint64_t dw_rx_timestamp, uint8_t* buf, uint16_t len) {
+	uint8_t message_type;
+
+	// We process based on the first byte in the packet. How very active
+	// message like...
+	message_type = buf[offsetof(struct pp_tag_poll, message_type)];
+
+	if (message_type == MSG_TYPE_PP_NOSLOTS_TAG_POLL) {
+		// This is one of the broadcast ranging packets from the tag
+		struct pp_tag_poll* rx_poll_pkt = (struct pp_tag_poll*) buf;
+
+		// Record the timestamp. Need to subtract off the TX+RX delay from each recorded
+		// timestamp.
+		uint64_t toa = dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, rx_poll_pkt->subsequence);
+
+		// Decide what to do with this packet
+		if (oa_scratch->state == ASTATE_IDLE) {
+			// We are currently not ranging with any tags.
+
+			if (rx_poll_pkt->subsequence < NUM_RANGING_CHANNELS) {
+				// We are idle and this is one of the first packets
+				// that the tag sent. Start listening for this tag's
+				// ranging broadcast packets.
+				oa_scratch->state = ASTATE_RANGING;
+
+				// Clear memory for this new tag ranging event
+				memset(oa_scratch->pp_anc_final_pkt.TOAs, 0, sizeof(oa_scratch->pp_anc_final_pkt.TOAs));
+				memset(oa_scratch->anchor_antenna_recv_num, 0, sizeof(oa_scratch->anchor_antenna_recv_num));
+#ifdef ONEWAY_ANCHOR_RANGING
+				memset(oa_scratch->tag_poll_TOAs, 0, sizeof(oa_scratch->tag_poll_TOAs));
+				memset(oa_scratch->tag_poll_send_times, 0, sizeof(oa_scratch->tag_poll_send_times));
+#endif
+
+				// Record the EUI of the tag so that we don't get mixed up
+				memcpy(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.destAddr, rx_poll_pkt->header.sourceAddr, EUI_LEN);
+				// Record which ranging subsequence the tag is on
+				oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
+				// This is the first broadcast we got from this tag, and
+				// until we hear another one, also the last
+				oa_scratch->pp_anc_final_pkt.first_rxd_toa = toa;
+				oa_scratch->pp_anc_final_pkt.first_rxd_idx = rx_poll_pkt->subsequence;
+				record_poll(rx_poll_pkt, toa);
+
+				// Also record parameters the tag has sent us about how to respond
+				// (or other operational parameters).
+				oa_scratch->ranging_operation_config.reply_after_subsequence = rx_poll_pkt->reply_after_subsequence;
+				oa_scratch->ranging_operation_config.anchor_reply_window_in_us = rx_poll_pkt->anchor_reply_window_in_us;
+				oa_scratch->ranging_operation_config.anchor_reply_slot_time_in_us = rx_poll_pkt->anchor_reply_slot_time_in_us;
+
+				// Now we need to start our own state machine to iterate
+				// through the antenna / channel combinations while listening
+				// for packets from the same tag.
+				timer_start(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US, ranging_broadcast_subsequence_task);
+
+			} else {
+				// We found this tag ranging sequence late. We don't want
+				// to use this because we won't get enough range estimates.
+				// Just stay idle, but with a single RX buffer we do need to
+				// re-enable RX to keep receiving packets.
+#ifndef ONEWAY_ANCHOR_RX_DOUBLE_BUFFER
+				dwt_rxenable(0);
+#endif
+			}
+
+		} else if (oa_scratch->state == ASTATE_RANGING) {
+			// We are currently ranging with a tag, waiting for the various
+			// ranging broadcast packets.
+
+			// First check if this is from the same tag
+			if (memcmp(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.destAddr, rx_poll_pkt->header.sourceAddr, EUI_LEN) == 0) {
+				// Same tag
+
+				// The tag can end the sequence early, and it puts where
+				// it ends in every broadcast.
+				oa_scratch->ranging_operation_config.reply_after_subsequence = rx_poll_pkt->reply_after_subsequence;
+
+				if (rx_poll_pkt->subsequence == oa_scratch->ranging_broadcast_ss_num) {
+					// This is the packet we were expecting from the tag.
+					// Record the TOA, and adjust it with the calibration value.
+					record_poll(rx_poll_pkt, toa);
+
+				} else {
+					// Some how we got out of sync with the tag. Ignore the
+					// range and catch up.
+					oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
+				}
+
+				// Regardless, it's a good idea to immediately call the subsequence task and restart the timer
+				timer_reset(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US-120); // Magic number calculated from timing
+				//ranging_broadcast_subsequence_task();
+				//timer_reset(oa_scratch->anchor_timer, 0);
+
+				//// Check to see if we got the last of the ranging broadcasts
+				//if (oa_scratch->ranging_broadcast_ss_num == oa_scratch->ranging_operation_config.reply_after_subsequence) {
+				//	// We did!
+				//	ranging_listening_window_setup();
+				//}
+
+			} else {
+				// Not the tag we are ranging with, ignore
+			}
+		} else {
+			// We are in some other state, not sure what that means
+		}
+
+	} else {
+		// With a single RX buffer we do want to enter RX mode again. With
+		// the double buffer the receiver stayed on by itself, and turning it
+		// on again would throw away a frame already in the other half.
+#ifndef ONEWAY_ANCHOR_RX_DOUBLE_BUFFER
+		dwt_rxenable(0);
+#endif
+		// Other message types go here, if they get added
+		if(message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ)
+			glossy_sync_process(dw_rx_timestamp-oneway_get_rxdelay_from_subsequence(ANCHOR, 0), buf, len);
+	}
+}
+
 // Called when the radio has received a packet.
 static void anchor_rxcallback (const dwt_callback_data_t *rxd) {
 
-	timer_disable_interrupt(oa_scratch->anchor_timer);
-
 	if (rxd->event == DWT_SIG_RX_OKAY) {
 
 		// First check to see if this is an acknowledgement...
@@ -278,126 +544,10 @@ static void anchor_rxcallback (const dwt_callback_data_t *rxd) {
 			if(cur_seq_num == oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.seqNum)
 				oa_scratch->final_ack_received = TRUE;
 		} else {
-
-			// Read in parameters of this packet reception
-			uint8_t  buf[ONEWAY_ANCHOR_MAX_RX_PKT_LEN];
-			uint64_t dw_rx_timestamp;
-			uint8_t  message_type;
-
-			// Get the received time of this packet first
-			dw_rx_timestamp = dw1000_readrxtimestamp();
-
-			// Get the actual packet bytes
-			dwt_readrxdata(buf, MIN(ONEWAY_ANCHOR_MAX_RX_PKT_LEN, rxd->datalength), 0);
-
-			// We process based on the first byte in the packet. How very active
-			// message like...
-			message_type = buf[offsetof(struct pp_tag_poll, message_type)];
-
-			if (message_type == MSG_TYPE_PP_NOSLOTS_TAG_POLL) {
-				// This is one of the broadcast ranging packets from the tag
-				struct pp_tag_poll* rx_poll_pkt = (struct pp_tag_poll*) buf;
-
-				// Decide what to do with this packet
-				if (oa_scratch->state == ASTATE_IDLE) {
-					// We are currently not ranging with any tags.
-
-					if (rx_poll_pkt->subsequence < NUM_RANGING_CHANNELS) {
-						// We are idle and this is one of the first packets
-						// that the tag sent. Start listening for this tag's
-						// ranging broadcast packets.
-						oa_scratch->state = ASTATE_RANGING;
-
-						// Clear memory for this new tag ranging event
-						memset(oa_scratch->pp_anc_final_pkt.TOAs, 0, sizeof(oa_scratch->pp_anc_final_pkt.TOAs));
-						memset(oa_scratch->anchor_antenna_recv_num, 0, sizeof(oa_scratch->anchor_antenna_recv_num));
-
-						// Record the EUI of the tag so that we don't get mixed up
-						memcpy(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.destAddr, rx_poll_pkt->header.sourceAddr, 8);
-						// Record which ranging subsequence the tag is on
-						oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
-						// Record the timestamp. Need to subtract off the TX+RX delay from each recorded
-						// timestamp.
-						oa_scratch->pp_anc_final_pkt.first_rxd_toa = dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num);
-						oa_scratch->pp_anc_final_pkt.first_rxd_idx = oa_scratch->ranging_broadcast_ss_num;
-						oa_scratch->pp_anc_final_pkt.TOAs[oa_scratch->ranging_broadcast_ss_num] =
-							(dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num)) & 0xFFFF;
-						// Also record parameters the tag has sent us about how to respond
-						// (or other operational parameters).
-						oa_scratch->ranging_operation_config.reply_after_subsequence = rx_poll_pkt->reply_after_subsequence;
-						oa_scratch->ranging_operation_config.anchor_reply_window_in_us = rx_poll_pkt->anchor_reply_window_in_us;
-						oa_scratch->ranging_operation_config.anchor_reply_slot_time_in_us = rx_poll_pkt->anchor_reply_slot_time_in_us;
-
-						// Update the statistics we keep about which antenna
-						// receives the most packets from the tag
-						uint8_t recv_antenna_index = oneway_subsequence_number_to_antenna(ANCHOR, rx_poll_pkt->subsequence);
-						oa_scratch->anchor_antenna_recv_num[recv_antenna_index]++;
-
-						// Now we need to start our own state machine to iterate
-						// through the antenna / channel combinations while listening
-						// for packets from the same tag.
-						timer_start(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US, ranging_broadcast_subsequence_task);
-
-					} else {
-						// We found this tag ranging sequence late. We don't want
-						// to use this because we won't get enough range estimates.
-						// Just stay idle, but we do need to re-enable RX to
-						// keep receiving packets.
-						dwt_rxenable(0);
-					}
-
-				} else if (oa_scratch->state == ASTATE_RANGING) {
-					// We are currently ranging with a tag, waiting for the various
-					// ranging broadcast packets.
-
-					// First check if this is from the same tag
-					if (memcmp(oa_scratch->pp_anc_final_pkt.ieee154_header_unicast.destAddr, rx_poll_pkt->header.sourceAddr, 8) == 0) {
-						// Same tag
-
-						if (rx_poll_pkt->subsequence == oa_scratch->ranging_broadcast_ss_num) {
-							// This is the packet we were expecting from the tag.
-							// Record the TOA, and adjust it with the calibration value.
-							oa_scratch->pp_anc_final_pkt.TOAs[oa_scratch->ranging_broadcast_ss_num] =
-								(dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num)) & 0xFFFF;
-							oa_scratch->pp_anc_final_pkt.last_rxd_toa = dw_rx_timestamp - oneway_get_rxdelay_from_subsequence(ANCHOR, oa_scratch->ranging_broadcast_ss_num);
-							oa_scratch->pp_anc_final_pkt.last_rxd_idx = oa_scratch->ranging_broadcast_ss_num;
-
-							// Update the statistics we keep about which antenna
-							// receives the most packets from the tag
-							uint8_t recv_antenna_index = oneway_subsequence_number_to_antenna(ANCHOR, oa_scratch->ranging_broadcast_ss_num);
-							oa_scratch->anchor_antenna_recv_num[recv_antenna_index]++;
-
-						} else {
-							// Some how we got out of sync with the tag. Ignore the
-							// range and catch up.
-							oa_scratch->ranging_broadcast_ss_num = rx_poll_pkt->subsequence;
-						}
-
-						// Regardless, it's a good idea to immediately call the subsequence task and restart the timer
-						timer_reset(oa_scratch->anchor_timer, RANGING_BROADCASTS_PERIOD_US-120); // Magic number calculated from timing
-						//ranging_broadcast_subsequence_task();
-						//timer_reset(oa_scratch->anchor_timer, 0);
-
-						//// Check to see if we got the last of the ranging broadcasts
-						//if (oa_scratch->ranging_broadcast_ss_num == oa_scratch->ranging_operation_config.reply_after_subsequence) {
-						//	// We did!
-						//	ranging_listening_window_setup();
-						//}
-
-					} else {
-						// Not the same tag, ignore
-					}
-				} else {
-					// We are in some other state, not sure what that means
-				}
-
-			} else {
-				// We do want to enter RX mode again, however
-				dwt_rxenable(0);
-				// Other message types go here, if they get added
-				if(message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ)
-					glossy_sync_process(dw_rx_timestamp-oneway_get_rxdelay_from_subsequence(ANCHOR, 0), buf);
-			}
+			// Read in the packet while the main loop gets on with other
+			// things, anchor_rx_frame() handles it
+			dw1000_read_rx(oa_scratch->rx_buf, MIN(ONEWAY_ANCHOR_MAX_RX_PKT_LEN, rxd->datalength),
+			               ANCHOR_RX_HEAD_LEN, anchor_rx_filter, anchor_rx_frame);
 		}
 
 	} else {
@@ -413,6 +563,4 @@ static void anchor_rxcallback (const dwt_callback_data_t *rxd) {
 			// Some other unknown error, not sure what to do
 		}
 	}
-
-	timer_enable_interrupt(oa_scratch->anchor_timer);
 }
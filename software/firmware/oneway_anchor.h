@@ -5,11 +5,12 @@
 #include "deca_regs.h"
 
 #include "dw1000.h"
+#include "oneway_range.h"
 #include "prng.h"
 
-// Set at some arbitrary length for what the longest packet we will receive
-// is.
-#define ONEWAY_ANCHOR_MAX_RX_PKT_LEN 64
+// Size buffers for reading in packets. Big enough for polls and the glossy
+// packets, which oneway_anchor.c checks.
+#define ONEWAY_ANCHOR_MAX_RX_PKT_LEN 128
 
 typedef enum {
 	ASTATE_IDLE,
@@ -54,7 +55,30 @@ typedef struct {
 	// Packet that the anchor unicasts to the tag
 	struct pp_anc_final pp_anc_final_pkt;
 
+	// What actually gets sent with ONEWAY_COMPACT_ANC_FINAL. It is packed
+	// from pp_anc_final_pkt right before each response.
+	struct pp_anc_final_compact pp_anc_final_compact_pkt;
+
+#ifdef ONEWAY_ANCHOR_RANGING
+	// Full TOAs of the tag broadcasts and when the tag says it sent them.
+	// Both are 0 for any broadcast we missed.
+	uint64_t tag_poll_TOAs[NUM_RANGING_BROADCASTS];
+	uint64_t tag_poll_send_times[NUM_RANGING_BROADCASTS];
+
+	// Our part of the range, calculated once the broadcasts are over
+	oneway_anchor_range_t range_result;
+
+	// What gets sent instead of the TOAs
+	struct pp_anc_final_range pp_anc_final_range_pkt;
+#endif
+
 	bool final_ack_received;
+
+	// The LWB schedule, when this anchor is the glossy master
+	glossy_sched_t glossy_sched;
+
+	// Where received packets are read to
+	uint8_t rx_buf[ONEWAY_ANCHOR_MAX_RX_PKT_LEN];
 } oneway_anchor_scratchspace_struct;
 
 oneway_anchor_scratchspace_struct *oa_scratch;
@@ -26,7 +26,15 @@ static const uint8_t channel_index_to_channel_rf_number[NUM_RANGING_CHANNELS] =
 // Buffer of anchor IDs and ranges to the anchor.
 // Long enough to hold an anchor id followed by the range, plus the number
 // of ranges
-uint8_t _anchor_ids_ranges[(MAX_NUM_ANCHOR_RESPONSES*(EUI_LEN+sizeof(int32_t)))+1];
+uint8_t _anchor_ids_ranges[ONEWAY_ANCHOR_IDS_RANGES_LEN];
+
+// Buffer for the tag's location: the number of anchors it came from, then
+// x, y, and z in millimeters and the RMS range residual in millimeters.
+static uint8_t _tag_location[1+(3*sizeof(int32_t))+sizeof(uint16_t)];
+
+// Where this anchor is. Kept across reconfiguring so the host can set it
+// whenever it likes.
+static struct pp_anchor_location _my_location = {ONEWAY_LOCATION_UNKNOWN, 0, 0};
 
 static void *_scratchspace_ptr;
 
@@ -45,7 +53,18 @@ static void tag_execute_range_callback () {
 	}
 }
 
-// This sets the settings for this node and initializes the node.
+// Check that a configuration can be used before anything is changed for it.
+// Only anchors have room in the scratchspace for the master's schedule, so a
+// tag can't be the glossy master.
+bool oneway_config_ok (oneway_config_t* config) {
+	if (config->my_role != ANCHOR && config->my_glossy_role == GLOSSY_MASTER) {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// This sets the settings for this node and initializes the node. The
+// configuration has to have passed oneway_config_ok().
 void oneway_configure (oneway_config_t* config, stm_timer_t* app_timer, void *app_scratchspace) {
 	_scratchspace_ptr = app_scratchspace;
 
@@ -53,13 +72,13 @@ void oneway_configure (oneway_config_t* config, stm_timer_t* app_timer, void *ap
 	memcpy(&_config, config, sizeof(oneway_config_t));
 
 	// Save the application timer for use by this application
-	//_app_timer = app_timer;
+	_app_timer = app_timer;
 
 	// Make sure the DW1000 is awake before trying to do anything.
 	dw1000_wakeup();
 
 	// Oneway ranging requires glossy synchronization, so let's enable that now
-	glossy_init(_config.my_glossy_role);
+	glossy_init(_config.my_glossy_role, &((oneway_anchor_scratchspace_struct*) app_scratchspace)->glossy_sched);
 
 	// Now init based on role
 	if (_config.my_role == TAG) {
@@ -85,16 +104,10 @@ void oneway_start () {
 
 		if (_config.update_mode == ONEWAY_UPDATE_MODE_PERIODIC) {
 			// Host requested periodic updates.
-			// Set the timer to fire at the correct rate. Multiply by 1000000 to
-			// get microseconds, then divide by 10 because update_rate is in
-			// tenths of hertz.
-			uint32_t period = (((uint32_t) _config.update_rate) * 1000000) / 10;
-			// Check if we are configured to sleep between ranges. If so,
-			// we need to take wakeup time into account.
-			if (_config.sleep_mode && period > DW1000_WAKEUP_DELAY_US) {
-				period -= DW1000_WAKEUP_DELAY_US;
-			}
-			//timer_start(_app_timer, period, tag_execute_range_callback);
+			// The LWB schedule starts the ranging events, so ask the glossy
+			// master for a slot at this rate. update_rate is in tenths of
+			// hertz, and 0 means as fast as possible.
+			lwb_set_update_rate(_config.update_rate);
 
 		} else if (_config.update_mode == ONEWAY_UPDATE_MODE_DEMAND) {
 			// Just wait for the host to request a ranging event
@@ -111,7 +124,7 @@ void oneway_start () {
 void oneway_stop () {
 	if (_config.my_role == TAG) {
 		if (_config.update_mode == ONEWAY_UPDATE_MODE_PERIODIC) {
-			//timer_stop(_app_timer);
+			timer_stop(_app_timer);
 		}
 		oneway_tag_stop();
 	} else if (_config.my_role == ANCHOR) {
@@ -147,6 +160,26 @@ void oneway_do_range () {
 	}
 }
 
+// Do any work that can wait until there are no interrupts to handle.
+// Returns TRUE if there is more to do.
+bool oneway_background_work () {
+	if (_config.my_role == TAG) {
+		return oneway_tag_background_work();
+	}
+	return FALSE;
+}
+
+// Tags can go into stop mode between ranging events. During one, the
+// listening windows are long enough for stop mode, but every wakeup from it
+// restarts the clocks and lines the timer up with the RTC again. That would
+// delay the responses the tag reads and the timing of the next window, so
+// tags only sleep then. Anchors have to answer tags on time, and one of
+// them is the glossy master that keeps time for everyone, so they only
+// sleep.
+bool oneway_idle_stop_ok () {
+	return _config.my_role == TAG && oneway_tag_idle();
+}
+
 // Return a pointer to the application configuration settings
 oneway_config_t* oneway_get_config () {
 	return &_config;
@@ -176,6 +209,36 @@ void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_
 	host_interface_notify_ranges(_anchor_ids_ranges, (num_anchor_ranges*(EUI_LEN+sizeof(int32_t)))+1);
 }
 
+// Record the location the tag found. num_anchors is 0 if there wasn't
+// enough to find a location, in which case the rest doesn't mean anything.
+void oneway_set_tag_location (uint8_t num_anchors, int32_t x_mm, int32_t y_mm, int32_t z_mm, uint16_t rms_residual_mm) {
+	_tag_location[0] = num_anchors;
+	memcpy(_tag_location+1, &x_mm, sizeof(int32_t));
+	memcpy(_tag_location+5, &y_mm, sizeof(int32_t));
+	memcpy(_tag_location+9, &z_mm, sizeof(int32_t));
+	memcpy(_tag_location+13, &rms_residual_mm, sizeof(uint16_t));
+
+	host_interface_notify_location(_tag_location, sizeof(_tag_location));
+}
+
+// Round millimeters to the nearest centimeter that fits in an int16_t,
+// staying clear of ONEWAY_LOCATION_UNKNOWN
+static int16_t mm_to_cm (int32_t mm) {
+	int32_t cm = (mm + ((mm < 0) ? -5 : 5)) / 10;
+	return MAX(MIN(cm, INT16_MAX), INT16_MIN+1);
+}
+
+// Set where this anchor is. The host gives it in millimeters.
+void oneway_set_my_location (int32_t x_mm, int32_t y_mm, int32_t z_mm) {
+	_my_location.x_cm = mm_to_cm(x_mm);
+	_my_location.y_cm = mm_to_cm(y_mm);
+	_my_location.z_cm = mm_to_cm(z_mm);
+}
+
+struct pp_anchor_location* oneway_get_my_location () {
+	return &_my_location;
+}
+
 
 /******************************************************************************/
 // Ranging Protocol Algorithm Functions
@@ -183,8 +246,8 @@ void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_
 
 // Break this out into two functions.
 // (Mostly needed for calibration purposes.)
-static uint8_t subsequence_number_to_channel_index (uint8_t subseq_num) {
-	return subseq_num % NUM_RANGING_CHANNELS;;
+uint8_t oneway_subsequence_number_to_channel_index (uint8_t subseq_num) {
+	return subseq_num % NUM_RANGING_CHANNELS;
 }
 
 // Return the RF channel to use for a given subsequence number
@@ -195,7 +258,7 @@ static uint8_t subsequence_number_to_channel (uint8_t subseq_num) {
 	// as possible so that they can join the sequence as early as possible. This
 	// increases the number of successful packet transmissions and increases
 	// ranging accuracy.
-	uint8_t channel_index = subsequence_number_to_channel_index(subseq_num);
+	uint8_t channel_index = oneway_subsequence_number_to_channel_index(subseq_num);
 	return channel_index_to_channel_rf_number[channel_index];
 }
 
@@ -287,7 +350,7 @@ uint8_t oneway_get_ss_index_from_settings (uint8_t anchor_antenna_index,
 uint64_t oneway_get_txdelay_from_subsequence (dw1000_role_e role,
                                                 uint8_t subseq_num) {
 	// Need to get channel and antenna to call the dw1000 function
-	uint8_t channel_index = subsequence_number_to_channel_index(subseq_num);
+	uint8_t channel_index = oneway_subsequence_number_to_channel_index(subseq_num);
 	return dw1000_get_tx_delay(channel_index);
 }
 
@@ -295,7 +358,7 @@ uint64_t oneway_get_txdelay_from_subsequence (dw1000_role_e role,
 uint64_t oneway_get_rxdelay_from_subsequence (dw1000_role_e role,
                                                 uint8_t subseq_num) {
 	// Need to get channel and antenna to call the dw1000 function
-	uint8_t channel_index = subsequence_number_to_channel_index(subseq_num);
+	uint8_t channel_index = oneway_subsequence_number_to_channel_index(subseq_num);
 	return dw1000_get_rx_delay(channel_index);
 }
 
@@ -306,3 +369,165 @@ uint64_t oneway_get_txdelay_from_ranging_listening_window (uint8_t window_num){
 uint64_t oneway_get_rxdelay_from_ranging_listening_window (uint8_t window_num){
 	return dw1000_get_rx_delay(window_num % NUM_RANGING_CHANNELS);
 }
+
+
+/******************************************************************************/
+// Compact ANC_FINAL packets
+/******************************************************************************/
+
+#define TIMESTAMP_40_BIT_MASK 0xFFFFFFFFFFULL
+
+static uint8_t* write_le (uint8_t* buf, uint64_t value, uint8_t num_bytes) {
+	for (uint8_t i=0; i<num_bytes; i++) {
+		buf[i] = (value >> (8*i)) & 0xFF;
+	}
+	return buf + num_bytes;
+}
+
+static const uint8_t* read_le (const uint8_t* buf, uint64_t* value, uint8_t num_bytes) {
+	*value = 0;
+	for (uint8_t i=0; i<num_bytes; i++) {
+		*value |= ((uint64_t) buf[i]) << (8*i);
+	}
+	return buf + num_bytes;
+}
+
+// Which broadcasts the anchor received, with the first and last always
+// included even if the low 16 bits of their TOAs happen to be 0.
+static uint32_t anc_final_rxd_bitmap (struct pp_anc_final* anc_final) {
+	uint32_t bitmap = 0;
+	for (uint8_t i=0; i<NUM_RANGING_BROADCASTS; i++) {
+		if (anc_final->TOAs[i] != 0) {
+			bitmap |= ((uint32_t) 1) << i;
+		}
+	}
+	bitmap |= ((uint32_t) 1) << anc_final->first_rxd_idx;
+	bitmap |= ((uint32_t) 1) << anc_final->last_rxd_idx;
+	return bitmap;
+}
+
+// Number of TOAs that go in the compact packet, which is all of the
+// received ones except the first and last.
+static uint8_t anc_final_compact_num_toas (uint32_t bitmap, uint8_t first_idx, uint8_t last_idx) {
+	uint8_t num = 0;
+	for (uint8_t i=first_idx+1; i<last_idx; i++) {
+		if (bitmap & (((uint32_t) 1) << i)) {
+			num++;
+		}
+	}
+	return num;
+}
+
+// Length of the compact version of this ANC_FINAL if the timestamps can't
+// be delta coded. This is as long as it can get.
+uint16_t oneway_anc_final_compact_max_len (struct pp_anc_final* anc_final) {
+	uint32_t bitmap = anc_final_rxd_bitmap(anc_final);
+	uint8_t num_toas = anc_final_compact_num_toas(bitmap, anc_final->first_rxd_idx, anc_final->last_rxd_idx);
+	return offsetof(struct pp_anc_final_compact, data) + 15 + (2*num_toas) + sizeof(struct ieee154_footer);
+}
+
+// Pack a complete ANC_FINAL into its compact form. The header is copied as
+// is. Returns the frame length to send, including the footer.
+uint16_t oneway_anc_final_compact_encode (struct pp_anc_final* anc_final, struct pp_anc_final_compact* compact) {
+	uint64_t first_toa = anc_final->first_rxd_toa & TIMESTAMP_40_BIT_MASK;
+	uint64_t last_delta = (anc_final->last_rxd_toa - anc_final->first_rxd_toa) & TIMESTAMP_40_BIT_MASK;
+	uint64_t sent_delta = (anc_final->dw_time_sent - anc_final->first_rxd_toa) & TIMESTAMP_40_BIT_MASK;
+
+	memcpy(&(compact->ieee154_header_unicast), &(anc_final->ieee154_header_unicast), sizeof(struct ieee154_header_unicast));
+	compact->message_type = MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT;
+	compact->final_antenna = anc_final->final_antenna;
+	memcpy(&(compact->anchor_location), &(anc_final->anchor_location), sizeof(struct pp_anchor_location));
+	compact->rxd_bitmap = anc_final_rxd_bitmap(anc_final);
+
+	uint8_t* data = write_le(compact->data, first_toa, 5);
+
+	// Both of these are usually well within 32 bits of the first TOA, but
+	// with slow ranging settings the response can be sent later than that.
+	if (last_delta <= UINT32_MAX && sent_delta <= UINT32_MAX) {
+		compact->flags = ANC_FINAL_COMPACT_FLAG_DELTA;
+		data = write_le(data, last_delta, 4);
+		data = write_le(data, sent_delta, 4);
+	} else {
+		compact->flags = 0;
+		data = write_le(data, anc_final->last_rxd_toa, 5);
+		data = write_le(data, anc_final->dw_time_sent, 5);
+	}
+
+	for (uint8_t i=anc_final->first_rxd_idx+1; i<anc_final->last_rxd_idx; i++) {
+		if (compact->rxd_bitmap & (((uint32_t) 1) << i)) {
+			data = write_le(data, anc_final->TOAs[i], 2);
+		}
+	}
+
+	return (data - (uint8_t*) compact) + sizeof(struct ieee154_footer);
+}
+
+// Unpack a compact ANC_FINAL of length len (including the footer) into the
+// fields of aresp that come from the anchor. The anchor timestamps only have
+// 40 bits, so they are all rebuilt relative to the first TOA. Only their
+// differences are used to calculate ranges, so this doesn't matter.
+// Returns FALSE if the packet doesn't make sense.
+bool oneway_anc_final_compact_decode (uint8_t* buf, uint16_t len, anchor_responses_t* aresp) {
+	struct pp_anc_final_compact* compact = (struct pp_anc_final_compact*) buf;
+	const uint8_t* data = compact->data;
+	uint64_t value;
+
+	if (len < offsetof(struct pp_anc_final_compact, data) + sizeof(struct ieee154_footer)) {
+		return FALSE;
+	}
+	const uint8_t* data_end = buf + len - sizeof(struct ieee154_footer);
+
+	uint32_t bitmap = compact->rxd_bitmap;
+	if (bitmap == 0 || (bitmap >> NUM_RANGING_BROADCASTS) != 0) {
+		return FALSE;
+	}
+
+	// First and last received are the lowest and highest set bits
+	uint8_t first_idx = 0;
+	while (!(bitmap & (((uint32_t) 1) << first_idx))) {
+		first_idx++;
+	}
+	uint8_t last_idx = NUM_RANGING_BROADCASTS - 1;
+	while (!(bitmap & (((uint32_t) 1) << last_idx))) {
+		last_idx--;
+	}
+
+	bool delta = compact->flags & ANC_FINAL_COMPACT_FLAG_DELTA;
+	uint8_t num_toas = anc_final_compact_num_toas(bitmap, first_idx, last_idx);
+	if (data_end - data < (delta ? 13 : 15) + (2*num_toas)) {
+		return FALSE;
+	}
+
+	// aresp is packed, so go through locals rather than pointing into it
+	uint64_t first_toa, last_delta, sent_delta;
+	data = read_le(data, &first_toa, 5);
+	if (delta) {
+		data = read_le(data, &last_delta, 4);
+		data = read_le(data, &sent_delta, 4);
+	} else {
+		data = read_le(data, &value, 5);
+		last_delta = (value - first_toa) & TIMESTAMP_40_BIT_MASK;
+		data = read_le(data, &value, 5);
+		sent_delta = (value - first_toa) & TIMESTAMP_40_BIT_MASK;
+	}
+	aresp->tag_poll_first_TOA = first_toa;
+	aresp->tag_poll_last_TOA = first_toa + last_delta;
+	aresp->anc_final_tx_timestamp = first_toa + sent_delta;
+
+	aresp->tag_poll_first_idx = first_idx;
+	aresp->tag_poll_last_idx = last_idx;
+	aresp->anchor_final_antenna_index = compact->final_antenna;
+
+	// Put the TOAs back where they would be in a full ANC_FINAL
+	memset(aresp->tag_poll_TOAs, 0, sizeof(aresp->tag_poll_TOAs));
+	aresp->tag_poll_TOAs[first_idx] = aresp->tag_poll_first_TOA & 0xFFFF;
+	aresp->tag_poll_TOAs[last_idx] = aresp->tag_poll_last_TOA & 0xFFFF;
+	for (uint8_t i=first_idx+1; i<last_idx; i++) {
+		if (bitmap & (((uint32_t) 1) << i)) {
+			data = read_le(data, &value, 2);
+			aresp->tag_poll_TOAs[i] = value;
+		}
+	}
+
+	return TRUE;
+}
@@ -28,7 +28,18 @@
 // contact will all anchors, even if the anchors aren't listening on the
 // first channel, plus we don't lose the first two if the anchor was listening
 // on the third channel.
+//
+// The repeats are also what the clock offset is calculated from, unless the
+// offset is fit from all of the broadcasts (ONEWAY_SKEW_REGRESSION). Then
+// they can be dropped to make each ranging event shorter.
+#ifdef ONEWAY_NO_REPEATED_BROADCASTS
+#ifndef ONEWAY_SKEW_REGRESSION
+#error "ONEWAY_NO_REPEATED_BROADCASTS requires ONEWAY_SKEW_REGRESSION"
+#endif
+#define NUM_RANGING_BROADCASTS NUM_UNIQUE_PACKET_CONFIGURATIONS
+#else
 #define NUM_RANGING_BROADCASTS ((NUM_RANGING_CHANNELS*NUM_ANTENNAS*NUM_ANTENNAS) + NUM_RANGING_CHANNELS)
+#endif
 
 // Listen for responses from the anchors on different channels
 #define NUM_RANGING_LISTENING_WINDOWS 3
@@ -40,8 +51,13 @@
 // How long the slots inside each window should be for the anchors to choose from
 #define RANGING_LISTENING_SLOT_US (RANGING_LISTENING_WINDOW_US/NUM_RANGING_LISTENING_SLOTS)
 
-// Maximum number of anchors a tag is willing to hear from
-#define MAX_NUM_ANCHOR_RESPONSES 10
+// Maximum number of anchors a tag is willing to hear from. Each one takes
+// about 115 bytes of the tag's scratchspace, and the STM32F031 only has 4 kB.
+#define MAX_NUM_ANCHOR_RESPONSES 8
+
+// The ranges the tag gives the host: the number of ranges, then an anchor
+// id followed by the range for each
+#define ONEWAY_ANCHOR_IDS_RANGES_LEN ((MAX_NUM_ANCHOR_RESPONSES*(EUI_LEN+sizeof(int32_t)))+1)
 
 // Reasonable constants to rule out unreasonable ranges
 #define MIN_VALID_RANGE_MM -1000      // -1 meter
@@ -58,6 +74,33 @@
 #define RANGE_PERCENTILE_NUMERATOR 1
 #define RANGE_PERCENTILE_DENOMENATOR 10
 
+// With ONEWAY_ADAPTIVE_BROADCASTS the tag sends just enough broadcasts that
+// every anchor it heard from last time would have received this many. This
+// is more than MIN_VALID_RANGES_PER_ANCHOR to leave room for a few more
+// dropped packets and so the percentile has something to choose from.
+#define ONEWAY_ADAPTIVE_TARGET_RANGES ((MIN_VALID_RANGES_PER_ANCHOR*3)/2)
+
+// Never send fewer broadcasts than this. It has to be at least
+// NUM_RANGING_CHANNELS*NUM_ANTENNAS so that the broadcast matching each
+// anchor's response (see oneway_get_ss_index_from_settings()) is sent.
+#define ONEWAY_ADAPTIVE_MIN_BROADCASTS ONEWAY_ADAPTIVE_TARGET_RANGES
+
+#if defined(ONEWAY_ADAPTIVE_BROADCASTS) && !defined(ONEWAY_SKEW_REGRESSION)
+#error "ONEWAY_ADAPTIVE_BROADCASTS requires ONEWAY_SKEW_REGRESSION"
+#endif
+
+// With ONEWAY_ANCHOR_RANGING the tag never sees which broadcasts each anchor
+// got, which is what ONEWAY_ADAPTIVE_BROADCASTS picks the next length from.
+// The anchors also have no FPU, so the result is sent as fixed point.
+#ifdef ONEWAY_ANCHOR_RANGING
+#ifdef ONEWAY_ADAPTIVE_BROADCASTS
+#error "ONEWAY_ANCHOR_RANGING does not work with ONEWAY_ADAPTIVE_BROADCASTS"
+#endif
+#ifndef ONEWAY_FIXED_POINT_RANGING
+#error "ONEWAY_ANCHOR_RANGING requires ONEWAY_FIXED_POINT_RANGING"
+#endif
+#endif
+
 
 /******************************************************************************/
 // Data Structs for packet messages between tags and anchors
@@ -69,6 +112,20 @@
 #define MSG_TYPE_PP_NOSLOTS_ANC_FINAL 0x81
 #define MSG_TYPE_PP_GLOSSY_SYNC       0x82
 #define MSG_TYPE_PP_GLOSSY_SCHED_REQ  0x83
+#define MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT 0x84
+#define MSG_TYPE_PP_NOSLOTS_ANC_FINAL_RANGE   0x85
+
+// Where an anchor is, as set by the host with HOST_CMD_SET_LOCATION. Anchors
+// put this in every ANC_FINAL so tags can find their own location
+// (ONEWAY_REPORT_MODE_LOCATION). Centimeters keep it small and are plenty
+// given how accurate the ranges are.
+#define ONEWAY_LOCATION_UNKNOWN INT16_MIN  // In x if the anchor wasn't told
+
+struct pp_anchor_location {
+	int16_t x_cm;
+	int16_t y_cm;
+	int16_t z_cm;
+} __attribute__ ((__packed__));
 
 // Packet the tag broadcasts to all nearby anchors
 struct pp_tag_poll  {
@@ -78,6 +135,9 @@ struct pp_tag_poll  {
 	uint8_t reply_after_subsequence;        // Tells anchor which broadcast subsequence number to respond after.
 	uint32_t anchor_reply_window_in_us;     // How long each anchor response window is. Each window allows multiple anchor responses.
 	uint16_t anchor_reply_slot_time_in_us;  // How long that slots that break up each window are.
+#ifdef ONEWAY_ANCHOR_RANGING
+	uint8_t dw_time_sent[5];                // Low 40 bits of the tag timestamp of when it sent this packet, little endian.
+#endif
 	struct ieee154_footer footer;
 } __attribute__ ((__packed__));
 
@@ -86,6 +146,7 @@ struct pp_anc_final {
 	struct ieee154_header_unicast ieee154_header_unicast;
 	uint8_t message_type;
 	uint8_t final_antenna;                 // The antenna the anchor used when sending this packet.
+	struct pp_anchor_location anchor_location; // Where the anchor is. Same offset in every ANC_FINAL type.
 	uint64_t dw_time_sent;                 // The anchor timestamp of when it sent this packet
 	uint8_t  first_rxd_idx;
 	uint64_t first_rxd_toa;
@@ -95,6 +156,47 @@ struct pp_anc_final {
 	struct ieee154_footer footer;
 } __attribute__ ((__packed__));
 
+// Smaller version of pp_anc_final (see ONEWAY_COMPACT_ANC_FINAL). After the
+// fixed fields, data holds, little endian:
+//   first_rxd_toa   40 bits
+//   last_rxd_toa    40 bits, or 32 bits after first_rxd_toa if delta coded
+//   dw_time_sent    40 bits, or 32 bits after first_rxd_toa if delta coded
+//   TOAs            16 bits each, only for the broadcasts in rxd_bitmap
+//                   between the first and last one
+// followed by the footer. The first and last received broadcasts are the
+// lowest and highest bits set in rxd_bitmap.
+#define ANC_FINAL_COMPACT_FLAG_DELTA 0x01
+#define ANC_FINAL_COMPACT_MAX_DATA_LEN (5+5+5+(2*NUM_RANGING_BROADCASTS))
+
+struct pp_anc_final_compact {
+	struct ieee154_header_unicast ieee154_header_unicast;
+	uint8_t message_type;
+	uint8_t final_antenna;                 // The antenna the anchor used when sending this packet.
+	struct pp_anchor_location anchor_location; // Where the anchor is. Same offset in every ANC_FINAL type.
+	uint8_t flags;                         // ANC_FINAL_COMPACT_FLAG_*
+	uint32_t rxd_bitmap;                   // Bit i is set if the anchor received tag poll i.
+	uint8_t data[ANC_FINAL_COMPACT_MAX_DATA_LEN + sizeof(struct ieee154_footer)];
+} __attribute__ ((__packed__));
+
+// What the anchor sends instead of its TOAs with ONEWAY_ANCHOR_RANGING. The
+// anchor knows when the tag sent every broadcast, so it can do everything
+// but the one way TOF, which needs the time the tag receives this packet.
+// The tag's range is then
+//   tof_percentile + ((recv - matching_send)*(1+clock_offset) - reply_delay)/2
+// where the matching broadcast is the one that used the same settings as
+// this packet (see oneway_get_ss_index_from_settings()).
+struct pp_anc_final_range {
+	struct ieee154_header_unicast ieee154_header_unicast;
+	uint8_t message_type;
+	uint8_t final_antenna;                 // The antenna the anchor used when sending this packet.
+	struct pp_anchor_location anchor_location; // Where the anchor is. Same offset in every ANC_FINAL type.
+	uint8_t num_ranges;                    // How many broadcasts went into tof_percentile, 0 if there is no result.
+	int32_t clock_offset;                  // Anchor over tag clock offset minus 1, Q40 (see oneway_range.h).
+	int32_t tof_percentile;                // The percentile TOF less the one way TOF, DW time units in Q8.
+	uint64_t reply_delay;                  // Anchor time from receiving the matching broadcast to sending this packet.
+	struct ieee154_footer footer;
+} __attribute__ ((__packed__));
+
 
 /******************************************************************************/
 // State objects for the oneway application
@@ -136,15 +238,22 @@ typedef struct {
 } __attribute__ ((__packed__)) anchor_responses_t;
 
 
+bool oneway_config_ok (oneway_config_t* config);
 void oneway_configure (oneway_config_t* config, stm_timer_t* app_timer, void *app_scratchspace);
 void oneway_start ();
 void oneway_stop ();
 void oneway_reset ();
 void oneway_do_range ();
+bool oneway_background_work ();
+bool oneway_idle_stop_ok ();
 oneway_config_t* oneway_get_config ();
 void oneway_set_ranges (int32_t* ranges_millimeters, anchor_responses_t* anchor_responses);
+void oneway_set_tag_location (uint8_t num_anchors, int32_t x_mm, int32_t y_mm, int32_t z_mm, uint16_t rms_residual_mm);
+void oneway_set_my_location (int32_t x_mm, int32_t y_mm, int32_t z_mm);
+struct pp_anchor_location* oneway_get_my_location ();
 
 
+uint8_t oneway_subsequence_number_to_channel_index (uint8_t subseq_num);
 uint8_t oneway_subsequence_number_to_antenna (dw1000_role_e role, uint8_t subseq_num);
 void oneway_set_ranging_broadcast_subsequence_settings (dw1000_role_e role, uint8_t subseq_num);
 void oneway_set_ranging_listening_window_settings (dw1000_role_e role, uint8_t slot_num, uint8_t antenna_num);
@@ -153,5 +262,8 @@ uint64_t oneway_get_txdelay_from_subsequence (dw1000_role_e role, uint8_t subseq
 uint64_t oneway_get_rxdelay_from_subsequence (dw1000_role_e role, uint8_t subseq_num);
 uint64_t oneway_get_txdelay_from_ranging_listening_window (uint8_t window_num);
 uint64_t oneway_get_rxdelay_from_ranging_listening_window (uint8_t window_num);
+uint16_t oneway_anc_final_compact_max_len (struct pp_anc_final* anc_final);
+uint16_t oneway_anc_final_compact_encode (struct pp_anc_final* anc_final, struct pp_anc_final_compact* compact);
+bool oneway_anc_final_compact_decode (uint8_t* buf, uint16_t len, anchor_responses_t* aresp);
 
 #endif
@@ -0,0 +1,323 @@
+#include "oneway_location.h"
+
+// Calculate the tag's location from its ranges to anchors with known
+// locations. This is a Levenberg-Marquardt fit of
+//   sum over anchors of (|location - anchor| - range)^2
+// done entirely with integers because the STM32F031 has no FPU.
+//
+// Each step solves the 3x3 normal equations with Cramer's rule. The
+// Jacobian rows are the unit vectors from each anchor to the tag, so the
+// normal matrix is small and well scaled no matter how far away the anchors
+// are.
+
+// Unit vectors from the anchors are in Q14
+#define UNIT_FRAC_BITS 14
+
+// The normal matrix is solved in Q12. Its trace is at most
+// ONEWAY_LOCATION_MAX_ANCHORS*5 with the most damping, which keeps all of the
+// products in solve_step() inside 64 bits.
+#define MATRIX_FRAC_BITS 12
+
+// LM damping is a fraction of the diagonal, in Q4
+#define LAMBDA_FRAC_BITS 4
+#define LAMBDA_START     1
+#define LAMBDA_MAX       (4 << LAMBDA_FRAC_BITS)
+
+// Right hand sides are scaled down below this so adj(M)*b fits in 64 bits
+#define MAX_RHS ((int64_t) 1 << 20)
+
+// A matrix whose determinant is this many bits smaller than the largest
+// possible for its trace is treated as singular
+#define SINGULAR_SHIFT 12
+
+// Keep the location where the squares of the distances can't overflow
+#define MAX_COORDINATE ((int32_t) 1 << 24)
+
+// The host benchmark (software/location) defines this to count the
+// operations that are expensive on a Cortex-M0.
+#ifndef LOCATION_COUNT_OP
+#define LOCATION_COUNT_OP(_op)
+#endif
+
+#define ABS(_a) (((_a) < 0) ? -(_a) : (_a))
+
+
+/******************************************************************************/
+// Integer helpers
+/******************************************************************************/
+
+static uint32_t isqrt64 (uint64_t value) {
+	uint64_t result = 0;
+	uint64_t bit = (uint64_t) 1 << 62;
+
+	LOCATION_COUNT_OP(ISQRT);
+
+	while (bit > value) {
+		bit >>= 2;
+	}
+	while (bit != 0) {
+		if (value >= result + bit) {
+			value -= result + bit;
+			result = (result >> 1) + bit;
+		} else {
+			result >>= 1;
+		}
+		bit >>= 2;
+	}
+	return result;
+}
+
+// num/den in Q14 where |num| <= den. Distances under ~131 m can use a 32
+// bit division, which is much cheaper on the M0.
+static int32_t ratio_q14 (int32_t num, int32_t den) {
+	if (den < ((int32_t) 1 << (31 - UNIT_FRAC_BITS))) {
+		LOCATION_COUNT_OP(DIV32);
+		return (num * (1 << UNIT_FRAC_BITS)) / den;
+	}
+	LOCATION_COUNT_OP(DIV64);
+	return ((int64_t) num * (1 << UNIT_FRAC_BITS)) / den;
+}
+
+// (num << MATRIX_FRAC_BITS) / den without overflowing, for den > 0.
+// Anything past MAX_COORDINATE is clamped to it.
+static int64_t div_matrix_frac (int64_t num, int64_t den) {
+	// The quotient and remainder come from the same library call
+	LOCATION_COUNT_OP(DIV64);
+	int64_t q = num / den;
+	int64_t r = num % den;
+	if (ABS(q) >= (MAX_COORDINATE >> MATRIX_FRAC_BITS)) {
+		return (q < 0) ? -MAX_COORDINATE : MAX_COORDINATE;
+	}
+	LOCATION_COUNT_OP(DIV64);
+	return (q * (1 << MATRIX_FRAC_BITS)) + ((r * (1 << MATRIX_FRAC_BITS)) / den);
+}
+
+static int32_t clamp_coordinate (int64_t value) {
+	return MAX(MIN(value, MAX_COORDINATE), -MAX_COORDINATE);
+}
+
+
+/******************************************************************************/
+// Solver
+/******************************************************************************/
+
+// Find the distance from location to each anchor minus its range, and the
+// unit vector from each anchor to location. Returns the sum of the squared
+// residuals.
+static int64_t evaluate (oneway_location_t* anchors, int32_t* ranges_mm, uint8_t num_anchors,
+                         oneway_location_t* location, int32_t* residuals, int32_t units[][3]) {
+	int64_t cost = 0;
+
+	for (uint8_t i=0; i<num_anchors; i++) {
+		LOCATION_COUNT_OP(RANGE);
+
+		int32_t d[3] = {
+			location->x - anchors[i].x,
+			location->y - anchors[i].y,
+			location->z - anchors[i].z,
+		};
+		int32_t distance = isqrt64(((int64_t) d[0] * d[0]) + ((int64_t) d[1] * d[1]) + ((int64_t) d[2] * d[2]));
+
+		for (uint8_t k=0; k<3; k++) {
+			// Sitting right on an anchor gives no direction, so that
+			// anchor just doesn't pull this step
+			units[i][k] = (distance == 0) ? 0 : ratio_q14(d[k], distance);
+		}
+
+		residuals[i] = distance - ranges_mm[i];
+		cost += (int64_t) residuals[i] * residuals[i];
+	}
+
+	return cost;
+}
+
+// Build the normal equations J'J and J'r, where the Jacobian rows are the
+// unit vectors. A is in Q28 and g is Q14 millimeters.
+static void normal_equations (int32_t* residuals, int32_t units[][3], uint8_t num_anchors,
+                              int64_t A[3][3], int64_t g[3]) {
+	for (uint8_t j=0; j<3; j++) {
+		g[j] = 0;
+		for (uint8_t k=0; k<3; k++) {
+			A[j][k] = 0;
+		}
+	}
+
+	for (uint8_t i=0; i<num_anchors; i++) {
+		for (uint8_t j=0; j<3; j++) {
+			g[j] += (int64_t) units[i][j] * residuals[i];
+			for (uint8_t k=j; k<3; k++) {
+				A[j][k] += (int64_t) units[i][j] * units[i][k];
+			}
+		}
+	}
+
+	A[1][0] = A[0][1];
+	A[2][0] = A[0][2];
+	A[2][1] = A[1][2];
+}
+
+// Solve (A + lambda*diag(A)) * step = g for the step in millimeters. With
+// dims == 2, z is held where it is. Returns FALSE if the matrix is singular.
+static bool solve_step (int64_t A[3][3], int64_t g[3], int32_t lambda, uint8_t dims, int32_t step[3]) {
+	int64_t M[3][3];
+	int64_t b[3];
+
+	LOCATION_COUNT_OP(STEP);
+
+	for (uint8_t j=0; j<3; j++) {
+		for (uint8_t k=0; k<3; k++) {
+			M[j][k] = A[j][k] >> ((2*UNIT_FRAC_BITS) - MATRIX_FRAC_BITS);
+		}
+		M[j][j] += (M[j][j] * lambda) >> LAMBDA_FRAC_BITS;
+		b[j] = g[j] >> UNIT_FRAC_BITS;
+	}
+
+	if (dims == 2) {
+		M[0][2] = M[1][2] = M[2][0] = M[2][1] = 0;
+		M[2][2] = 1 << MATRIX_FRAC_BITS;
+		b[2] = 0;
+	}
+
+	// A far off starting point can make the right hand side large. Scaling
+	// it down only scales the step.
+	uint8_t b_shift = 0;
+	while (MAX(MAX(ABS(b[0]), ABS(b[1])), ABS(b[2])) >= MAX_RHS) {
+		b[0] >>= 1;
+		b[1] >>= 1;
+		b[2] >>= 1;
+		b_shift++;
+	}
+
+	// Cofactors. M is symmetric, so these are also the adjugate.
+	int64_t C[3][3];
+	C[0][0] =   (M[1][1] * M[2][2]) - (M[1][2] * M[2][1]);
+	C[0][1] = -((M[1][0] * M[2][2]) - (M[1][2] * M[2][0]));
+	C[0][2] =   (M[1][0] * M[2][1]) - (M[1][1] * M[2][0]);
+	C[1][1] =   (M[0][0] * M[2][2]) - (M[0][2] * M[2][0]);
+	C[1][2] = -((M[0][0] * M[2][1]) - (M[0][1] * M[2][0]));
+	C[2][2] =   (M[0][0] * M[1][1]) - (M[0][1] * M[1][0]);
+	C[1][0] = C[0][1];
+	C[2][0] = C[0][2];
+	C[2][1] = C[1][2];
+
+	int64_t det = (M[0][0] * C[0][0]) + (M[0][1] * C[0][1]) + (M[0][2] * C[0][2]);
+	int64_t trace = M[0][0] + M[1][1] + M[2][2];
+
+	// det is at most (trace/3)^3, which is a bit more than trace^3/32. Much
+	// smaller than that and the anchors don't constrain every direction.
+	if (det <= 0 || (det << SINGULAR_SHIFT) < ((trace * trace * trace) >> 5)) {
+		return FALSE;
+	}
+
+	for (uint8_t j=0; j<3; j++) {
+		int64_t num = (C[j][0] * b[0]) + (C[j][1] * b[1]) + (C[j][2] * b[2]);
+		step[j] = clamp_coordinate(div_matrix_frac(num, det) * ((int64_t) 1 << b_shift));
+	}
+	return TRUE;
+}
+
+// Find the location that best fits the ranges to the anchors. location is
+// used as the starting point if have_guess is set, otherwise the solver
+// starts at the middle of the anchors. Returns FALSE if there aren't enough
+// anchors or they are laid out so that the location can't be found (all on
+// one line, for instance). Otherwise the location and the RMS of how far
+// each range is off at that location are filled in.
+bool oneway_calculate_location (oneway_location_t* anchors, int32_t* ranges_mm, uint8_t num_anchors,
+                                bool have_guess, oneway_location_t* location, uint16_t* rms_residual_mm) {
+	int32_t residuals[ONEWAY_LOCATION_MAX_ANCHORS];
+	int32_t units[ONEWAY_LOCATION_MAX_ANCHORS][3];
+	int64_t A[3][3];
+	int64_t g[3];
+
+	num_anchors = MIN(num_anchors, ONEWAY_LOCATION_MAX_ANCHORS);
+	if (num_anchors < ONEWAY_LOCATION_MIN_ANCHORS) {
+		return FALSE;
+	}
+
+	uint8_t max_dims = (num_anchors > ONEWAY_LOCATION_MIN_ANCHORS) ? 3 : 2;
+
+	// Without a guess, start by fitting only x and y. Height is usually the
+	// worst constrained direction, and solving for it from far away tends to
+	// send z off on a detour that takes many evaluations to come back from.
+	uint8_t dims = have_guess ? max_dims : 2;
+
+	oneway_location_t current = *location;
+	if (!have_guess) {
+		int64_t sum[3] = {0, 0, 0};
+		for (uint8_t i=0; i<num_anchors; i++) {
+			sum[0] += anchors[i].x;
+			sum[1] += anchors[i].y;
+			sum[2] += anchors[i].z;
+		}
+		LOCATION_COUNT_OP(DIV64);
+		LOCATION_COUNT_OP(DIV64);
+		LOCATION_COUNT_OP(DIV64);
+		current.x = sum[0] / num_anchors;
+		current.y = sum[1] / num_anchors;
+		current.z = sum[2] / num_anchors;
+	}
+
+	int64_t cost = evaluate(anchors, ranges_mm, num_anchors, &current, residuals, units);
+	normal_equations(residuals, units, num_anchors, A, g);
+
+	uint8_t evaluations = 1;
+	int32_t lambda = LAMBDA_START;
+	bool solved = FALSE;
+
+	while (evaluations < ONEWAY_LOCATION_MAX_EVALUATIONS) {
+		int32_t step[3];
+		if (!solve_step(A, g, lambda, dims, step)) {
+			if (dims == 3) {
+				// Not enough spread in height, so keep z where it is
+				dims = max_dims = 2;
+				continue;
+			}
+			break;
+		}
+		solved = TRUE;
+
+		oneway_location_t trial = {
+			clamp_coordinate((int64_t) current.x - step[0]),
+			clamp_coordinate((int64_t) current.y - step[1]),
+			clamp_coordinate((int64_t) current.z - step[2]),
+		};
+		int64_t trial_cost = evaluate(anchors, ranges_mm, num_anchors, &trial, residuals, units);
+		evaluations++;
+
+		bool small_step = MAX(MAX(ABS(step[0]), ABS(step[1])), ABS(step[2])) < ONEWAY_LOCATION_CONVERGED_MM;
+
+		if (trial_cost < cost) {
+			// Better, so take it and trust the linear model more
+			current = trial;
+			cost = trial_cost;
+			normal_equations(residuals, units, num_anchors, A, g);
+			lambda >>= 1;
+		} else {
+			// Worse, so take smaller steps in the direction of the gradient.
+			// A and g are still for the current location.
+			lambda = (lambda == 0) ? LAMBDA_START : lambda * 4;
+			if (lambda > LAMBDA_MAX) {
+				break;
+			}
+		}
+
+		if (small_step) {
+			if (dims == max_dims) {
+				break;
+			}
+			// x and y have settled, now let z move too
+			dims = max_dims;
+			lambda = LAMBDA_START;
+		}
+	}
+
+	if (!solved) {
+		return FALSE;
+	}
+
+	*location = current;
+	LOCATION_COUNT_OP(DIV64);
+	uint32_t rms = isqrt64(cost / num_anchors);
+	*rms_residual_mm = MIN(rms, UINT16_MAX);
+	return TRUE;
+}
@@ -0,0 +1,40 @@
+#ifndef __ONEWAY_LOCATION_H
+#define __ONEWAY_LOCATION_H
+
+#include <stdint.h>
+
+#include "system.h"
+
+// This only depends on the C library so that software/location can build it
+// on a PC to check its accuracy and cost.
+
+/******************************************************************************/
+// Parameters for the location solver
+/******************************************************************************/
+
+// Need at least this many anchors for a location. With exactly this many
+// only x and y are solved for and z is kept where it started, as a 3D fix
+// from three ranges can't tell which side of the anchors the tag is on.
+#define ONEWAY_LOCATION_MIN_ANCHORS 3
+
+// Only this many anchors are used. This sizes the solver's stack use.
+#define ONEWAY_LOCATION_MAX_ANCHORS 16
+
+// Upper bound on how many times the ranges are evaluated at a candidate
+// location. This bounds the time the solver can take on the tag.
+#define ONEWAY_LOCATION_MAX_EVALUATIONS 16
+
+// Stop once a step moves the location less than this many millimeters
+#define ONEWAY_LOCATION_CONVERGED_MM 2
+
+// Location in millimeters
+typedef struct {
+	int32_t x;
+	int32_t y;
+	int32_t z;
+} oneway_location_t;
+
+bool oneway_calculate_location (oneway_location_t* anchors, int32_t* ranges_mm, uint8_t num_anchors,
+                                bool have_guess, oneway_location_t* location, uint16_t* rms_residual_mm);
+
+#endif
@@ -0,0 +1,495 @@
+#include <string.h>
+
+#include "deca_device_api.h"
+
+#include "dw1000.h"
+#include "oneway_common.h"
+#include "oneway_tag.h"
+#include "oneway_range.h"
+
+// Millimeters per DW time unit in Q16. This is folded by the compiler, so
+// there is no floating point at runtime.
+#define MILLIMETERS_PER_DWTIME_Q16 ((int64_t) (DWT_TIME_UNITS * SPEED_OF_LIGHT * 1000.0 * 65536.0 + 0.5))
+
+// Largest time difference that the offset math can handle without
+// overflowing. This is ~134 ms, much longer than a ranging event.
+#define MAX_TIME_DIFFERENCE ((int64_t) 1 << 33)
+
+// How much the tag time differences are scaled down by before they are
+// squared in the clock offset regression so that the sums fit in 64 bits.
+#define REGRESSION_X_SHIFT 8
+
+
+/******************************************************************************/
+// Number format helpers
+/******************************************************************************/
+
+// Calculate the clock offset (recv_delta / send_delta) between two nodes
+// given the same time span measured by both of them.
+// Returns FALSE if the offset is not believable.
+static bool offset_ratio (int64_t recv_delta, int64_t send_delta, oneway_offset_t* offset) {
+	int64_t skew = recv_delta - send_delta;
+
+	if (send_delta <= 0 || send_delta >= MAX_TIME_DIFFERENCE) {
+		return FALSE;
+	}
+	if (MAX(skew, -skew) > (send_delta >> ONEWAY_RANGE_MAX_OFFSET_SHIFT)) {
+		return FALSE;
+	}
+
+#ifdef ONEWAY_FIXED_POINT_RANGING
+	*offset = (skew * ((int64_t) 1 << ONEWAY_RANGE_OFFSET_FRAC_BITS)) / send_delta;
+#else
+	*offset = (double) recv_delta / (double) send_delta;
+#endif
+	return TRUE;
+}
+
+#ifdef ONEWAY_SKEW_REGRESSION
+// Calculate the clock offset with a least squares fit of the anchor TOAs
+// against the tag send times for every broadcast the anchor received.
+//
+// The antenna delays differ between channels, so each channel gets its own
+// intercept and only the slope is shared. To keep the numbers small the fit
+// is of the skew (recv_delta - send_delta) against send_delta, with the
+// deltas measured from the first broadcast received on that channel.
+// Returns FALSE if there are not enough broadcasts or the fit is not
+// believable.
+static bool offset_regression (uint64_t* TOAs, uint64_t* send_times, oneway_offset_t* offset) {
+	int8_t  ref_index[NUM_RANGING_CHANNELS];
+	int64_t n[NUM_RANGING_CHANNELS] = {0};
+	int64_t sx[NUM_RANGING_CHANNELS] = {0};
+	int64_t sr[NUM_RANGING_CHANNELS] = {0};
+	int64_t sxx[NUM_RANGING_CHANNELS] = {0};
+	int64_t sxr[NUM_RANGING_CHANNELS] = {0};
+	memset(ref_index, -1, sizeof(ref_index));
+
+	for (uint8_t ii=0; ii<NUM_RANGING_BROADCASTS; ii++) {
+		if (TOAs[ii] == 0) {
+			continue;
+		}
+
+		uint8_t ch = oneway_subsequence_number_to_channel_index(ii);
+		if (ref_index[ch] < 0) {
+			ref_index[ch] = ii;
+		}
+
+		int64_t send_delta = send_times[ii] - send_times[ref_index[ch]];
+		int64_t skew = (int64_t) (TOAs[ii] - TOAs[ref_index[ch]]) - send_delta;
+
+		// Drop any broadcast that disagrees this much with the reference,
+		// it has a bad timestamp.
+		if (send_delta < 0 || send_delta >= MAX_TIME_DIFFERENCE ||
+		    MAX(skew, -skew) > (send_delta >> ONEWAY_RANGE_MAX_OFFSET_SHIFT)) {
+			continue;
+		}
+
+		int64_t x = send_delta >> REGRESSION_X_SHIFT;
+		n[ch]++;
+		sx[ch] += x;
+		sr[ch] += skew;
+		sxx[ch] += x * x;
+		sxr[ch] += x * skew;
+	}
+
+	// Remove each channel's mean from its sums and combine them
+	int64_t sum_xx = 0;
+	int64_t sum_xr = 0;
+	for (uint8_t ch=0; ch<NUM_RANGING_CHANNELS; ch++) {
+		if (n[ch] < 2) {
+			continue;
+		}
+		sum_xx += ((n[ch] * sxx[ch]) - (sx[ch] * sx[ch])) / n[ch];
+		sum_xr += ((n[ch] * sxr[ch]) - (sx[ch] * sr[ch])) / n[ch];
+	}
+
+	// Scale the sums down until the division below can't overflow
+	while (MAX(sum_xr, -sum_xr) >= ((int64_t) 1 << 30)) {
+		sum_xr >>= 1;
+		sum_xx >>= 1;
+	}
+	if (sum_xx <= 0) {
+		return FALSE;
+	}
+
+	const uint8_t shift = ONEWAY_RANGE_OFFSET_FRAC_BITS - REGRESSION_X_SHIFT;
+	int64_t skew_q40 = (sum_xr * ((int64_t) 1 << shift)) / sum_xx;
+	if (MAX(skew_q40, -skew_q40) > ((int64_t) 1 << (ONEWAY_RANGE_OFFSET_FRAC_BITS - ONEWAY_RANGE_MAX_OFFSET_SHIFT))) {
+		return FALSE;
+	}
+
+#ifdef ONEWAY_FIXED_POINT_RANGING
+	*offset = skew_q40;
+#else
+	*offset = 1.0 + ((double) sum_xr / (double) sum_xx / (double) (1 << REGRESSION_X_SHIFT));
+#endif
+	return TRUE;
+}
+#endif
+
+// Convert a time difference measured in DW time units to a TOF value
+static oneway_tof_t ticks_to_tof (int64_t ticks) {
+#ifdef ONEWAY_FIXED_POINT_RANGING
+	return ticks * (1 << ONEWAY_RANGE_TOF_FRAC_BITS);
+#else
+	return (double) ticks;
+#endif
+}
+
+// Drop the fractional part of a TOF value
+static int64_t tof_to_ticks (oneway_tof_t tof) {
+#ifdef ONEWAY_FIXED_POINT_RANGING
+	return tof / (1 << ONEWAY_RANGE_TOF_FRAC_BITS);
+#else
+	return (int64_t) tof;
+#endif
+}
+
+// Multiply a time difference by a clock offset. The time difference must be
+// smaller than MAX_TIME_DIFFERENCE.
+static oneway_tof_t scale_by_offset (int64_t ticks, oneway_offset_t offset) {
+#ifdef ONEWAY_FIXED_POINT_RANGING
+	// ticks*(1+offset), where the ticks*offset term is rounded to the
+	// TOF resolution.
+	const uint8_t shift = ONEWAY_RANGE_OFFSET_FRAC_BITS - ONEWAY_RANGE_TOF_FRAC_BITS;
+	int64_t skew = (ticks * offset + ((int64_t) 1 << (shift-1))) >> shift;
+	return ticks_to_tof(ticks) + skew;
+#else
+	return (double) ticks * offset;
+#endif
+}
+
+// Same as dwtime_to_millimeters(), including truncating towards zero.
+static int tof_to_millimeters (oneway_tof_t tof) {
+#ifdef ONEWAY_FIXED_POINT_RANGING
+	// Anything this large is not a valid range, and this keeps the
+	// multiplication from overflowing.
+	if (tof > INT32_MAX || tof < INT32_MIN) {
+		return INT32_MIN;
+	}
+	return (int) ((tof * MILLIMETERS_PER_DWTIME_Q16) / ((int64_t) 1 << (16 + ONEWAY_RANGE_TOF_FRAC_BITS)));
+#else
+	return dwtime_to_millimeters(tof);
+#endif
+}
+
+
+/******************************************************************************/
+// Range calculation
+/******************************************************************************/
+
+// Calculate the crystal offset between the anchor and tag from the full
+// anchor TOAs (0 for any broadcast it missed) and the tag send times.
+// Returns FALSE if there isn't enough to go on.
+static bool clock_offset (uint64_t* TOAs, uint64_t* send_times, oneway_offset_t* offset) {
+#ifdef ONEWAY_SKEW_REGRESSION
+	return offset_regression(TOAs, send_times, offset);
+#else
+	// To do this, we need to get the timestamps at the anchor and tag
+	// for packets that are repeated. In the current scheme, the first
+	// three packets are repeated, where three is the number of channels.
+	// If we get multiple matches, we take the average of the clock offsets.
+	uint8_t valid_offset_calculations = 0;
+	oneway_offset_t offset_ratios_sum = 0;
+	for (uint8_t j=0; j<NUM_RANGING_CHANNELS; j++) {
+		uint8_t first_broadcast_index = j;
+		uint8_t last_broadcast_index = NUM_RANGING_BROADCASTS - NUM_RANGING_CHANNELS + j;
+		uint64_t first_broadcast_send_time = send_times[first_broadcast_index];
+		uint64_t first_broadcast_recv_time = TOAs[first_broadcast_index];
+		uint64_t last_broadcast_send_time  = send_times[last_broadcast_index];
+		uint64_t last_broadcast_recv_time  = TOAs[last_broadcast_index];
+
+		// Now lets check that the anchor actually received both of these
+		// packets. If it didn't then this isn't valid.
+		if (first_broadcast_recv_time == 0 || last_broadcast_recv_time == 0) {
+			// A packet was dropped (or the anchor wasn't listening on the
+			// first channel). This isn't useful so we skip it.
+			continue;
+		}
+
+		// Calculate the "multiplier for the crystal offset between tag
+		// and anchor".
+		// (last_recv-first_recv) / (last_send-first_send)
+		oneway_offset_t offset_item;
+		if (!offset_ratio(last_broadcast_recv_time - first_broadcast_recv_time,
+		                  last_broadcast_send_time - first_broadcast_send_time,
+		                  &offset_item)) {
+			continue;
+		}
+
+		// Add this to the running sum for the average
+		offset_ratios_sum += offset_item;
+		valid_offset_calculations++;
+	}
+
+	// If we didn't get any matching pairs in the first and last rounds
+	// then we have to skip this anchor.
+	if (valid_offset_calculations == 0) {
+		return FALSE;
+	}
+
+	// Calculate the average clock offset multiplier
+	*offset = offset_ratios_sum / valid_offset_calculations;
+	return TRUE;
+#endif
+}
+
+// Calculate the range to a single anchor from the tag broadcast send times
+// and the anchor's ANC_FINAL response. Returns the range in millimeters or
+// one of the ONEWAY_TAG_RANGE_ERROR values.
+int32_t oneway_calculate_anchor_range (anchor_responses_t* aresp, uint64_t* send_times) {
+
+	if (aresp->tag_poll_first_idx >= NUM_RANGING_BROADCASTS ||
+	    aresp->tag_poll_last_idx >= NUM_RANGING_BROADCASTS) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+
+	// Since the rxd TOAs are compressed to 16 bits, we first need to decompress them back to 64-bit quantities
+	uint64_t tag_poll_TOAs[NUM_RANGING_BROADCASTS];
+	memset(tag_poll_TOAs, 0, sizeof(tag_poll_TOAs));
+
+	// Get an estimate of clock offset. If the first and last TOAs don't
+	// agree with each other then nothing else from this anchor can be
+	// trusted either.
+	oneway_offset_t approx_clock_offset;
+	if (!offset_ratio(aresp->tag_poll_last_TOA - aresp->tag_poll_first_TOA,
+	                  send_times[aresp->tag_poll_last_idx] - send_times[aresp->tag_poll_first_idx],
+	                  &approx_clock_offset)) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+
+	// First put in the TOA values that are known
+	tag_poll_TOAs[aresp->tag_poll_first_idx] = aresp->tag_poll_first_TOA;
+	tag_poll_TOAs[aresp->tag_poll_last_idx] = aresp->tag_poll_last_TOA;
+
+	// Then interpolate between the two to find the high 48 bits which fit best
+	for (uint8_t ii=aresp->tag_poll_first_idx+1; ii<aresp->tag_poll_last_idx; ii++) {
+		// The anchor leaves a 0 for any broadcast it missed. Keep it that way
+		// so the rest of the calculation skips it.
+		if (aresp->tag_poll_TOAs[ii] == 0) {
+			continue;
+		}
+
+		uint64_t estimated_TOA = aresp->tag_poll_first_TOA +
+			tof_to_ticks(scale_by_offset(send_times[ii] - send_times[aresp->tag_poll_first_idx], approx_clock_offset));
+
+		uint64_t actual_TOA = (estimated_TOA & 0xFFFFFFFFFFFF0000ULL) + aresp->tag_poll_TOAs[ii];
+
+		// Make corrections if we're off by more than 0x7FFF
+		if (actual_TOA < estimated_TOA - 0x7FFF) {
+			actual_TOA += 0x10000;
+		} else if (actual_TOA > estimated_TOA + 0x7FFF) {
+			actual_TOA -= 0x10000;
+		}
+
+		// We're done -- store it...
+		tag_poll_TOAs[ii] = actual_TOA;
+	}
+
+	// First need to calculate the crystal offset between the anchor and tag.
+	oneway_offset_t offset_anchor_over_tag;
+	if (!clock_offset(tag_poll_TOAs, send_times, &offset_anchor_over_tag)) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+
+	// Now we need to use the one packet we have from the anchor
+	// to calculate a one-way time of flight measurement so that we can
+	// account for the time offset between the anchor and tag (i.e. the
+	// tag and anchors are not synchronized). We will use this TOF
+	// to calculate ranges from all of the other polls the tag sent.
+	// To do this, we need to match the anchor_antenna, tag_antenna, and
+	// channel between the anchor response and the correct tag poll.
+	uint8_t ss_index_matching = oneway_get_ss_index_from_settings(aresp->anchor_final_antenna_index,
+	                                                              aresp->window_packet_recv);
+
+	// Exit early if the corresponding broadcast wasn't received
+	if (tag_poll_TOAs[ss_index_matching] == 0) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+
+	uint64_t matching_broadcast_send_time = send_times[ss_index_matching];
+	uint64_t matching_broadcast_recv_time = tag_poll_TOAs[ss_index_matching];
+	uint64_t response_send_time  = aresp->anc_final_tx_timestamp;
+	uint64_t response_recv_time  = aresp->anc_final_rx_timestamp;
+
+	// The response has to come after the broadcast, and not so long after
+	// that the offset multiplication could overflow.
+	int64_t response_delay = (int64_t) response_recv_time - (int64_t) matching_broadcast_send_time;
+	if (response_delay <= 0 || response_delay >= MAX_TIME_DIFFERENCE) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+
+	oneway_tof_t two_way_TOF = scale_by_offset(response_delay, offset_anchor_over_tag) -
+		ticks_to_tof((int64_t) response_send_time - (int64_t) matching_broadcast_recv_time);
+	oneway_tof_t one_way_TOF = two_way_TOF / 2;
+
+
+	// Declare an array for the ranges. These are not kept sorted, the
+	// percentile is selected from them at the end.
+	int distances_millimeters[NUM_RANGING_BROADCASTS] = {0};
+	uint8_t num_valid_distances = 0;
+
+	// Next we calculate the TOFs for each of the poll messages the tag sent.
+	for (uint8_t broadcast_index=0; broadcast_index<NUM_RANGING_BROADCASTS; broadcast_index++) {
+		uint64_t broadcast_send_time = send_times[broadcast_index];
+		uint64_t broadcast_recv_time = tag_poll_TOAs[broadcast_index];
+
+		// Check that the anchor actually received the tag broadcast.
+		// We use 0 as a sentinel for the anchor not receiving the packet.
+		if (broadcast_recv_time == 0) {
+			continue;
+		}
+
+		// We use the reference packet (that we used to calculate one_way_TOF)
+		// to compensate for the unsynchronized clock.
+		int64_t broadcast_anchor_offset = (int64_t) broadcast_recv_time - (int64_t) matching_broadcast_recv_time;
+		int64_t broadcast_tag_offset = (int64_t) broadcast_send_time - (int64_t) matching_broadcast_send_time;
+		oneway_tof_t TOF = ticks_to_tof(broadcast_anchor_offset) - scale_by_offset(broadcast_tag_offset, offset_anchor_over_tag) + one_way_TOF;
+
+		int distance_millimeters = tof_to_millimeters(TOF);
+
+		// Check that the distance we have at this point is at all reasonable
+		if (distance_millimeters >= MIN_VALID_RANGE_MM && distance_millimeters <= MAX_VALID_RANGE_MM) {
+			distances_millimeters[num_valid_distances] = distance_millimeters;
+			num_valid_distances++;
+		}
+	}
+
+	// Check to make sure that we got enough ranges from this anchor.
+	// If not, we just skip it.
+	if (num_valid_distances < MIN_VALID_RANGES_PER_ANCHOR) {
+		return ONEWAY_TAG_RANGE_ERROR_TOO_FEW_RANGES;
+	}
+
+
+	// Now that we have all of the calculated ranges from all of the tag
+	// broadcasts we can calculate some percentile range.
+	int32_t result = select_percentile(distances_millimeters, num_valid_distances,
+	                                   RANGE_PERCENTILE_NUMERATOR, RANGE_PERCENTILE_DENOMENATOR);
+
+	if (result == INT32_MAX) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+	return result;
+}
+
+
+/******************************************************************************/
+// Range calculation split between the anchor and tag (ONEWAY_ANCHOR_RANGING)
+/******************************************************************************/
+
+#ifdef ONEWAY_ANCHOR_RANGING
+// Anchor side. Every TOF the tag would calculate is
+//   (TOA_i - TOA_m) - (send_i - send_m)*offset + one_way_TOF
+// for the broadcast m that matches the response. Only the one way TOF
+// depends on the response, so here we find the percentile of
+//   (TOA_i - TOA_ref) - (send_i - send_ref)*offset
+// for the first broadcast received, ref, and the window the response goes
+// out in only has to shift it to m (see oneway_anchor_range_tof_percentile()).
+//
+// Without the one way TOF we can't tell if a single TOF is within
+// MIN_VALID_RANGE_MM and MAX_VALID_RANGE_MM, so instead any broadcast that
+// puts the tag further than that span from the reference is dropped.
+// Returns FALSE if the clock offset couldn't be found.
+bool oneway_anchor_calculate_range (uint64_t* TOAs, uint64_t* send_times, oneway_anchor_range_t* result) {
+	result->num_ranges = 0;
+
+	if (!clock_offset(TOAs, send_times, &(result->offset))) {
+		return FALSE;
+	}
+
+	// There has to be one of these if there was an offset
+	uint8_t ref = 0;
+	while (TOAs[ref] == 0) {
+		ref++;
+	}
+	result->ref_idx = ref;
+
+	int relative_tofs[NUM_RANGING_BROADCASTS];
+	uint8_t num_relative_tofs = 0;
+
+	for (uint8_t ii=ref; ii<NUM_RANGING_BROADCASTS; ii++) {
+		if (TOAs[ii] == 0) {
+			continue;
+		}
+
+		int64_t send_delta = (int64_t) send_times[ii] - (int64_t) send_times[ref];
+		if (send_delta < 0 || send_delta >= MAX_TIME_DIFFERENCE) {
+			continue;
+		}
+
+		oneway_tof_t TOF = ticks_to_tof((int64_t) TOAs[ii] - (int64_t) TOAs[ref]) - scale_by_offset(send_delta, result->offset);
+
+		int distance_millimeters = tof_to_millimeters(TOF);
+		if (distance_millimeters >= MIN_VALID_RANGE_MM - MAX_VALID_RANGE_MM &&
+		    distance_millimeters <= MAX_VALID_RANGE_MM - MIN_VALID_RANGE_MM) {
+			relative_tofs[num_relative_tofs] = TOF;
+			num_relative_tofs++;
+		}
+	}
+
+	result->num_ranges = num_relative_tofs;
+	result->tof_percentile = 0;
+	if (num_relative_tofs >= MIN_VALID_RANGES_PER_ANCHOR) {
+		result->tof_percentile = select_percentile(relative_tofs, num_relative_tofs,
+		                                           RANGE_PERCENTILE_NUMERATOR, RANGE_PERCENTILE_DENOMENATOR);
+	}
+
+	return TRUE;
+}
+
+// Move the anchor's percentile TOF over to the broadcast that matches the
+// response it is about to send. Returns FALSE if the anchor didn't receive
+// that broadcast.
+bool oneway_anchor_range_tof_percentile (oneway_anchor_range_t* result, uint64_t* TOAs, uint64_t* send_times,
+                                         uint8_t ss_index_matching, oneway_tof_t* tof_percentile) {
+	if (TOAs[ss_index_matching] == 0) {
+		return FALSE;
+	}
+
+	int64_t send_delta = (int64_t) send_times[ss_index_matching] - (int64_t) send_times[result->ref_idx];
+	if (MAX(send_delta, -send_delta) >= MAX_TIME_DIFFERENCE) {
+		return FALSE;
+	}
+
+	*tof_percentile = result->tof_percentile -
+		(ticks_to_tof((int64_t) TOAs[ss_index_matching] - (int64_t) TOAs[result->ref_idx]) - scale_by_offset(send_delta, result->offset));
+	return TRUE;
+}
+
+// Tag side. All that is left is the one way TOF, from the broadcast that
+// matches the anchor's response and when the response was received.
+// Returns the range in millimeters or one of the ONEWAY_TAG_RANGE_ERROR
+// values.
+int32_t oneway_calculate_anchor_range_from_result (struct pp_anc_final_range* anc_final,
+                                                   uint64_t matching_broadcast_send_time,
+                                                   uint64_t response_recv_time) {
+	if (anc_final->num_ranges == 0) {
+		return ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+	}
+	if (anc_final->num_ranges < MIN_VALID_RANGES_PER_ANCHOR) {
+		return ONEWAY_TAG_RANGE_ERROR_TOO_FEW_RANGES;
+	}
+
+	// Same checks as when the tag does all of the work
+	int64_t response_delay = (int64_t) response_recv_time - (int64_t) matching_broadcast_send_time;
+	if (matching_broadcast_send_time == 0 || response_delay <= 0 || response_delay >= MAX_TIME_DIFFERENCE) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+	if (anc_final->reply_delay >= MAX_TIME_DIFFERENCE) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+
+	oneway_offset_t offset_anchor_over_tag = anc_final->clock_offset;
+	oneway_tof_t two_way_TOF = scale_by_offset(response_delay, offset_anchor_over_tag) -
+		ticks_to_tof(anc_final->reply_delay);
+	oneway_tof_t one_way_TOF = two_way_TOF / 2;
+
+	int range_millimeters = tof_to_millimeters(anc_final->tof_percentile + one_way_TOF);
+
+	if (range_millimeters < MIN_VALID_RANGE_MM || range_millimeters > MAX_VALID_RANGE_MM) {
+		return ONEWAY_TAG_RANGE_ERROR_MISC;
+	}
+	return range_millimeters;
+}
+#endif
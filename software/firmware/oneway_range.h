@@ -0,0 +1,59 @@
+#ifndef __ONEWAY_RANGE_H
+#define __ONEWAY_RANGE_H
+
+#include "oneway_common.h"
+
+/******************************************************************************/
+// Number formats for the range calculation
+/******************************************************************************/
+
+// The STM32F031 has no FPU, so by default the range math is done entirely
+// with integers (see ONEWAY_FIXED_POINT_RANGING in polypoint_conf.h).
+//
+// Clock offsets between the anchor and tag are stored as the deviation from
+// 1.0 in Q40 format. This gives a resolution of ~1e-12, which is about
+// 0.004 DW time units of error across an entire ranging event.
+//
+// Times of flight are stored in DW time units in Q8 format.
+//
+// With these formats every range is within 1 mm of what the double version
+// computes (the only difference is which side of a millimeter boundary the
+// truncation lands on), and the final percentile range is within 2 mm.
+#define ONEWAY_RANGE_OFFSET_FRAC_BITS 40
+#define ONEWAY_RANGE_TOF_FRAC_BITS    8
+
+// Crystals are specified to +-20 ppm. Any offset calculation that claims
+// more than this (about 1000 ppm) came from a corrupted timestamp. This bound
+// also keeps the fixed point multiplications from overflowing.
+#define ONEWAY_RANGE_MAX_OFFSET_SHIFT 10
+
+#ifdef ONEWAY_FIXED_POINT_RANGING
+typedef int64_t oneway_offset_t;
+typedef int64_t oneway_tof_t;
+#else
+typedef double oneway_offset_t;
+typedef double oneway_tof_t;
+#endif
+
+// What the anchor keeps from its part of the range calculation with
+// ONEWAY_ANCHOR_RANGING. The percentile TOF is missing the one way TOF and is
+// relative to broadcast ref_idx.
+typedef struct {
+	oneway_offset_t offset;
+	oneway_tof_t tof_percentile;
+	uint8_t ref_idx;
+	uint8_t num_ranges;
+} oneway_anchor_range_t;
+
+int32_t oneway_calculate_anchor_range (anchor_responses_t* aresp, uint64_t* send_times);
+
+#ifdef ONEWAY_ANCHOR_RANGING
+bool oneway_anchor_calculate_range (uint64_t* TOAs, uint64_t* send_times, oneway_anchor_range_t* result);
+bool oneway_anchor_range_tof_percentile (oneway_anchor_range_t* result, uint64_t* TOAs, uint64_t* send_times,
+                                         uint8_t ss_index_matching, oneway_tof_t* tof_percentile);
+int32_t oneway_calculate_anchor_range_from_result (struct pp_anc_final_range* anc_final,
+                                                   uint64_t matching_broadcast_send_time,
+                                                   uint64_t response_recv_time);
+#endif
+
+#endif
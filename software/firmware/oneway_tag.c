@@ -7,16 +7,32 @@
 #include "delay.h"
 #include "dw1000.h"
 #include "oneway_tag.h"
+#include "oneway_range.h"
 #include "firmware.h"
 
+_Static_assert(sizeof(struct pp_anc_final) <= ONEWAY_TAG_MAX_RX_PKT_LEN, "ANC_FINAL does not fit rx_buf");
+_Static_assert(sizeof(struct pp_anc_final_compact) <= ONEWAY_TAG_MAX_RX_PKT_LEN, "ANC_FINAL_COMPACT does not fit rx_buf");
+_Static_assert(sizeof(struct pp_anc_final_range) <= ONEWAY_TAG_MAX_RX_PKT_LEN, "ANC_FINAL_RANGE does not fit rx_buf");
+_Static_assert(sizeof(struct pp_sched_flood) <= ONEWAY_TAG_MAX_RX_PKT_LEN, "Glossy sync does not fit rx_buf");
+
 // Functions
 static void send_poll ();
 static void ranging_broadcast_subsequence_task ();
 static void ranging_listening_window_task ();
+static bool calculate_next_range ();
 static void calculate_ranges ();
+static void update_broadcast_count ();
 static void report_range ();
+static void record_report_latency ();
+static uint8_t calculate_location (uint16_t* rms_residual_mm);
 static void tag_txcallback (const dwt_callback_data_t *txd);
 static void tag_rxcallback (const dwt_callback_data_t *rxd);
+static uint16_t tag_rx_filter (const uint8_t* head, uint16_t head_len, uint16_t len);
+static void tag_rx_frame (uint64_t dw_rx_timestamp, uint8_t* buf, uint16_t len);
+
+// How long the range calculation and reporting take. This is kept outside
+// of the scratchspace so that it lasts across configurations.
+static oneway_tag_stats_t _stats;
 
 // Do the TAG-specific init calls.
 // We trust that the DW1000 is not in SLEEP mode when this is called.
@@ -61,7 +77,7 @@ void oneway_tag_init (void *app_scratchspace) {
 
 	// Setup parameters of how the radio should work
 	dwt_setautorxreenable(TRUE);
-	dwt_setdblrxbuffmode(TRUE);//FALSE);
+	dw1000_rx_double_buffer(TRUE);
 	dwt_enableautoack(DW1000_ACK_RESPONSE_TIME);
 
 	// Put source EUI in the pp_tag_poll packet
@@ -75,8 +91,16 @@ void oneway_tag_init (void *app_scratchspace) {
 	// Make SPI fast now that everything has been setup
 	dw1000_spi_fast();
 
+	// The M0 has no cycle counter, so time the range calculation with
+	// SysTick counting down from the core clock. Nothing else uses it, and
+	// with its interrupt off SysTick_Handler never runs.
+	SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
 	// Reset our state because nothing should be in progress if we call init()
 	ot_scratch->state = TSTATE_IDLE;
+	ot_scratch->location_valid = FALSE;
 
 	// LPM now schedules all of our ranging events!
 	lwb_set_sched_request(TRUE);
@@ -119,6 +143,19 @@ dw1000_err_e oneway_tag_start_ranging_event () {
 	memset(ot_scratch->ranging_broadcast_ss_send_times, 0, sizeof(ot_scratch->ranging_broadcast_ss_send_times));
 	ot_scratch->ranging_broadcast_ss_num = 0;
 
+	// Decide how long this event is. update_broadcast_count() picked it from
+	// the last event, since the tag hears nothing from the anchors until the
+	// listening windows. Every broadcast tells the anchors when the last one
+	// is, so an anchor that joins late still stops with the tag.
+#ifdef ONEWAY_ADAPTIVE_BROADCASTS
+	if (ot_scratch->ranging_broadcast_count == 0) {
+		ot_scratch->ranging_broadcast_count = NUM_RANGING_BROADCASTS;
+	}
+#else
+	ot_scratch->ranging_broadcast_count = NUM_RANGING_BROADCASTS;
+#endif
+	ot_scratch->pp_tag_poll_pkt.reply_after_subsequence = ot_scratch->ranging_broadcast_count - 1;
+
 	// Start a timer that will kick off the broadcast ranging events
 	timer_start(ot_scratch->tag_timer, RANGING_BROADCASTS_PERIOD_US, ranging_broadcast_subsequence_task);
 
@@ -160,6 +197,12 @@ static void tag_txcallback (const dwt_callback_data_t *data) {
 			// Init some state
 			ot_scratch->ranging_listening_window_num = 0;
 			ot_scratch->anchor_response_count = 0;
+			ot_scratch->anchor_ranges_calculated = 0;
+
+			// Clear ranges array, don't use memset
+			for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
+				ot_scratch->ranges_millimeters[i] = INT32_MAX;
+			}
 
 			// Start a timer to switch between the windows
 			timer_start(ot_scratch->tag_timer, RANGING_LISTENING_WINDOW_US + RANGING_LISTENING_WINDOW_PADDING_US*2, ranging_listening_window_task);
@@ -176,53 +219,87 @@ static void tag_txcallback (const dwt_callback_data_t *data) {
 
 }
 
-// Called when the tag receives a packet.
-static void tag_rxcallback (const dwt_callback_data_t* rxd) {
-	if (rxd->event == DWT_SIG_RX_OKAY) {
-		// Everything went right when receiving this packet.
-		// We have to process it to ensure that it is a packet we are expecting
-		// to get.
+// How much of the first bytes of a received packet the tag has to read to
+// tell whether it wants it. That covers the unicast header and the message
+// type of every ANC_FINAL.
+#define TAG_RX_HEAD_LEN (offsetof(struct pp_anc_final, message_type) + 1)
+
+// Decides from the first TAG_RX_HEAD_LEN bytes of a packet whether to read
+// the rest. ANC_FINALs meant for other tags are the bulk of what the tag
+// hears, and tag_rx_frame() only needs their header to drop them.
+static uint16_t tag_rx_filter (const uint8_t* head, uint16_t head_len, uint16_t len) {
+	uint8_t message_type = head[offsetof(struct pp_anc_final, message_type)];
+
+	if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL ||
+	    message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT ||
+	    message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_RANGE) {
+		if (memcmp(((struct pp_anc_final*) head)->ieee154_header_unicast.destAddr,
+		           ot_scratch->pp_tag_poll_pkt.header.sourceAddr, EUI_LEN) == 0) {
+			return len;
+		}
+		return head_len;
+	}
 
-		uint64_t dw_rx_timestamp;
-		uint8_t  buf[ONEWAY_TAG_MAX_RX_PKT_LEN];
-		uint8_t  message_type;
+	message_type = head[offsetof(struct pp_tag_poll, message_type)];
+	if (message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ) {
+		return len;
+	}
+	return head_len;
+}
 
-		// Get the received time of this packet first
-		dw_rx_timestamp = dw1000_readrxtimestamp();
+// Called from the main loop with a packet the tag received, once it has been
+// read from the DW1000. We have to process it to ensure that it is a packet
+// we are expecting to get.
+static void tag_rx_frame (uint64_t dw_rx_timestamp, uint8_t* buf, uint16_t len) {
+	uint8_t message_type = buf[offsetof(struct pp_anc_final, message_type)];
+
+	// Tags in other reuse zones can be ranging at the same time, and we can
+	// hear their anchors' responses, so make sure responses are meant for
+	// us. All of them start with the same unicast header.
+	if ((message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL ||
+	     message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT ||
+	     message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_RANGE) &&
+	    memcmp(((struct pp_anc_final*) buf)->ieee154_header_unicast.destAddr,
+	           ot_scratch->pp_tag_poll_pkt.header.sourceAddr, EUI_LEN) != 0) {
+		return;
+	}
 
-		// Get the actual packet bytes
-		dwt_readrxdata(buf, MIN(ONEWAY_TAG_MAX_RX_PKT_LEN, rxd->datalength), 0);
-		message_type = buf[offsetof(struct pp_anc_final, message_type)];
+	if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL ||
+	    message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT) {
+		// This is what we were looking for, an ANC_FINAL packet. Both
+		// versions start with the same header.
+		struct pp_anc_final* anc_final;
 
-		if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL) {
-			// This is what we were looking for, an ANC_FINAL packet
-			struct pp_anc_final* anc_final;
+		if (ot_scratch->anchor_response_count >= MAX_NUM_ANCHOR_RESPONSES) {
+			// Nowhere to store this, so we have to ignore this
+			return;
+		}
 
-			if (ot_scratch->anchor_response_count >= MAX_NUM_ANCHOR_RESPONSES) {
-				// Nowhere to store this, so we have to ignore this
-				return;
+		// Continue parsing the received packet
+		anc_final = (struct pp_anc_final*) buf;
+
+		// Check that we haven't already received a packet from this anchor.
+		// The anchors should check for an ACK and not retransmit, but that
+		// could still fail.
+		bool anc_already_found = FALSE;
+		for (uint8_t i=0; i<ot_scratch->anchor_response_count; i++) {
+			if (memcmp(ot_scratch->anchor_responses[i].anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN) == 0) {
+				anc_already_found = TRUE;
+				break;
 			}
+		}
 
-			// Continue parsing the received packet
-			anc_final = (struct pp_anc_final*) buf;
+		// Only save this response if we haven't already seen this anchor
+		if (!anc_already_found) {
 
-			// Check that we haven't already received a packet from this anchor.
-			// The anchors should check for an ACK and not retransmit, but that
-			// could still fail.
-			bool anc_already_found = FALSE;
-			for (uint8_t i=0; i<ot_scratch->anchor_response_count; i++) {
-				if (memcmp(ot_scratch->anchor_responses[i].anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN) == 0) {
-					anc_already_found = TRUE;
-					break;
+			if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_COMPACT) {
+				// Unpack the anchor's TOAs, antenna, and send time
+				if (!oneway_anc_final_compact_decode(buf, len,
+				                                     &(ot_scratch->anchor_responses[ot_scratch->anchor_response_count]))) {
+					return;
 				}
-			}
-
-			// Only save this response if we haven't already seen this anchor
-			if (!anc_already_found) {
-
-				// Save the anchor address
-				memcpy(ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN);
 
+			} else {
 				// Save the anchor's list of when it received the tag broadcasts
 				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].tag_poll_first_TOA = anc_final->first_rxd_toa;
 				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].tag_poll_first_idx = anc_final->first_rxd_idx;
@@ -235,28 +312,81 @@ static void tag_rxcallback (const dwt_callback_data_t* rxd) {
 
 				// Save when the anchor sent the packet we just received
 				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anc_final_tx_timestamp = anc_final->dw_time_sent;
+			}
 
-				// Save when we received the packet.
-				// We have already handled the calibration values so
-				// we don't need to here.
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anc_final_rx_timestamp = dw_rx_timestamp - oneway_get_rxdelay_from_ranging_listening_window(ot_scratch->ranging_listening_window_num - 1);
+			// Save the anchor address
+			memcpy(ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN);
 
-				// Also need to save what window we are in when we received
-				// this packet. This is used so we know all of the settings
-				// that were used when this packet was sent to us.
-				ot_scratch->anchor_responses[ot_scratch->anchor_response_count].window_packet_recv = ot_scratch->ranging_listening_window_num - 1;
+			// And where it is. This is in the same place in both versions.
+			memcpy(&(ot_scratch->anchor_locations[ot_scratch->anchor_response_count]), &(anc_final->anchor_location), sizeof(struct pp_anchor_location));
 
-				// Increment the number of anchors heard from
-				ot_scratch->anchor_response_count++;
-			}
+			// Save when we received the packet.
+			// We have already handled the calibration values so
+			// we don't need to here.
+			ot_scratch->anchor_responses[ot_scratch->anchor_response_count].anc_final_rx_timestamp = dw_rx_timestamp - oneway_get_rxdelay_from_ranging_listening_window(ot_scratch->ranging_listening_window_num - 1);
 
-		} else {
-			// TAGs don't expect to receive any other types of packets.
-			message_type = buf[offsetof(struct pp_tag_poll, message_type)];
-			if(message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ)
-				glossy_sync_process(dw_rx_timestamp-oneway_get_rxdelay_from_subsequence(TAG, 0), buf);
+			// Also need to save what window we are in when we received
+			// this packet. This is used so we know all of the settings
+			// that were used when this packet was sent to us.
+			ot_scratch->anchor_responses[ot_scratch->anchor_response_count].window_packet_recv = ot_scratch->ranging_listening_window_num - 1;
+
+			// Increment the number of anchors heard from
+			ot_scratch->anchor_response_count++;
 		}
 
+#ifdef ONEWAY_ANCHOR_RANGING
+	} else if (message_type == MSG_TYPE_PP_NOSLOTS_ANC_FINAL_RANGE) {
+		// The anchor already did most of the range calculation for us
+		struct pp_anc_final_range* anc_final = (struct pp_anc_final_range*) buf;
+		uint8_t anchor_index = ot_scratch->anchor_response_count;
+
+		if (anchor_index >= MAX_NUM_ANCHOR_RESPONSES) {
+			return;
+		}
+
+		for (uint8_t i=0; i<anchor_index; i++) {
+			if (memcmp(ot_scratch->anchor_responses[i].anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN) == 0) {
+				return;
+			}
+		}
+
+		// There are no TOAs to keep, just what the host needs to know
+		// who this is from.
+		anchor_responses_t* aresp = &(ot_scratch->anchor_responses[anchor_index]);
+		memset(aresp, 0, sizeof(anchor_responses_t));
+		memcpy(aresp->anchor_addr, anc_final->ieee154_header_unicast.sourceAddr, EUI_LEN);
+		aresp->anchor_final_antenna_index = anc_final->final_antenna;
+		aresp->window_packet_recv = ot_scratch->ranging_listening_window_num - 1;
+		aresp->anc_final_rx_timestamp = dw_rx_timestamp - oneway_get_rxdelay_from_ranging_listening_window(ot_scratch->ranging_listening_window_num - 1);
+		memcpy(&(ot_scratch->anchor_locations[anchor_index]), &(anc_final->anchor_location), sizeof(struct pp_anchor_location));
+
+		// Finishing the range is cheap, so just do it now.
+		// calculate_next_range() skips anchors that already have one.
+		uint8_t ss_index_matching = oneway_get_ss_index_from_settings(aresp->anchor_final_antenna_index,
+		                                                              aresp->window_packet_recv);
+		ot_scratch->ranges_millimeters[anchor_index] =
+			oneway_calculate_anchor_range_from_result(anc_final,
+			                                          ot_scratch->ranging_broadcast_ss_send_times[ss_index_matching],
+			                                          aresp->anc_final_rx_timestamp);
+
+		ot_scratch->anchor_response_count++;
+#endif
+
+	} else {
+		// TAGs don't expect to receive any other types of packets.
+		message_type = buf[offsetof(struct pp_tag_poll, message_type)];
+		if(message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ)
+			glossy_sync_process(dw_rx_timestamp-oneway_get_rxdelay_from_subsequence(TAG, 0), buf, len);
+	}
+}
+
+// Called when the tag receives a packet.
+static void tag_rxcallback (const dwt_callback_data_t* rxd) {
+	if (rxd->event == DWT_SIG_RX_OKAY) {
+		// Everything went right when receiving this packet. Read it in while
+		// the main loop gets on with other things.
+		dw1000_read_rx(ot_scratch->rx_buf, MIN(ONEWAY_TAG_MAX_RX_PKT_LEN, rxd->datalength),
+		               TAG_RX_HEAD_LEN, tag_rx_filter, tag_rx_frame);
 	} else {
 		// Packet was NOT received correctly. Need to do some re-configuring
 		// as things get blown out when this happens. (Because dwt_rxreset
@@ -304,11 +434,18 @@ static void send_poll () {
 	ot_scratch->ranging_broadcast_ss_send_times[ot_scratch->ranging_broadcast_ss_num] =
 		(((uint64_t) delay_time) << 8) + dw1000_gettimestampoverflow() + oneway_get_txdelay_from_subsequence(TAG, ot_scratch->ranging_broadcast_ss_num);
 
+#ifdef ONEWAY_ANCHOR_RANGING
+	// The anchors need this to do the range calculation themselves
+	memcpy(ot_scratch->pp_tag_poll_pkt.dw_time_sent,
+	       &(ot_scratch->ranging_broadcast_ss_send_times[ot_scratch->ranging_broadcast_ss_num]),
+	       sizeof(ot_scratch->pp_tag_poll_pkt.dw_time_sent));
+#endif
+
 	// Write the data
 	dwt_writetxdata(tx_len, (uint8_t*) &(ot_scratch->pp_tag_poll_pkt), 0);
 
 	// Start the transmission
-	if (ot_scratch->ranging_broadcast_ss_num == NUM_RANGING_BROADCASTS-1) {
+	if (ot_scratch->ranging_broadcast_ss_num == ot_scratch->pp_tag_poll_pkt.reply_after_subsequence) {
 		// This is the last broadcast ranging packet, so we want to transition
 		// to RX mode after this packet to receive the responses from the anchors.
 		dwt_setrxaftertxdelay(1); // us
@@ -330,7 +467,7 @@ static void send_poll () {
 // the tag sends broadcast packets.
 static void ranging_broadcast_subsequence_task () {
 
-	if (ot_scratch->ranging_broadcast_ss_num == NUM_RANGING_BROADCASTS-1) {
+	if (ot_scratch->ranging_broadcast_ss_num == ot_scratch->pp_tag_poll_pkt.reply_after_subsequence) {
 		// This is our last packet to send. Stop the timer so we don't generate
 		// more packets.
 		timer_stop(ot_scratch->tag_timer);
@@ -359,6 +496,10 @@ static void ranging_listening_window_task () {
 		// Stop the radio
 		dwt_forcetrxoff();
 
+		// Mark when we stopped listening so we know how long it takes
+		// to get the ranges to the host.
+		ot_scratch->listening_end_dw_time = dwt_readsystimestamphi32();
+
 		// This function finishes up this ranging event.
 		report_range();
 
@@ -376,13 +517,31 @@ static void ranging_listening_window_task () {
 	}
 }
 
+// Called right before the results go to the host
+static void record_report_latency () {
+	uint32_t latency_us = (dwt_readsystimestamphi32() - ot_scratch->listening_end_dw_time) / DW_DELAY_FROM_US(1);
+	_stats.last_report_us = latency_us;
+	if (latency_us > _stats.max_report_us) {
+		_stats.max_report_us = latency_us;
+	}
+}
+
 // Once we have heard from all of the anchors, calculate range.
 static void report_range () {
 	// New state
 	ot_scratch->state = TSTATE_CALCULATE_RANGE;
 
-	// Calculate ranges
-	//calculate_ranges();
+	// Calculate any ranges that weren't already done in the background
+	calculate_ranges();
+
+	// Use what the anchors heard this time to pick the next event's length
+	update_broadcast_count();
+
+	// Let the LWB master know which anchors we reach, so it can schedule
+	// tags that don't reach the same ones at the same time
+	for (uint8_t i=0; i<ot_scratch->anchor_response_count; i++) {
+		lwb_note_anchor(ot_scratch->anchor_responses[i].anchor_addr);
+	}
 
 	// Push data out over UART if configured to do so
 #ifdef UART_DATA_OFFLOAD
@@ -425,207 +584,170 @@ static void report_range () {
 	uart_write(2, footer);
 #endif
 
+	// We're done, so go to idle.
+	ot_scratch->state = TSTATE_IDLE;
+
 	// Decide what we should do with these ranges. We can either report
-	// these right back to the host, or we can try to get the anchors
-	// to calculate location.
+	// these right back to the host, or use them to find where we are.
+	// Either way this returns control to the main application and signals
+	// the end of the ranging event.
 	oneway_report_mode_e report_mode = oneway_get_config()->report_mode;
 	if (report_mode == ONEWAY_REPORT_MODE_RANGES) {
-		// We're done, so go to idle.
-		ot_scratch->state = TSTATE_IDLE;
-
 		// Just need to send the ranges back to the host. Send the array
 		// of ranges to the main application and let it deal with it.
-		// This also returns control to the main application and signals
-		// the end of the ranging event.
+		record_report_latency();
 		oneway_set_ranges(ot_scratch->ranges_millimeters, ot_scratch->anchor_responses);
 
-		// Check if we should try to sleep after the ranging event.
-		if (oneway_get_config()->sleep_mode) {
-			// Call stop() to sleep, it will be woken up automatically on
-			// the next call to start_ranging_event().
-			oneway_tag_stop();
-		}
-
 	} else if (report_mode == ONEWAY_REPORT_MODE_LOCATION) {
-		// TODO: implement this
+		// Find where we are and send just that to the host
+		uint16_t rms_residual_mm;
+		uint8_t num_anchors = calculate_location(&rms_residual_mm);
+		record_report_latency();
+		oneway_set_tag_location(num_anchors, ot_scratch->location.x, ot_scratch->location.y,
+		                        ot_scratch->location.z, rms_residual_mm);
 	}
-}
-
 
-// After getting responses from anchors calculate the range to each anchor.
-// These values are stored in ot_scratch->ranges_millimeters.
-static void calculate_ranges () {
-	// Clear array, don't use memset
-	for (uint8_t i=0; i<MAX_NUM_ANCHOR_RESPONSES; i++) {
-		ot_scratch->ranges_millimeters[i] = INT32_MAX;
+	// Check if we should try to sleep after the ranging event.
+	if (oneway_get_config()->sleep_mode) {
+		// Call stop() to sleep, it will be woken up automatically on
+		// the next call to start_ranging_event().
+		oneway_tag_stop();
 	}
+}
 
-	// Iterate through all anchors to calculate the range from the tag
-	// to each anchor
-	for (uint8_t anchor_index=0; anchor_index<ot_scratch->anchor_response_count; anchor_index++) {
-		anchor_responses_t* aresp = &(ot_scratch->anchor_responses[anchor_index]);
-
-		// Since the rxd TOAs are compressed to 16 bits, we first need to decompress them back to 64-bit quantities
-		uint64_t tag_poll_TOAs[NUM_RANGING_BROADCASTS];
-		memset(tag_poll_TOAs, 0, sizeof(tag_poll_TOAs));
-
-		// Get an estimate of clock offset
-		double approx_clock_offset = (double)(aresp->tag_poll_last_TOA - aresp->tag_poll_first_TOA) / (double)(ot_scratch->ranging_broadcast_ss_send_times[aresp->tag_poll_last_idx] - ot_scratch->ranging_broadcast_ss_send_times[aresp->tag_poll_first_idx]);
-
-		// First put in the TOA values that are known
-		tag_poll_TOAs[aresp->tag_poll_first_idx] = aresp->tag_poll_first_TOA;
-		tag_poll_TOAs[aresp->tag_poll_last_idx] = aresp->tag_poll_last_TOA;
-
-		// Then interpolate between the two to find the high 48 bits which fit best
-		uint8_t ii;
-		for(ii=aresp->tag_poll_first_idx+1; ii < aresp->tag_poll_last_idx; ii++){
-			uint64_t estimated_TOA = aresp->tag_poll_first_TOA + (approx_clock_offset*(ot_scratch->ranging_broadcast_ss_send_times[ii] - ot_scratch->ranging_broadcast_ss_send_times[aresp->tag_poll_first_idx]));
-
-			uint64_t actual_TOA = (estimated_TOA & 0xFFFFFFFFFFFF0000ULL) + aresp->tag_poll_TOAs[ii];
-
-			// Make corrections if we're off by more than 0x7FFF
-			if(actual_TOA < estimated_TOA - 0x7FFF)
-				actual_TOA += 0x10000;
-			else if(actual_TOA > estimated_TOA + 0x7FFF)
-				actual_TOA -= 0x10000;
-
-			// We're done -- store it...
-			tag_poll_TOAs[ii] = actual_TOA;
-		}
-
-		// First need to calculate the crystal offset between the anchor and tag.
-		// To do this, we need to get the timestamps at the anchor and tag
-		// for packets that are repeated. In the current scheme, the first
-		// three packets are repeated, where three is the number of channels.
-		// If we get multiple matches, we take the average of the clock offsets.
-		uint8_t valid_offset_calculations = 0;
-		double offset_ratios_sum = 0.0;
-		for (uint8_t j=0; j<NUM_RANGING_CHANNELS; j++) {
-			uint8_t first_broadcast_index = j;
-			uint8_t last_broadcast_index = NUM_RANGING_BROADCASTS - NUM_RANGING_CHANNELS + j;
-			uint64_t first_broadcast_send_time = ot_scratch->ranging_broadcast_ss_send_times[first_broadcast_index];
-			uint64_t first_broadcast_recv_time = tag_poll_TOAs[first_broadcast_index];
-			uint64_t last_broadcast_send_time  = ot_scratch->ranging_broadcast_ss_send_times[last_broadcast_index];
-			uint64_t last_broadcast_recv_time  = tag_poll_TOAs[last_broadcast_index];
-
-			// Now lets check that the anchor actually received both of these
-			// packets. If it didn't then this isn't valid.
-			if (first_broadcast_recv_time == 0 || last_broadcast_recv_time == 0) {
-				// A packet was dropped (or the anchor wasn't listening on the
-				// first channel). This isn't useful so we skip it.
-				continue;
-			}
-
-			// Calculate the "multiplier for the crystal offset between tag
-			// and anchor".
-			// (last_recv-first_recv) / (last_send-first_send)
-			double offset_anchor_over_tag_item = ((double) last_broadcast_recv_time - (double) first_broadcast_recv_time) /
-				((double) last_broadcast_send_time - (double) first_broadcast_send_time);
+// Find our location from the ranges to the anchors that told us where they
+// are. Returns how many anchors were used, or 0 if there wasn't a location.
+static uint8_t calculate_location (uint16_t* rms_residual_mm) {
+	oneway_location_t anchors[MAX_NUM_ANCHOR_RESPONSES];
+	int32_t ranges_mm[MAX_NUM_ANCHOR_RESPONSES];
+	uint8_t num_anchors = 0;
 
-			// Add this to the running sum for the average
-			offset_ratios_sum += offset_anchor_over_tag_item;
-			valid_offset_calculations++;
-		}
+	for (uint8_t i=0; i<ot_scratch->anchor_response_count; i++) {
+		struct pp_anchor_location* anchor_location = &(ot_scratch->anchor_locations[i]);
+		int32_t range = ot_scratch->ranges_millimeters[i];
 
-		// If we didn't get any matching pairs in the first and last rounds
-		// then we have to skip this anchor.
-		if (valid_offset_calculations == 0) {
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
+		// The error codes are all out of this range too
+		if (range < MIN_VALID_RANGE_MM || range > MAX_VALID_RANGE_MM ||
+		    anchor_location->x_cm == ONEWAY_LOCATION_UNKNOWN) {
 			continue;
 		}
 
-		// Calculate the average clock offset multiplier
-		double offset_anchor_over_tag = offset_ratios_sum / (double) valid_offset_calculations;
+		anchors[num_anchors].x = anchor_location->x_cm * 10;
+		anchors[num_anchors].y = anchor_location->y_cm * 10;
+		anchors[num_anchors].z = anchor_location->z_cm * 10;
+		ranges_mm[num_anchors] = MAX(range, 0);
+		num_anchors++;
+	}
 
-		// Now we need to use the one packet we have from the anchor
-		// to calculate a one-way time of flight measurement so that we can
-		// account for the time offset between the anchor and tag (i.e. the
-		// tag and anchors are not synchronized). We will use this TOF
-		// to calculate ranges from all of the other polls the tag sent.
-		// To do this, we need to match the anchor_antenna, tag_antenna, and
-		// channel between the anchor response and the correct tag poll.
-		uint8_t ss_index_matching = oneway_get_ss_index_from_settings(aresp->anchor_final_antenna_index,
-		                                                              aresp->window_packet_recv);
+	*rms_residual_mm = 0;
+	if (!oneway_calculate_location(anchors, ranges_mm, num_anchors, ot_scratch->location_valid,
+	                               &(ot_scratch->location), rms_residual_mm)) {
+		// The last location is still the best place to start next time
+		return 0;
+	}
 
-		// Exit early if the corresponding broadcast wasn't received
-		if(tag_poll_TOAs[ss_index_matching] == 0){
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_NO_OFFSET;
-			continue;
-		}
+	ot_scratch->location_valid = TRUE;
+	return MIN(num_anchors, ONEWAY_LOCATION_MAX_ANCHORS);
+}
 
-		uint64_t matching_broadcast_send_time = ot_scratch->ranging_broadcast_ss_send_times[ss_index_matching];
-		uint64_t matching_broadcast_recv_time = tag_poll_TOAs[ss_index_matching];
-		uint64_t response_send_time  = aresp->anc_final_tx_timestamp;
-		uint64_t response_recv_time  = aresp->anc_final_rx_timestamp;
 
-		double two_way_TOF = (((double) response_recv_time - (double) matching_broadcast_send_time)*offset_anchor_over_tag) -
-			((double) response_send_time - (double) matching_broadcast_recv_time);
-		double one_way_TOF = two_way_TOF / 2.0;
+// Calculate the range to the oldest anchor response that doesn't have one
+// yet. Returns FALSE if there was nothing left to do.
+static bool calculate_next_range () {
+	uint8_t anchor_index = ot_scratch->anchor_ranges_calculated;
 
+	if (anchor_index >= ot_scratch->anchor_response_count) {
+		return FALSE;
+	}
 
-		// Declare an array for sorting the ranges.
-		int distances_millimeters[NUM_RANGING_BROADCASTS] = {0};
-		uint8_t num_valid_distances = 0;
+	// Responses with ONEWAY_ANCHOR_RANGING get their range as soon as they
+	// arrive. Nothing else sets a range to INT32_MAX.
+	if (ot_scratch->ranges_millimeters[anchor_index] == INT32_MAX) {
+		uint32_t start = SysTick->VAL;
+
+		ot_scratch->ranges_millimeters[anchor_index] =
+			oneway_calculate_anchor_range(&(ot_scratch->anchor_responses[anchor_index]),
+			                              ot_scratch->ranging_broadcast_ss_send_times);
+
+		// This includes any interrupts that came in meanwhile
+		uint32_t cycles = (start - SysTick->VAL) & SysTick_LOAD_RELOAD_Msk;
+		_stats.ranges++;
+		_stats.last_range_cycles = cycles;
+		if (cycles > _stats.max_range_cycles) {
+			_stats.max_range_cycles = cycles;
+		}
+	}
+	ot_scratch->anchor_ranges_calculated++;
 
-		// Next we calculate the TOFs for each of the poll messages the tag sent.
-		for (uint8_t broadcast_index=0; broadcast_index<NUM_RANGING_BROADCASTS; broadcast_index++) {
-			uint64_t broadcast_send_time = ot_scratch->ranging_broadcast_ss_send_times[broadcast_index];
-			uint64_t broadcast_recv_time = tag_poll_TOAs[broadcast_index];
+	return TRUE;
+}
 
-			// Check that the anchor actually received the tag broadcast.
-			// We use 0 as a sentinel for the anchor not receiving the packet.
-			if (broadcast_recv_time == 0) {
-				continue;
-			}
+// After getting responses from anchors calculate the range to each anchor.
+// These values are stored in ot_scratch->ranges_millimeters.
+static void calculate_ranges () {
+	while (calculate_next_range());
+}
 
-			// We use the reference packet (that we used to calculate one_way_TOF)
-			// to compensate for the unsynchronized clock.
-			int64_t broadcast_anchor_offset = (int64_t) broadcast_recv_time - (int64_t) matching_broadcast_recv_time;
-			int64_t broadcast_tag_offset = (int64_t) broadcast_send_time - (int64_t) matching_broadcast_send_time;
-			double TOF = (double) broadcast_anchor_offset - (((double) broadcast_tag_offset) * offset_anchor_over_tag) + one_way_TOF;
+// Pick how many broadcasts the next ranging event needs. For each anchor
+// that responded, find the broadcast at which it had heard
+// ONEWAY_ADAPTIVE_TARGET_RANGES of them, and send up to the latest of those.
+// If any anchor didn't get that many, or no anchors responded at all, go
+// back to the full sequence.
+static void update_broadcast_count () {
+#ifdef ONEWAY_ADAPTIVE_BROADCASTS
+	uint8_t needed = ONEWAY_ADAPTIVE_MIN_BROADCASTS;
+
+	if (ot_scratch->anchor_response_count == 0) {
+		needed = NUM_RANGING_BROADCASTS;
+	}
 
-			int distance_millimeters = dwtime_to_millimeters(TOF);
+	for (uint8_t anchor_index=0; anchor_index<ot_scratch->anchor_response_count; anchor_index++) {
+		anchor_responses_t* aresp = &(ot_scratch->anchor_responses[anchor_index]);
+		uint8_t received = 0;
+		uint8_t ii;
 
-			// Check that the distance we have at this point is at all reasonable
-			if (distance_millimeters >= MIN_VALID_RANGE_MM && distance_millimeters <= MAX_VALID_RANGE_MM) {
-				// Add this to our sorted array of distances
-				insert_sorted(distances_millimeters, distance_millimeters, num_valid_distances);
-				num_valid_distances++;
+		for (ii=0; ii<ot_scratch->ranging_broadcast_count; ii++) {
+			if (aresp->tag_poll_TOAs[ii] != 0) {
+				received++;
+				if (received == ONEWAY_ADAPTIVE_TARGET_RANGES) {
+					break;
+				}
 			}
 		}
 
-		// Check to make sure that we got enough ranges from this anchor.
-		// If not, we just skip it.
-		if (num_valid_distances < MIN_VALID_RANGES_PER_ANCHOR) {
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_TOO_FEW_RANGES;
-			continue;
+		if (received < ONEWAY_ADAPTIVE_TARGET_RANGES) {
+			needed = NUM_RANGING_BROADCASTS;
+			break;
 		}
+		needed = MAX(needed, ii+1);
+	}
+
+	// Grow right away, but only shrink a little at a time so that one
+	// lucky event doesn't make the next one too short.
+	ot_scratch->ranging_broadcast_count = MAX(needed, ot_scratch->ranging_broadcast_count - NUM_RANGING_CHANNELS);
+#endif
+}
 
+const oneway_tag_stats_t* oneway_tag_stats () {
+	return &_stats;
+}
 
-		// Now that we have all of the calculated ranges from all of the tag
-		// broadcasts we can calculate some percentile range.
-		uint8_t bot = (num_valid_distances*RANGE_PERCENTILE_NUMERATOR)/RANGE_PERCENTILE_DENOMENATOR;
-		uint8_t top = bot+1;
-		// bot represents the whole index of the item at the percentile.
-		// Then we are going to use the remainder decimal portion to get
-		// a scaled value to add to that base. And we are going to do this
-		// without floating point, so buckle up.
-		// EXAMPLE: if the 90th percentile would be index 3.4, we do:
-		//                  distances[3] + 0.4*(distances[4]-distances[3])
-		int32_t result = distances_millimeters[bot] +
-			(((distances_millimeters[top]-distances_millimeters[bot]) * ((RANGE_PERCENTILE_NUMERATOR*num_valid_distances)
-			 - (bot*RANGE_PERCENTILE_DENOMENATOR))) / RANGE_PERCENTILE_DENOMENATOR);
-
-		// Save the result
-		ot_scratch->ranges_millimeters[anchor_index] = result;
-		// ot_scratch->ranges_millimeters[anchor_index] = (int32_t) one_way_TOF;
-		// ot_scratch->ranges_millimeters[anchor_index] = dm;
-		// ot_scratch->ranges_millimeters[anchor_index] = distances_millimeters[bot];
-		// ot_scratch->ranges_millimeters[anchor_index] = ot_scratch->ranging_broadcast_ss_send_times[0];
-		// ot_scratch->ranges_millimeters[anchor_index] = ss_index_matching;
-		// ot_scratch->ranges_millimeters[anchor_index] = num_valid_distances;
-		if (ot_scratch->ranges_millimeters[anchor_index] == INT32_MAX) {
-			ot_scratch->ranges_millimeters[anchor_index] = ONEWAY_TAG_RANGE_ERROR_MISC;
-		}
+// True between ranging events. During one the tag's timer and radio are
+// running on microsecond deadlines.
+bool oneway_tag_idle () {
+	return ot_scratch->state == TSTATE_IDLE;
+}
+
+// Called from the main loop when all interrupts have been handled.
+// While the listening windows are still open we use this time to get the
+// ranges to the anchors that have already responded, one anchor per call so
+// that new packets don't have to wait long. Returns TRUE if there might
+// be more work to do.
+bool oneway_tag_background_work () {
+#ifdef ONEWAY_INCREMENTAL_RANGING
+	if (ot_scratch->state == TSTATE_LISTENING) {
+		return calculate_next_range();
 	}
+#endif
+	return FALSE;
 }
@@ -2,6 +2,7 @@
 #define __ONEWAY_TAG_H
 
 #include "oneway_common.h"
+#include "oneway_location.h"
 #include "deca_device_api.h"
 #include "deca_regs.h"
 
@@ -31,8 +32,20 @@ typedef enum {
 #define ONEWAY_TAG_RANGE_ERROR_MISC 0x8000000F
 
 
-// Size buffers for reading in packets
-#define ONEWAY_TAG_MAX_RX_PKT_LEN 296
+// Size buffers for reading in packets. Big enough for every ANC_FINAL type
+// and the glossy packets, which oneway_tag.c checks.
+#define ONEWAY_TAG_MAX_RX_PKT_LEN 128
+
+// How long the tag's range calculation takes, in core clock cycles, and how
+// long after the listening windows end the results get to the host, for
+// HOST_CMD_READ_RANGING
+typedef struct {
+	uint32_t ranges;            // Anchor ranges calculated on the tag
+	uint32_t last_range_cycles; // How long the last one took
+	uint32_t max_range_cycles;  // The longest any one took
+	uint32_t last_report_us;    // From the end of listening to the host, last event
+	uint32_t max_report_us;     // The longest for any event
+} oneway_tag_stats_t;
 
 typedef struct {
 	// Our timer object that we use for timing packet transmissions
@@ -43,6 +56,10 @@ typedef struct {
 	// Which subsequence slot we are on when transmitting broadcast packets
 	// for ranging.
 	uint8_t ranging_broadcast_ss_num;
+
+	// How many broadcasts to send in this ranging event. This is only ever
+	// less than NUM_RANGING_BROADCASTS with ONEWAY_ADAPTIVE_BROADCASTS.
+	uint8_t ranging_broadcast_count;
 	
 	// Which slot we are in when receiving packets from the anchor.
 	uint8_t ranging_listening_window_num;
@@ -60,9 +77,31 @@ typedef struct {
 	// They use the same index as the _anchor_responses array.
 	// Invalid ranges are marked with INT32_MAX.
 	int32_t ranges_millimeters[MAX_NUM_ANCHOR_RESPONSES];
+
+	// Where each anchor said it was, same index as the _anchor_responses
+	// array. Only used with ONEWAY_REPORT_MODE_LOCATION.
+	struct pp_anchor_location anchor_locations[MAX_NUM_ANCHOR_RESPONSES];
+
+	// The last location we found. The next one starts from here because
+	// the tag usually hasn't moved far.
+	oneway_location_t location;
+	bool location_valid;
+
+	// How many of the anchor responses already have a range calculated.
+	// With ONEWAY_INCREMENTAL_RANGING this runs in the background while we
+	// are still listening for more responses.
+	uint8_t anchor_ranges_calculated;
+
+	// DW1000 time (upper 32 bits) when the last listening window ended.
+	// How long it takes from then until the ranges are handed to the host
+	// shows how much the incremental ranging saves.
+	uint32_t listening_end_dw_time;
 	
 	// Prepopulated struct of the outgoing broadcast poll packet.
 	struct pp_tag_poll pp_tag_poll_pkt;
+
+	// Where received packets are read to
+	uint8_t rx_buf[ONEWAY_TAG_MAX_RX_PKT_LEN];
 } oneway_tag_scratchspace_struct;
 
 oneway_tag_scratchspace_struct *ot_scratch;
@@ -70,5 +109,8 @@ oneway_tag_scratchspace_struct *ot_scratch;
 void oneway_tag_init (void *app_scratchspace);
 dw1000_err_e oneway_tag_start_ranging_event ();
 void oneway_tag_stop ();
+bool oneway_tag_background_work ();
+const oneway_tag_stats_t* oneway_tag_stats ();
+bool oneway_tag_idle ();
 
 #endif
@@ -6,6 +6,55 @@
 //#define GLOSSY_PER_TEST
 //#define GLOSSY_ANCHOR_SYNC_TEST
 
+// ONEWAY_FIXED_POINT_RANGING: Calculate ranges on the tag with integer math
+// instead of software floating point (see oneway_range.h). The host check in
+// software/simulation sets ONEWAY_DOUBLE_RANGING to build the other version.
+#ifndef ONEWAY_DOUBLE_RANGING
+#define ONEWAY_FIXED_POINT_RANGING
+#endif
+
+// ONEWAY_INCREMENTAL_RANGING: Calculate the range to each anchor as soon as
+// its response arrives instead of waiting for all listening windows to end
+#define ONEWAY_INCREMENTAL_RANGING
+
+// ONEWAY_SKEW_REGRESSION: Fit the tag/anchor clock offset with least squares
+// over every broadcast the anchor received instead of only using the
+// broadcasts that are repeated at the end of the sequence
+#define ONEWAY_SKEW_REGRESSION
+
+// ONEWAY_NO_REPEATED_BROADCASTS: Don't repeat the first broadcasts at the end
+// of the sequence. Needs ONEWAY_SKEW_REGRESSION. This changes the packet and
+// UART_DATA_OFFLOAD formats, so all tags, anchors, and host tools must agree.
+//#define ONEWAY_NO_REPEATED_BROADCASTS
+
+// ONEWAY_ADAPTIVE_BROADCASTS: Stop the broadcast sequence early if the anchors
+// heard in the last ranging event would still get enough ranges. The length
+// is picked at the start of each event. Shorter events range a little less
+// accurately, see adaptive_sim in software/simulation. Needs
+// ONEWAY_SKEW_REGRESSION.
+//#define ONEWAY_ADAPTIVE_BROADCASTS
+
+// ONEWAY_COMPACT_ANC_FINAL: Anchors respond with pp_anc_final_compact, which
+// only carries the TOAs the anchor actually received. Tags accept both.
+#define ONEWAY_COMPACT_ANC_FINAL
+
+// ONEWAY_ANCHOR_RX_DOUBLE_BUFFER: Anchors keep receiving into the other half
+// of the DW1000 RX buffer while a frame is read. This only helps when a
+// request flood deeper than a contention slot runs into the next ranging
+// event, see rxbuf_sim in software/simulation.
+//#define ONEWAY_ANCHOR_RX_DOUBLE_BUFFER
+
+// ONEWAY_ANCHOR_RANGING: Anchors calculate all but the last step of the range
+// themselves and respond with a short pp_anc_final_range. The tag puts its
+// send times in the broadcasts for this, so all tags and anchors must agree.
+// Needs ONEWAY_FIXED_POINT_RANGING.
+//#define ONEWAY_ANCHOR_RANGING
+
+// GLOSSY_CLOCK_TRACKER: Glossy slaves model their clock against the master's
+// (see glossy_clock.h) and use it to keep the LWB schedule going when they
+// miss sync floods. Needed for GLOSSY_SYNC_INTERVALS above 1.
+#define GLOSSY_CLOCK_TRACKER
+
 // FAST_RANGING_CONFIG: 6.8 Mbps
 // LONG_RANGING_CONFIG: 110 Kbps
 #define FAST_RANGING_CONFIG
@@ -2,34 +2,72 @@
 #define __TIMER_H
 
 #include "stm32f0xx.h"
+#include "system.h"
 
-// Number of supported timers
-#define TIMER_NUMBER 2
+// How many timers timer_init() can hand out. Any number of others can be
+// declared statically and passed straight to timer_start().
+#define TIMER_NUMBER 4
 
-typedef struct {
-	uint8_t                 index;
-	TIM_TypeDef*            tim_ptr;
-	NVIC_InitTypeDef        nvic_init;
-	TIM_TimeBaseInitTypeDef tim_init;
-	uint32_t                timer_clock;
-	uint32_t                divider;
-} stm_timer_t;
+// How long after a wakeup from stop mode the clocks take to come back, with
+// room to spare. timer_idle() wakes up this much before the next deadline.
+#ifndef TIMER_STOP_WAKE_US
+#define TIMER_STOP_WAKE_US 250
+#endif
+
+// Don't go into stop mode for less than this. The RTC has to be lined up
+// with timer_now() on the way in and out, which takes up to 100us awake.
+#ifndef TIMER_STOP_MIN_US
+#define TIMER_STOP_MIN_US 2000
+#endif
+
+// Longest stop before waking up anyway. The RTC time is only compared within
+// a minute.
+#define TIMER_STOP_MAX_US 30000000
+
+// How much time the LSI has to be measured against TIM17 before each update
+// of its rate. Stop mode isn't used until the first one.
+#ifndef TIMER_LSI_CAL_US
+#define TIMER_LSI_CAL_US 200000
+#endif
 
 typedef void (*timer_callback)();
 
-// NOTE: These timers are peculiar in that they fire
+// Where the time went, to see what saves power
+typedef struct {
+	uint64_t run_us;   // Awake
+	uint64_t sleep_us; // In sleep mode
+	uint64_t stop_us;  // In stop mode
+	uint32_t stops;    // Times stop mode was used
+} timer_idle_stats_t;
+
+// A software timer. They all run off TIM17, which counts microseconds and
+// interrupts at whichever of them expires first.
+typedef struct stm_timer {
+	struct stm_timer* next;       // Next timer to expire after this one
+	struct stm_timer* next_fired; // Next timer waiting for its callback
+	uint32_t          deadline;   // In timer_now() time
+	uint32_t          period;     // Between deadlines, or the delay of a one shot
+	timer_callback    callback;
+	bool              once;
+	bool              running;
+	bool              fired;
+} stm_timer_t;
+
+// NOTE: timer_start() timers are peculiar in that they fire
 // immediately then at the periodic interval.
 
 stm_timer_t* timer_init ();
-void timer_disable_interrupt (stm_timer_t* t);
-void timer_enable_interrupt (stm_timer_t* t);
 void timer_start (stm_timer_t* t, uint32_t us_period, timer_callback);
+void timer_start_once (stm_timer_t* t, uint32_t us_delay, timer_callback);
 void timer_reset (stm_timer_t* t, uint32_t val_us);
 void timer_stop (stm_timer_t* t);
+uint32_t timer_now ();
 
+// Sleep until an interrupt. Call with interrupts masked.
+void timer_idle (bool stop_ok);
+const timer_idle_stats_t* timer_idle_stats ();
 
 // Only used for interrupt handling
-void timer_17_fired ();
-void timer_16_fired ();
+void timer_fired ();
 
 #endif
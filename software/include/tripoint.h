@@ -49,6 +49,7 @@
 #define SPI1_RX_DMA_CHANNEL              DMA1_Channel2
 #define SPI1_RX_DMA_FLAG_TC              DMA1_FLAG_TC2
 #define SPI1_RX_DMA_FLAG_GL              DMA1_FLAG_GL2
+#define SPI1_RX_DMA_IT_TC                DMA1_IT_TC2
 #define SPI1_DMA_IRQn                    DMA1_Channel2_3_IRQn
 
 #define USART1_DR_ADDRESS                0x40013828
@@ -0,0 +1,419 @@
+// Check the accuracy and cost of the tag's location solver
+// (firmware/oneway_location.c) on a PC.
+//
+// The tag positions come from the IPSN 2015 localization competition data.
+// For each one the ranges to the anchors are simulated with noise and some
+// NLOS bias, and the location is solved for with the firmware's integer
+// solver and with a double precision Levenberg-Marquardt for reference.
+//
+// The solver is built with LOCATION_COUNT_OP (see location_ops.h) counting
+// the operations that are expensive on the STM32F031, which is turned into a
+// rough cycle estimate at the end.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oneway_location.h"
+
+#define DEFAULT_POSITIONS "../../data/ipsn-loc-comp-2015/competition_data_stripped.txt"
+
+#define MAX_POSITIONS 4096
+
+// The tag keeps at most this many anchor responses (MAX_NUM_ANCHOR_RESPONSES)
+#define MAX_ANCHORS_HEARD 8
+
+// Rough Cortex-M0 cycle costs. The divisions are libgcc's, the square root
+// is the 32 iteration loop in oneway_location.c, and RANGE and STEP cover
+// the 64 bit multiplies done for each anchor and for each solve_step().
+#define CYCLES_DIV32 100
+#define CYCLES_DIV64 1000
+#define CYCLES_ISQRT 600
+#define CYCLES_RANGE 250
+#define CYCLES_STEP  1500
+#define CPU_MHZ      48
+
+location_ops_t location_ops;
+
+// Anchor positions in meters, from contiki/tools/pp_oneway_loc.py
+static const double anchor_positions[][3] = {
+	{15.236,  0.502, 2},
+	{9.470,   0.502, 2},
+	{3.856,   0.502, 2},
+	{0.055,  12.955, 2},
+	{3.863,  12.526, 2},
+	{12.535, -0.081, 4.646},
+	{0.055,   4.063, 2},
+	{0.055,   8.228, 2},
+	{0.916,  13.127, 4.646},
+	{15.603,  3.383, 4.646},
+	{6.832,  13.127, 4.646},
+	{6.81,   -0.081, 4.646},
+	{9.470,   0.502, 0.057},
+	{0.898,  -0.081, 4.646},
+	{3.863,  12.526, 0.057},
+};
+#define NUM_ANCHORS (sizeof(anchor_positions)/sizeof(anchor_positions[0]))
+
+typedef struct {
+	double sigma_mm;
+	double nlos_prob;
+	double nlos_max_mm;
+	double drop_prob;
+	int trials;
+} bench_config_t;
+
+typedef struct {
+	double* errors_3d;
+	double* errors_2d;
+	size_t num;
+	size_t failed;
+} error_stats_t;
+
+static double uniform () {
+	return (rand() + 0.5) / ((double) RAND_MAX + 1.0);
+}
+
+static double gaussian () {
+	return sqrt(-2.0 * log(uniform())) * cos(2.0 * M_PI * uniform());
+}
+
+static int cmp_double (const void* a, const void* b) {
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile (double* values, size_t num, double p) {
+	if (num == 0) {
+		return NAN;
+	}
+	qsort(values, num, sizeof(double), cmp_double);
+	return values[(size_t) (p * (num - 1))];
+}
+
+static void record_error (error_stats_t* stats, const double* truth, const double* estimate) {
+	double dx = estimate[0] - truth[0];
+	double dy = estimate[1] - truth[1];
+	double dz = estimate[2] - truth[2];
+	stats->errors_3d[stats->num] = sqrt(dx*dx + dy*dy + dz*dz);
+	stats->errors_2d[stats->num] = sqrt(dx*dx + dy*dy);
+	stats->num++;
+}
+
+static void print_errors (const char* name, error_stats_t* stats) {
+	printf("%-10s %8zu %6zu   %6.3f %6.3f %6.3f   %6.3f %6.3f\n", name, stats->num, stats->failed,
+	       percentile(stats->errors_3d, stats->num, 0.5),
+	       percentile(stats->errors_3d, stats->num, 0.9),
+	       percentile(stats->errors_3d, stats->num, 0.99),
+	       percentile(stats->errors_2d, stats->num, 0.5),
+	       percentile(stats->errors_2d, stats->num, 0.9));
+}
+
+// Double precision version of the same fit, run to convergence. Like the
+// firmware, z is held fixed with only three anchors.
+static void reference_solve (double anchors[][3], double* ranges, int num, double* location) {
+	int dims = (num > ONEWAY_LOCATION_MIN_ANCHORS) ? 3 : 2;
+	double lambda = 1.0/16;
+
+	double cost = 0;
+	for (int iter=0; iter<200; iter++) {
+		double A[3][3] = {{0}};
+		double g[3] = {0};
+		cost = 0;
+
+		for (int i=0; i<num; i++) {
+			double d[3];
+			double dist = 0;
+			for (int k=0; k<3; k++) {
+				d[k] = location[k] - anchors[i][k];
+				dist += d[k]*d[k];
+			}
+			dist = sqrt(dist);
+			double r = dist - ranges[i];
+			cost += r*r;
+			for (int j=0; j<3; j++) {
+				double uj = (dist > 0) ? d[j]/dist : 0;
+				g[j] += uj*r;
+				for (int k=0; k<3; k++) {
+					double uk = (dist > 0) ? d[k]/dist : 0;
+					A[j][k] += uj*uk;
+				}
+			}
+		}
+
+		// Take the LM step that lowers the cost
+		int improved = 0;
+		while (!improved && lambda < 1e6) {
+			double M[3][3];
+			memcpy(M, A, sizeof(M));
+			for (int j=0; j<3; j++) {
+				M[j][j] *= 1 + lambda;
+			}
+			if (dims == 2) {
+				M[0][2] = M[1][2] = M[2][0] = M[2][1] = 0;
+				M[2][2] = 1;
+			}
+			double b[3] = {g[0], g[1], (dims == 2) ? 0 : g[2]};
+
+			double det = M[0][0]*(M[1][1]*M[2][2] - M[1][2]*M[2][1])
+			           - M[0][1]*(M[1][0]*M[2][2] - M[1][2]*M[2][0])
+			           + M[0][2]*(M[1][0]*M[2][1] - M[1][1]*M[2][0]);
+			if (fabs(det) < 1e-12) {
+				return;
+			}
+			double step[3];
+			for (int j=0; j<3; j++) {
+				double Mj[3][3];
+				memcpy(Mj, M, sizeof(Mj));
+				for (int k=0; k<3; k++) {
+					Mj[k][j] = b[k];
+				}
+				step[j] = (Mj[0][0]*(Mj[1][1]*Mj[2][2] - Mj[1][2]*Mj[2][1])
+				         - Mj[0][1]*(Mj[1][0]*Mj[2][2] - Mj[1][2]*Mj[2][0])
+				         + Mj[0][2]*(Mj[1][0]*Mj[2][1] - Mj[1][1]*Mj[2][0])) / det;
+			}
+
+			double trial[3];
+			double trial_cost = 0;
+			for (int k=0; k<3; k++) {
+				trial[k] = location[k] - step[k];
+			}
+			for (int i=0; i<num; i++) {
+				double dist = 0;
+				for (int k=0; k<3; k++) {
+					dist += (trial[k]-anchors[i][k])*(trial[k]-anchors[i][k]);
+				}
+				double r = sqrt(dist) - ranges[i];
+				trial_cost += r*r;
+			}
+
+			if (trial_cost < cost) {
+				memcpy(location, trial, sizeof(trial));
+				lambda /= 2;
+				improved = 1;
+				if (fabs(step[0]) + fabs(step[1]) + fabs(step[2]) < 1e-4) {
+					return;
+				}
+			} else {
+				lambda *= 4;
+			}
+		}
+		if (!improved) {
+			return;
+		}
+	}
+}
+
+// Time a solve and add up the operations it took
+static bool timed_solve (oneway_location_t* anchors, int32_t* ranges_mm, uint8_t num, bool have_guess,
+                         oneway_location_t* location, location_ops_t* ops, double* seconds) {
+	location_ops_t before = location_ops;
+	struct timespec t0, t1;
+	uint16_t rms;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	bool ok = oneway_calculate_location(anchors, ranges_mm, num, have_guess, location, &rms);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	*seconds += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)*1e-9;
+	ops->RANGE += location_ops.RANGE - before.RANGE;
+	ops->STEP  += location_ops.STEP  - before.STEP;
+	ops->ISQRT += location_ops.ISQRT - before.ISQRT;
+	ops->DIV32 += location_ops.DIV32 - before.DIV32;
+	ops->DIV64 += location_ops.DIV64 - before.DIV64;
+	return ok;
+}
+
+static void print_cost (const char* name, location_ops_t* ops, double seconds, size_t solves) {
+	double cycles = ((double) ops->DIV32*CYCLES_DIV32) + ((double) ops->DIV64*CYCLES_DIV64) +
+	                ((double) ops->ISQRT*CYCLES_ISQRT) + ((double) ops->RANGE*CYCLES_RANGE) +
+	                ((double) ops->STEP*CYCLES_STEP);
+	printf("%-10s %6.1f %6.1f %6.1f %6.1f %6.1f   %6.2f   %7.0f %6.2f\n", name,
+	       (double) ops->RANGE / solves, (double) ops->STEP / solves, (double) ops->ISQRT / solves,
+	       (double) ops->DIV32 / solves, (double) ops->DIV64 / solves,
+	       seconds / solves * 1e6, cycles / solves, (cycles / solves) / (CPU_MHZ * 1000.0));
+}
+
+static size_t read_positions (const char* filename, double positions[][3]) {
+	FILE* f = fopen(filename, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	size_t num = 0;
+	while (num < MAX_POSITIONS &&
+	       fscanf(f, "%lf %lf %lf", &positions[num][0], &positions[num][1], &positions[num][2]) == 3) {
+		num++;
+	}
+	fclose(f);
+	return num;
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-t trials] [-s sigma_mm] [-n nlos_prob] [-b nlos_max_mm] [-d drop_prob] [positions]\n", name);
+}
+
+int main (int argc, char** argv) {
+	bench_config_t config = {
+		.sigma_mm = 100,
+		.nlos_prob = 0.1,
+		.nlos_max_mm = 600,
+		.drop_prob = 0.2,
+		.trials = 100,
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:n:b:d:h")) != -1) {
+		switch (opt) {
+			case 't': config.trials = atoi(optarg); break;
+			case 's': config.sigma_mm = atof(optarg); break;
+			case 'n': config.nlos_prob = atof(optarg); break;
+			case 'b': config.nlos_max_mm = atof(optarg); break;
+			case 'd': config.drop_prob = atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	const char* filename = (optind < argc) ? argv[optind] : DEFAULT_POSITIONS;
+
+	static double positions[MAX_POSITIONS][3];
+	size_t num_positions = read_positions(filename, positions);
+	if (num_positions == 0) {
+		fprintf(stderr, "Could not read any positions from %s\n", filename);
+		return 1;
+	}
+
+	size_t max_solves = num_positions * config.trials;
+	error_stats_t cold = {malloc(max_solves*sizeof(double)), malloc(max_solves*sizeof(double)), 0, 0};
+	error_stats_t warm = {malloc(max_solves*sizeof(double)), malloc(max_solves*sizeof(double)), 0, 0};
+	error_stats_t ref  = {malloc(max_solves*sizeof(double)), malloc(max_solves*sizeof(double)), 0, 0};
+	double* solver_diff = malloc(max_solves*sizeof(double));
+	size_t num_diff = 0;
+	location_ops_t cold_ops = {0};
+	location_ops_t warm_ops = {0};
+	double cold_seconds = 0;
+	double warm_seconds = 0;
+
+	srand(1);
+
+	for (int trial=0; trial<config.trials; trial++) {
+		// Warm starts follow the tag through the positions in order, the way
+		// the tag reuses its last location.
+		oneway_location_t last = {0, 0, 0};
+		bool have_last = FALSE;
+
+		for (size_t p=0; p<num_positions; p++) {
+			// Ranges to every anchor, then keep the closest ones the tag heard
+			double dists[NUM_ANCHORS];
+			int order[NUM_ANCHORS];
+			for (size_t a=0; a<NUM_ANCHORS; a++) {
+				double dx = positions[p][0] - anchor_positions[a][0];
+				double dy = positions[p][1] - anchor_positions[a][1];
+				double dz = positions[p][2] - anchor_positions[a][2];
+				dists[a] = sqrt(dx*dx + dy*dy + dz*dz);
+				order[a] = a;
+			}
+			for (size_t i=1; i<NUM_ANCHORS; i++) {
+				for (size_t j=i; j>0 && dists[order[j]] < dists[order[j-1]]; j--) {
+					int t = order[j];
+					order[j] = order[j-1];
+					order[j-1] = t;
+				}
+			}
+
+			oneway_location_t anchors[MAX_ANCHORS_HEARD];
+			double anchors_m[MAX_ANCHORS_HEARD][3];
+			int32_t ranges_mm[MAX_ANCHORS_HEARD];
+			double ranges_m[MAX_ANCHORS_HEARD];
+			int num = 0;
+			for (size_t i=0; i<NUM_ANCHORS && num<MAX_ANCHORS_HEARD; i++) {
+				int a = order[i];
+				if (uniform() < config.drop_prob) {
+					continue;
+				}
+				double range = dists[a]*1000 + config.sigma_mm*gaussian();
+				if (uniform() < config.nlos_prob) {
+					range += config.nlos_max_mm*uniform();
+				}
+
+				// Anchors send their location in centimeters
+				anchors[num].x = lround(anchor_positions[a][0]*100)*10;
+				anchors[num].y = lround(anchor_positions[a][1]*100)*10;
+				anchors[num].z = lround(anchor_positions[a][2]*100)*10;
+				anchors_m[num][0] = anchors[num].x / 1000.0;
+				anchors_m[num][1] = anchors[num].y / 1000.0;
+				anchors_m[num][2] = anchors[num].z / 1000.0;
+				ranges_mm[num] = (int32_t) range;
+				ranges_m[num] = ranges_mm[num] / 1000.0;
+				num++;
+			}
+
+			// Cold start, which is what gets timed
+			oneway_location_t location;
+			bool ok = timed_solve(anchors, ranges_mm, num, FALSE, &location, &cold_ops, &cold_seconds);
+
+			double cold_m[3] = {location.x/1000.0, location.y/1000.0, location.z/1000.0};
+			if (ok) {
+				record_error(&cold, positions[p], cold_m);
+			} else {
+				cold.failed++;
+			}
+
+			// Reference from the same starting point
+			double ref_m[3] = {0, 0, 0};
+			for (int i=0; i<num; i++) {
+				for (int k=0; k<3; k++) {
+					ref_m[k] += anchors_m[i][k] / num;
+				}
+			}
+			if (num >= ONEWAY_LOCATION_MIN_ANCHORS) {
+				reference_solve(anchors_m, ranges_m, num, ref_m);
+				record_error(&ref, positions[p], ref_m);
+				if (ok) {
+					double dx = cold_m[0]-ref_m[0], dy = cold_m[1]-ref_m[1], dz = cold_m[2]-ref_m[2];
+					solver_diff[num_diff++] = sqrt(dx*dx + dy*dy + dz*dz);
+				}
+			} else {
+				ref.failed++;
+			}
+
+			// Warm start from the last location
+			location = last;
+			if (timed_solve(anchors, ranges_mm, num, have_last, &location, &warm_ops, &warm_seconds)) {
+				double warm_m[3] = {location.x/1000.0, location.y/1000.0, location.z/1000.0};
+				record_error(&warm, positions[p], warm_m);
+				last = location;
+				have_last = TRUE;
+			} else {
+				warm.failed++;
+			}
+		}
+	}
+
+	printf("%zu positions from %s, %d trials each\n", num_positions, filename, config.trials);
+	printf("Ranges: sigma %.0f mm, %.0f%% NLOS up to +%.0f mm, %.0f%% of anchors dropped, closest %d kept\n\n",
+	       config.sigma_mm, config.nlos_prob*100, config.nlos_max_mm, config.drop_prob*100, MAX_ANCHORS_HEARD);
+
+	printf("                          3D error (m)           2D error (m)\n");
+	printf("solver        solves failed   p50    p90    p99      p50    p90\n");
+	print_errors("cold", &cold);
+	print_errors("warm", &warm);
+	print_errors("reference", &ref);
+
+	printf("\nInteger solver vs reference: p50 %.1f mm, p90 %.1f mm, p99 %.1f mm\n",
+	       percentile(solver_diff, num_diff, 0.5)*1000,
+	       percentile(solver_diff, num_diff, 0.9)*1000,
+	       percentile(solver_diff, num_diff, 0.99)*1000);
+
+	size_t solves = num_positions * config.trials;
+	printf("\nPer solve   evals  steps  isqrt  div32  div64  host us  M0 cycles    ms\n");
+	print_cost("cold", &cold_ops, cold_seconds, solves);
+	print_cost("warm", &warm_ops, warm_seconds, solves);
+	printf("(M0 cycles are a rough estimate at %d MHz, see CYCLES_* in %s)\n", CPU_MHZ, __FILE__);
+
+	return 0;
+}
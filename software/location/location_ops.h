@@ -0,0 +1,21 @@
+#ifndef __LOCATION_OPS_H
+#define __LOCATION_OPS_H
+
+#include <stdint.h>
+
+// Forced in front of firmware/oneway_location.c so the benchmark can count
+// the operations that dominate its run time on the Cortex-M0.
+
+typedef struct {
+	uint64_t RANGE;  // One anchor evaluated at one candidate location
+	uint64_t STEP;   // Normal equations solved in solve_step()
+	uint64_t ISQRT;  // 64 bit integer square roots
+	uint64_t DIV32;  // 32 bit divisions (__aeabi_idiv)
+	uint64_t DIV64;  // 64 bit divisions (__aeabi_ldivmod)
+} location_ops_t;
+
+extern location_ops_t location_ops;
+
+#define LOCATION_COUNT_OP(_op) (location_ops._op++)
+
+#endif
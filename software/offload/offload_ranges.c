@@ -0,0 +1,226 @@
+// Calculate ranges from a capture of the tag's UART_DATA_OFFLOAD output.
+//
+// This does the same math as firmware/data_dump_glossy.py, but for a whole
+// capture file at once and using all of the cores on the machine.
+//
+// Output is one line per range: <timestamp> <anchor EUI> <range in meters>
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ranging_offload.h"
+
+// Same start time data_dump_glossy.py uses for the first frame
+#define DEFAULT_START_TIME 1459998187.496
+
+// How many events a worker thread takes at once
+#define EVENTS_PER_CHUNK 4096
+
+#define MAX_THREADS 256
+
+typedef struct {
+	const offload_config_t* config;
+	const uint8_t* capture;
+	const offload_index_t* index;
+	// Where in ranges each event's results start
+	const size_t* range_offsets;
+	offload_range_t* ranges;
+	uint8_t* num_ranges;
+	// Next event that no worker has claimed yet
+	atomic_size_t next_event;
+} work_t;
+
+static void* worker (void* arg) {
+	work_t* work = (work_t*) arg;
+
+	while (1) {
+		size_t start = atomic_fetch_add(&work->next_event, EVENTS_PER_CHUNK);
+		if (start >= work->index->num_events) {
+			break;
+		}
+
+		size_t end = start + EVENTS_PER_CHUNK;
+		if (end > work->index->num_events) {
+			end = work->index->num_events;
+		}
+
+		for (size_t i=start; i<end; i++) {
+			work->num_ranges[i] = offload_calculate_event(work->config,
+			                                              work->capture,
+			                                              &work->index->events[i],
+			                                              &work->ranges[work->range_offsets[i]]);
+		}
+	}
+
+	return NULL;
+}
+
+static uint8_t* read_file (const char* filename, size_t* len) {
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+
+	size_t capacity = 1 << 20;
+	uint8_t* buf = malloc(capacity);
+	*len = 0;
+
+	while (buf != NULL) {
+		*len += fread(buf + *len, 1, capacity - *len, f);
+		if (*len < capacity) {
+			break;
+		}
+		capacity *= 2;
+		uint8_t* bigger = realloc(buf, capacity);
+		if (bigger == NULL) {
+			free(buf);
+		}
+		buf = bigger;
+	}
+
+	fclose(f);
+	return buf;
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-l] [-r] [-j threads] [-s start_time] [-o outfile] capture\n", name);
+	fprintf(stderr, "  -l  fit the clock offset over all broadcasts (ONEWAY_SKEW_REGRESSION)\n");
+	fprintf(stderr, "  -r  tag was built with ONEWAY_NO_REPEATED_BROADCASTS, implies -l\n");
+}
+
+int main (int argc, char** argv) {
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double start_time = DEFAULT_START_TIME;
+	FILE* out = stdout;
+	offload_config_t config = {
+		.num_broadcasts = MAX_RANGING_BROADCASTS,
+		.skew_regression = false,
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "lrj:s:o:h")) != -1) {
+		switch (opt) {
+			case 'l':
+				config.skew_regression = true;
+				break;
+			case 'r':
+				config.num_broadcasts = NUM_UNIQUE_PACKET_CONFIGURATIONS;
+				config.skew_regression = true;
+				break;
+			case 'j':
+				num_threads = strtol(optarg, NULL, 10);
+				break;
+			case 's':
+				start_time = strtod(optarg, NULL);
+				break;
+			case 'o':
+				out = fopen(optarg, "w");
+				if (out == NULL) {
+					fprintf(stderr, "Could not open %s: %s\n", optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (num_threads < 1) {
+		num_threads = 1;
+	} else if (num_threads > MAX_THREADS) {
+		num_threads = MAX_THREADS;
+	}
+
+	size_t len;
+	uint8_t* capture = read_file(argv[optind], &len);
+	if (capture == NULL) {
+		fprintf(stderr, "Could not read %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	// Find all of the frames first. This has to be done in order since
+	// a bad frame changes where the search for the next one starts.
+	offload_index_t index;
+	if (!offload_index_capture(&config, capture, len, start_time, &index)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	// Give every event room for all of its anchors
+	size_t* range_offsets = malloc((index.num_events + 1) * sizeof(size_t));
+	uint8_t* num_ranges = malloc((index.num_events + 1) * sizeof(uint8_t));
+	if (range_offsets == NULL || num_ranges == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	range_offsets[0] = 0;
+	for (size_t i=0; i<index.num_events; i++) {
+		range_offsets[i+1] = range_offsets[i] + index.events[i].num_anchors;
+	}
+	offload_range_t* ranges = malloc((range_offsets[index.num_events] + 1) * sizeof(offload_range_t));
+	if (ranges == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	// Calculate all of the ranges in parallel
+	work_t work = {
+		.config = &config,
+		.capture = capture,
+		.index = &index,
+		.range_offsets = range_offsets,
+		.ranges = ranges,
+		.num_ranges = num_ranges,
+	};
+	atomic_init(&work.next_event, 0);
+
+	pthread_t threads[MAX_THREADS];
+	for (long i=1; i<num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, worker, &work) != 0) {
+			num_threads = i;
+			break;
+		}
+	}
+	worker(&work);
+	for (long i=1; i<num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// And print them in the order they were captured
+	size_t total_ranges = 0;
+	for (size_t i=0; i<index.num_events; i++) {
+		for (uint8_t j=0; j<num_ranges[i]; j++) {
+			offload_range_t* r = &ranges[range_offsets[i] + j];
+			fprintf(out, "%.3f\t%02x%02x%02x%02x%02x%02x%02x%02x\t%.6f\n",
+			        index.events[i].timestamp,
+			        r->anchor_eui[7], r->anchor_eui[6], r->anchor_eui[5], r->anchor_eui[4],
+			        r->anchor_eui[3], r->anchor_eui[2], r->anchor_eui[1], r->anchor_eui[0],
+			        r->range_mm / 1000);
+		}
+		total_ranges += num_ranges[i];
+	}
+
+	fprintf(stderr, "Good %zu\nBad  %zu\nTotal ranges %zu\n", index.num_events, index.num_bad, total_ranges);
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(ranges);
+	free(num_ranges);
+	free(range_offsets);
+	offload_index_free(&index);
+	free(capture);
+
+	return 0;
+}
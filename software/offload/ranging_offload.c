@@ -0,0 +1,428 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ranging_offload.h"
+
+// All of these match firmware/data_dump_glossy.py so that the results
+// from both are the same.
+#define DWT_TIME_UNITS (1.0/499.2e6/128.0)
+#define SPEED_OF_LIGHT 2.99792458e8
+#define AIR_N 1.0003
+#define RANGE_OFFSET_MM 121.591
+#define RANGE_PERCENTILE 0.1
+#define MAX_VALID_RANGE_MM (1000*30)
+
+static const uint8_t HEADER[OFFLOAD_HEADER_LEN] = {0x80, 0x01, 0x80, 0x01};
+static const uint8_t DATA_HEADER[OFFLOAD_DATA_HEADER_LEN] = {0x80, 0x80};
+static const uint8_t FOOTER[OFFLOAD_FOOTER_LEN] = {0x80, 0xfe};
+
+// Offsets of the fields in a dumped anchor_responses_t
+#define ANCHOR_ADDR_OFFSET        0
+#define FINAL_ANTENNA_OFFSET      (ANCHOR_ADDR_OFFSET+EUI_LEN)
+#define WINDOW_PACKET_RECV_OFFSET (FINAL_ANTENNA_OFFSET+1)
+#define FINAL_TX_OFFSET           (WINDOW_PACKET_RECV_OFFSET+1)
+#define FINAL_RX_OFFSET           (FINAL_TX_OFFSET+8)
+#define FIRST_IDX_OFFSET          (FINAL_RX_OFFSET+8)
+#define FIRST_TOA_OFFSET          (FIRST_IDX_OFFSET+1)
+#define LAST_IDX_OFFSET           (FIRST_TOA_OFFSET+8)
+#define LAST_TOA_OFFSET           (LAST_IDX_OFFSET+1)
+#define TOAS_OFFSET               (LAST_TOA_OFFSET+8)
+
+
+/******************************************************************************/
+// Helpers
+/******************************************************************************/
+
+static uint64_t read_uint64 (const uint8_t* buf) {
+	uint64_t ret = 0;
+	for (int i=7; i>=0; i--) {
+		ret = (ret << 8) | buf[i];
+	}
+	return ret;
+}
+
+static uint16_t read_uint16 (const uint8_t* buf) {
+	return buf[0] | (buf[1] << 8);
+}
+
+// Same as oneway_get_ss_index_from_settings() in the firmware
+static uint8_t get_ss_index_from_settings (uint8_t anchor_antenna_index, uint8_t window_num) {
+	uint8_t tag_antenna_index = 0;
+	uint8_t channel_index = window_num % NUM_RANGING_CHANNELS;
+
+	return (tag_antenna_index * NUM_RANGING_CHANNELS * NUM_RANGING_CHANNELS) +
+	       (anchor_antenna_index * NUM_RANGING_CHANNELS) +
+	       channel_index;
+}
+
+// Find the k-th smallest value in arr, reordering it (quickselect)
+static double select_kth (double arr[], int num, int k) {
+	int lo = 0;
+	int hi = num - 1;
+
+	while (lo < hi) {
+		int mid = lo + ((hi - lo) / 2);
+		double temp;
+		if (arr[mid] < arr[lo]) { temp = arr[mid]; arr[mid] = arr[lo]; arr[lo] = temp; }
+		if (arr[hi] < arr[lo])  { temp = arr[hi];  arr[hi] = arr[lo];  arr[lo] = temp; }
+		if (arr[hi] < arr[mid]) { temp = arr[hi];  arr[hi] = arr[mid]; arr[mid] = temp; }
+		double pivot = arr[mid];
+
+		int i = lo;
+		int j = hi;
+		while (i <= j) {
+			while (arr[i] < pivot) i++;
+			while (arr[j] > pivot) j--;
+			if (i <= j) {
+				temp = arr[i];
+				arr[i] = arr[j];
+				arr[j] = temp;
+				i++;
+				j--;
+			}
+		}
+
+		if (k <= j) {
+			hi = j;
+		} else if (k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+
+	return arr[k];
+}
+
+// Least squares fit of the clock offset over every broadcast the anchor
+// received. Each channel gets its own intercept since the antenna delays are
+// different on each channel. Same as skew_regression() in
+// data_dump_glossy.py, which mirrors offset_regression() in the firmware.
+static bool skew_regression (int num_broadcasts, const uint64_t* send_times,
+                             const int64_t* tag_poll_TOAs, double* offset) {
+	double sum_xx = 0;
+	double sum_xr = 0;
+
+	for (int ch=0; ch<NUM_RANGING_CHANNELS; ch++) {
+		int ref = -1;
+		int n = 0;
+		double sx = 0, sr = 0, sxx = 0, sxr = 0;
+
+		for (int i=ch; i<num_broadcasts; i+=NUM_RANGING_CHANNELS) {
+			if ((tag_poll_TOAs[i] & 0xFFFF) == 0) {
+				continue;
+			}
+			if (ref < 0) {
+				ref = i;
+			}
+
+			int64_t send_delta = (int64_t) send_times[i] - (int64_t) send_times[ref];
+			int64_t skew = (tag_poll_TOAs[i] - tag_poll_TOAs[ref]) - send_delta;
+			// Drop broadcasts with bad timestamps
+			if (llabs(skew) > (send_delta >> 10)) {
+				continue;
+			}
+
+			double x = (double) send_delta;
+			double r = (double) skew;
+			n++;
+			sx += x;
+			sr += r;
+			sxx += x*x;
+			sxr += x*r;
+		}
+
+		if (n < 2) {
+			continue;
+		}
+		sum_xx += sxx - ((sx*sx) / n);
+		sum_xr += sxr - ((sx*sr) / n);
+	}
+
+	if (sum_xx <= 0) {
+		return false;
+	}
+	double skew = sum_xr / sum_xx;
+	if (fabs(skew) > 1.0/1024) {
+		return false;
+	}
+	*offset = 1 + skew;
+	return true;
+}
+
+// Linearly interpolated percentile, computed the same way as numpy's
+// default np.percentile(). Reorders arr.
+static double percentile (double arr[], int num, double q) {
+	double virtual_index = (num - 1) * q;
+	int prev = (int) floor(virtual_index);
+	double gamma = virtual_index - prev;
+
+	double a = select_kth(arr, num, prev);
+
+	// Everything after prev is no smaller, so the next value in sorted
+	// order is the smallest of those.
+	double b = a;
+	if (prev + 1 < num) {
+		b = arr[prev+1];
+		for (int i=prev+2; i<num; i++) {
+			if (arr[i] < b) {
+				b = arr[i];
+			}
+		}
+	}
+
+	double diff_b_a = b - a;
+	if (gamma >= 0.5) {
+		return b - (diff_b_a * (1 - gamma));
+	}
+	return a + (diff_b_a * gamma);
+}
+
+
+/******************************************************************************/
+// Range calculation
+/******************************************************************************/
+
+// Calculate the range to one anchor. anchor points to a dumped
+// anchor_responses_t. Returns false if there is no valid range.
+bool offload_calculate_anchor_range (const offload_config_t* config, const uint64_t* send_times,
+                                     const uint8_t* anchor, double* range_mm) {
+	const int num_broadcasts = config->num_broadcasts;
+
+	uint8_t  anchor_final_antenna_index = anchor[FINAL_ANTENNA_OFFSET];
+	uint8_t  window_packet_recv         = anchor[WINDOW_PACKET_RECV_OFFSET];
+	int64_t  anc_final_tx_timestamp     = (int64_t) read_uint64(anchor+FINAL_TX_OFFSET);
+	int64_t  anc_final_rx_timestamp     = (int64_t) read_uint64(anchor+FINAL_RX_OFFSET);
+	uint8_t  tag_poll_first_idx         = anchor[FIRST_IDX_OFFSET];
+	int64_t  tag_poll_first_TOA         = (int64_t) read_uint64(anchor+FIRST_TOA_OFFSET);
+	uint8_t  tag_poll_last_idx          = anchor[LAST_IDX_OFFSET];
+	int64_t  tag_poll_last_TOA          = (int64_t) read_uint64(anchor+LAST_TOA_OFFSET);
+
+	if (tag_poll_first_idx >= num_broadcasts || tag_poll_last_idx >= num_broadcasts) {
+		return false;
+	}
+
+	int64_t tag_poll_TOAs[MAX_RANGING_BROADCASTS];
+	for (int i=0; i<num_broadcasts; i++) {
+		tag_poll_TOAs[i] = read_uint16(anchor+TOAS_OFFSET+(2*i));
+	}
+	tag_poll_TOAs[tag_poll_first_idx] = tag_poll_first_TOA;
+	tag_poll_TOAs[tag_poll_last_idx] = tag_poll_last_TOA;
+
+	// Decompress the 16 bit TOAs by interpolating between the first and last
+	double approx_clock_offset = (double) (tag_poll_last_TOA - tag_poll_first_TOA) /
+		(double) ((int64_t) send_times[tag_poll_last_idx] - (int64_t) send_times[tag_poll_first_idx]);
+
+	for (int i=tag_poll_first_idx+1; i<tag_poll_last_idx; i++) {
+		double estimated_TOA = (double) tag_poll_first_TOA +
+			(approx_clock_offset * (double) ((int64_t) send_times[i] - (int64_t) send_times[tag_poll_first_idx]));
+		int64_t actual_TOA = (((int64_t) estimated_TOA) & 0xFFFFFFFFFFF0000LL) + tag_poll_TOAs[i];
+
+		if ((double) actual_TOA < estimated_TOA - 0x7FFF) {
+			actual_TOA += 0x10000;
+		} else if ((double) actual_TOA > estimated_TOA + 0x7FFF) {
+			actual_TOA -= 0x10000;
+		}
+
+		tag_poll_TOAs[i] = actual_TOA;
+	}
+
+	double offset_anchor_over_tag;
+	if (config->skew_regression) {
+		if (!skew_regression(num_broadcasts, send_times, tag_poll_TOAs, &offset_anchor_over_tag)) {
+			return false;
+		}
+	} else {
+		// Clock offset from the repeated broadcasts
+		int num_valid_offsets = 0;
+		double offset_sum = 0;
+		for (int i=0; i<NUM_RANGING_CHANNELS; i++) {
+			int last = num_broadcasts - NUM_RANGING_CHANNELS + i;
+			if ((tag_poll_TOAs[i] & 0xFFFF) > 0 && (tag_poll_TOAs[last] & 0xFFFF) > 0) {
+				offset_sum += (double) (tag_poll_TOAs[last] - tag_poll_TOAs[i]) /
+					(double) ((int64_t) send_times[last] - (int64_t) send_times[i]);
+				num_valid_offsets++;
+			}
+		}
+		if (num_valid_offsets == 0) {
+			return false;
+		}
+		offset_anchor_over_tag = offset_sum / num_valid_offsets;
+	}
+
+	// Find the broadcast the ANC_FINAL was sent with
+	uint8_t ss_index_matching = get_ss_index_from_settings(anchor_final_antenna_index, window_packet_recv);
+	if (ss_index_matching >= num_broadcasts ||
+	    (tag_poll_TOAs[ss_index_matching] & 0xFFFF) == 0) {
+		return false;
+	}
+
+	int64_t matching_broadcast_send_time = (int64_t) send_times[ss_index_matching];
+	int64_t matching_broadcast_recv_time = tag_poll_TOAs[ss_index_matching];
+
+	double two_way_TOF = ((double) (anc_final_rx_timestamp - matching_broadcast_send_time) * offset_anchor_over_tag) -
+		(double) (anc_final_tx_timestamp - matching_broadcast_recv_time);
+	double one_way_TOF = two_way_TOF / 2;
+
+	// Packed int64 to double conversions need AVX-512DQ, so they are done
+	// on their own first. That leaves the TOF loop all doubles, which the
+	// compiler vectorizes with plain SSE2. Missing broadcasts are calculated
+	// anyway and dropped afterwards.
+	double anchor_offsets[MAX_RANGING_BROADCASTS];
+	double tag_offsets[MAX_RANGING_BROADCASTS];
+	for (int i=0; i<num_broadcasts; i++) {
+		anchor_offsets[i] = (double) (tag_poll_TOAs[i] - matching_broadcast_recv_time);
+		tag_offsets[i] = (double) ((int64_t) send_times[i] - matching_broadcast_send_time);
+	}
+
+	double distances_millimeters[MAX_RANGING_BROADCASTS];
+	for (int i=0; i<num_broadcasts; i++) {
+		double TOF = (anchor_offsets[i] - (tag_offsets[i] * offset_anchor_over_tag)) + one_way_TOF;
+
+		distances_millimeters[i] = ((((TOF * DWT_TIME_UNITS) * SPEED_OF_LIGHT) / AIR_N) * 1000) - RANGE_OFFSET_MM;
+	}
+
+	int num_valid_distances = 0;
+	for (int i=0; i<num_broadcasts; i++) {
+		if ((tag_poll_TOAs[i] & 0xFFFF) != 0) {
+			distances_millimeters[num_valid_distances++] = distances_millimeters[i];
+		}
+	}
+
+	if (num_valid_distances == 0) {
+		return false;
+	}
+
+	*range_mm = percentile(distances_millimeters, num_valid_distances, RANGE_PERCENTILE);
+
+	if (*range_mm < 0 || *range_mm > MAX_VALID_RANGE_MM) {
+		return false;
+	}
+	return true;
+}
+
+// Calculate ranges to all of the anchors in an event. ranges must have room
+// for event->num_anchors entries. Returns the number of valid ranges.
+uint8_t offload_calculate_event (const offload_config_t* config, const uint8_t* buf,
+                                 const offload_event_t* event, offload_range_t* ranges) {
+	uint64_t send_times[MAX_RANGING_BROADCASTS];
+	uint8_t num_ranges = 0;
+
+	for (int i=0; i<config->num_broadcasts; i++) {
+		send_times[i] = read_uint64(buf + event->send_times_offset + (8*i));
+	}
+
+	const uint8_t* anchor = buf + event->anchors_offset;
+	for (uint8_t i=0; i<event->num_anchors; i++) {
+		if (offload_calculate_anchor_range(config, send_times, anchor, &ranges[num_ranges].range_mm)) {
+			memcpy(ranges[num_ranges].anchor_eui, anchor+ANCHOR_ADDR_OFFSET, EUI_LEN);
+			num_ranges++;
+		}
+		anchor += OFFLOAD_ANCHOR_RESPONSE_LEN(config->num_broadcasts) + OFFLOAD_DATA_HEADER_LEN;
+	}
+
+	return num_ranges;
+}
+
+
+/******************************************************************************/
+// Capture parsing
+/******************************************************************************/
+
+// Find all of the complete tag frames in a capture. This follows the same
+// resynchronization rules as data_dump_glossy.py: after a bad data header or
+// footer the search for the next header starts right after the bad bytes.
+// Returns false if we ran out of memory.
+bool offload_index_capture (const offload_config_t* config, const uint8_t* buf, size_t len,
+                            double start_time, offload_index_t* index) {
+	const size_t send_times_len = 8 * config->num_broadcasts;
+	size_t capacity = 1024;
+	size_t pos = 0;
+	bool have_first_time = false;
+	int64_t first_time = 0;
+
+	index->events = malloc(capacity * sizeof(offload_event_t));
+	index->num_events = 0;
+	index->num_bad = 0;
+	if (index->events == NULL) {
+		return false;
+	}
+
+	while (true) {
+		// Look for the next frame header
+		while (pos + OFFLOAD_HEADER_LEN <= len && memcmp(buf+pos, HEADER, OFFLOAD_HEADER_LEN) != 0) {
+			pos++;
+		}
+		pos += OFFLOAD_HEADER_LEN;
+
+		if (pos + 1 + send_times_len > len) {
+			break;
+		}
+
+		offload_event_t event;
+		event.num_anchors = buf[pos];
+		event.send_times_offset = pos + 1;
+		event.anchors_offset = event.send_times_offset + send_times_len + OFFLOAD_DATA_HEADER_LEN;
+		pos = event.send_times_offset + send_times_len;
+
+		// The timestamp is relative to the first frame in the capture and
+		// comes from the 16th broadcast, like in data_dump_glossy.py
+		int64_t event_time = (int64_t) read_uint64(buf + event.send_times_offset + (8*15));
+		if (!have_first_time) {
+			first_time = event_time;
+			have_first_time = true;
+		}
+		event.timestamp = start_time + ((double) (event_time - first_time) * DWT_TIME_UNITS);
+
+		bool bad = false;
+		bool truncated = false;
+		for (uint8_t i=0; i<event.num_anchors; i++) {
+			if (pos + OFFLOAD_DATA_HEADER_LEN > len) {
+				truncated = true;
+				break;
+			}
+			if (memcmp(buf+pos, DATA_HEADER, OFFLOAD_DATA_HEADER_LEN) != 0) {
+				pos += OFFLOAD_DATA_HEADER_LEN;
+				bad = true;
+				break;
+			}
+			pos += OFFLOAD_DATA_HEADER_LEN + OFFLOAD_ANCHOR_RESPONSE_LEN(config->num_broadcasts);
+			if (pos > len) {
+				truncated = true;
+				break;
+			}
+		}
+
+		if (truncated || (!bad && pos + OFFLOAD_FOOTER_LEN > len)) {
+			break;
+		}
+		if (!bad) {
+			bad = memcmp(buf+pos, FOOTER, OFFLOAD_FOOTER_LEN) != 0;
+			pos += OFFLOAD_FOOTER_LEN;
+		}
+
+		if (bad) {
+			index->num_bad++;
+			continue;
+		}
+
+		if (index->num_events == capacity) {
+			capacity *= 2;
+			offload_event_t* events = realloc(index->events, capacity * sizeof(offload_event_t));
+			if (events == NULL) {
+				return false;
+			}
+			index->events = events;
+		}
+		index->events[index->num_events++] = event;
+	}
+
+	return true;
+}
+
+void offload_index_free (offload_index_t* index) {
+	free(index->events);
+	index->events = NULL;
+	index->num_events = 0;
+}
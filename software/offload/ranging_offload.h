@@ -0,0 +1,75 @@
+#ifndef __RANGING_OFFLOAD_H
+#define __RANGING_OFFLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************/
+// Constants that must match the firmware (see firmware/oneway_common.h)
+/******************************************************************************/
+
+#define NUM_RANGING_CHANNELS 3
+#define NUM_UNIQUE_PACKET_CONFIGURATIONS 27
+#define MAX_RANGING_BROADCASTS (NUM_UNIQUE_PACKET_CONFIGURATIONS+NUM_RANGING_CHANNELS)
+#define EUI_LEN 8
+
+// Framing the tag uses when UART_DATA_OFFLOAD is set (see report_range())
+#define OFFLOAD_HEADER_LEN 4
+#define OFFLOAD_DATA_HEADER_LEN 2
+#define OFFLOAD_FOOTER_LEN 2
+
+// The tag dumps anchor_responses_t as is, so this is its packed size
+#define OFFLOAD_ANCHOR_RESPONSE_LEN(num_broadcasts) (EUI_LEN+1+1+8+8+1+8+1+8+(2*(num_broadcasts)))
+
+/******************************************************************************/
+// Data structures
+/******************************************************************************/
+
+// How the tag that made the capture was configured
+typedef struct {
+	// MAX_RANGING_BROADCASTS, or NUM_UNIQUE_PACKET_CONFIGURATIONS if the tag
+	// was built with ONEWAY_NO_REPEATED_BROADCASTS
+	uint8_t num_broadcasts;
+	// Fit the clock offset over all broadcasts (ONEWAY_SKEW_REGRESSION)
+	bool skew_regression;
+} offload_config_t;
+
+// One ranging event (one tag frame) found in a capture. Everything points
+// back into the capture buffer so that indexing a capture is cheap.
+typedef struct {
+	// Start of the send times in the capture
+	size_t send_times_offset;
+	// Start of the first anchor response (after its 0x8080 data header)
+	size_t anchors_offset;
+	uint8_t num_anchors;
+	// Timestamp of the event, in seconds
+	double timestamp;
+} offload_event_t;
+
+// Range from one anchor in one event
+typedef struct {
+	uint8_t anchor_eui[EUI_LEN];
+	double range_mm;
+} offload_range_t;
+
+// Results of indexing a capture
+typedef struct {
+	offload_event_t* events;
+	size_t num_events;
+	size_t num_bad;
+} offload_index_t;
+
+/******************************************************************************/
+// Function prototypes
+/******************************************************************************/
+
+bool offload_index_capture (const offload_config_t* config, const uint8_t* buf, size_t len,
+                            double start_time, offload_index_t* index);
+void offload_index_free (offload_index_t* index);
+uint8_t offload_calculate_event (const offload_config_t* config, const uint8_t* buf,
+                                 const offload_event_t* event, offload_range_t* ranges);
+bool offload_calculate_anchor_range (const offload_config_t* config, const uint64_t* send_times,
+                                     const uint8_t* anchor, double* range_mm);
+
+#endif
@@ -0,0 +1,280 @@
+// Compare ranging events of a fixed length with the ones
+// ONEWAY_ADAPTIVE_BROADCASTS picks, in how long they take and how accurate
+// the ranges are.
+//
+// The tag sends its broadcasts going through the channels, then the anchor
+// antennas, then its own antennas, like oneway_common.c does. Each anchor
+// hears each combination of channel and antennas with its own probability,
+// and each combination reads long by its own multipath bias, plus noise. An
+// anchor that heard at least one broadcast responds, and the tag gets the
+// response with the anchor's mean reception rate. The tag takes the
+// RANGE_PERCENTILE of the ranges of each anchor that heard at least
+// MIN_VALID_RANGES_PER_ANCHOR broadcasts.
+//
+// The adaptive tag picks each event's length at its start from the
+// responses of the event before, like update_broadcast_count() in
+// oneway_tag.c. The tag hears nothing from the anchors until the listening
+// windows, so nothing changes the length during an event.
+//
+// Every `move` events the tag moves: the reception rates and biases are
+// drawn again, and the adaptive tag only finds out from the event after.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mirrored from firmware/oneway_common.h and polypoint_conf.h
+// (FAST_RANGING_CONFIG)
+#define NUM_RANGING_CHANNELS          3
+#define NUM_ANTENNAS                  3
+#define NUM_RANGING_BROADCASTS        ((NUM_RANGING_CHANNELS*NUM_ANTENNAS*NUM_ANTENNAS) + NUM_RANGING_CHANNELS)
+#define NUM_RANGING_LISTENING_WINDOWS 3
+#define MIN_VALID_RANGES_PER_ANCHOR   10
+#define RANGE_PERCENTILE_NUMERATOR    1
+#define RANGE_PERCENTILE_DENOMENATOR  10
+#define ONEWAY_ADAPTIVE_TARGET_RANGES ((MIN_VALID_RANGES_PER_ANCHOR*3)/2)
+#define ONEWAY_ADAPTIVE_MIN_BROADCASTS ONEWAY_ADAPTIVE_TARGET_RANGES
+#define RANGING_BROADCASTS_PERIOD_US  1000
+#define RANGING_LISTENING_WINDOW_US   8000
+#define RANGING_LISTENING_WINDOW_PADDING_US 1100
+
+#define MAX_ANCHORS 16
+#define NUM_COMBINATIONS (NUM_RANGING_CHANNELS*NUM_ANTENNAS*NUM_ANTENNAS)
+
+// Spread of a single range, and the mean of the multipath bias of each
+// combination, in mm
+#define NOISE_MM 40.0
+#define BIAS_MM  150.0
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+typedef struct {
+	double rate[NUM_COMBINATIONS];
+	double bias_mm[NUM_COMBINATIONS];
+	double mean_rate;
+} anchor_t;
+
+typedef struct {
+	// The tag's state, as in oneway_tag.c
+	int broadcast_count;
+	int response_count;
+	int heard[MAX_ANCHORS][NUM_RANGING_BROADCASTS];
+
+	long broadcasts;
+	long events;
+	long anchor_ranges;
+	long located;
+	double abs_error_sum;
+	double *abs_errors;
+	long num_errors;
+} policy_t;
+
+static int num_anchors = 6;
+static int num_events = 5000;
+static double rate_lo = 0.8;
+static double rate_hi = 0.95;
+static double bad_share = 0;
+static double bad_rate = 0.3;
+static int move_events = 50;
+
+static anchor_t anchors[MAX_ANCHORS];
+
+static double uniform () {
+	return (rand() + 0.5) / ((double) RAND_MAX + 1.0);
+}
+
+static double gaussian () {
+	return sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+}
+
+// The subsequence's place among the channel and antenna combinations, from
+// oneway_subsequence_number_to_channel_index() and
+// oneway_subsequence_number_to_antenna()
+static int combination (int subseq_num) {
+	int channel = subseq_num % NUM_RANGING_CHANNELS;
+	int anchor_antenna = (subseq_num / NUM_RANGING_CHANNELS) % NUM_ANTENNAS;
+	int tag_antenna = ((subseq_num / NUM_RANGING_CHANNELS) / NUM_RANGING_CHANNELS) % NUM_ANTENNAS;
+	return (tag_antenna*NUM_ANTENNAS + anchor_antenna)*NUM_RANGING_CHANNELS + channel;
+}
+
+static void move_tag () {
+	for (int a=0; a<num_anchors; a++) {
+		anchors[a].mean_rate = 0;
+		for (int c=0; c<NUM_COMBINATIONS; c++) {
+			if (uniform() < bad_share) {
+				anchors[a].rate[c] = bad_rate;
+			} else {
+				anchors[a].rate[c] = rate_lo + (rate_hi - rate_lo) * uniform();
+			}
+			anchors[a].bias_mm[c] = -BIAS_MM * log(uniform());
+			anchors[a].mean_rate += anchors[a].rate[c] / NUM_COMBINATIONS;
+		}
+	}
+}
+
+static int compare_double (const void* a, const void* b) {
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+// select_percentile() from dw1000_util.c, interpolating the same way
+static double percentile (double* values, int count) {
+	int bot = (count * RANGE_PERCENTILE_NUMERATOR) / RANGE_PERCENTILE_DENOMENATOR;
+
+	qsort(values, count, sizeof(double), compare_double);
+	if (bot + 1 >= count) {
+		return values[bot];
+	}
+	return values[bot] + (values[bot+1] - values[bot]) *
+	       (count * RANGE_PERCENTILE_NUMERATOR - bot * RANGE_PERCENTILE_DENOMENATOR) / RANGE_PERCENTILE_DENOMENATOR;
+}
+
+// update_broadcast_count() from oneway_tag.c
+static void update_broadcast_count (policy_t* p) {
+	int needed = ONEWAY_ADAPTIVE_MIN_BROADCASTS;
+
+	if (p->response_count == 0) {
+		needed = NUM_RANGING_BROADCASTS;
+	}
+
+	for (int a=0; a<p->response_count; a++) {
+		int received = 0;
+		int ii;
+
+		for (ii=0; ii<p->broadcast_count; ii++) {
+			if (p->heard[a][ii]) {
+				received++;
+				if (received == ONEWAY_ADAPTIVE_TARGET_RANGES) {
+					break;
+				}
+			}
+		}
+
+		if (received < ONEWAY_ADAPTIVE_TARGET_RANGES) {
+			needed = NUM_RANGING_BROADCASTS;
+			break;
+		}
+		needed = MAX(needed, ii+1);
+	}
+
+	p->broadcast_count = MAX(needed, p->broadcast_count - NUM_RANGING_CHANNELS);
+}
+
+static void run_event (policy_t* p, int adaptive) {
+	double ranges[NUM_RANGING_BROADCASTS];
+	int ranged = 0;
+
+	if (!adaptive || p->broadcast_count == 0) {
+		p->broadcast_count = NUM_RANGING_BROADCASTS;
+	}
+
+	p->response_count = 0;
+	for (int a=0; a<num_anchors; a++) {
+		int heard[NUM_RANGING_BROADCASTS];
+		int count = 0;
+
+		for (int ss=0; ss<p->broadcast_count; ss++) {
+			int c = combination(ss);
+			heard[ss] = uniform() < anchors[a].rate[c];
+			if (heard[ss]) {
+				ranges[count++] = anchors[a].bias_mm[c] + NOISE_MM * gaussian();
+			}
+		}
+
+		// The anchor responds if it heard the tag at all, and the tag has
+		// to hear that
+		if (count == 0 || uniform() >= anchors[a].mean_rate) {
+			continue;
+		}
+		memcpy(p->heard[p->response_count], heard, sizeof(int) * p->broadcast_count);
+		p->response_count++;
+
+		if (count >= MIN_VALID_RANGES_PER_ANCHOR) {
+			double error = fabs(percentile(ranges, count));
+			p->abs_error_sum += error;
+			p->abs_errors[p->num_errors++] = error;
+			ranged++;
+		}
+	}
+
+	p->broadcasts += p->broadcast_count;
+	p->anchor_ranges += ranged;
+	p->located += ranged >= 3;
+	p->events++;
+
+	if (adaptive) {
+		update_broadcast_count(p);
+	}
+}
+
+static void print_row (const char* name, policy_t* p) {
+	double broadcasts = (double) p->broadcasts / p->events;
+	double event_ms = (broadcasts * RANGING_BROADCASTS_PERIOD_US +
+	                   NUM_RANGING_LISTENING_WINDOWS * (RANGING_LISTENING_WINDOW_US + RANGING_LISTENING_WINDOW_PADDING_US*2)) / 1000;
+
+	qsort(p->abs_errors, p->num_errors, sizeof(double), compare_double);
+	printf("%-9s %10.1f %9.1f %11.2f %9.1f%% %11.1f %11.1f\n", name,
+	       broadcasts, event_ms,
+	       (double) p->anchor_ranges / p->events,
+	       100.0 * p->located / p->events,
+	       p->num_errors ? p->abs_error_sum / p->num_errors : 0,
+	       p->num_errors ? p->abs_errors[(p->num_errors * 9) / 10] : 0);
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-a anchors] [-e events] [-l rate_lo] [-h rate_hi]\n"
+	                "       [-b bad_share] [-q bad_rate] [-m move_events] [-s seed]\n", name);
+	exit(1);
+}
+
+int main (int argc, char** argv) {
+	unsigned seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:e:l:h:b:q:m:s:")) != -1) {
+		switch (opt) {
+			case 'a': num_anchors = atoi(optarg); break;
+			case 'e': num_events = atoi(optarg); break;
+			case 'l': rate_lo = atof(optarg); break;
+			case 'h': rate_hi = atof(optarg); break;
+			case 'b': bad_share = atof(optarg); break;
+			case 'q': bad_rate = atof(optarg); break;
+			case 'm': move_events = atoi(optarg); break;
+			case 's': seed = strtoul(optarg, NULL, 0); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (num_anchors < 1 || num_anchors > MAX_ANCHORS || num_events < 1 || move_events < 1) {
+		usage(argv[0]);
+	}
+
+	policy_t policies[2];
+	memset(policies, 0, sizeof(policies));
+	for (int i=0; i<2; i++) {
+		policies[i].abs_errors = malloc(sizeof(double) * num_events * num_anchors);
+	}
+
+	// Both tags see the same links, each with its own packet losses
+	srand(seed);
+	for (int e=0; e<num_events; e++) {
+		if (e % move_events == 0) {
+			move_tag();
+		}
+		run_event(&policies[0], 0);
+		run_event(&policies[1], 1);
+	}
+
+	printf("%d anchors, %d events, links %.2f-%.2f, %.0f%% at %.2f, moving every %d events\n\n",
+	       num_anchors, num_events, rate_lo, rate_hi, bad_share*100, bad_rate, move_events);
+	printf("policy    broadcasts  event ms  anchors/evt  located  mean err mm  90%% err mm\n");
+	print_row("fixed", &policies[0]);
+	print_row("adaptive", &policies[1]);
+
+	for (int i=0; i<2; i++) {
+		free(policies[i].abs_errors);
+	}
+	return 0;
+}
@@ -0,0 +1,310 @@
+// Replay recorded glossy sync timestamps through the slave clock model.
+//
+// The input has one line per sync packet a slave received:
+//
+//     node rx_timestamp depth xtal_trim
+//
+// with the raw 40 bit DW1000 RX timestamp, the depth (seqNum) the packet had
+// and the crystal trim the node had when it arrived. glossy_sim -o writes
+// these. Lines starting with # are skipped.
+//
+// For every node, floods are dropped to mimic missed floods or a master that
+// sends less often, and each sync that is left is compared with where
+// firmware/glossy_clock.c predicted it and where the two point estimate
+// glossy.c used before would have put it: the last sync plus the clock
+// offset measured between the last two.
+//
+// The recording node changed its crystal trim after syncs that may be dropped
+// here. Those changes are moved back to the last sync that wasn't, as if the
+// node had made them then.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "glossy_clock.h"
+
+#define DW_TIME_MASK 0xFFFFFFFFFFULL
+
+#define TICKS_TO_US(_t) ((_t) * DWT_TIME_UNITS * 1e6)
+
+#define NOMINAL_INTERVAL ((double) ((uint64_t) (GLOSSY_UPDATE_INTERVAL_DW) << 8))
+#define FLOOD_TIMESLOT   ((double) ((uint64_t) (DW_DELAY_FROM_US(GLOSSY_FLOOD_TIMESLOT_US) & 0xFFFFFFFE) << 8))
+
+#define MAX_NODES 4096
+
+typedef struct {
+	int node;
+	int line;
+	uint64_t timestamp;
+	uint8_t depth;
+	uint8_t trim;
+} sample_t;
+
+typedef struct {
+	double miss;
+	int keep_every;
+	long seed;
+} replay_config_t;
+
+// Prediction errors in us, by how many intervals ahead they were made
+typedef struct {
+	double* errors;
+	int num;
+	int max;
+} error_list_t;
+
+typedef struct {
+	error_list_t model[GLOSSY_CLOCK_MAX_INTERVALS+1];
+	error_list_t two_point[GLOSSY_CLOCK_MAX_INTERVALS+1];
+	int floods;
+	int used_floods;
+	int model_updates;
+	int model_restarts;
+	int model_rejects;
+	int two_point_updates;
+	int two_point_lost;
+} replay_stats_t;
+
+static replay_config_t cfg;
+static replay_stats_t stats;
+
+static void add_error (error_list_t* list, double err_us) {
+	if (list->num == list->max) {
+		list->max = list->max ? list->max*2 : 256;
+		list->errors = realloc(list->errors, list->max * sizeof(double));
+		if (!list->errors) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	list->errors[list->num++] = fabs(err_us);
+}
+
+static int compare_double (const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile (error_list_t* list, double p) {
+	if (list->num == 0) return 0;
+	qsort(list->errors, list->num, sizeof(double), compare_double);
+	int i = (int) ceil(p * list->num) - 1;
+	return list->errors[i < 0 ? 0 : i];
+}
+
+static int compare_sample (const void* a, const void* b) {
+	const sample_t* x = a;
+	const sample_t* y = b;
+	// Keep each node's samples in the order they were received
+	if (x->node != y->node) return x->node - y->node;
+	return x->line - y->line;
+}
+
+// Replay one node's syncs
+static void replay_node (const sample_t* samples, int num) {
+	glossy_clock_t clk;
+	uint64_t overflow = 0;
+	uint64_t last_raw = 0;
+	uint8_t trim = samples[0].trim;
+	double trim_ppm = 0;
+	double trim_shift = 0;
+	uint64_t first_sync = 0;
+	uint64_t prev_sync = 0;
+	uint64_t last_used = 0;
+	long last_flood = -1;
+	bool drop = FALSE;
+
+	// The estimate glossy.c used before: the last sync and the offset
+	// measured from the one before it
+	bool tp_valid = FALSE;
+	bool tp_have_ppm = FALSE;
+	uint64_t tp_last = 0;
+	double tp_ppm = 0;
+
+	glossy_clock_init(&clk);
+
+	for (int i = 0; i < num; i++) {
+		const sample_t* s = &samples[i];
+
+		if (s->timestamp < last_raw) overflow += DW_TIME_MASK + 1;
+		last_raw = s->timestamp;
+		uint64_t ts = s->timestamp + overflow;
+
+		// When the sync left the master, going back over the hops it took
+		double scale = clk.valid ? clk.interval / NOMINAL_INTERVAL : 1.0;
+		uint64_t sync_time = ts - (uint64_t) llround(FLOOD_TIMESLOT * scale * s->depth);
+
+		// The trim changed after the last sync. If that one was dropped, work
+		// out how much earlier the last sync used would have been with the
+		// new trim.
+		if (s->trim != trim) {
+			double ppm = -(s->trim - trim) * CW_CAL_12PF;
+			if (i > 0 && drop) trim_shift += ppm * 1e-6 * (double) (int64_t) (prev_sync - last_used);
+			trim_ppm += ppm;
+			trim = s->trim;
+		}
+		prev_sync = sync_time;
+
+		// Which flood this is, counted from the first one the node heard
+		if (i == 0) first_sync = sync_time;
+		long flood = lround((double) (int64_t) (sync_time - first_sync) / NOMINAL_INTERVAL);
+		if (flood != last_flood) {
+			stats.floods++;
+			drop = (flood % cfg.keep_every != 0) || drand48() < cfg.miss;
+			if (!drop) stats.used_floods++;
+			last_flood = flood;
+		}
+		if (drop) continue;
+
+		last_used = sync_time;
+		if (trim_ppm != 0) {
+			if (clk.valid) {
+				glossy_clock_trim(&clk, trim_ppm);
+				clk.sync_frac -= trim_shift;
+			}
+			tp_ppm += trim_ppm;
+			tp_last -= (int64_t) llround(trim_shift);
+		}
+		trim_ppm = 0;
+		trim_shift = 0;
+
+		// Where the model expected this sync, once it has a clock offset
+		if (clk.valid && clk.intervals > 0) {
+			double meas = (double) (int64_t) (sync_time - clk.sync_time) - clk.sync_frac;
+			long n = lround(meas / clk.interval);
+			if (n >= 1 && n <= GLOSSY_CLOCK_MAX_INTERVALS) {
+				add_error(&stats.model[n], TICKS_TO_US((double) (int64_t) (sync_time - glossy_clock_predict(&clk, n))));
+			}
+		}
+		switch (glossy_clock_update(&clk, sync_time, s->depth)) {
+			case GLOSSY_CLOCK_UPDATED: stats.model_updates++; break;
+			case GLOSSY_CLOCK_RESTARTED: stats.model_restarts++; break;
+			case GLOSSY_CLOCK_REJECTED: stats.model_rejects++; break;
+			default: break;
+		}
+
+		// And where the two point estimate did
+		double gap = (double) (int64_t) (sync_time - tp_last);
+		long n = lround(gap / NOMINAL_INTERVAL);
+		if (n >= 1 && tp_valid) {
+			if (n <= GLOSSY_CLOCK_MAX_INTERVALS && tp_have_ppm) {
+				double pred = n * NOMINAL_INTERVAL * (1 + tp_ppm * 1e-6);
+				add_error(&stats.two_point[n], TICKS_TO_US(gap - pred));
+			}
+			// glossy.c only took syncs 0.5 to 1.5 intervals after the last
+			if (n == 1) stats.two_point_updates++;
+			else stats.two_point_lost++;
+		}
+		if (n >= 1 && tp_valid) {
+			tp_ppm = (gap / (n * NOMINAL_INTERVAL) - 1) * 1e6;
+			tp_have_ppm = TRUE;
+		}
+		if (n >= 1 || !tp_valid) {
+			tp_last = sync_time;
+			tp_valid = TRUE;
+		}
+	}
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-m miss] [-k keep_every] [-s seed] file\n", name);
+}
+
+int main (int argc, char** argv) {
+	int opt;
+
+	cfg = (replay_config_t) {
+		.miss = 0,
+		.keep_every = 1,
+		.seed = 1,
+	};
+
+	while ((opt = getopt(argc, argv, "m:k:s:h")) != -1) {
+		switch (opt) {
+			case 'm': cfg.miss = atof(optarg); break;
+			case 'k': cfg.keep_every = atoi(optarg); break;
+			case 's': cfg.seed = atol(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc-1 || cfg.keep_every < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	FILE* f = fopen(argv[optind], "r");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	sample_t* samples = NULL;
+	int num = 0, max = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		sample_t s;
+		unsigned long long ts;
+		unsigned depth, trim;
+
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%d %llu %u %u", &s.node, &ts, &depth, &trim) != 4) continue;
+		if (s.node < 0 || s.node >= MAX_NODES) continue;
+		s.line = num;
+		s.timestamp = ts & DW_TIME_MASK;
+		s.depth = depth;
+		s.trim = trim;
+
+		if (num == max) {
+			max = max ? max*2 : 4096;
+			samples = realloc(samples, max * sizeof(sample_t));
+			if (!samples) {
+				perror("realloc");
+				return 1;
+			}
+		}
+		samples[num++] = s;
+	}
+	fclose(f);
+
+	if (num == 0) {
+		fprintf(stderr, "No syncs in %s\n", argv[optind]);
+		return 1;
+	}
+
+	srand48(cfg.seed);
+	qsort(samples, num, sizeof(sample_t), compare_sample);
+
+	int nodes = 0;
+	for (int start = 0; start < num; ) {
+		int end = start;
+		while (end < num && samples[end].node == samples[start].node) end++;
+		replay_node(&samples[start], end - start);
+		nodes++;
+		start = end;
+	}
+
+	printf("%d syncs from %d nodes, %.0f%% of floods missed, every %d kept: %d of %d floods used\n\n",
+	       num, nodes, cfg.miss*100, cfg.keep_every, stats.used_floods, stats.floods);
+	printf("Clock model: %d updates, %d restarts, %d rejected\n",
+	       stats.model_updates, stats.model_restarts, stats.model_rejects);
+	printf("Two point:   %d updates, %d lost sync\n\n",
+	       stats.two_point_updates, stats.two_point_lost);
+
+	printf("Prediction error (us)\n");
+	printf("intervals      syncs   model p50   model p99   two point p50   two point p99\n");
+	for (int n = 1; n <= GLOSSY_CLOCK_MAX_INTERVALS; n++) {
+		if (stats.model[n].num == 0 && stats.two_point[n].num == 0) continue;
+		printf("%9d  %9d  %10.3f  %10.3f  %14.3f  %14.3f\n",
+		       n, stats.model[n].num,
+		       percentile(&stats.model[n], 0.5), percentile(&stats.model[n], 0.99),
+		       percentile(&stats.two_point[n], 0.5), percentile(&stats.two_point[n], 0.99));
+	}
+
+	free(samples);
+	return 0;
+}
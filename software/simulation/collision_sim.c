@@ -0,0 +1,236 @@
+// Estimate how many anchor responses collide in the tag's listening windows
+// with the full pp_anc_final and with pp_anc_final_compact
+// (ONEWAY_COMPACT_ANC_FINAL).
+//
+// Every anchor that heard the tag picks a random time in each listening
+// window to send its response, the way ranging_listening_window_task() in
+// oneway_anchor.c does: uniform over the window less the preamble and the
+// frame, which for the compact packet is the longest it could be. The tag
+// acks each response it gets, and an anchor that got its ack doesn't send
+// in the later windows. A response is lost if any other response or an ack
+// is on the air at any point while it is.
+//
+// The compact frames are made by oneway_anc_final_compact_encode() from
+// firmware/oneway_common.c, from anchors that heard each broadcast with
+// their own rate between rate_lo and rate_hi, so their length is what the
+// firmware would send.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dw1000.h"
+#include "oneway_common.h"
+
+// From FAST_RANGING_CONFIG in polypoint_conf.h: 64 symbol preamble at
+// 64 MHz PRF, 6.8 Mbps, timed like dw1000_preamble_time_in_us() and
+// dw1000_packet_data_time_in_us()
+#define PREAMBLE_US  65
+#define US_PER_BYTE  (8.0/6.8)
+#define ACK_LEN      5
+#define ACK_DELAY_US 12
+
+#define MAX_ANCHORS 32
+
+#define DW_PER_US (1.0 / (DWT_TIME_UNITS * 1e6))
+
+enum { FORMAT_FULL, FORMAT_COMPACT, NUM_FORMATS };
+
+static const char* format_names[NUM_FORMATS] = { "full", "compact" };
+
+typedef struct {
+	double start;
+	double end;
+	int anchor;   // -1 for an ack
+} tx_t;
+
+typedef struct {
+	long frames;
+	long frame_bytes;
+	long first_sent;
+	long first_collided;
+	long responses;
+	long lost;
+} stats_t;
+
+static int num_anchors = 6;
+static int num_events = 20000;
+static double rate_lo = 0.5;
+static double rate_hi = 1.0;
+
+static double uniform () {
+	return (rand() + 0.5) / ((double) RAND_MAX + 1.0);
+}
+
+// The ANC_FINAL an anchor would send in listening window window_num if it
+// heard the broadcasts in heard. Returns its length, and in slot_len the
+// length the anchor picks its slot with.
+static uint16_t make_anc_final (int format, const int* heard, int window_num, uint16_t* slot_len) {
+	struct pp_anc_final anc_final;
+	struct pp_anc_final_compact compact;
+	uint64_t base = ((uint64_t) rand() << 16) & 0xFFFFFFFFFFULL;
+	int first = -1;
+
+	if (format == FORMAT_FULL) {
+		*slot_len = sizeof(struct pp_anc_final);
+		return sizeof(struct pp_anc_final);
+	}
+
+	memset(&anc_final, 0, sizeof(anc_final));
+	for (int ss=0; ss<NUM_RANGING_BROADCASTS; ss++) {
+		if (!heard[ss]) {
+			continue;
+		}
+		uint64_t toa = base + (uint64_t) (ss * RANGING_BROADCASTS_PERIOD_US * DW_PER_US);
+		anc_final.TOAs[ss] = toa & 0xFFFF;
+		if (first < 0) {
+			first = ss;
+			anc_final.first_rxd_idx = ss;
+			anc_final.first_rxd_toa = toa;
+		}
+		anc_final.last_rxd_idx = ss;
+		anc_final.last_rxd_toa = toa;
+	}
+
+	// When ranging_listening_window_task() sends it, at the latest
+	double sent_us = (NUM_RANGING_BROADCASTS - first) * RANGING_BROADCASTS_PERIOD_US +
+	                 (window_num + 1) * (RANGING_LISTENING_WINDOW_US + 2*RANGING_LISTENING_WINDOW_PADDING_US);
+	anc_final.dw_time_sent = anc_final.first_rxd_toa + (uint64_t) (sent_us * DW_PER_US);
+
+	*slot_len = oneway_anc_final_compact_max_len(&anc_final);
+	return oneway_anc_final_compact_encode(&anc_final, &compact);
+}
+
+static int overlaps (const tx_t* a, const tx_t* b) {
+	return a->start < b->end && b->start < a->end;
+}
+
+static void run_event (stats_t* stats) {
+	int heard[MAX_ANCHORS][NUM_RANGING_BROADCASTS];
+	int acked[NUM_FORMATS][MAX_ANCHORS];
+	int responding = 0;
+
+	for (int a=0; a<num_anchors; a++) {
+		double rate = rate_lo + (rate_hi - rate_lo) * uniform();
+		int count = 0;
+		for (int ss=0; ss<NUM_RANGING_BROADCASTS; ss++) {
+			heard[a][ss] = uniform() < rate;
+			count += heard[a][ss];
+		}
+		// An anchor that heard nothing doesn't respond
+		for (int f=0; f<NUM_FORMATS; f++) {
+			acked[f][a] = (count == 0);
+		}
+		responding += (count > 0);
+	}
+
+	for (int f=0; f<NUM_FORMATS; f++) {
+		stats[f].responses += responding;
+
+		for (int w=0; w<NUM_RANGING_LISTENING_WINDOWS; w++) {
+			tx_t txs[MAX_ANCHORS];
+			int num_txs = 0;
+
+			for (int a=0; a<num_anchors; a++) {
+				if (acked[f][a]) {
+					continue;
+				}
+				uint16_t slot_len;
+				uint16_t len = make_anc_final(f, heard[a], w, &slot_len);
+				uint32_t slots = RANGING_LISTENING_WINDOW_US - (uint32_t) (slot_len * US_PER_BYTE + 0.5) - PREAMBLE_US;
+				double start = rand() % slots;
+
+				txs[num_txs].start = start;
+				txs[num_txs].end = start + PREAMBLE_US + len * US_PER_BYTE;
+				txs[num_txs].anchor = a;
+				num_txs++;
+
+				stats[f].frames++;
+				stats[f].frame_bytes += len;
+			}
+
+			// The tag acks the responses it gets, in the order they end
+			tx_t acks[MAX_ANCHORS];
+			int num_acks = 0;
+			int got[MAX_ANCHORS];
+			for (int i=0; i<num_txs; i++) {
+				got[i] = 1;
+				for (int j=0; j<num_txs; j++) {
+					if (j != i && overlaps(&txs[i], &txs[j])) {
+						got[i] = 0;
+					}
+				}
+			}
+			for (int i=0; i<num_txs; i++) {
+				if (got[i]) {
+					acks[num_acks].start = txs[i].end + ACK_DELAY_US;
+					acks[num_acks].end = acks[num_acks].start + PREAMBLE_US + ACK_LEN * US_PER_BYTE;
+					acks[num_acks].anchor = -1;
+					num_acks++;
+				}
+			}
+			for (int i=0; i<num_txs; i++) {
+				for (int k=0; k<num_acks && got[i]; k++) {
+					if (overlaps(&txs[i], &acks[k])) {
+						got[i] = 0;
+					}
+				}
+				if (got[i]) {
+					acked[f][txs[i].anchor] = 1;
+				}
+				if (w == 0) {
+					stats[f].first_sent++;
+					stats[f].first_collided += !got[i];
+				}
+			}
+		}
+
+		for (int a=0; a<num_anchors; a++) {
+			stats[f].lost += !acked[f][a];
+		}
+	}
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-a anchors] [-e events] [-l rate_lo] [-h rate_hi] [-s seed]\n", name);
+	exit(1);
+}
+
+int main (int argc, char** argv) {
+	unsigned seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:e:l:h:s:")) != -1) {
+		switch (opt) {
+			case 'a': num_anchors = atoi(optarg); break;
+			case 'e': num_events = atoi(optarg); break;
+			case 'l': rate_lo = atof(optarg); break;
+			case 'h': rate_hi = atof(optarg); break;
+			case 's': seed = strtoul(optarg, NULL, 0); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (num_anchors < 1 || num_anchors > MAX_ANCHORS || num_events < 1) {
+		usage(argv[0]);
+	}
+
+	stats_t stats[NUM_FORMATS];
+	memset(stats, 0, sizeof(stats));
+
+	srand(seed);
+	for (int e=0; e<num_events; e++) {
+		run_event(stats);
+	}
+
+	printf("%d anchors, %d events, reception %.2f-%.2f, %d us windows\n\n",
+	       num_anchors, num_events, rate_lo, rate_hi, RANGING_LISTENING_WINDOW_US);
+	printf("format    mean bytes  collided in window 0  lost after all windows\n");
+	for (int f=0; f<NUM_FORMATS; f++) {
+		printf("%-9s %10.1f %20.1f%% %22.2f%%\n", format_names[f],
+		       (double) stats[f].frame_bytes / stats[f].frames,
+		       100.0 * stats[f].first_collided / stats[f].first_sent,
+		       100.0 * stats[f].lost / stats[f].responses);
+	}
+	return 0;
+}
@@ -0,0 +1,1283 @@
+// Discrete event simulation of glossy floods and the LWB schedule.
+//
+// firmware/glossy.c is linked in unchanged. Each node gets a simulated
+// DW1000 (a 40 bit timestamp clock with its own crystal offset that follows
+// dwt_xtaltrim(), delayed TX, RX after TX and the frame buffer) and a
+// simulated stm_timer_t running from its own MCU clock. glossy.c keeps its
+// state in file statics, so the Makefile moves them into their own section
+// and the simulator swaps that memory in before running a node's code.
+//
+// Packets reach the nodes in radio range, each link losing a packet with
+// some probability. The floor can be split into square rooms whose walls
+// shorten the range. Identical packets that arrive within the concurrent
+// transmission window of each other are received like multipath, anything
+// else that overlaps collides. Ranging itself isn't simulated: when a tag's
+// LWB slot comes up the simulator only records it, tells glossy.c which
+// anchors the tag reaches, and counts it as clashing if another tag that
+// reaches one of the same anchors ranges at the same time.
+//
+// The sync timestamps the slaves receive can be recorded for clock_replay.
+
+#include <getopt.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "deca_regs.h"
+#include "glossy.h"
+#include "oneway_common.h"
+#include "timer.h"
+
+// Simulation time is in DW1000 ticks of an ideal clock
+typedef int64_t sim_time_t;
+
+#define TICKS_PER_US    (499.2*128)
+#define US(_us)         ((sim_time_t) llround((_us) * TICKS_PER_US))
+#define TICKS_TO_US(_t) ((double) (_t) / TICKS_PER_US)
+
+#define DW_TIME_MASK 0xFFFFFFFFFFULL
+#define DW_TIME_HALF 0x8000000000ULL
+
+#define SPEED_OF_LIGHT_M_PER_US 299.792458
+
+// Frame timing for FAST_RANGING_CONFIG (64 MHz PRF, 64 symbol preamble,
+// 6.8 Mbps). The RMARKER, which the timestamps and delayed TX times refer
+// to, is at the end of the SFD. The PHR is sent at 850 kbps and the data has
+// 48 Reed-Solomon bits for every 330.
+#define PREAMBLE_SFD_US        ((64+8)*1.01763)
+#define PHR_US                 (21/0.85)
+#define DATA_US_PER_BYTE       (8*(378.0/330.0)/6.8)
+
+// How long the MCU takes to get to a DW1000 interrupt, and how long reading
+// a received frame over SPI takes (dw1000.h)
+#define ISR_LATENCY_US         30
+#define RX_READ_US_PER_BYTE    (SPI_US_PER_BYTE+SPI_US_BETWEEN_BYTES)
+
+// Unit of dwt_setrxaftertxdelay()
+#define RX_AFTER_TX_UNIT_US    1.0256
+
+// How much one step of the crystal trim moves the DW1000 clock. This is what
+// glossy.c assumes (CW_CAL_12PF); the real steps are not all the same size.
+#define XTAL_TRIM_PPM_PER_STEP ((3.494350-3.494173)/3.4944*1e6/30)
+
+// The STM32 timers are 16 bit
+#define TIMER_WRAP_US 65536
+
+#define MAX_FRAME_LEN 128
+
+// Node numbers go in the last two bytes of the EUI
+#define MAX_NODES 4096
+
+// Room for LWB_RANGING_EVENTS
+#define MAX_RANGING_EVENTS 64
+
+// Ranging events the tags can have in one interval
+#define MAX_INTERVAL_RANGING (MAX_RANGING_EVENTS*LWB_REUSE_ZONES*2)
+
+// Log-distance path loss. A link works if the loss over the distance and
+// the walls in the way is no more than over range_m in the open.
+#define PATH_LOSS_EXPONENT 2.0
+
+// Sync error histogram
+#define SYNC_ERROR_BIN_US 0.25
+#define SYNC_ERROR_BINS   8000
+
+typedef enum {
+	NODE_MASTER,
+	NODE_ANCHOR,
+	NODE_TAG
+} node_role_e;
+
+typedef enum {
+	RADIO_IDLE,
+	RADIO_RX,
+	RADIO_TX
+} radio_state_e;
+
+typedef enum {
+	EV_BOOT,
+	EV_TIMER,
+	EV_TX_START,
+	EV_TX_END,
+	EV_RX_ENABLE,
+	EV_RX_END,
+	EV_RX_HANDLER,
+	EV_TX_HANDLER
+} event_type_e;
+
+typedef struct {
+	sim_time_t time;
+	uint64_t seq;
+	uint32_t gen;
+	uint16_t node;
+	uint8_t type;
+} event_t;
+
+typedef struct {
+	uint16_t node;
+	sim_time_t delay;   // Propagation delay
+} link_t;
+
+typedef struct {
+	bool active;
+	bool corrupted;
+	bool any_ok;
+	sim_time_t start;       // When the first frame's preamble arrived
+	sim_time_t rmarker;     // Earliest RMARKER heard from a link that worked
+	sim_time_t end;
+	uint16_t len;
+	uint8_t buf[MAX_FRAME_LEN];
+} reception_t;
+
+typedef struct {
+	node_role_e role;
+	double x, y;
+	int hops;
+	uint8_t eui[EUI_LEN];
+
+	// DW1000 clock: local ticks = clock_local + (t - clock_time) * clock_rate
+	double dw_ppm;
+	double clock_rate;
+	sim_time_t clock_time;
+	int64_t clock_local;
+	uint8_t xtal_trim;
+
+	// DW1000 radio
+	radio_state_e radio;
+	uint32_t radio_gen;
+	uint8_t channel;
+	uint32_t delayed_time;
+	uint32_t rx_after_tx;
+	bool response_expected;
+	uint16_t tx_len;
+	uint8_t tx_buf[MAX_FRAME_LEN];
+	sim_time_t tx_rmarker;
+	uint16_t tx_frame_len;
+	uint8_t tx_frame[MAX_FRAME_LEN];
+	reception_t rx;
+	uint16_t rx_handler_len;
+	uint8_t rx_handler_buf[MAX_FRAME_LEN];
+	uint64_t rx_handler_timestamp;
+
+	// MCU timer
+	stm_timer_t timer;
+	double mcu_ppm;
+	timer_callback timer_cb;
+	uint32_t timer_gen;
+	uint32_t timer_period_us;
+
+	link_t* links;
+	int num_links;
+
+	uint8_t* glossy_state;
+
+	// Misses the whole sync flood of this interval
+	bool deaf;
+
+	// Statistics
+	bool synced;
+	int flood_interval;
+	sim_time_t boot_time;
+	sim_time_t acked_time;
+	int sched_slot;     // The last slot the tag heard it was given
+	sim_time_t first_slot_time;
+	int ranging_events;
+	int slot_interval;
+} node_t;
+
+typedef struct {
+	int num_nodes;
+	int num_anchors;
+	double width_m;
+	double range_m;
+	double room_m;
+	double wall_db;
+	double loss;
+	double dw_ppm;
+	double mcu_ppm;
+	double ci_window_us;
+	double miss;
+	double dw_wander;
+	double tag_boot_s;
+	int asset_tags;
+	int asset_rate;
+	int alias_tags;
+	double duration_s;
+	const char* record_path;
+	long seed;
+	bool verbose;
+} sim_config_t;
+
+typedef struct {
+	uint64_t events;
+	uint64_t transmissions;
+	uint64_t receptions;
+	uint64_t collisions;
+	uint64_t late_tx;
+	uint64_t sync_error_hist[SYNC_ERROR_BINS+1];
+	uint64_t sync_error_count;
+	double sync_error_max_us;
+	uint64_t resyncs;
+	uint64_t depth_hist[GLOSSY_MAX_DEPTH+1];
+	uint64_t sched_requests;
+	uint64_t sched_requests_heard;
+
+	int intervals;
+	int max_intervals;
+	bool* flooded;
+	double* completion_ms;
+	double* coverage;
+	double* utilization;
+	int* conflicts;
+	int* tags_served;
+	int* locations;
+	int* clashes;
+
+	uint64_t misaligned_slots;
+} sim_stats_t;
+
+// glossy.c's statics, moved here by the Makefile
+extern uint8_t __start_glossy_state[];
+extern uint8_t __stop_glossy_state[];
+#define GLOSSY_STATE_SIZE ((size_t) (__stop_glossy_state - __start_glossy_state))
+
+// The master's schedule, which the firmware keeps in the anchor's
+// scratchspace
+static glossy_sched_t master_sched;
+
+static sim_config_t cfg;
+static sim_stats_t stats;
+static node_t* nodes;
+static int current_node = -1;
+static sim_time_t now;
+
+static event_t* events;
+static size_t num_events;
+static size_t max_events;
+static uint64_t event_seq;
+static event_type_e current_event;
+
+static FILE* record;
+
+// Master's view of the current LWB interval
+static int interval = -1;
+static bool interval_flooded;
+static int master_counter;
+static bool master_sending;
+static sim_time_t interval_sync_time;
+static sim_time_t interval_slot0_time;
+static sim_time_t master_last_fire;
+static int interval_covered;
+static sim_time_t interval_completion;
+static int interval_events_used[MAX_RANGING_EVENTS];
+static int interval_tags_served;
+static int interval_ranging_node[MAX_INTERVAL_RANGING];
+static int interval_ranging_event[MAX_INTERVAL_RANGING];
+static int interval_num_ranging;
+
+static double uniform () {
+	return drand48();
+}
+
+static double gaussian () {
+	return sqrt(-2 * log(1 - uniform())) * cos(2 * M_PI * uniform());
+}
+
+/******************************************************************************/
+// Event queue
+/******************************************************************************/
+
+static bool event_before (const event_t* a, const event_t* b) {
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void schedule (sim_time_t time, event_type_e type, int node, uint32_t gen) {
+	if (num_events == max_events) {
+		max_events = max_events ? max_events*2 : 1024;
+		events = realloc(events, max_events * sizeof(event_t));
+		if (!events) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	event_t ev = {time, event_seq++, gen, node, type};
+	size_t i = num_events++;
+	while (i > 0 && event_before(&ev, &events[(i-1)/2])) {
+		events[i] = events[(i-1)/2];
+		i = (i-1)/2;
+	}
+	events[i] = ev;
+}
+
+static event_t next_event () {
+	event_t top = events[0];
+	event_t last = events[--num_events];
+	size_t i = 0;
+
+	for (;;) {
+		size_t child = 2*i + 1;
+		if (child >= num_events) break;
+		if (child+1 < num_events && event_before(&events[child+1], &events[child])) child++;
+		if (!event_before(&events[child], &last)) break;
+		events[i] = events[child];
+		i = child;
+	}
+	events[i] = last;
+
+	return top;
+}
+
+/******************************************************************************/
+// Node context
+/******************************************************************************/
+
+// Make glossy.c's statics the ones belonging to this node
+static node_t* enter_node (int n) {
+	if (current_node != n) {
+		if (current_node >= 0) {
+			memcpy(nodes[current_node].glossy_state, __start_glossy_state, GLOSSY_STATE_SIZE);
+		}
+		memcpy(__start_glossy_state, nodes[n].glossy_state, GLOSSY_STATE_SIZE);
+		current_node = n;
+	}
+	return &nodes[current_node];
+}
+
+static node_t* this_node () {
+	return &nodes[current_node];
+}
+
+/******************************************************************************/
+// Simulated DW1000
+/******************************************************************************/
+
+static int64_t local_time (node_t* node, sim_time_t t) {
+	return node->clock_local + llround((double) (t - node->clock_time) * node->clock_rate);
+}
+
+static void set_clock_rate (node_t* node) {
+	node->clock_local = local_time(node, now);
+	node->clock_time = now;
+	node->clock_rate = 1.0 + (node->dw_ppm - (node->xtal_trim - DW1000_DEFAULT_XTALTRIM)*XTAL_TRIM_PPM_PER_STEP) * 1e-6;
+}
+
+static sim_time_t frame_airtime_after_rmarker (uint16_t len) {
+	return US(PHR_US + DATA_US_PER_BYTE*len);
+}
+
+// Anything the radio was doing is abandoned
+static void radio_change (node_t* node, radio_state_e state) {
+	node->radio = state;
+	node->radio_gen++;
+	node->rx.active = FALSE;
+}
+
+int dwt_rxenable (int delayed) {
+	(void) delayed;
+	node_t* node = this_node();
+	radio_change(node, RADIO_RX);
+	return 0;
+}
+
+void dwt_forcetrxoff (void) {
+	radio_change(this_node(), RADIO_IDLE);
+}
+
+uint32 dwt_readsystimestamphi32 (void) {
+	node_t* node = this_node();
+	return (uint32) ((local_time(node, now) & DW_TIME_MASK) >> 8);
+}
+
+void dwt_setdelayedtrxtime (uint32 starttime) {
+	this_node()->delayed_time = starttime;
+}
+
+void dwt_setrxaftertxdelay (uint32 rxDelayTime) {
+	this_node()->rx_after_tx = rxDelayTime;
+}
+
+int dwt_writetxfctrl (uint16 txFrameLength, uint16 txBufferOffset) {
+	(void) txBufferOffset;
+	this_node()->tx_len = txFrameLength;
+	return 0;
+}
+
+int dwt_writetxdata (uint16 txFrameLength, uint8 *txFrameBytes, uint16 txBufferOffset) {
+	node_t* node = this_node();
+	if (txBufferOffset + txFrameLength <= MAX_FRAME_LEN) {
+		memcpy(node->tx_buf + txBufferOffset, txFrameBytes, txFrameLength);
+	}
+	return 0;
+}
+
+int dwt_writetodevice (uint16 recordNumber, uint16 index, uint32 length, const uint8 *buffer) {
+	node_t* node = this_node();
+	if (recordNumber == TX_BUFFER_ID && index + length <= MAX_FRAME_LEN) {
+		memcpy(node->tx_buf + index, buffer, length);
+	}
+	return 0;
+}
+
+int dwt_starttx (uint8 mode) {
+	node_t* node = this_node();
+	uint64_t now_local = local_time(node, now) & DW_TIME_MASK;
+	uint64_t target = ((uint64_t) (node->delayed_time & 0xFFFFFFFE) << 8) & DW_TIME_MASK;
+	uint64_t delta = (target - now_local) & DW_TIME_MASK;
+
+	radio_change(node, RADIO_TX);
+	if (node->role == NODE_MASTER) master_sending = TRUE;
+	node->response_expected = (mode & DWT_RESPONSE_EXPECTED) != 0;
+
+	// Only delayed sends are used. The chip gives up (HPDWARN) if the time
+	// has passed, and it needs the preamble's worth of time to start.
+	if (!(mode & DWT_START_TX_DELAYED) || delta >= DW_TIME_HALF ||
+	    (double) delta < US(PREAMBLE_SFD_US) * node->clock_rate) {
+		stats.late_tx++;
+		radio_change(node, RADIO_IDLE);
+		return -1;
+	}
+
+	node->tx_rmarker = now + (sim_time_t) llround((double) delta / node->clock_rate);
+	schedule(node->tx_rmarker - US(PREAMBLE_SFD_US), EV_TX_START, current_node, node->radio_gen);
+	return 0;
+}
+
+void dwt_settxantennadelay (uint16 antennaDly) {
+	(void) antennaDly;
+}
+
+void dwt_setdblrxbuffmode (int enable) {
+	(void) enable;
+}
+
+void dwt_xtaltrim (uint8 value) {
+	node_t* node = this_node();
+	node->xtal_trim = value;
+	set_clock_rate(node);
+}
+
+int dwt_write32bitoffsetreg (int regFileID, int regOffset, uint32 regval) {
+	(void) regFileID;
+	(void) regOffset;
+	(void) regval;
+	return 0;
+}
+
+void dw1000_read_eui (uint8_t *eui_buf) {
+	memcpy(eui_buf, this_node()->eui, EUI_LEN);
+}
+
+void dw1000_update_channel (uint8_t chan) {
+	node_t* node = this_node();
+	node->channel = chan;
+	if (node->radio == RADIO_RX) {
+		radio_change(node, RADIO_RX);
+	}
+}
+
+void dw1000_choose_antenna (uint8_t antenna_number) {
+	(void) antenna_number;
+}
+
+uint16_t dw1000_preamble_time_in_us () {
+	return (uint16_t) (64 * 1.01763 + 0.5);
+}
+
+/******************************************************************************/
+// Simulated timers
+/******************************************************************************/
+
+static sim_time_t mcu_us (node_t* node, double us) {
+	return US(us / (1.0 + node->mcu_ppm * 1e-6));
+}
+
+stm_timer_t* timer_init () {
+	return &this_node()->timer;
+}
+
+void timer_start (stm_timer_t* t, uint32_t us_period, timer_callback cb) {
+	(void) t;
+	node_t* node = this_node();
+	node->timer_cb = cb;
+	node->timer_period_us = us_period;
+	node->timer_gen++;
+	schedule(now + mcu_us(node, us_period), EV_TIMER, current_node, node->timer_gen);
+}
+
+void timer_reset (stm_timer_t* t, uint32_t val_us) {
+	(void) t;
+	node_t* node = this_node();
+	uint32_t remaining = (val_us <= node->timer_period_us) ? node->timer_period_us - val_us
+	                                                       : TIMER_WRAP_US - val_us + node->timer_period_us;
+	node->timer_gen++;
+	schedule(now + mcu_us(node, remaining), EV_TIMER, current_node, node->timer_gen);
+
+	// Interval boundaries come from the sync packet. The timer is also
+	// moved before the end of each interval to line it up with the DW1000.
+	if (node->role != NODE_MASTER) {
+		if (current_event == EV_RX_HANDLER) {
+			node->synced = TRUE;
+			stats.resyncs++;
+		}
+	} else if (current_event == EV_TX_HANDLER) {
+		interval_slot0_time = now;
+		master_counter = 0;
+	}
+}
+
+void timer_stop (stm_timer_t* t) {
+	(void) t;
+	node_t* node = this_node();
+	node->timer_cb = NULL;
+	node->timer_gen++;
+}
+
+/******************************************************************************/
+// Statistics
+/******************************************************************************/
+
+// Whether two nodes are both in range of some anchor
+static bool share_anchor (node_t* a, node_t* b) {
+	for (int i = 0; i < a->num_links; i++) {
+		if (nodes[a->links[i].node].role == NODE_TAG) continue;
+		for (int j = 0; j < b->num_links; j++) {
+			if (b->links[j].node == a->links[i].node) return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void finish_interval () {
+	int used = 0;
+	int conflicts = 0;
+	int locations = 0;
+	int clashes = 0;
+	bool clashed[MAX_RANGING_EVENTS] = { FALSE };
+
+	if (interval < 0) return;
+
+	// A tag's ranging clashes with any other tag's in the same event that
+	// reaches one of the same anchors
+	for (int i = 0; i < interval_num_ranging; i++) {
+		bool clash = FALSE;
+		for (int j = 0; j < interval_num_ranging && !clash; j++) {
+			clash = j != i && interval_ranging_event[j] == interval_ranging_event[i] &&
+			        share_anchor(&nodes[interval_ranging_node[i]], &nodes[interval_ranging_node[j]]);
+		}
+		if (clash) {
+			clashes++;
+			clashed[interval_ranging_event[i]] = TRUE;
+		} else {
+			locations++;
+		}
+	}
+
+	for (int e = 0; e < (int) LWB_RANGING_EVENTS; e++) {
+		if (interval_events_used[e] > 0) used++;
+		if (clashed[e]) conflicts++;
+	}
+
+	stats.flooded[interval] = interval_flooded;
+	stats.completion_ms[interval] = interval_covered ? TICKS_TO_US(interval_completion) / 1000 : 0;
+	stats.coverage[interval] = (double) interval_covered / (cfg.num_nodes - 1);
+	stats.utilization[interval] = (double) used / LWB_RANGING_EVENTS;
+	stats.conflicts[interval] = conflicts;
+	stats.tags_served[interval] = interval_tags_served;
+	stats.locations[interval] = locations;
+	stats.clashes[interval] = clashes;
+	stats.intervals = interval + 1;
+
+	if (cfg.verbose) {
+		printf("%8d  %8.3f  %13.2f  %11.2f  %9d  %11d\n",
+		       interval, stats.coverage[interval], stats.completion_ms[interval],
+		       stats.utilization[interval], conflicts, interval_tags_served);
+	}
+}
+
+// The master started an interval, either by sending a sync or, between
+// syncs, from its timer
+static void start_interval (bool flooded) {
+	finish_interval();
+	if (interval+1 < stats.max_intervals) interval++;
+	interval_flooded = flooded;
+	interval_covered = 0;
+	interval_completion = 0;
+	interval_tags_served = 0;
+	interval_num_ranging = 0;
+	memset(interval_events_used, 0, sizeof(interval_events_used));
+
+	if (flooded) {
+		for (int n = 1; n < cfg.num_nodes; n++) {
+			nodes[n].deaf = uniform() < cfg.miss;
+		}
+	}
+}
+
+static void record_sync_error (node_t* node) {
+	if (node->role == NODE_MASTER) {
+		master_last_fire = now;
+		return;
+	}
+	if (!node->synced || master_last_fire == 0) return;
+
+	// Distance to the nearest master slot boundary
+	sim_time_t slot = US(LWB_SLOT_US);
+	sim_time_t err = (now - master_last_fire) % slot;
+	if (err > slot/2) err -= slot;
+	double err_us = fabs(TICKS_TO_US(err));
+
+	int bin = (int) (err_us / SYNC_ERROR_BIN_US);
+	if (bin > SYNC_ERROR_BINS) bin = SYNC_ERROR_BINS;
+	stats.sync_error_hist[bin]++;
+	stats.sync_error_count++;
+	if (err_us > stats.sync_error_max_us) stats.sync_error_max_us = err_us;
+}
+
+static double sync_error_percentile (double p) {
+	uint64_t target = (uint64_t) ceil(p * stats.sync_error_count);
+	uint64_t seen = 0;
+	for (int i = 0; i <= SYNC_ERROR_BINS; i++) {
+		seen += stats.sync_error_hist[i];
+		if (seen >= target && seen > 0) {
+			return (i == SYNC_ERROR_BINS) ? stats.sync_error_max_us : (i+1) * SYNC_ERROR_BIN_US;
+		}
+	}
+	return 0;
+}
+
+static void record_flood (node_t* node, const uint8_t* buf) {
+	const struct pp_sched_flood* sync = (const struct pp_sched_flood*) buf;
+
+	if (interval < 0 || node->flood_interval == interval) return;
+	node->flood_interval = interval;
+	interval_covered++;
+	if (now - interval_sync_time > interval_completion) {
+		interval_completion = now - interval_sync_time;
+	}
+	if (sync->header.seqNum <= GLOSSY_MAX_DEPTH) {
+		stats.depth_hist[sync->header.seqNum]++;
+	}
+}
+
+// When a tag hears that it was given a slot, and which
+static void record_ack (node_t* node, const uint8_t* buf) {
+	const struct pp_sched_flood* sync = (const struct pp_sched_flood*) buf;
+
+	for (int i = 0; i < sync->num_sched_entries && i < LWB_SCHED_DELTA_ENTRIES; i++) {
+		if (memcmp(sync->sched_entries[i].tag_sched_eui, node->eui, LWB_SCHED_EUI_LEN) == 0 &&
+		    sync->sched_entries[i].tag_sched_check == lwb_sched_check(node->eui)) {
+			if (!node->acked_time) node->acked_time = now;
+			node->sched_slot = sync->sched_entries[i].slot;
+		}
+	}
+}
+
+// The LWB callback. A tag would start ranging here.
+static void ranging_slot () {
+	node_t* node = this_node();
+	sim_time_t slot = US(LWB_SLOT_US);
+	long counter = lround((double) (now - interval_slot0_time) / slot);
+
+	if (node->first_slot_time == 0) {
+		node->first_slot_time = now;
+	}
+	node->ranging_events++;
+	if (node->slot_interval != interval) {
+		node->slot_interval = interval;
+		interval_tags_served++;
+	}
+
+	// The anchors in range answer, like they would in oneway_tag.c
+	for (int l = 0; l < node->num_links; l++) {
+		node_t* other = &nodes[node->links[l].node];
+		if (other->role != NODE_TAG) lwb_note_anchor(other->eui);
+	}
+
+	counter -= LWB_FIRST_RANGING_SLOT;
+	if (counter < 0 || counter % LWB_SLOTS_PER_RANGE != 0 ||
+	    counter / LWB_SLOTS_PER_RANGE >= (long) LWB_RANGING_EVENTS) {
+		stats.misaligned_slots++;
+		return;
+	}
+	interval_events_used[counter / LWB_SLOTS_PER_RANGE]++;
+	if (interval_num_ranging < MAX_INTERVAL_RANGING) {
+		interval_ranging_node[interval_num_ranging] = current_node;
+		interval_ranging_event[interval_num_ranging] = counter / LWB_SLOTS_PER_RANGE;
+		interval_num_ranging++;
+	}
+}
+
+/******************************************************************************/
+// Radio propagation
+/******************************************************************************/
+
+// Walls between two points when the floor is split into rooms
+static int walls_between (node_t* a, node_t* b) {
+	if (cfg.room_m <= 0) return 0;
+	return abs((int) floor(a->x / cfg.room_m) - (int) floor(b->x / cfg.room_m)) +
+	       abs((int) floor(a->y / cfg.room_m) - (int) floor(b->y / cfg.room_m));
+}
+
+static bool in_range (node_t* a, node_t* b) {
+	double d = hypot(a->x - b->x, a->y - b->y);
+	if (d > cfg.range_m) return FALSE;
+	if (d <= 0) return TRUE;
+	double loss_db = 10 * PATH_LOSS_EXPONENT * log10(d / cfg.range_m) + walls_between(a, b) * cfg.wall_db;
+	return loss_db <= 0;
+}
+
+static void frame_arrives (int n, node_t* sender, sim_time_t delay) {
+	node_t* node = &nodes[n];
+	reception_t* rx = &node->rx;
+	sim_time_t start = now + delay;
+	sim_time_t rmarker = sender->tx_rmarker + delay;
+	sim_time_t end = rmarker + frame_airtime_after_rmarker(sender->tx_frame_len);
+	bool ok = uniform() >= cfg.loss;
+
+	if (node->radio != RADIO_RX || node->channel != sender->channel) return;
+	if (node->deaf && sender->tx_frame[offsetof(struct pp_sched_flood, message_type)] == MSG_TYPE_PP_GLOSSY_SYNC) return;
+
+	if (!rx->active) {
+		rx->active = TRUE;
+		rx->corrupted = FALSE;
+		rx->any_ok = ok;
+		rx->start = start;
+		rx->rmarker = rmarker;
+		rx->end = end;
+		rx->len = sender->tx_frame_len;
+		memcpy(rx->buf, sender->tx_frame, rx->len);
+		schedule(end, EV_RX_END, n, node->radio_gen);
+		return;
+	}
+
+	// Something else is already arriving
+	if (llabs(start - rx->start) <= US(cfg.ci_window_us) &&
+	    rx->len == sender->tx_frame_len &&
+	    memcmp(rx->buf, sender->tx_frame, rx->len) == 0) {
+		if (ok && (!rx->any_ok || rmarker < rx->rmarker)) {
+			rx->rmarker = rmarker;
+		}
+		rx->any_ok |= ok;
+	} else {
+		rx->corrupted = TRUE;
+	}
+	if (end > rx->end) {
+		rx->end = end;
+		schedule(end, EV_RX_END, n, node->radio_gen);
+	}
+}
+
+static void tx_start (int n) {
+	node_t* node = &nodes[n];
+
+	node->tx_frame_len = node->tx_len;
+	memcpy(node->tx_frame, node->tx_buf, node->tx_len);
+	stats.transmissions++;
+	if (node->tx_frame[offsetof(struct pp_sched_req_flood, message_type)] == MSG_TYPE_PP_GLOSSY_SCHED_REQ &&
+	    node->tx_frame[offsetof(struct ieee154_header_broadcast, seqNum)] == 0) {
+		stats.sched_requests++;
+	}
+
+	if (node->role == NODE_MASTER && node->tx_frame[offsetof(struct pp_sched_flood, message_type)] == MSG_TYPE_PP_GLOSSY_SYNC) {
+		start_interval(TRUE);
+		interval_sync_time = node->tx_rmarker;
+	}
+
+	for (int l = 0; l < node->num_links; l++) {
+		frame_arrives(node->links[l].node, node, node->links[l].delay);
+	}
+
+	schedule(node->tx_rmarker + frame_airtime_after_rmarker(node->tx_frame_len), EV_TX_END, n, node->radio_gen);
+}
+
+static void tx_end (int n) {
+	node_t* node = &nodes[n];
+
+	radio_change(node, RADIO_IDLE);
+	if (node->response_expected) {
+		schedule(now + US(node->rx_after_tx * RX_AFTER_TX_UNIT_US), EV_RX_ENABLE, n, node->radio_gen);
+	}
+	schedule(now + US(ISR_LATENCY_US), EV_TX_HANDLER, n, 0);
+}
+
+static void rx_end (int n) {
+	node_t* node = &nodes[n];
+	reception_t* rx = &node->rx;
+
+	if (!rx->active || rx->end != now) return;
+	rx->active = FALSE;
+
+	if (rx->corrupted || !rx->any_ok) {
+		// The firmware puts the radio straight back into RX after an error
+		if (rx->corrupted) stats.collisions++;
+		return;
+	}
+
+	// After a good frame the DW1000 stays idle until told otherwise
+	stats.receptions++;
+	radio_change(node, RADIO_IDLE);
+	node->rx_handler_len = rx->len;
+	memcpy(node->rx_handler_buf, rx->buf, rx->len);
+	node->rx_handler_timestamp = (uint64_t) local_time(node, rx->rmarker) & DW_TIME_MASK;
+	schedule(now + US(ISR_LATENCY_US + RX_READ_US_PER_BYTE*rx->len), EV_RX_HANDLER, n, 0);
+}
+
+// What the anchor and tag RX callbacks do with glossy packets
+static void rx_handler (int n) {
+	node_t* node = enter_node(n);
+	uint8_t message_type = node->rx_handler_buf[offsetof(struct pp_sched_flood, message_type)];
+
+	if (node->role != NODE_TAG) {
+		dwt_rxenable(0);
+	}
+	if (message_type == MSG_TYPE_PP_GLOSSY_SYNC) {
+		record_flood(node, node->rx_handler_buf);
+		if (node->role == NODE_TAG) record_ack(node, node->rx_handler_buf);
+		if (record) {
+			fprintf(record, "%d %llu %u %u\n", n, (unsigned long long) node->rx_handler_timestamp,
+			        node->rx_handler_buf[offsetof(struct ieee154_header_broadcast, seqNum)], node->xtal_trim);
+		}
+	}
+	if (message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ && node->role == NODE_MASTER) {
+		stats.sched_requests_heard++;
+	}
+	if (message_type == MSG_TYPE_PP_GLOSSY_SYNC || message_type == MSG_TYPE_PP_GLOSSY_SCHED_REQ) {
+		glossy_sync_process(node->rx_handler_timestamp, node->rx_handler_buf, node->rx_handler_len);
+	}
+}
+
+/******************************************************************************/
+// Setup
+/******************************************************************************/
+
+static void place_nodes () {
+	for (int n = 0; n < cfg.num_nodes; n++) {
+		node_t* node = &nodes[n];
+		node->role = (n == 0) ? NODE_MASTER : (n < cfg.num_anchors) ? NODE_ANCHOR : NODE_TAG;
+		if (n == 0) {
+			node->x = cfg.width_m / 2;
+			node->y = cfg.width_m / 2;
+		} else {
+			node->x = uniform() * cfg.width_m;
+			node->y = uniform() * cfg.width_m;
+		}
+		node->links = malloc(cfg.num_nodes * sizeof(link_t));
+		node->num_links = 0;
+		node->hops = -1;
+	}
+
+	for (int a = 0; a < cfg.num_nodes; a++) {
+		for (int b = 0; b < cfg.num_nodes; b++) {
+			double d = hypot(nodes[a].x - nodes[b].x, nodes[a].y - nodes[b].y);
+			if (a == b || !in_range(&nodes[a], &nodes[b])) continue;
+			nodes[a].links[nodes[a].num_links].node = b;
+			nodes[a].links[nodes[a].num_links].delay = US(d / SPEED_OF_LIGHT_M_PER_US);
+			nodes[a].num_links++;
+		}
+	}
+
+	// Hop distance from the master
+	int* queue = malloc(cfg.num_nodes * sizeof(int));
+	int head = 0, tail = 0;
+	nodes[0].hops = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		node_t* node = &nodes[queue[head++]];
+		for (int l = 0; l < node->num_links; l++) {
+			node_t* other = &nodes[node->links[l].node];
+			if (other->hops < 0) {
+				other->hops = node->hops + 1;
+				queue[tail++] = node->links[l].node;
+			}
+		}
+	}
+	free(queue);
+}
+
+static void boot_node (int n) {
+	node_t* node = enter_node(n);
+
+	memset(__start_glossy_state, 0, GLOSSY_STATE_SIZE);
+
+	// c0:98:e5:50:50:44:xx:xx, stored least significant byte first
+	const uint8_t eui[EUI_LEN] = {n & 0xFF, 0x50 + (n >> 8), 0x44, 0x50, 0x50, 0xe5, 0x98, 0xc0};
+	memcpy(node->eui, eui, EUI_LEN);
+
+	// The last alias_tags tags have the same last two bytes as the first
+	// ones, like tags from another batch could
+	int alias_of = n - (cfg.num_nodes - cfg.alias_tags) + cfg.num_anchors;
+	if (alias_of >= cfg.num_anchors && alias_of < n) {
+		node->eui[0] = alias_of & 0xFF;
+		node->eui[1] = 0x50 + (alias_of >> 8);
+		node->eui[2] = 0x45;
+	}
+
+	node->dw_ppm = (uniform()*2 - 1) * cfg.dw_ppm;
+	node->mcu_ppm = (uniform()*2 - 1) * cfg.mcu_ppm;
+	node->clock_local = (int64_t) (uniform() * DW_TIME_MASK);
+	node->clock_time = now;
+	node->xtal_trim = DW1000_DEFAULT_XTALTRIM;
+	set_clock_rate(node);
+
+	node->channel = 1;
+	node->radio = RADIO_IDLE;
+	node->boot_time = now;
+	node->flood_interval = -1;
+	node->slot_interval = -1;
+
+	glossy_init(node->role == NODE_MASTER ? GLOSSY_MASTER : GLOSSY_SLAVE, &master_sched);
+
+	if (node->role == NODE_TAG) {
+		lwb_set_sched_request(TRUE);
+		if (n < cfg.num_anchors + cfg.asset_tags) lwb_set_update_rate(cfg.asset_rate);
+		lwb_set_sched_callback(ranging_slot);
+	} else {
+		// Anchors wait for tags on the first ranging channel
+		dwt_rxenable(0);
+	}
+}
+
+/******************************************************************************/
+// Main loop
+/******************************************************************************/
+
+static void run () {
+	sim_time_t end = US(cfg.duration_s * 1e6);
+
+	// Everyone is turned on at some point in the first interval, or the tags
+	// all at once later on
+	for (int n = 0; n < cfg.num_nodes; n++) {
+		sim_time_t boot = (n == 0) ? 0 : US(uniform() * GLOSSY_UPDATE_INTERVAL_US);
+		if (nodes[n].role == NODE_TAG && cfg.tag_boot_s >= 0) boot = US(cfg.tag_boot_s * 1e6);
+		schedule(boot, EV_BOOT, n, 0);
+	}
+
+	while (num_events > 0) {
+		event_t ev = next_event();
+		node_t* node = &nodes[ev.node];
+
+		if (ev.time > end) break;
+		now = ev.time;
+		current_event = ev.type;
+		stats.events++;
+
+		switch (ev.type) {
+			case EV_BOOT:
+				boot_node(ev.node);
+				break;
+
+			case EV_TIMER:
+				if (ev.gen != node->timer_gen || !node->timer_cb) break;
+				schedule(now + mcu_us(node, node->timer_period_us), EV_TIMER, ev.node, node->timer_gen);
+				if (cfg.dw_wander > 0) {
+					node->dw_ppm += gaussian() * cfg.dw_wander * sqrt(node->timer_period_us * 1e-6);
+					set_clock_rate(node);
+				}
+				// Without a sync the master starts the next interval itself
+				if (node->role == NODE_MASTER && ++master_counter == GLOSSY_UPDATE_INTERVAL_US/LWB_SLOT_US && !master_sending) {
+					start_interval(FALSE);
+					interval_slot0_time = now;
+					master_counter = 0;
+				}
+				record_sync_error(node);
+				enter_node(ev.node);
+				node->timer_cb();
+				break;
+
+			case EV_TX_START:
+				if (ev.gen == node->radio_gen) tx_start(ev.node);
+				break;
+
+			case EV_TX_END:
+				if (ev.gen == node->radio_gen) tx_end(ev.node);
+				break;
+
+			case EV_RX_ENABLE:
+				if (ev.gen == node->radio_gen) radio_change(node, RADIO_RX);
+				break;
+
+			case EV_RX_END:
+				if (ev.gen == node->radio_gen) rx_end(ev.node);
+				break;
+
+			case EV_RX_HANDLER:
+				rx_handler(ev.node);
+				break;
+
+			case EV_TX_HANDLER:
+				if (node->role == NODE_MASTER) master_sending = FALSE;
+				enter_node(ev.node);
+				glossy_process_txcallback();
+				break;
+		}
+	}
+
+	// The interval that was cut off isn't counted
+}
+
+/******************************************************************************/
+// Reporting
+/******************************************************************************/
+
+static int compare_double (const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile (double* values, int num, double p) {
+	if (num == 0) return 0;
+	qsort(values, num, sizeof(double), compare_double);
+	int i = (int) ceil(p * num) - 1;
+	return values[i < 0 ? 0 : i];
+}
+
+// Returns how many tags were told the same slot as another
+static int report (double wall_s) {
+	int num_tags = cfg.num_nodes - cfg.num_anchors;
+	int max_hops = 0, unreachable = 0;
+	int never_synced = 0, never_scheduled = 0;
+	int shared_slots = 0, alias_pairs_scheduled = 0;
+	double* joins = malloc((num_tags+1) * sizeof(double));
+	double* acks = malloc((num_tags+1) * sizeof(double));
+	int num_joins = 0, num_acks = 0;
+	double rate[2] = {0, 0};
+	int rate_tags[2] = {0, 0};
+	int intervals = stats.intervals;
+
+	for (int n = 0; n < cfg.num_nodes; n++) {
+		node_t* node = &nodes[n];
+		if (node->hops < 0) unreachable++;
+		else if (node->hops > max_hops) max_hops = node->hops;
+		if (n > 0 && !node->synced) never_synced++;
+		if (node->role == NODE_TAG) {
+			if (node->first_slot_time) joins[num_joins++] = TICKS_TO_US(node->first_slot_time - node->boot_time) / 1e6;
+			else never_scheduled++;
+			if (node->acked_time) acks[num_acks++] = TICKS_TO_US(node->acked_time - node->boot_time) / 1e6;
+			int alias_of = n - (cfg.num_nodes - cfg.alias_tags) + cfg.num_anchors;
+			if (alias_of >= cfg.num_anchors && alias_of < n && node->acked_time && nodes[alias_of].acked_time) {
+				alias_pairs_scheduled++;
+			}
+			for (int o = cfg.num_anchors; o < cfg.num_nodes && node->acked_time; o++) {
+				if (o != n && nodes[o].acked_time && nodes[o].sched_slot == node->sched_slot) {
+					shared_slots++;
+					break;
+				}
+			}
+			if (node->first_slot_time) {
+				int asset = n < cfg.num_anchors + cfg.asset_tags;
+				rate[asset] += node->ranging_events / (cfg.duration_s - TICKS_TO_US(node->first_slot_time) / 1e6);
+				rate_tags[asset]++;
+			}
+		}
+	}
+
+	printf("\n%d nodes (%d anchors including the master, %d tags), %.0f m square, %.0f m range\n",
+	       cfg.num_nodes, cfg.num_anchors, num_tags, cfg.width_m, cfg.range_m);
+	if (cfg.room_m > 0) {
+		printf("%.0f m rooms, %.0f dB through each wall\n", cfg.room_m, cfg.wall_db);
+	}
+	printf("%.0f%% link loss, +-%.0f ppm DW1000, +-%.0f ppm MCU, %.2f us concurrent window\n",
+	       cfg.loss*100, cfg.dw_ppm, cfg.mcu_ppm, cfg.ci_window_us);
+	printf("%.0f%% of floods missed, %.3f ppm/sqrt(s) DW1000 wander, a sync every %d intervals\n",
+	       cfg.miss*100, cfg.dw_wander, GLOSSY_SYNC_INTERVALS);
+	printf("%.0f s simulated in %.2f s (%.0fx), %llu events\n\n",
+	       cfg.duration_s, wall_s, cfg.duration_s / wall_s, (unsigned long long) stats.events);
+
+	printf("Topology:    %d hops to the furthest node, %d unreachable\n", max_hops, unreachable);
+	printf("Radio:       %llu TX, %llu RX, %llu collisions, %llu late TX\n",
+	       (unsigned long long) stats.transmissions, (unsigned long long) stats.receptions,
+	       (unsigned long long) stats.collisions, (unsigned long long) stats.late_tx);
+
+	printf("Sync error:  p50 %.2f us  p90 %.2f us  p99 %.2f us  max %.2f us (%d never synced)\n",
+	       sync_error_percentile(0.5), sync_error_percentile(0.9),
+	       sync_error_percentile(0.99), stats.sync_error_max_us, never_synced);
+	printf("Resyncs:     %.2f per node per interval\n",
+	       (double) stats.resyncs / ((cfg.num_nodes-1) * (double) (intervals ? intervals : 1)));
+
+	printf("Flood depth:");
+	for (int d = 0; d <= GLOSSY_MAX_DEPTH; d++) {
+		if (stats.depth_hist[d]) printf(" %d:%llu", d, (unsigned long long) stats.depth_hist[d]);
+	}
+	printf("\n");
+
+	// Leave out the first intervals while nodes are still booting
+	int skip = intervals > 2 ? 2 : 0;
+	double* values = malloc((intervals+1) * sizeof(double));
+	int num = 0;
+
+	for (int i = skip; i < intervals; i++) if (stats.flooded[i]) values[num++] = stats.coverage[i];
+	printf("Coverage:    p10 %.3f  p50 %.3f of nodes got each flood\n",
+	       percentile(values, num, 0.1), percentile(values, num, 0.5));
+
+	num = 0;
+	for (int i = skip; i < intervals; i++) if (stats.flooded[i]) values[num++] = stats.completion_ms[i];
+	printf("Completion:  p50 %.2f ms  p90 %.2f ms  max %.2f ms\n",
+	       percentile(values, num, 0.5), percentile(values, num, 0.9), percentile(values, num, 1.0));
+
+	double used = 0, served = 0;
+	int conflicts = 0;
+	for (int i = skip; i < intervals; i++) {
+		used += stats.utilization[i];
+		served += stats.tags_served[i];
+		conflicts += stats.conflicts[i];
+	}
+	num = intervals - skip;
+	if (num < 1) num = 1;
+	printf("LWB slots:   %.1f%% of %d ranging slots used, %.1f tags served, %.2f with clashing tags per interval\n",
+	       100 * used / num, (int) LWB_RANGING_EVENTS, served / num, (double) conflicts / num);
+	printf("             %llu slots started off the master's slot boundaries\n",
+	       (unsigned long long) stats.misaligned_slots);
+	printf("Tag joining: p50 %.1f s  p90 %.1f s  max %.1f s, %d never scheduled\n",
+	       percentile(joins, num_joins, 0.5), percentile(joins, num_joins, 0.9),
+	       percentile(joins, num_joins, 1.0), never_scheduled);
+	printf("             got a slot p50 %.1f s  p90 %.1f s  max %.1f s\n",
+	       percentile(acks, num_acks, 0.5), percentile(acks, num_acks, 0.9), percentile(acks, num_acks, 1.0));
+	printf("Ranging:     %.3f events/s for each of %d tags, %.3f for each of %d asset tags\n",
+	       rate_tags[0] ? rate[0] / rate_tags[0] : 0, rate_tags[0],
+	       rate_tags[1] ? rate[1] / rate_tags[1] : 0, rate_tags[1]);
+	printf("             %llu schedule requests sent, %llu received by the master\n",
+	       (unsigned long long) stats.sched_requests, (unsigned long long) stats.sched_requests_heard);
+	printf("             %d tags last heard the same slot as another tag\n", shared_slots);
+	if (cfg.alias_tags) {
+		printf("             %d of the %d pairs of tags sharing EUI bytes both got a slot\n",
+		       alias_pairs_scheduled, cfg.alias_tags);
+	}
+
+	// Once the tags have reported their anchors
+	int locations = 0, clashes = 0;
+	for (int i = intervals/2; i < intervals; i++) {
+		locations += stats.locations[i];
+		clashes += stats.clashes[i];
+	}
+	num = intervals - intervals/2;
+	if (num < 1) num = 1;
+	printf("Locations:   %.2f per second in the second half, %.1f%% of ranging events clashed\n",
+	       locations / (num * GLOSSY_UPDATE_INTERVAL_US / 1e6),
+	       (locations + clashes) ? 100.0 * clashes / (locations + clashes) : 0);
+
+	free(values);
+	free(joins);
+	free(acks);
+	return shared_slots;
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-n nodes] [-a anchors] [-w width_m] [-r range_m] [-g room_m]\n"
+	                "       [-W wall_db] [-l loss] [-p dw_ppm] [-m mcu_ppm] [-c ci_window_us]\n"
+	                "       [-f miss] [-d dw_wander]\n"
+	                "       [-j tag_boot_s] [-A asset_tags] [-R asset_rate] [-e alias_tags]\n"
+	                "       [-t seconds] [-s seed]\n"
+	                "       [-o record_file] [-v]\n", name);
+}
+
+int main (int argc, char** argv) {
+	int opt;
+
+	cfg = (sim_config_t) {
+		.num_nodes = 100,
+		.num_anchors = 90,
+		.width_m = 100,
+		.range_m = 30,
+		.room_m = 0,
+		.wall_db = 10,
+		.loss = 0.05,
+		.dw_ppm = 10,
+		.mcu_ppm = 20,
+		.ci_window_us = 0.5,
+		.miss = 0,
+		.dw_wander = 0,
+		.tag_boot_s = -1,
+		.asset_tags = 0,
+		.asset_rate = 1,
+		.alias_tags = 0,
+		.duration_s = 600,
+		.record_path = NULL,
+		.seed = 1,
+		.verbose = FALSE,
+	};
+
+	while ((opt = getopt(argc, argv, "n:a:w:r:g:W:l:p:m:c:f:d:j:A:R:e:t:s:o:vh")) != -1) {
+		switch (opt) {
+			case 'n': cfg.num_nodes = atoi(optarg); break;
+			case 'a': cfg.num_anchors = atoi(optarg); break;
+			case 'w': cfg.width_m = atof(optarg); break;
+			case 'r': cfg.range_m = atof(optarg); break;
+			case 'g': cfg.room_m = atof(optarg); break;
+			case 'W': cfg.wall_db = atof(optarg); break;
+			case 'l': cfg.loss = atof(optarg); break;
+			case 'p': cfg.dw_ppm = atof(optarg); break;
+			case 'm': cfg.mcu_ppm = atof(optarg); break;
+			case 'c': cfg.ci_window_us = atof(optarg); break;
+			case 'f': cfg.miss = atof(optarg); break;
+			case 'd': cfg.dw_wander = atof(optarg); break;
+			case 'j': cfg.tag_boot_s = atof(optarg); break;
+			case 'A': cfg.asset_tags = atoi(optarg); break;
+			case 'R': cfg.asset_rate = atoi(optarg); break;
+			case 'e': cfg.alias_tags = atoi(optarg); break;
+			case 't': cfg.duration_s = atof(optarg); break;
+			case 's': cfg.seed = atol(optarg); break;
+			case 'o': cfg.record_path = optarg; break;
+			case 'v': cfg.verbose = TRUE; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (cfg.num_nodes < 2 || cfg.num_nodes > MAX_NODES ||
+	    cfg.num_anchors < 1 || cfg.num_anchors > cfg.num_nodes || cfg.duration_s <= 0 ||
+	    cfg.asset_tags < 0 || cfg.asset_tags > cfg.num_nodes - cfg.num_anchors ||
+	    cfg.asset_rate < 0 || cfg.asset_rate > 255 ||
+	    cfg.alias_tags < 0 || cfg.alias_tags * 2 > cfg.num_nodes - cfg.num_anchors) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (LWB_RANGING_EVENTS > MAX_RANGING_EVENTS) {
+		fprintf(stderr, "Increase MAX_RANGING_EVENTS to %d\n", (int) LWB_RANGING_EVENTS);
+		return 1;
+	}
+
+	srand48(cfg.seed);
+
+	nodes = calloc(cfg.num_nodes, sizeof(node_t));
+	for (int n = 0; n < cfg.num_nodes; n++) {
+		nodes[n].glossy_state = calloc(1, GLOSSY_STATE_SIZE);
+	}
+	stats.max_intervals = (int) (cfg.duration_s * 1e6 / GLOSSY_UPDATE_INTERVAL_US) + 2;
+	stats.flooded = calloc(stats.max_intervals, sizeof(bool));
+	stats.completion_ms = calloc(stats.max_intervals, sizeof(double));
+	stats.coverage = calloc(stats.max_intervals, sizeof(double));
+	stats.utilization = calloc(stats.max_intervals, sizeof(double));
+	stats.conflicts = calloc(stats.max_intervals, sizeof(int));
+	stats.tags_served = calloc(stats.max_intervals, sizeof(int));
+	stats.locations = calloc(stats.max_intervals, sizeof(int));
+	stats.clashes = calloc(stats.max_intervals, sizeof(int));
+
+	if (cfg.record_path) {
+		record = fopen(cfg.record_path, "w");
+		if (!record) {
+			perror(cfg.record_path);
+			return 1;
+		}
+		fprintf(record, "# node rx_timestamp depth xtal_trim\n");
+	}
+
+	place_nodes();
+
+	if (cfg.verbose) {
+		printf("interval  coverage  completion_ms  utilization  conflicts  tags_served\n");
+	}
+
+	clock_t start = clock();
+	run();
+	int shared_slots = report((double) (clock() - start) / CLOCKS_PER_SEC);
+
+	if (record) fclose(record);
+
+	return shared_slots ? 1 : 0;
+}
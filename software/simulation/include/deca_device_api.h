@@ -0,0 +1,42 @@
+#ifndef __DECA_DEVICE_API_H
+#define __DECA_DEVICE_API_H
+
+// Host stand-in for the dw1000-driver header of the same name, enough to
+// build firmware/glossy.c for glossy_sim. The functions are implemented by
+// the simulated DW1000 in glossy_sim.c.
+
+#include "deca_types.h"
+
+#define DWT_TIME_UNITS (1.0/499.2e6/128.0)
+
+#define DWT_BR_110K 0
+#define DWT_BR_850K 1
+#define DWT_BR_6M8  2
+
+#define DWT_PLEN_4096 0x0C
+#define DWT_PLEN_64   0x04
+
+#define DWT_PAC8  0
+#define DWT_PAC64 3
+
+#define DWT_START_TX_IMMEDIATE 0
+#define DWT_START_TX_DELAYED   1
+#define DWT_RESPONSE_EXPECTED  2
+
+int    dwt_starttx (uint8 mode);
+void   dwt_setdelayedtrxtime (uint32 starttime);
+void   dwt_setrxaftertxdelay (uint32 rxDelayTime);
+int    dwt_rxenable (int delayed);
+void   dwt_forcetrxoff (void);
+uint32 dwt_readsystimestamphi32 (void);
+int    dwt_writetxdata (uint16 txFrameLength, uint8 *txFrameBytes, uint16 txBufferOffset);
+int    dwt_writetxfctrl (uint16 txFrameLength, uint16 txBufferOffset);
+void   dwt_settxantennadelay (uint16 antennaDly);
+void   dwt_setdblrxbuffmode (int enable);
+void   dwt_xtaltrim (uint8 value);
+int    dwt_writetodevice (uint16 recordNumber, uint16 index, uint32 length, const uint8 *buffer);
+int    dwt_write32bitoffsetreg (int regFileID, int regOffset, uint32 regval);
+
+#define dwt_write32bitreg(x,y) dwt_write32bitoffsetreg(x,0,y)
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __DECA_REGS_H
+#define __DECA_REGS_H
+
+// Host stand-in for the dw1000-driver header of the same name, enough to
+// build firmware/glossy.c for glossy_sim and firmware/dw1000_channel.c for
+// spi_bench.
+
+#define SYS_CFG_ID     0x04
+#define TX_FCTRL_ID    0x08
+#define TX_BUFFER_ID   0x09
+#define SYS_CTRL_ID    0x0D
+#define SYS_STATUS_ID  0x0F
+#define RX_BUFFER_ID   0x11
+#define RX_TIME_ID     0x15
+#define TX_ANTD_ID     0x18
+#define TX_POWER_ID    0x1E
+#define CHAN_CTRL_ID   0x1F
+#define AGC_CFG_STS_ID 0x23
+#define DRX_CONF_ID    0x27
+#define RF_CONF_ID     0x28
+#define TX_CAL_ID      0x2A
+#define FS_CTRL_ID     0x2B
+#define LDE_IF_ID      0x2E
+
+#define RF_RXCTRLH_OFFSET 0x0B
+#define RF_TXCTRL_OFFSET  0x0C
+#define TC_PGDELAY_OFFSET 0x0B
+#define FS_PLLCFG_OFFSET  0x07
+#define FS_PLLTUNE_OFFSET 0x0B
+#define SYS_CTRL_HRBT_OFFSET 0x03
+
+#define OTP_IF_ID            0x2D
+#define OTP_SF               0x12
+#define OTP_SF_OPS_KICK      0x01
+#define OTP_SF_OPS_SEL_TIGHT 0x40
+
+#endif
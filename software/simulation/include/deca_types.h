@@ -0,0 +1,16 @@
+#ifndef __DECA_TYPES_H
+#define __DECA_TYPES_H
+
+// Host stand-in for the dw1000-driver header of the same name, enough to
+// build firmware/glossy.c for glossy_sim.
+
+#include <stdint.h>
+
+typedef uint8_t  uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t   int8;
+typedef int16_t  int16;
+typedef int32_t  int32;
+
+#endif
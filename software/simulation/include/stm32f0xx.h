@@ -0,0 +1,219 @@
+#ifndef __STM32F0XX_H
+#define __STM32F0XX_H
+
+// Host stand-in for the STM32F0 standard library header, enough for
+// include/timer.h and source/timer.c, and for firmware/dw1000_spi.c.
+// glossy_sim.c implements the timer functions itself, timer_bench.c models
+// the TIM17, RTC, and clocks that source/timer.c uses, and spi_bench.c the
+// SPI1 and DMA channels that firmware/dw1000_spi.c uses.
+
+#include <stdint.h>
+
+typedef enum { RESET = 0, SET = !RESET } FlagStatus, ITStatus;
+typedef enum { DISABLE = 0, ENABLE = !DISABLE } FunctionalState;
+typedef enum { ERROR = 0, SUCCESS = !ERROR } ErrorStatus;
+
+typedef struct {
+	uint32_t CNT;
+} TIM_TypeDef;
+
+typedef struct {
+	uint8_t NVIC_IRQChannel;
+	uint8_t NVIC_IRQChannelPriority;
+	uint8_t NVIC_IRQChannelCmd;
+} NVIC_InitTypeDef;
+
+typedef struct {
+	uint16_t TIM_Prescaler;
+	uint16_t TIM_CounterMode;
+	uint32_t TIM_Period;
+	uint16_t TIM_ClockDivision;
+	uint8_t  TIM_RepetitionCounter;
+} TIM_TimeBaseInitTypeDef;
+
+typedef struct {
+	uint32_t EXTI_Line;
+	uint32_t EXTI_Mode;
+	uint32_t EXTI_Trigger;
+	FunctionalState EXTI_LineCmd;
+} EXTI_InitTypeDef;
+
+typedef struct {
+	uint32_t RTC_HourFormat;
+	uint32_t RTC_AsynchPrediv;
+	uint32_t RTC_SynchPrediv;
+} RTC_InitTypeDef;
+
+typedef struct {
+	uint8_t RTC_Hours;
+	uint8_t RTC_Minutes;
+	uint8_t RTC_Seconds;
+	uint8_t RTC_H12;
+} RTC_TimeTypeDef;
+
+typedef struct {
+	RTC_TimeTypeDef RTC_AlarmTime;
+	uint32_t RTC_AlarmMask;
+	uint32_t RTC_AlarmDateWeekDaySel;
+	uint8_t  RTC_AlarmDateWeekDay;
+} RTC_AlarmTypeDef;
+
+typedef struct {
+	uint32_t DMA_PeripheralBaseAddr;
+	uint32_t DMA_MemoryBaseAddr;
+	uint32_t DMA_DIR;
+	uint32_t DMA_BufferSize;
+	uint32_t DMA_PeripheralInc;
+	uint32_t DMA_MemoryInc;
+	uint32_t DMA_PeripheralDataSize;
+	uint32_t DMA_MemoryDataSize;
+	uint32_t DMA_Mode;
+	uint32_t DMA_Priority;
+	uint32_t DMA_M2M;
+} DMA_InitTypeDef;
+
+typedef struct {
+	uint32_t CCR;
+} DMA_Channel_TypeDef;
+
+typedef struct {
+	uint16_t CR1;
+} SPI_TypeDef;
+
+typedef struct {
+	uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef enum { Bit_RESET = 0, Bit_SET } BitAction;
+
+extern TIM_TypeDef sim_tim17;
+extern uint32_t SystemCoreClock;
+
+#define TIM17                ((TIM_TypeDef*) &sim_tim17)
+#define TIM17_IRQn           22
+#define RTC_IRQn             2
+#define RCC_APB2Periph_TIM17 0x00040000
+
+#define TIM_CounterMode_Up   0x0000
+#define TIM_CKD_DIV1         0x0000
+#define TIM_IT_Update        0x0001
+#define TIM_IT_CC1           0x0002
+#define TIM_FLAG_Update      0x0001
+#define TIM_EventSource_CC1  0x0002
+
+extern DMA_Channel_TypeDef sim_dma1_channel2;
+extern DMA_Channel_TypeDef sim_dma1_channel3;
+extern SPI_TypeDef sim_spi1;
+extern GPIO_TypeDef sim_gpioa;
+
+#define DMA1_Channel2             (&sim_dma1_channel2)
+#define DMA1_Channel3             (&sim_dma1_channel3)
+#define DMA1_Channel2_3_IRQn      10
+#define DMA1_FLAG_GL2             0x00000010
+#define DMA1_FLAG_TC2             0x00000020
+#define DMA1_FLAG_GL3             0x00000100
+#define DMA1_FLAG_TC3             0x00000200
+#define DMA1_IT_TC2               0x00000020
+#define DMA_IT_TC                 0x00000002
+#define DMA_DIR_PeripheralDST     0x00000010
+#define DMA_DIR_PeripheralSRC     0x00000000
+#define DMA_PeripheralInc_Disable 0x00000000
+#define DMA_MemoryInc_Enable      0x00000080
+#define DMA_MemoryInc_Disable     0x00000000
+#define DMA_PeripheralDataSize_Byte 0x00000000
+#define DMA_MemoryDataSize_Byte   0x00000000
+#define DMA_Mode_Normal           0x00000000
+#define DMA_Priority_High         0x00002000
+#define DMA_M2M_Disable           0x00000000
+
+#define SPI1                      (&sim_spi1)
+#define SPI_I2S_DMAReq_Tx         0x0002
+#define SPI_I2S_DMAReq_Rx         0x0001
+#define SPI_I2S_FLAG_TXE          0x0002
+#define SPI_I2S_FLAG_BSY          0x0080
+
+#define GPIOA                     (&sim_gpioa)
+#define GPIO_Pin_4                0x0010
+
+#define RCC_APB1Periph_PWR          0x10000000
+#define RCC_FLAG_HSERDY             0x31
+#define RCC_FLAG_PLLRDY             0x39
+#define RCC_FLAG_LSIRDY             0x41
+#define RCC_HSE_ON                  0x01
+#define RCC_SYSCLKSource_HSE        0x01
+#define RCC_SYSCLKSource_PLLCLK     0x02
+#define RCC_RTCCLKSource_LSI        0x00000200
+#define PWR_Regulator_LowPower      0x01
+#define PWR_SLEEPEntry_WFI          0x01
+#define PWR_STOPEntry_WFI           0x01
+#define EXTI_Line17                 0x00020000
+#define EXTI_Mode_Interrupt         0x00
+#define EXTI_Trigger_Rising         0x08
+#define RTC_Format_BIN              0x00
+#define RTC_Alarm_A                 0x00000100
+#define RTC_AlarmMask_DateWeekDay   0x80000000
+#define RTC_AlarmMask_Hours         0x00800000
+#define RTC_AlarmMask_Minutes       0x00008000
+#define RTC_AlarmSubSecondMask_None 0x0F000000
+#define RTC_IT_ALRA                 0x00001000
+
+void RCC_APB2PeriphClockCmd (uint32_t periph, FunctionalState state);
+void NVIC_Init (NVIC_InitTypeDef* init);
+void TIM_TimeBaseInit (TIM_TypeDef* tim, TIM_TimeBaseInitTypeDef* init);
+void TIM_Cmd (TIM_TypeDef* tim, FunctionalState state);
+void TIM_ITConfig (TIM_TypeDef* tim, uint16_t it, FunctionalState state);
+ITStatus TIM_GetITStatus (TIM_TypeDef* tim, uint16_t it);
+FlagStatus TIM_GetFlagStatus (TIM_TypeDef* tim, uint16_t flag);
+void TIM_ClearITPendingBit (TIM_TypeDef* tim, uint16_t it);
+void TIM_GenerateEvent (TIM_TypeDef* tim, uint16_t source);
+void TIM_SetCompare1 (TIM_TypeDef* tim, uint32_t compare);
+uint32_t TIM_GetCounter (TIM_TypeDef* tim);
+
+void RCC_APB1PeriphClockCmd (uint32_t periph, FunctionalState state);
+void RCC_LSICmd (FunctionalState state);
+void RCC_HSEConfig (uint8_t hse);
+ErrorStatus RCC_WaitForHSEStartUp (void);
+void RCC_PLLCmd (FunctionalState state);
+FlagStatus RCC_GetFlagStatus (uint8_t flag);
+void RCC_SYSCLKConfig (uint32_t source);
+uint8_t RCC_GetSYSCLKSource (void);
+void RCC_RTCCLKConfig (uint32_t source);
+void RCC_RTCCLKCmd (FunctionalState state);
+void PWR_BackupAccessCmd (FunctionalState state);
+void PWR_EnterSleepMode (uint8_t entry);
+void PWR_EnterSTOPMode (uint32_t regulator, uint8_t entry);
+void EXTI_Init (EXTI_InitTypeDef* init);
+void EXTI_ClearITPendingBit (uint32_t line);
+ErrorStatus RTC_WaitForSynchro (void);
+void RTC_StructInit (RTC_InitTypeDef* init);
+ErrorStatus RTC_Init (RTC_InitTypeDef* init);
+ErrorStatus RTC_BypassShadowCmd (FunctionalState state);
+void RTC_ITConfig (uint32_t it, FunctionalState state);
+ITStatus RTC_GetITStatus (uint32_t it);
+void RTC_ClearITPendingBit (uint32_t it);
+uint32_t RTC_GetSubSecond (void);
+void RTC_GetTime (uint32_t format, RTC_TimeTypeDef* time);
+void RTC_AlarmStructInit (RTC_AlarmTypeDef* alarm);
+void RTC_SetAlarm (uint32_t format, uint32_t alarm, RTC_AlarmTypeDef* init);
+void RTC_AlarmSubSecondConfig (uint32_t alarm, uint32_t value, uint32_t mask);
+ErrorStatus RTC_AlarmCmd (uint32_t alarm, FunctionalState state);
+
+void DMA_Init (DMA_Channel_TypeDef* channel, DMA_InitTypeDef* init);
+void DMA_Cmd (DMA_Channel_TypeDef* channel, FunctionalState state);
+void DMA_ITConfig (DMA_Channel_TypeDef* channel, uint32_t it, FunctionalState state);
+FlagStatus DMA_GetFlagStatus (uint32_t flag);
+void DMA_ClearFlag (uint32_t flag);
+ITStatus DMA_GetITStatus (uint32_t it);
+void DMA_ClearITPendingBit (uint32_t it);
+void SPI_Cmd (SPI_TypeDef* spi, FunctionalState state);
+void SPI_SSOutputCmd (SPI_TypeDef* spi, FunctionalState state);
+void SPI_I2S_DMACmd (SPI_TypeDef* spi, uint16_t req, FunctionalState state);
+FlagStatus SPI_I2S_GetFlagStatus (SPI_TypeDef* spi, uint16_t flag);
+void GPIO_WriteBit (GPIO_TypeDef* port, uint16_t pin, BitAction value);
+
+uint32_t __get_PRIMASK (void);
+void __set_PRIMASK (uint32_t primask);
+void __disable_irq (void);
+void __enable_irq (void);
+
+#endif
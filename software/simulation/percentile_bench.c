@@ -0,0 +1,164 @@
+// Time select_percentile() from firmware/dw1000_util.c against what the tag
+// did before it: keep the ranges sorted with insert_sorted() as they come in,
+// then interpolate between the two around the percentile. Both get the same
+// ranges, and have to give the same result.
+//
+// The ranges are random, sorted or reverse sorted, with between
+// MIN_VALID_RANGES_PER_ANCHOR and NUM_RANGING_BROADCASTS of them like the
+// tag sees. This runs on the PC, so only the ratio between the two means
+// anything for the tag.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dw1000.h"
+#include "oneway_common.h"
+
+#define NUM_ORDERS 3
+
+static const char* order_names[NUM_ORDERS] = { "random", "sorted", "reversed" };
+
+// The tag's percentile before select_percentile(), from oneway_range.c
+static void insert_sorted (int arr[], int new, unsigned end) {
+	unsigned insert_at = 0;
+	while ((insert_at < end) && (new >= arr[insert_at])) {
+		insert_at++;
+	}
+	if (insert_at == end) {
+		arr[insert_at] = new;
+	} else {
+		while (insert_at <= end) {
+			int temp = arr[insert_at];
+			arr[insert_at] = new;
+			new = temp;
+			insert_at++;
+		}
+	}
+}
+
+static int sorted_percentile (const int ranges[], unsigned num) {
+	int distances_millimeters[NUM_RANGING_BROADCASTS] = {0};
+	for (unsigned i = 0; i < num; i++) {
+		insert_sorted(distances_millimeters, ranges[i], i);
+	}
+
+	uint8_t bot = (num*RANGE_PERCENTILE_NUMERATOR)/RANGE_PERCENTILE_DENOMENATOR;
+	uint8_t top = bot+1;
+	return distances_millimeters[bot] +
+		(((distances_millimeters[top]-distances_millimeters[bot]) * ((RANGE_PERCENTILE_NUMERATOR*num)
+		 - (bot*RANGE_PERCENTILE_DENOMENATOR))) / RANGE_PERCENTILE_DENOMENATOR);
+}
+
+static int selected_percentile (const int ranges[], unsigned num) {
+	int distances_millimeters[NUM_RANGING_BROADCASTS];
+	memcpy(distances_millimeters, ranges, num * sizeof(int));
+	return select_percentile(distances_millimeters, num, RANGE_PERCENTILE_NUMERATOR,
+	                         RANGE_PERCENTILE_DENOMENATOR);
+}
+
+static int compare_int (const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+
+// Ranges around a few meters with 10 cm of spread, like one anchor gives
+static void make_ranges (int ranges[], unsigned num, int order) {
+	int center = 500 + (int) (drand48() * 20000);
+	for (unsigned i = 0; i < num; i++) {
+		ranges[i] = center + (int) (drand48() * 200) - 100;
+	}
+	if (order > 0) {
+		qsort(ranges, num, sizeof(int), compare_int);
+	}
+	if (order > 1) {
+		for (unsigned i = 0; i < num / 2; i++) {
+			int temp = ranges[i];
+			ranges[i] = ranges[num - 1 - i];
+			ranges[num - 1 - i] = temp;
+		}
+	}
+}
+
+static double now_ns () {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-n sets] [-r repeats] [-s seed]\n", name);
+}
+
+int main (int argc, char** argv) {
+	int sets = 10000;
+	int repeats = 100;
+	long seed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:s:h")) != -1) {
+		switch (opt) {
+			case 'n': sets = atoi(optarg); break;
+			case 'r': repeats = atoi(optarg); break;
+			case 's': seed = atol(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (sets < 1 || repeats < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int (*ranges)[NUM_RANGING_BROADCASTS] = malloc(sets * sizeof(*ranges));
+	unsigned* nums = malloc(sets * sizeof(unsigned));
+	if (ranges == NULL || nums == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	srand48(seed);
+	long mismatches = 0;
+	volatile int sink = 0;
+
+	printf("%d sets of %d to %d ranges, %d times each\n\n", sets, MIN_VALID_RANGES_PER_ANCHOR,
+	       NUM_RANGING_BROADCASTS, repeats);
+	printf("order     insert_sorted  select_percentile\n");
+
+	for (int order = 0; order < NUM_ORDERS; order++) {
+		for (int s = 0; s < sets; s++) {
+			nums[s] = MIN_VALID_RANGES_PER_ANCHOR +
+			          (unsigned) (drand48() * (NUM_RANGING_BROADCASTS - MIN_VALID_RANGES_PER_ANCHOR + 1));
+			make_ranges(ranges[s], nums[s], order);
+			if (sorted_percentile(ranges[s], nums[s]) != selected_percentile(ranges[s], nums[s])) {
+				mismatches++;
+			}
+		}
+
+		double start = now_ns();
+		for (int r = 0; r < repeats; r++) {
+			for (int s = 0; s < sets; s++) {
+				sink += sorted_percentile(ranges[s], nums[s]);
+			}
+		}
+		double sorted_ns = (now_ns() - start) / ((double) sets * repeats);
+
+		start = now_ns();
+		for (int r = 0; r < repeats; r++) {
+			for (int s = 0; s < sets; s++) {
+				sink += selected_percentile(ranges[s], nums[s]);
+			}
+		}
+		double selected_ns = (now_ns() - start) / ((double) sets * repeats);
+
+		printf("%-8s  %10.0f ns  %14.0f ns\n", order_names[order], sorted_ns, selected_ns);
+	}
+
+	printf("\ndifferent results: %ld\n", mismatches);
+
+	free(ranges);
+	free(nums);
+	return mismatches == 0 ? 0 : 1;
+}
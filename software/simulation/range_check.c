@@ -0,0 +1,312 @@
+// Check the tag's fixed point range calculation against the double version.
+//
+// Both come from firmware/oneway_range.c: range_fixed.o is built with
+// ONEWAY_FIXED_POINT_RANGING like the firmware, and range_double.o with
+// ONEWAY_DOUBLE_RANGING and its oneway_calculate_anchor_range() renamed to
+// oneway_calculate_anchor_range_double(). Every anchor response goes through
+// both, and they have to give the same error, or ranges within the bound in
+// firmware/oneway_range.h.
+//
+// The responses come from a capture of the tag's UART_DATA_OFFLOAD output
+// (see software/offload) or, without one, are made up here in the same
+// format: anchors at random distances with crystals off by up to 20 ppm,
+// timestamp noise and missed broadcasts. -w saves those as a capture so that
+// the same events can be run through offload_ranges or checked again later.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dw1000.h"
+#include "oneway_common.h"
+#include "oneway_range.h"
+#include "oneway_tag.h"
+
+// ranging_offload.h keeps its own copy of the firmware constants, spelled
+// differently but with the same values
+#undef NUM_UNIQUE_PACKET_CONFIGURATIONS
+#include "ranging_offload.h"
+
+_Static_assert(OFFLOAD_ANCHOR_RESPONSE_LEN(NUM_RANGING_BROADCASTS) == sizeof(anchor_responses_t),
+               "offload format does not match anchor_responses_t");
+_Static_assert(NUM_RANGING_BROADCASTS <= MAX_RANGING_BROADCASTS,
+               "offload format is too small for the firmware's broadcasts");
+
+// The bound documented in firmware/oneway_range.h
+#define MAX_DIFF_MM 2
+
+// Made up events
+#define ANCHORS_PER_EVENT 8
+#define MAX_PPM           20
+#define MIN_RANGE_M       0.5
+#define MAX_RANGE_M       30.0
+#define NOISE_M           0.1
+#define NLOS_PROB         0.05   // Broadcasts that take a longer path
+#define NLOS_M            1.0
+#define LOSS              0.1
+
+// DW1000 time units per microsecond and per meter
+#define DW_PER_US (1.0 / (DWT_TIME_UNITS * 1e6))
+#define DW_PER_M  (1.0 / (DWT_TIME_UNITS * SPEED_OF_LIGHT))
+
+int32_t oneway_calculate_anchor_range_double (anchor_responses_t* aresp, uint64_t* send_times);
+
+typedef struct {
+	long responses;
+	long both_valid;
+	long same;
+	long diff_hist[MAX_DIFF_MM + 2];   // |fixed - double|, last bucket is beyond the bound
+	long error_mismatch;
+	double sum_abs_truth_mm;           // Fixed point against the made up distance
+	long truth_count;
+} check_result_t;
+
+static check_result_t result;
+
+// Where made up events are saved with -w
+static FILE* capture_out;
+
+static double uniform () {
+	return drand48();
+}
+
+static double gaussian () {
+	double u1 = 1 - uniform();
+	double u2 = uniform();
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+// Both versions on one response
+static void check_response (anchor_responses_t* aresp, uint64_t* send_times, double truth_mm) {
+	int32_t fixed = oneway_calculate_anchor_range(aresp, send_times);
+	int32_t dbl = oneway_calculate_anchor_range_double(aresp, send_times);
+	bool fixed_valid = (fixed & 0x80000000) == 0;
+	bool dbl_valid = (dbl & 0x80000000) == 0;
+
+	result.responses++;
+	if (fixed_valid != dbl_valid || (!fixed_valid && fixed != dbl)) {
+		result.error_mismatch++;
+		fprintf(stderr, "response %ld: fixed 0x%08x, double 0x%08x\n", result.responses,
+		        (unsigned) fixed, (unsigned) dbl);
+		return;
+	}
+	if (!fixed_valid) {
+		result.same++;
+		return;
+	}
+
+	result.both_valid++;
+	int32_t diff = abs(fixed - dbl);
+	if (diff == 0) result.same++;
+	result.diff_hist[diff > MAX_DIFF_MM ? MAX_DIFF_MM + 1 : diff]++;
+	if (diff > MAX_DIFF_MM) {
+		fprintf(stderr, "response %ld: fixed %d mm, double %d mm\n", result.responses, fixed, dbl);
+	}
+	if (truth_mm >= 0) {
+		result.sum_abs_truth_mm += fabs(fixed - truth_mm);
+		result.truth_count++;
+	}
+}
+
+// Save an event framed the way the tag offloads it (see report_range())
+static void write_event (uint64_t* send_times, anchor_responses_t* aresps, uint8_t num_anchors) {
+	static const uint8_t header[OFFLOAD_HEADER_LEN] = { 0x80, 0x01, 0x80, 0x01 };
+	static const uint8_t data_header[OFFLOAD_DATA_HEADER_LEN] = { 0x80, 0x80 };
+	static const uint8_t footer[OFFLOAD_FOOTER_LEN] = { 0x80, 0xfe };
+
+	fwrite(header, 1, sizeof(header), capture_out);
+	fwrite(&num_anchors, 1, 1, capture_out);
+	fwrite(send_times, sizeof(uint64_t), NUM_RANGING_BROADCASTS, capture_out);
+	for (uint8_t a = 0; a < num_anchors; a++) {
+		fwrite(data_header, 1, sizeof(data_header), capture_out);
+		fwrite(&aresps[a], sizeof(anchor_responses_t), 1, capture_out);
+	}
+	fwrite(footer, 1, sizeof(footer), capture_out);
+}
+
+// One tag ranging event against ANCHORS_PER_EVENT anchors
+static void make_event () {
+	anchor_responses_t aresps[ANCHORS_PER_EVENT];
+	double truth_mm[ANCHORS_PER_EVENT];
+	uint8_t num_anchors = 0;
+	uint64_t send_times[NUM_RANGING_BROADCASTS];
+	uint64_t period = (uint64_t) (RANGING_BROADCASTS_PERIOD_US * DW_PER_US);
+	uint64_t t0 = ((uint64_t) (uniform() * (1ULL << 40))) & ~0x1FFULL;
+
+	// Delayed sends go out on 512 tick boundaries
+	for (int i = 0; i < NUM_RANGING_BROADCASTS; i++) {
+		send_times[i] = (t0 + i * period) & ~0x1FFULL;
+	}
+	uint64_t listen_start = send_times[NUM_RANGING_BROADCASTS - 1] + period;
+
+	for (int a = 0; a < ANCHORS_PER_EVENT; a++) {
+		anchor_responses_t aresp;
+		memset(&aresp, 0, sizeof(aresp));
+
+		double skew = 1 + (2 * uniform() - 1) * MAX_PPM * 1e-6;
+		double range_m = MIN_RANGE_M + uniform() * (MAX_RANGE_M - MIN_RANGE_M);
+		double tof = range_m * DW_PER_M;
+		double a0 = uniform() * (1ULL << 40);
+
+		// Anchor time of a tag time
+		#define ANCHOR_TIME(t) (a0 + ((double) (t) - (double) t0) * skew)
+
+		int first = -1, last = -1;
+		for (int i = 0; i < NUM_RANGING_BROADCASTS; i++) {
+			if (uniform() < LOSS) continue;
+			double noise = gaussian() * NOISE_M * DW_PER_M;
+			if (uniform() < NLOS_PROB) noise += uniform() * NLOS_M * DW_PER_M;
+			uint64_t toa = (uint64_t) llround(ANCHOR_TIME(send_times[i] + tof + noise));
+			// 0 means missed
+			if ((toa & 0xFFFF) == 0) toa++;
+
+			if (first < 0) {
+				first = i;
+				aresp.tag_poll_first_idx = i;
+				aresp.tag_poll_first_TOA = toa;
+			}
+			last = i;
+			aresp.tag_poll_last_idx = i;
+			aresp.tag_poll_last_TOA = toa;
+			aresp.tag_poll_TOAs[i] = toa & 0xFFFF;
+		}
+		if (first < 0 || first == last) continue;
+
+		// The anchor answers in a random window with a random antenna, and
+		// the tag gets it one TOF later
+		aresp.window_packet_recv = (uint8_t) (uniform() * NUM_RANGING_CHANNELS);
+		aresp.anchor_final_antenna_index = (uint8_t) (uniform() * NUM_ANTENNAS);
+		double window = listen_start + aresp.window_packet_recv * RANGING_LISTENING_WINDOW_US * DW_PER_US +
+		                uniform() * RANGING_LISTENING_WINDOW_US * DW_PER_US;
+		uint64_t tx = ((uint64_t) llround(ANCHOR_TIME(window))) & ~0x1FFULL;
+		double tx_tag_time = t0 + (tx - a0) / skew;
+		aresp.anc_final_tx_timestamp = tx;
+		aresp.anc_final_rx_timestamp = (uint64_t) llround(tx_tag_time + tof + gaussian() * NOISE_M * DW_PER_M);
+		#undef ANCHOR_TIME
+
+		aresps[num_anchors] = aresp;
+		truth_mm[num_anchors] = range_m * 1000;
+		num_anchors++;
+	}
+
+	if (capture_out != NULL) {
+		write_event(send_times, aresps, num_anchors);
+	}
+	for (uint8_t a = 0; a < num_anchors; a++) {
+		check_response(&aresps[a], send_times, truth_mm[a]);
+	}
+}
+
+static bool check_capture (const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t* buf = malloc(len);
+	if (buf == NULL || fread(buf, 1, len, f) != (size_t) len) {
+		fprintf(stderr, "%s: could not read\n", path);
+		fclose(f);
+		free(buf);
+		return false;
+	}
+	fclose(f);
+
+	offload_config_t config = {
+		.num_broadcasts = NUM_RANGING_BROADCASTS,
+#ifdef ONEWAY_SKEW_REGRESSION
+		.skew_regression = true,
+#endif
+	};
+	offload_index_t index;
+	if (!offload_index_capture(&config, buf, len, 0, &index)) {
+		fprintf(stderr, "%s: could not index\n", path);
+		free(buf);
+		return false;
+	}
+	if (index.num_bad > 0) {
+		fprintf(stderr, "%s: skipped %zu bad frames\n", path, index.num_bad);
+	}
+
+	for (size_t e = 0; e < index.num_events; e++) {
+		offload_event_t* event = &index.events[e];
+		uint64_t send_times[NUM_RANGING_BROADCASTS];
+		memcpy(send_times, buf + event->send_times_offset, sizeof(send_times));
+
+		const uint8_t* anchor = buf + event->anchors_offset;
+		for (uint8_t a = 0; a < event->num_anchors; a++) {
+			anchor_responses_t aresp;
+			memcpy(&aresp, anchor, sizeof(aresp));
+			check_response(&aresp, send_times, -1);
+			anchor += sizeof(aresp) + OFFLOAD_DATA_HEADER_LEN;
+		}
+	}
+
+	offload_index_free(&index);
+	free(buf);
+	return true;
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-e events] [-s seed] [-w capture.bin]\n"
+	                "       %s capture.bin\n", name, name);
+}
+
+int main (int argc, char** argv) {
+	int events = 10000;
+	long seed = 1;
+	const char* write_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "e:s:w:h")) != -1) {
+		switch (opt) {
+			case 'e': events = atoi(optarg); break;
+			case 's': seed = atol(optarg); break;
+			case 'w': write_path = optarg; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (events < 1 || argc - optind > 1 || (write_path != NULL && optind < argc)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (optind < argc) {
+		if (!check_capture(argv[optind])) return 1;
+	} else {
+		if (write_path != NULL) {
+			capture_out = fopen(write_path, "wb");
+			if (capture_out == NULL) {
+				perror(write_path);
+				return 1;
+			}
+		}
+		srand48(seed);
+		for (int e = 0; e < events; e++) {
+			make_event();
+		}
+		if (capture_out != NULL) {
+			fclose(capture_out);
+		}
+	}
+
+	printf("%ld anchor responses, %ld with a range from both\n", result.responses, result.both_valid);
+	printf("same result: %ld, different error: %ld\n", result.same, result.error_mismatch);
+	for (int d = 0; d <= MAX_DIFF_MM; d++) {
+		printf("ranges %d mm apart: %ld\n", d, result.diff_hist[d]);
+	}
+	printf("ranges more than %d mm apart: %ld\n", MAX_DIFF_MM, result.diff_hist[MAX_DIFF_MM + 1]);
+	if (result.truth_count > 0) {
+		printf("mean fixed point error from the true distance: %.0f mm\n",
+		       result.sum_abs_truth_mm / result.truth_count);
+	}
+
+	return (result.error_mismatch == 0 && result.diff_hist[MAX_DIFF_MM + 1] == 0) ? 0 : 1;
+}
@@ -0,0 +1,508 @@
+// Estimate what an anchor receives with the DW1000's RX buffer used single
+// and double, with the traffic one LWB interval brings it.
+//
+// An interval starts with the master's sync flood, followed by the
+// contention slots that tags send schedule requests in, which are flooded
+// too. Floods go one GLOSSY_FLOOD_TIMESLOT_US hop at a time: the anchor hears
+// the hop before it, relays GLOSSY_RELAY_COUNT times, and then hears the
+// copies from further out. Then comes the ranging event of the one tag in
+// the anchor's zone: NUM_RANGING_BROADCASTS polls, the anchor changing
+// channel and antenna ahead of each, and the listening windows, in which
+// every anchor that heard the tag sends its ANC_FINAL at a random time and
+// the tag acks the first it gets from each. The anchor only hears the ones
+// sent after its own.
+//
+// Everything the anchor does runs one thing at a time from the main loop:
+// dwt_isr() when a frame is in, anchor_rx_frame() once the frame has been
+// read over the SPI, the timer tasks, and other work (the host) that comes
+// at random.
+//
+// With a single buffer the receiver turns off when a frame is in, and is
+// turned back on once the frame has been handled, or for polls by the next
+// channel change. With the double buffer and auto re-enable it stays on:
+// the next frame goes into the other half, and dwt_isr() gives a half back
+// once the frame in it has been read. A frame that comes in with both halves
+// full is an overrun. One that comes in while dwt_isr() hands a half back
+// loses its interrupt, and is a swap race.
+//
+// This follows the timing in firmware/glossy.c, oneway_anchor.c and dw1000.c
+// but does not run that code. Time goes in steps of 1 us.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Mirrored from firmware/glossy.h
+#define LWB_SLOT_US               10000
+#define LWB_CONTENTION_SLOTS      4
+#define LWB_FIRST_RANGING_SLOT    (1 + LWB_CONTENTION_SLOTS)
+#define GLOSSY_MAX_DEPTH          10
+#define GLOSSY_FLOOD_TIMESLOT_US  1000
+#define GLOSSY_RELAY_COUNT        2
+
+// Mirrored from firmware/oneway_common.h and polypoint_conf.h
+// (FAST_RANGING_CONFIG)
+#define NUM_RANGING_BROADCASTS        30
+#define NUM_RANGING_LISTENING_WINDOWS 3
+#define MIN_VALID_RANGES_PER_ANCHOR   10
+#define RANGING_LISTENING_WINDOW_US   8000
+#define RANGING_LISTENING_WINDOW_PADDING_US 1100
+
+// How early the anchor moves to the next subsequence settings before the lead
+// tag's next poll (the 120 in oneway_anchor.c)
+#define ANCHOR_SWITCH_EARLY_US 120
+
+// Frames at 6.8 Mbps with a 64 symbol preamble: preamble, SFD and PHR, then
+// the bytes. The receiver has to be on before the last 32 symbols of the
+// preamble to find a frame.
+#define PREAMBLE_US  95
+#define US_PER_BYTE  1.2
+#define RX_LOCK_US   32
+#define ACK_DELAY_US 12
+
+// Frame lengths in bytes: pp_tag_poll, pp_sched_flood, pp_sched_req_flood,
+// pp_anc_final and an ack
+#define POLL_LEN  26
+#define SYNC_LEN  106
+#define REQ_LEN   38
+#define FINAL_LEN 117
+#define ACK_LEN   5
+
+// Main loop time, from spi_bench and the fast channel switch
+#define ISR_US      30  // dwt_isr() reading and clearing the status
+#define READ_US     55  // Timestamp and frame over the SPI
+#define TOGGLE_US   5   // Giving the half back
+#define CHECK_US    8   // dw1000.c reading the status after dwt_isr()
+#define RXENABLE_US 10
+#define SWITCH_US   60  // Channel, antenna and turning RX on again
+#define RESET_US    20  // Receiver reset after an overrun
+
+#define MAX_ANCHORS 10
+#define MAX_FRAMES  128
+#define MAX_JOBS    64
+
+typedef struct {
+	int intervals;
+	int anchors;
+	int depth;
+	int flood_depth;
+	double requests;
+	double handle_us;
+	double load;
+	double job_us;
+	int period_us;
+	long seed;
+} sim_config_t;
+
+typedef enum {
+	FRAME_POLL,
+	FRAME_SYNC,
+	FRAME_REQ,
+	FRAME_FINAL,
+	FRAME_ACK,
+	NUM_FRAME_TYPES
+} frame_e;
+
+static const char* frame_names[NUM_FRAME_TYPES] = { "polls", "syncs", "requests", "ANC_FINALs", "acks" };
+
+typedef struct {
+	frame_e type;
+	int start;
+	int end;
+	int ss;       // Subsequence of a poll
+	int flood;    // Which flood a sync or request copy belongs to
+} frame_t;
+
+typedef enum {
+	JOB_ISR,
+	JOB_HANDLE,
+	JOB_SWITCH,
+	JOB_WINDOW,
+	JOB_OTHER
+} job_e;
+
+typedef struct {
+	job_e type;
+	int   start;  // When it can start
+	int   cpu;
+	int   arg;    // Frame, subsequence or window
+} job_t;
+
+typedef struct {
+	int sent[NUM_FRAME_TYPES];
+	int received[NUM_FRAME_TYPES];
+	int usable;      // Ranging events with enough polls for a range
+	int events;
+	int floods_heard;
+	int floods;
+	int overruns;
+	int swap_races;
+} sim_result_t;
+
+static sim_config_t cfg;
+
+static frame_t frames[MAX_FRAMES];
+static int num_frames;
+
+static job_t jobs[MAX_JOBS];
+static int num_jobs;
+
+static double uniform () {
+	return drand48();
+}
+
+static int airtime (int len) {
+	return PREAMBLE_US + (int) (len * US_PER_BYTE);
+}
+
+// Frames are kept in the order they start, and one can be added after
+// those already coming in
+static void add_frame (frame_e type, int start, int len, int ss, int flood) {
+	if (num_frames >= MAX_FRAMES) {
+		fprintf(stderr, "too many frames\n");
+		exit(1);
+	}
+	int i = num_frames++;
+	for (; i > 0 && frames[i - 1].start > start; i--) {
+		frames[i] = frames[i - 1];
+	}
+	frames[i] = (frame_t) { type, start, start + airtime(len), ss, flood };
+}
+
+static void push_job (job_e type, int start, int cpu, int arg) {
+	if (num_jobs >= MAX_JOBS) {
+		fprintf(stderr, "main loop fell behind\n");
+		exit(1);
+	}
+	jobs[num_jobs++] = (job_t) { type, start, cpu, arg };
+}
+
+// The first job that can start by now, in the order they came
+static int next_job (int now) {
+	int best = -1;
+	for (int i = 0; i < num_jobs; i++) {
+		if (jobs[i].start <= now && (best < 0 || jobs[i].start < jobs[best].start)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+// The copies of a flood the anchor could hear, one each timeslot from the
+// hop before it on. The anchor's own relays are left out when it runs.
+static void add_flood (frame_e type, int start, int len, int flood) {
+	for (int hop = cfg.depth - 1; hop < cfg.flood_depth; hop++) {
+		add_frame(type, start + hop * GLOSSY_FLOOD_TIMESLOT_US, len, -1, flood);
+	}
+}
+
+// The ranging event's polls, and the ANC_FINALs of the other anchors in
+// every window. Returns when the windows start.
+static int add_ranging_event (int start) {
+	for (int ss = 0; ss < NUM_RANGING_BROADCASTS; ss++) {
+		add_frame(FRAME_POLL, start + ss * cfg.period_us, POLL_LEN, ss, -1);
+	}
+	int windows = start + NUM_RANGING_BROADCASTS * cfg.period_us;
+	int spread = RANGING_LISTENING_WINDOW_US - airtime(FINAL_LEN);
+	for (int w = 0; w < NUM_RANGING_LISTENING_WINDOWS; w++) {
+		int ws = windows + w * (RANGING_LISTENING_WINDOW_US + 2 * RANGING_LISTENING_WINDOW_PADDING_US) +
+		         RANGING_LISTENING_WINDOW_PADDING_US;
+		for (int a = 0; a < cfg.anchors - 1; a++) {
+			add_frame(FRAME_FINAL, ws + (int) (uniform() * spread), FINAL_LEN, w, -1);
+		}
+	}
+	return windows;
+}
+
+// One LWB interval
+static void run_interval (int dbl, sim_result_t* r) {
+	int period = cfg.period_us;
+	double other_rate = cfg.load / cfg.job_us;
+
+	num_frames = 0;
+	num_jobs = 0;
+
+	// The sync, and maybe a request flood in one of the contention slots
+	int num_floods = 1;
+	add_flood(FRAME_SYNC, 0, SYNC_LEN, 0);
+	if (uniform() < cfg.requests) {
+		// The tag leaves room for the flood to finish within the slot
+		int slot = 1 + (int) (uniform() * LWB_CONTENTION_SLOTS);
+		int window_us = GLOSSY_FLOOD_TIMESLOT_US;
+		if (LWB_SLOT_US > (cfg.flood_depth + 2) * GLOSSY_FLOOD_TIMESLOT_US) {
+			window_us = LWB_SLOT_US - (cfg.flood_depth + 1) * GLOSSY_FLOOD_TIMESLOT_US;
+		}
+		add_flood(FRAME_REQ, slot * LWB_SLOT_US + GLOSSY_FLOOD_TIMESLOT_US + (int) (uniform() * window_us), REQ_LEN, 1);
+		num_floods++;
+	}
+	int event_start = LWB_FIRST_RANGING_SLOT * LWB_SLOT_US;
+	int windows = add_ranging_event(event_start);
+	int window_len = RANGING_LISTENING_WINDOW_US + 2 * RANGING_LISTENING_WINDOW_PADDING_US;
+	int end = windows + NUM_RANGING_LISTENING_WINDOWS * window_len + LWB_SLOT_US;
+
+	// This anchor's ANC_FINAL in each window
+	int own_tx[NUM_RANGING_LISTENING_WINDOWS];
+	int spread = RANGING_LISTENING_WINDOW_US - airtime(FINAL_LEN);
+	for (int w = 0; w < NUM_RANGING_LISTENING_WINDOWS; w++) {
+		own_tx[w] = windows + w * window_len + RANGING_LISTENING_WINDOW_PADDING_US + (int) (uniform() * spread);
+	}
+
+	int heard_flood[2] = {0};
+	int relay_start = -1, relay_end = -1;
+	int ranging = 0;          // Heard the first poll
+	int settings = 0;         // Subsequence the anchor listens with
+	int polls = 0;
+	int acked = 0;
+	int tx_end = -1;          // This anchor sending its ANC_FINAL
+	int ack_at = -1;
+
+	int rx_on = 1;
+	int rx_off_until = -1;    // After an overrun
+	int receiving = -1;       // Frame the receiver is on
+	int halves = 0;           // Held by frames not yet given back
+
+	int running = 0;
+	job_t job = {0};
+	int job_end = 0;
+	int toggle_start = -1, toggle_end = -1;
+	int next_frame = 0;
+
+	for (int now = 0; now < end; now++) {
+		if (uniform() < other_rate) {
+			push_job(JOB_OTHER, now, (int) (-log(1 - uniform()) * cfg.job_us) + 1, -1);
+		}
+
+		if (rx_off_until == now) rx_on = 1;
+
+		// Sending turns the receiver off, and it comes back on after
+		if (now == relay_start || (tx_end >= 0 && now == tx_end - airtime(FINAL_LEN))) {
+			rx_on = 0;
+			receiving = -1;
+		}
+		if (now == relay_end) rx_on = 1;
+		if (now == tx_end) {
+			rx_on = 1;
+			tx_end = -1;
+			// The tag acks if no other ANC_FINAL was on the air with ours
+			int clash = 0;
+			for (int i = 0; i < num_frames; i++) {
+				if (frames[i].type == FRAME_FINAL && frames[i].start < now &&
+				    frames[i].end > now - airtime(FINAL_LEN)) {
+					clash = 1;
+				}
+			}
+			if (!clash) ack_at = now + ACK_DELAY_US;
+		}
+		if (now == ack_at) {
+			add_frame(FRAME_ACK, now, ACK_LEN, -1, -1);
+			ack_at = -1;
+		}
+
+		// Frames coming in. Ones that start while the receiver is on
+		// another frame, or off, are lost either way. Ones that come
+		// while the anchor itself sends aren't counted.
+		int sending = (now >= relay_start && now < relay_end) ||
+		              (tx_end >= 0 && now >= tx_end - airtime(FINAL_LEN));
+		for (; next_frame < num_frames && frames[next_frame].start + RX_LOCK_US <= now; next_frame++) {
+			frame_t* f = &frames[next_frame];
+			if (sending) continue;
+			r->sent[f->type]++;
+			if (!rx_on || receiving >= 0) continue;
+			if (f->type == FRAME_POLL && f->ss != settings) continue;
+			receiving = next_frame;
+		}
+
+		if (receiving >= 0 && !rx_on) {
+			receiving = -1;
+		} else if (receiving >= 0 && now == frames[receiving].end) {
+			int f = receiving;
+			receiving = -1;
+
+			if (!dbl) {
+				rx_on = 0;
+				push_job(JOB_ISR, now, ISR_US, f);
+			} else if (halves == 2) {
+				r->overruns++;
+				rx_on = 0;
+				rx_off_until = now + RESET_US;
+			} else if (now >= toggle_start && now <= toggle_end) {
+				// Its half is given back after dwt_isr()
+				r->swap_races++;
+			} else {
+				halves++;
+				push_job(JOB_ISR, now, ISR_US + READ_US + TOGGLE_US + CHECK_US, f);
+			}
+		}
+
+		// The main loop
+		if (running && now == job_end) {
+			running = 0;
+			switch (job.type) {
+				case JOB_ISR:
+					if (dbl) halves--;
+					if (frames[job.arg].type == FRAME_ACK) {
+						// anchor_rxcallback() takes it from the frame control
+						r->received[FRAME_ACK]++;
+						acked = 1;
+					} else {
+						push_job(JOB_HANDLE, now + (dbl ? 0 : READ_US), (int) cfg.handle_us, job.arg);
+					}
+					break;
+				case JOB_HANDLE: {
+					frame_t* f = &frames[job.arg];
+					r->received[f->type]++;
+					if (f->type == FRAME_POLL) {
+						polls++;
+						if (!ranging) {
+							// The timer changes settings ahead of each poll
+							ranging = 1;
+							for (int ss = 1; ss < NUM_RANGING_BROADCASTS; ss++) {
+								push_job(JOB_SWITCH, f->start + ss * period - ANCHOR_SWITCH_EARLY_US, SWITCH_US, ss);
+							}
+							for (int w = 0; w < NUM_RANGING_LISTENING_WINDOWS; w++) {
+								push_job(JOB_WINDOW, windows + w * window_len, RXENABLE_US, w);
+							}
+						}
+						// The channel change turns it back on
+					} else {
+						if ((f->type == FRAME_SYNC || f->type == FRAME_REQ) && !heard_flood[f->flood]) {
+							// Relay in the next timeslots, unless it is too late
+							heard_flood[f->flood] = 1;
+							r->floods_heard++;
+							int first = f->start + GLOSSY_FLOOD_TIMESLOT_US;
+							if (now <= first) {
+								relay_start = now;
+								relay_end = first + (GLOSSY_RELAY_COUNT - 1) * GLOSSY_FLOOD_TIMESLOT_US +
+								            airtime(f->type == FRAME_SYNC ? SYNC_LEN : REQ_LEN);
+								rx_on = 0;
+								receiving = -1;
+							}
+						}
+						if (!dbl && now >= relay_end && tx_end < 0) rx_on = 1;
+					}
+					break;
+				}
+				case JOB_SWITCH:
+					settings = job.arg;
+					if (rx_off_until <= now && tx_end < 0) rx_on = 1;
+					break;
+				case JOB_WINDOW:
+					// ranging_listening_window_task() queues this anchor's
+					// ANC_FINAL, unless the tag acked one already
+					if (!acked) {
+						tx_end = own_tx[job.arg] + airtime(FINAL_LEN);
+						rx_on = 0;
+						receiving = -1;
+					}
+					break;
+				case JOB_OTHER:
+					break;
+			}
+		}
+		if (!running) {
+			int i = next_job(now);
+			if (i >= 0) {
+				job = jobs[i];
+				jobs[i] = jobs[--num_jobs];
+				running = 1;
+				job_end = now + job.cpu;
+				if (job.type == JOB_SWITCH) {
+					rx_on = 0;
+					receiving = -1;
+				} else if (job.type == JOB_ISR && dbl) {
+					toggle_start = now + ISR_US + READ_US;
+					toggle_end = toggle_start + TOGGLE_US;
+				}
+			}
+		}
+	}
+
+	r->events++;
+	if (polls >= MIN_VALID_RANGES_PER_ANCHOR) r->usable++;
+	r->floods += num_floods;
+}
+
+static sim_result_t run (int dbl) {
+	sim_result_t r = {0};
+	srand48(cfg.seed);
+	for (int i = 0; i < cfg.intervals; i++) {
+		run_interval(dbl, &r);
+	}
+	return r;
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-i intervals] [-a anchors] [-d depth] [-D flood_depth]\n"
+	                "       [-r requests] [-c handle_us] [-l load] [-j job_us] [-p period_us]\n"
+	                "       [-s seed]\n", name);
+}
+
+static double percent (int n, int d) {
+	return d ? 100.0 * n / d : 0;
+}
+
+int main (int argc, char** argv) {
+	static const int periods[] = { 1000, 800, 600, 500 };
+	int num_periods = sizeof(periods) / sizeof(periods[0]);
+	int period_us = 0;
+	int opt;
+
+	cfg = (sim_config_t) {
+		.intervals = 200,
+		.anchors = 6,
+		.depth = 1,
+		.flood_depth = 4,
+		.requests = 0.5,
+		.handle_us = 20,
+		.load = 0.1,
+		.job_us = 100,
+		.seed = 1,
+	};
+
+	while ((opt = getopt(argc, argv, "i:a:d:D:r:c:l:j:p:s:h")) != -1) {
+		switch (opt) {
+			case 'i': cfg.intervals = atoi(optarg); break;
+			case 'a': cfg.anchors = atoi(optarg); break;
+			case 'd': cfg.depth = atoi(optarg); break;
+			case 'D': cfg.flood_depth = atoi(optarg); break;
+			case 'r': cfg.requests = atof(optarg); break;
+			case 'c': cfg.handle_us = atof(optarg); break;
+			case 'l': cfg.load = atof(optarg); break;
+			case 'j': cfg.job_us = atof(optarg); break;
+			case 'p': period_us = atoi(optarg); break;
+			case 's': cfg.seed = atol(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (cfg.intervals < 1 || cfg.anchors < 1 || cfg.anchors > MAX_ANCHORS || cfg.depth < 1 ||
+	    cfg.flood_depth <= cfg.depth || cfg.flood_depth > GLOSSY_MAX_DEPTH || cfg.requests < 0 || cfg.requests > 1 ||
+	    cfg.load < 0 || cfg.load >= 1 || cfg.job_us < 1 || period_us < 0 ||
+	    (period_us && period_us < airtime(POLL_LEN) + ANCHOR_SWITCH_EARLY_US)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("%d intervals, %d anchors, depth %d of %d, %.0f us to handle a frame, %.0f%% other load\n\n",
+	       cfg.intervals, cfg.anchors, cfg.depth, cfg.flood_depth, cfg.handle_us, cfg.load * 100);
+	printf("period  buffer  %-8s usable  %-8s %-8s %-10s %-8s floods  overruns  swap races\n",
+	       frame_names[0], frame_names[1], frame_names[2], frame_names[3], frame_names[4]);
+
+	for (int i = 0; i < (period_us ? 1 : num_periods); i++) {
+		cfg.period_us = period_us ? period_us : periods[i];
+
+		for (int dbl = 0; dbl < 2; dbl++) {
+			sim_result_t r = run(dbl);
+			printf("%6d  %-6s ", cfg.period_us, dbl ? "double" : "single");
+			for (int t = 0; t < NUM_FRAME_TYPES; t++) {
+				printf(" %*.1f%%", t == FRAME_FINAL ? 9 : 7, percent(r.received[t], r.sent[t]));
+				if (t == FRAME_POLL) printf(" %5.1f%%", percent(r.usable, r.events));
+			}
+			printf(" %5.1f%%  %8d  %10d\n", percent(r.floods_heard, r.floods), r.overruns, r.swap_races);
+		}
+	}
+
+	return 0;
+}
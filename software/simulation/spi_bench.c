@@ -0,0 +1,977 @@
+// Run the firmware's firmware/dw1000_spi.c against a model of SPI1, its two
+// DMA channels and the DW1000 on the other end.
+//
+// The model moves the bytes of a transfer once the SPI and both channels are
+// enabled and enough time has gone by for them to be clocked out, then sets
+// the transfer complete flags and runs DMA1_Channel2_3_IRQHandler when the
+// rx channel interrupt is enabled and interrupts aren't masked. The DW1000
+// reads and writes a register file, and logs each transaction when NSS goes
+// back up.
+//
+// First it checks the ordering: random reads and writes of random registers,
+// some queued with callbacks and some blocking, some started from those
+// callbacks, some longer than the stage buffers. The DW1000 has to see them
+// in the order they were asked for, every read has to return what the writes
+// before it left, and the callbacks have to come in order too.
+//
+// Then it runs anchor ranging events: the tag's broadcasts come in every
+// period, and for each the main loop reads and clears the status like
+// dwt_isr() does, reads the timestamp and the frame, handles it, and turns
+// the receiver back on. Once with the timestamp and frame read blocking, like
+// before, and once queued like firmware/oneway_anchor.c does now. The main
+// loop sleeps whenever it has nothing to do, and the time it was awake is
+// the CPU time per ranging event.
+//
+// Then a tag's listening window: ANC_FINALs come in, only some of them for
+// this tag. Once read whole like before, and once head first like
+// firmware/oneway_tag.c does now, with the rest read from the DMA interrupt
+// only for its own. After the reads are queued, dwt_isr() flips the host side
+// of the double buffer, and the frame is gone from under any read that
+// didn't get in before that.
+//
+// Last it hops between the ranging channels, once with the writes the
+// dw1000-driver makes to configure a channel and once through
+// firmware/dw1000_channel.c, and checks that the registers end up the same.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f0xx.h"
+#include "deca_regs.h"
+
+#include "firmware.h"
+#include "dw1000_channel.h"
+#include "dw1000_spi.h"
+
+#define NS(_us) ((int64_t) ((_us) * 1000))
+
+// Time some things take on the MCU
+#define REGISTER_ACCESS_NS 100
+#define ISR_ENTRY_NS       500
+
+// 48 MHz divided by 8, plus the gap the DMA leaves between bytes
+#define SPI_BYTE_NS 1583
+
+#define NEVER INT64_MAX
+
+// Long enough for the LDE registers' offsets
+#define REGISTER_LEN 0x3000
+
+#define MAX_OPS    (1 << 16)
+#define ASYNC_OPS  8
+#define MAX_OP_LEN 300
+
+typedef struct {
+	int ops;
+	int events;
+	int broadcasts;
+	int frame_len;
+	int final_len;
+	int mine_every;
+	double period_us;
+	double handle_us;
+	int hops;
+	long seed;
+} bench_config_t;
+
+static bench_config_t cfg;
+
+static double uniform () {
+	return drand48();
+}
+
+/******************************************************************************/
+// Time, interrupts and the NVIC
+/******************************************************************************/
+
+static int64_t now_ns;
+static int64_t idle_ns;
+static uint32_t primask;
+static bool in_isr;
+static bool nvic_dma;
+static int dma_isrs;
+
+// The DW1000 interrupt line, and when the next frame comes in
+static bool dw_irq;
+static int64_t next_frame_ns = NEVER;
+
+static void frame_arrives ();
+static void spend (int64_t ns);
+
+void DMA1_Channel2_3_IRQHandler (void) {
+	dw1000_spi_dma_interrupt();
+}
+
+/******************************************************************************/
+// The DW1000's side of the SPI
+/******************************************************************************/
+
+typedef struct {
+	bool     write;
+	uint8_t  reg;
+	uint16_t offset;
+	uint32_t len;
+} transaction_t;
+
+static uint8_t dw_regs[64][REGISTER_LEN];
+
+static bool nss_low;
+static int dw_byte;
+static transaction_t dw_current;
+
+static transaction_t* dw_log;
+static int dw_log_len;
+static bool dw_logging;
+static int dw_transactions;
+
+static uint8_t dw_spi_byte (uint8_t mosi) {
+	uint8_t miso = 0;
+	int i = dw_byte++;
+
+	if (i == 0) {
+		dw_current = (transaction_t) { mosi & 0x80, mosi & 0x3F, 0, 0 };
+		// No sub-index means the body starts next
+		if (!(mosi & 0x40)) dw_byte = 3;
+	} else if (i == 1) {
+		dw_current.offset = mosi & 0x7F;
+		if (!(mosi & 0x80)) dw_byte = 3;
+	} else if (i == 2) {
+		dw_current.offset |= (uint16_t) mosi << 7;
+	} else {
+		uint8_t* reg = &dw_regs[dw_current.reg][(dw_current.offset + dw_current.len) % REGISTER_LEN];
+		if (dw_current.write) *reg = mosi;
+		else miso = *reg;
+		dw_current.len++;
+	}
+	return miso;
+}
+
+void GPIO_WriteBit (GPIO_TypeDef* port, uint16_t pin, BitAction value) {
+	(void) port;
+	(void) pin;
+	if (value == Bit_RESET && !nss_low) {
+		dw_byte = 0;
+	} else if (value == Bit_SET && nss_low) {
+		dw_transactions++;
+		if (dw_logging) dw_log[dw_log_len++] = dw_current;
+		// The next frame goes in the other half of the double buffer
+		if (dw_current.write && dw_current.reg == SYS_CTRL_ID &&
+		    dw_current.offset == SYS_CTRL_HRBT_OFFSET) {
+			memset(dw_regs[RX_BUFFER_ID], 0xEE, MAX_OP_LEN);
+		}
+	}
+	nss_low = value == Bit_RESET;
+	spend(REGISTER_ACCESS_NS);
+}
+
+/******************************************************************************/
+// SPI1 and DMA
+/******************************************************************************/
+
+typedef struct {
+	bool     enabled;
+	bool     minc;
+	bool     tcie;
+	bool     tc;
+	uint32_t length;
+	uint32_t memory;
+} dma_channel_t;
+
+DMA_Channel_TypeDef sim_dma1_channel2;
+DMA_Channel_TypeDef sim_dma1_channel3;
+SPI_TypeDef sim_spi1;
+GPIO_TypeDef sim_gpioa;
+
+static dma_channel_t dma_rx;
+static dma_channel_t dma_tx;
+static bool spi_enabled;
+static bool spi_dma_rx;
+static bool spi_dma_tx;
+
+// When the transfer on the bus is done
+static int64_t spi_end_ns = NEVER;
+static int64_t spi_busy_ns;
+static int64_t spi_bytes;
+
+static dma_channel_t* channel (DMA_Channel_TypeDef* ch) {
+	return ch == DMA1_Channel2 ? &dma_rx : &dma_tx;
+}
+
+// The buffers have to be below 4 GB, which is why the Makefile links
+// spi_bench without PIE and everything given to the DMA is static
+static uint8_t* memory (uint32_t address) {
+	return (uint8_t*) (uintptr_t) address;
+}
+
+static void spi_kick () {
+	if (spi_end_ns != NEVER || !spi_enabled || !spi_dma_rx || !spi_dma_tx ||
+	    !dma_rx.enabled || !dma_tx.enabled || dma_rx.tc || dma_rx.length == 0) {
+		return;
+	}
+	if (dma_rx.length != dma_tx.length) {
+		fprintf(stderr, "DMA channels set up for %u and %u bytes\n", dma_rx.length, dma_tx.length);
+		exit(1);
+	}
+	spi_end_ns = now_ns + dma_rx.length * SPI_BYTE_NS;
+	spi_busy_ns += dma_rx.length * SPI_BYTE_NS;
+	spi_bytes += dma_rx.length;
+}
+
+// The last byte is in. Move them all.
+static void spi_done () {
+	for (uint32_t i = 0; i < dma_rx.length; i++) {
+		uint8_t mosi = *memory(dma_tx.memory + (dma_tx.minc ? i : 0));
+		uint8_t miso = dw_spi_byte(mosi);
+		*memory(dma_rx.memory + (dma_rx.minc ? i : 0)) = miso;
+	}
+	dma_rx.tc = dma_tx.tc = TRUE;
+	spi_end_ns = NEVER;
+}
+
+static bool dma_irq_pending () {
+	return nvic_dma && dma_rx.tcie && dma_rx.tc;
+}
+
+void DMA_Init (DMA_Channel_TypeDef* ch, DMA_InitTypeDef* init) {
+	dma_channel_t* c = channel(ch);
+	c->length = init->DMA_BufferSize;
+	c->memory = init->DMA_MemoryBaseAddr;
+	c->minc = init->DMA_MemoryInc == DMA_MemoryInc_Enable;
+	spend(REGISTER_ACCESS_NS * 4);
+}
+
+void DMA_Cmd (DMA_Channel_TypeDef* ch, FunctionalState state) {
+	channel(ch)->enabled = state == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+	spi_kick();
+}
+
+void DMA_ITConfig (DMA_Channel_TypeDef* ch, uint32_t it, FunctionalState state) {
+	(void) it;
+	channel(ch)->tcie = state == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+FlagStatus DMA_GetFlagStatus (uint32_t flag) {
+	spend(REGISTER_ACCESS_NS);
+	if (flag == DMA1_FLAG_TC2) return dma_rx.tc ? SET : RESET;
+	if (flag == DMA1_FLAG_TC3) return dma_tx.tc ? SET : RESET;
+	return RESET;
+}
+
+void DMA_ClearFlag (uint32_t flag) {
+	if (flag & (DMA1_FLAG_GL2 | DMA1_FLAG_TC2)) dma_rx.tc = FALSE;
+	if (flag & (DMA1_FLAG_GL3 | DMA1_FLAG_TC3)) dma_tx.tc = FALSE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+ITStatus DMA_GetITStatus (uint32_t it) {
+	spend(REGISTER_ACCESS_NS);
+	return (it == DMA1_IT_TC2 && dma_rx.tc && dma_rx.tcie) ? SET : RESET;
+}
+
+void DMA_ClearITPendingBit (uint32_t it) {
+	if (it == DMA1_IT_TC2) dma_rx.tc = FALSE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void SPI_Cmd (SPI_TypeDef* spi, FunctionalState state) {
+	(void) spi;
+	spi_enabled = state == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+	spi_kick();
+}
+
+void SPI_SSOutputCmd (SPI_TypeDef* spi, FunctionalState state) {
+	(void) spi;
+	(void) state;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void SPI_I2S_DMACmd (SPI_TypeDef* spi, uint16_t req, FunctionalState state) {
+	(void) spi;
+	if (req & SPI_I2S_DMAReq_Rx) spi_dma_rx = state == ENABLE;
+	if (req & SPI_I2S_DMAReq_Tx) spi_dma_tx = state == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+	spi_kick();
+}
+
+FlagStatus SPI_I2S_GetFlagStatus (SPI_TypeDef* spi, uint16_t flag) {
+	(void) spi;
+	spend(REGISTER_ACCESS_NS);
+	if (flag == SPI_I2S_FLAG_BSY) return spi_end_ns != NEVER ? SET : RESET;
+	if (flag == SPI_I2S_FLAG_TXE) return SET;
+	return RESET;
+}
+
+void NVIC_Init (NVIC_InitTypeDef* init) {
+	if (init->NVIC_IRQChannel == DMA1_Channel2_3_IRQn) nvic_dma = init->NVIC_IRQChannelCmd == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+/******************************************************************************/
+// Letting time go by
+/******************************************************************************/
+
+// Move time up to the next thing the hardware does, if it comes before end
+static bool advance (int64_t end) {
+	int64_t next = spi_end_ns < next_frame_ns ? spi_end_ns : next_frame_ns;
+	if (next > end) return FALSE;
+
+	now_ns = next;
+	if (next == spi_end_ns) spi_done();
+	else frame_arrives();
+	return TRUE;
+}
+
+static void take_interrupts () {
+	while (!primask && !in_isr && (dw_irq || dma_irq_pending())) {
+		in_isr = TRUE;
+		now_ns += ISR_ENTRY_NS;
+		if (dw_irq) {
+			dw_irq = FALSE;
+			mark_interrupt(INTERRUPT_DW1000);
+		} else {
+			dma_isrs++;
+			DMA1_Channel2_3_IRQHandler();
+		}
+		in_isr = FALSE;
+	}
+}
+
+// Time the CPU spends doing something. The hardware catches up to it, and
+// interrupts are taken along the way.
+static void spend (int64_t ns) {
+	int64_t end = now_ns + ns;
+	while (1) {
+		int64_t start = now_ns;
+		take_interrupts();
+		end += now_ns - start;
+		if (!advance(end)) break;
+	}
+	now_ns = end;
+}
+
+// WFI from the main loop, with interrupts masked. Time asleep doesn't count
+// as CPU time.
+static void wait_for_interrupt () {
+	int64_t start = now_ns;
+	while (!dw_irq && !dma_irq_pending()) {
+		if (!advance(NEVER - 1)) break;
+	}
+	idle_ns += now_ns - start;
+}
+
+uint32_t __get_PRIMASK (void) {
+	return primask;
+}
+
+void __set_PRIMASK (uint32_t mask) {
+	primask = mask;
+	if (!primask) spend(0);
+}
+
+void __disable_irq (void) {
+	primask = 1;
+}
+
+void __enable_irq (void) {
+	__set_PRIMASK(0);
+}
+
+/******************************************************************************/
+// The main loop
+/******************************************************************************/
+
+#define EVENT_QUEUE_LEN 16
+
+static uint8_t events[EVENT_QUEUE_LEN];
+static volatile uint8_t events_head;
+static volatile uint8_t events_tail;
+
+static void dw1000_fired ();
+
+void mark_interrupt (interrupt_source_e src) {
+	if ((uint8_t) (events_head - events_tail) >= EVENT_QUEUE_LEN) {
+		fprintf(stderr, "event queue overflowed\n");
+		exit(1);
+	}
+	events[events_head++ % EVENT_QUEUE_LEN] = src;
+}
+
+void polypoint_reset () {
+	fprintf(stderr, "SPI timed out\n");
+	exit(1);
+}
+
+// One pass of firmware/main.c's main loop
+static void main_loop () {
+	if (events_head != events_tail) {
+		uint8_t src = events[events_tail++ % EVENT_QUEUE_LEN];
+
+		// Like main.c, frames still being read are handled first
+		if (src == INTERRUPT_DW1000) {
+			if (dw1000_spi_flush()) polypoint_reset();
+		}
+
+		if (src == INTERRUPT_DW1000) dw1000_fired();
+		if (src == INTERRUPT_DW1000_SPI) dw1000_spi_fired();
+		return;
+	}
+
+	__disable_irq();
+	if (events_head == events_tail) {
+		wait_for_interrupt();
+	}
+	__enable_irq();
+}
+
+/******************************************************************************/
+// Ordering
+/******************************************************************************/
+
+typedef struct {
+	dw1000_spi_xfer_t xfer;
+	int               seq;
+	uint8_t           header[DW1000_SPI_HEADER_LEN];
+	uint8_t           data[MAX_OP_LEN];
+	uint8_t           expected[MAX_OP_LEN];
+} async_op_t;
+
+static transaction_t* submitted;
+static int submitted_len;
+
+// What the registers should hold after everything submitted so far
+static uint8_t model_regs[64][REGISTER_LEN];
+
+static async_op_t async_ops[ASYNC_OPS];
+static int next_seq;
+static int last_callback_seq;
+static int bad_reads;
+static int out_of_order;
+static int callbacks;
+
+static void submit_blocking ();
+
+// Pick a random transfer, note it as submitted, and update the model
+static void random_transfer (uint8_t* header, uint16_t* header_len, uint8_t* data,
+                             uint8_t* expected, uint32_t* len, bool* write) {
+	uint8_t reg = uniform() * 64;
+	uint16_t offset = (uniform() < 0.3) ? 0 : (uint16_t) (uniform() * 600);
+	*len = 1 + (uint32_t) (uniform() * uniform() * (MAX_OP_LEN - 1));
+	*write = uniform() < 0.5;
+	*header_len = dw1000_spi_header(header, *write, reg, offset);
+
+	for (uint32_t i = 0; i < *len; i++) {
+		uint8_t* r = &model_regs[reg][(offset + i) % REGISTER_LEN];
+		if (*write) {
+			data[i] = lrand48();
+			*r = data[i];
+		} else {
+			expected[i] = *r;
+		}
+	}
+	submitted[submitted_len++] = (transaction_t) { *write ? 0x80 : 0, reg, offset, *len };
+}
+
+static void async_done (dw1000_spi_xfer_t* x) {
+	async_op_t* op = (async_op_t*) x;
+
+	callbacks++;
+	if (op->seq != last_callback_seq + 1) out_of_order++;
+	last_callback_seq = op->seq;
+	if (x->rx && memcmp(op->data, op->expected, x->body_len) != 0) bad_reads++;
+
+	// Sometimes start another from the callback
+	if (uniform() < 0.2 && submitted_len < cfg.ops) submit_blocking();
+	spend(NS(uniform() * 20));
+}
+
+static void submit_async () {
+	async_op_t* op = NULL;
+	for (int i = 0; i < ASYNC_OPS; i++) {
+		if (!async_ops[i].xfer.queued) {
+			op = &async_ops[i];
+			break;
+		}
+	}
+	if (op == NULL) return;
+
+	bool write;
+	uint16_t header_len;
+	uint32_t len;
+	memset(&op->xfer, 0, sizeof(op->xfer));
+	random_transfer(op->header, &header_len, op->data, op->expected, &len, &write);
+	op->xfer.header = op->header;
+	op->xfer.header_len = header_len;
+	op->xfer.body_len = len;
+	op->xfer.rx = write ? NULL : op->data;
+	op->xfer.tx = write ? op->data : NULL;
+	op->xfer.callback = async_done;
+	op->seq = ++next_seq;
+	dw1000_spi_queue(&op->xfer);
+}
+
+static void submit_blocking () {
+	static uint8_t header[DW1000_SPI_HEADER_LEN];
+	static uint8_t data[MAX_OP_LEN];
+	static uint8_t expected[MAX_OP_LEN];
+	uint16_t header_len;
+	uint32_t len;
+	bool write;
+	int ret;
+
+	random_transfer(header, &header_len, data, expected, &len, &write);
+	if (write) {
+		ret = dw1000_spi_write(header_len, header, len, data);
+	} else {
+		ret = dw1000_spi_read(header_len, header, len, data);
+		if (memcmp(data, expected, len) != 0) bad_reads++;
+	}
+	if (ret) polypoint_reset();
+}
+
+static int check_ordering () {
+	submitted = malloc(cfg.ops * 2 * sizeof(transaction_t));
+	dw_log = malloc(cfg.ops * 2 * sizeof(transaction_t));
+	if (!submitted || !dw_log) {
+		perror("malloc");
+		exit(1);
+	}
+	dw_logging = TRUE;
+
+	while (submitted_len < cfg.ops) {
+		double r = uniform();
+		if (r < 0.5) submit_async();
+		else if (r < 0.7) submit_blocking();
+		else if (r < 0.9) main_loop();
+		else spend(NS(uniform() * 200));
+	}
+	while (events_head != events_tail || dw1000_spi_busy()) {
+		main_loop();
+	}
+	dw_logging = FALSE;
+
+	int mismatched = 0;
+	if (dw_log_len != submitted_len) {
+		mismatched = abs(dw_log_len - submitted_len);
+	}
+	for (int i = 0; i < dw_log_len && i < submitted_len; i++) {
+		if (memcmp(&dw_log[i], &submitted[i], sizeof(transaction_t)) != 0) mismatched++;
+	}
+	int wrong_regs = memcmp(dw_regs, model_regs, sizeof(dw_regs)) != 0;
+
+	printf("Ordering:    %d transfers (%d with callbacks), %d DMA interrupts\n",
+	       submitted_len, callbacks, dma_isrs);
+	printf("Errors:      %d out of order, %d callbacks out of order, %d bad reads%s\n",
+	       mismatched, out_of_order, bad_reads, wrong_regs ? ", registers differ" : "");
+
+	free(submitted);
+	free(dw_log);
+	return mismatched || out_of_order || bad_reads || wrong_regs || next_seq != callbacks;
+}
+
+/******************************************************************************/
+// Ranging events
+/******************************************************************************/
+
+typedef enum {
+	READ_BLOCKING, // Timestamp and frame read before handling it
+	READ_QUEUED,   // Both queued, handled from the callback
+	READ_HEAD      // Timestamp and head queued, the rest only if wanted
+} read_mode_e;
+
+// Like the tag's TAG_RX_HEAD_LEN: the unicast header and message type
+#define HEAD_LEN 22
+
+// Stands in for destAddr
+#define MINE_BYTE 5
+
+static int frames_left;
+static int frames_sent;
+static int frames_handled;
+static int frames_mine;
+static int frames_bad;
+static read_mode_e read_mode;
+static int frame_len;
+static bool tag_window;
+
+static uint8_t rx_timestamp[5];
+static uint8_t rx_buf[MAX_OP_LEN];
+static uint16_t rx_len;
+static uint8_t timestamp_header[DW1000_SPI_HEADER_LEN];
+static uint8_t data_header[DW1000_SPI_HEADER_LEN];
+static uint8_t rest_header[DW1000_SPI_HEADER_LEN];
+static dw1000_spi_xfer_t timestamp_xfer;
+static dw1000_spi_xfer_t data_xfer;
+static dw1000_spi_xfer_t rest_xfer;
+
+static bool frame_mine (int frame) {
+	return !tag_window || frame % cfg.mine_every == 0;
+}
+
+static uint8_t frame_byte (int frame, int i) {
+	if (i == MINE_BYTE) return frame_mine(frame);
+	return (uint8_t) (frame * 31 + i * 7);
+}
+
+// The next broadcast, or ANC_FINAL in the tag's window. The receiver is on
+// by now.
+static void frame_arrives () {
+	for (int i = 0; i < frame_len; i++) {
+		dw_regs[RX_BUFFER_ID][i] = frame_byte(frames_sent, i);
+	}
+	memcpy(dw_regs[RX_TIME_ID], &frames_sent, sizeof(frames_sent));
+	frames_sent++;
+	dw_irq = TRUE;
+
+	next_frame_ns = --frames_left > 0 ? next_frame_ns + NS(cfg.period_us) : NEVER;
+}
+
+static void register_access (bool write, uint8_t reg, uint16_t offset, uint32_t len) {
+	static uint8_t header[DW1000_SPI_HEADER_LEN];
+	static uint8_t data[8];
+	uint16_t header_len = dw1000_spi_header(header, write, reg, offset);
+	if (write) dw1000_spi_write(header_len, header, len, data);
+	else dw1000_spi_read(header_len, header, len, data);
+}
+
+// What anchor_rx_frame() or tag_rx_frame() does with a frame, and turning
+// the receiver back on. Frames for other tags only need their head.
+static void handle_frame () {
+	int frame;
+	memcpy(&frame, rx_timestamp, sizeof(frame));
+	if (rx_len != (frame_mine(frame) || read_mode != READ_HEAD ? frame_len : HEAD_LEN)) {
+		frames_bad++;
+	}
+	for (int i = 0; i < rx_len; i++) {
+		if (rx_buf[i] != frame_byte(frame, i)) {
+			frames_bad++;
+			break;
+		}
+	}
+	frames_handled++;
+	if (frame_mine(frame)) {
+		frames_mine++;
+		spend(NS(cfg.handle_us));
+	}
+	register_access(TRUE, SYS_CTRL_ID, 0, 4);
+}
+
+static void frame_read (dw1000_spi_xfer_t* x) {
+	(void) x;
+	handle_frame();
+}
+
+// Like tag_rx_filter() and rx_head_follow(), from the DMA interrupt
+static dw1000_spi_xfer_t* head_follow (dw1000_spi_xfer_t* x) {
+	if (!rx_buf[MINE_BYTE]) {
+		rx_len = HEAD_LEN;
+		x->callback = frame_read;
+		return NULL;
+	}
+
+	rx_len = frame_len;
+	rest_xfer = (dw1000_spi_xfer_t) {
+		.header = rest_header,
+		.header_len = dw1000_spi_header(rest_header, FALSE, RX_BUFFER_ID, HEAD_LEN),
+		.rx = rx_buf + HEAD_LEN, .body_len = frame_len - HEAD_LEN, .callback = frame_read,
+	};
+	x->callback = NULL;
+	return &rest_xfer;
+}
+
+// dwt_isr() and the rx callback
+static void dw1000_fired () {
+	register_access(FALSE, SYS_STATUS_ID, 0, 4);
+	register_access(TRUE, SYS_STATUS_ID, 0, 4);
+
+	uint16_t ts_len = dw1000_spi_header(timestamp_header, FALSE, RX_TIME_ID, 0);
+	uint16_t data_len = dw1000_spi_header(data_header, FALSE, RX_BUFFER_ID, 0);
+	bool head = read_mode == READ_HEAD && frame_len > HEAD_LEN;
+
+	memset(rx_buf, 0, sizeof(rx_buf));
+	rx_len = frame_len;
+
+	if (read_mode == READ_BLOCKING) {
+		dw1000_spi_read(ts_len, timestamp_header, sizeof(rx_timestamp), rx_timestamp);
+		dw1000_spi_read(data_len, data_header, frame_len, rx_buf);
+		handle_frame();
+		return;
+	}
+
+	timestamp_xfer = (dw1000_spi_xfer_t) {
+		.header = timestamp_header, .header_len = ts_len,
+		.rx = rx_timestamp, .body_len = sizeof(rx_timestamp),
+	};
+	data_xfer = (dw1000_spi_xfer_t) {
+		.header = data_header, .header_len = data_len,
+		.rx = rx_buf, .body_len = head ? HEAD_LEN : frame_len,
+		.callback = head ? NULL : frame_read,
+		.follow = head ? head_follow : NULL,
+	};
+	dw1000_spi_queue(&timestamp_xfer);
+	dw1000_spi_queue(&data_xfer);
+
+	if (tag_window) {
+		register_access(TRUE, SYS_CTRL_ID, SYS_CTRL_HRBT_OFFSET, 1);
+	}
+}
+
+typedef struct {
+	double cpu_us;
+	double spi_us;
+	double spi_bytes;
+	int dma_isrs;
+} event_cost_t;
+
+static event_cost_t run_events (read_mode_e mode, bool tag, int len, int frames) {
+	int64_t start_ns = now_ns, start_idle = idle_ns, start_spi = spi_busy_ns, start_bytes = spi_bytes;
+	int start_isrs = dma_isrs;
+
+	read_mode = mode;
+	tag_window = tag;
+	frame_len = len;
+	frames_left = frames;
+	next_frame_ns = now_ns + NS(cfg.period_us);
+
+	while (next_frame_ns != NEVER || events_head != events_tail || dw1000_spi_busy()) {
+		main_loop();
+	}
+
+	return (event_cost_t) {
+		.cpu_us = ((now_ns - start_ns) - (idle_ns - start_idle)) / 1000.0 / cfg.events,
+		.spi_us = (spi_busy_ns - start_spi) / 1000.0 / cfg.events,
+		.spi_bytes = (double) (spi_bytes - start_bytes) / frames,
+		.dma_isrs = dma_isrs - start_isrs,
+	};
+}
+
+/******************************************************************************/
+// Channel switches
+/******************************************************************************/
+
+// The dw1000-driver's tables for what dwt_configure() sets on each channel,
+// and dw1000.c's for what dwt_configuretxrf() does
+static const uint32_t fs_pll_cfg[8]  = { 0, 0x09000407, 0x08400508, 0x08401009, 0x08400508, 0x0800041D, 0, 0x0800041D };
+static const uint8_t  fs_pll_tune[8] = { 0, 0x1E, 0x26, 0x56, 0x26, 0xBE, 0, 0xBE };
+static const uint32_t rf_txctrl[8]   = { 0, 0x00005C40, 0x00045CA0, 0x00086CC0, 0x00045C80, 0x001E3FE0, 0, 0x001E7DE0 };
+static const uint8_t  pg_delay[8]    = { 0, 0xC9, 0xC2, 0xC5, 0x95, 0xC0, 0, 0x93 };
+static const uint32_t tx_power[8]    = { 0, 0x07274767, 0x07274767, 0x2B4B6B8B, 0x3A5A7A9A, 0x25456585, 0, 0x5171B1D1 };
+
+static const uint8_t hop_channels[] = { 1, 4, 3 };
+
+// Where driver_write() puts things: over the SPI, or when set straight into
+// a copy of the registers to check the fast path against
+static uint8_t (*config_regs)[REGISTER_LEN];
+static uint8_t expected_regs[64][REGISTER_LEN];
+static bool touched[64];
+
+// One register write the way the driver makes it: a blocking transfer
+static void driver_write (uint8_t reg, uint16_t offset, uint8_t len, uint32_t value) {
+	static uint8_t header[DW1000_SPI_HEADER_LEN];
+	static uint8_t data[4];
+
+	touched[reg] = TRUE;
+	for (int i = 0; i < len; i++) {
+		data[i] = value >> (8 * i);
+		if (config_regs) config_regs[reg][(offset + i) % REGISTER_LEN] = data[i];
+	}
+	if (config_regs) return;
+
+	uint16_t header_len = dw1000_spi_header(header, TRUE, reg, offset);
+	if (dw1000_spi_write(header_len, header, len, data)) polypoint_reset();
+}
+
+// What dw1000_reset_configuration() writes: dwt_configure() with the fast
+// ranging settings, dwt_setsmarttxpower(), dwt_configuretxrf() and the
+// antenna delays. Only the channel's own values matter to the fast path, the
+// rest are there for their SPI traffic.
+static void driver_configure (uint8_t chan) {
+	uint32_t code = 9;
+
+	driver_write(SYS_CFG_ID,     0x00,   4, 0x00441200);        // SYS_CFG
+	driver_write(LDE_IF_ID,      0x0806, 1, 0x6D);              // LDE_CFG1
+	driver_write(LDE_IF_ID,      0x1806, 2, 0x0607);            // LDE_CFG2
+	driver_write(LDE_IF_ID,      0x2804, 2, 0x35C2);            // LDE_REPC
+	driver_write(FS_CTRL_ID,     FS_PLLCFG_OFFSET,  4, fs_pll_cfg[chan]);
+	driver_write(FS_CTRL_ID,     FS_PLLTUNE_OFFSET, 1, fs_pll_tune[chan]);
+	driver_write(RF_CONF_ID,     RF_RXCTRLH_OFFSET, 1, (chan == 4 || chan == 7) ? 0xBC : 0xD8);
+	driver_write(RF_CONF_ID,     RF_TXCTRL_OFFSET,  4, rf_txctrl[chan]);
+	driver_write(DRX_CONF_ID,    0x02,   2, 0x0001);            // DRX_TUNE0b
+	driver_write(DRX_CONF_ID,    0x04,   2, 0x008D);            // DRX_TUNE1a
+	driver_write(DRX_CONF_ID,    0x06,   2, 0x0010);            // DRX_TUNE1b
+	driver_write(DRX_CONF_ID,    0x26,   2, 0x0010);            // DRX_TUNE4H
+	driver_write(DRX_CONF_ID,    0x08,   4, 0x313B006B);        // DRX_TUNE2
+	driver_write(DRX_CONF_ID,    0x20,   2, 64 + 8 + 1);        // DRX_SFDTOC
+	driver_write(AGC_CFG_STS_ID, 0x04,   2, 0x889B);            // AGC_TUNE1
+	driver_write(AGC_CFG_STS_ID, 0x0C,   4, 0x2502A907);        // AGC_TUNE2
+	driver_write(AGC_CFG_STS_ID, 0x12,   2, 0x0035);            // AGC_TUNE3
+	driver_write(CHAN_CTRL_ID,   0x00,   4, chan | chan << 4 | 2 << 18 | code << 22 | code << 27);
+	driver_write(TX_FCTRL_ID,    0x00,   4, 0x0015C000);        // TX_FCTRL
+	driver_write(SYS_CTRL_ID,    0x00,   1, 0x42);              // TXSTRT | TRXOFF
+	driver_write(SYS_CFG_ID,     0x00,   4, 0x00441200);        // Smart TX power
+	driver_write(TX_CAL_ID,      TC_PGDELAY_OFFSET, 1, pg_delay[chan]);
+	driver_write(TX_POWER_ID,    0x00,   4, tx_power[chan]);
+	driver_write(LDE_IF_ID,      0x1804, 2, 0);                 // LDE_RXANTD
+	driver_write(TX_ANTD_ID,     0x00,   2, 0);                 // TX_ANTD
+}
+
+// dw1000_update_channel(), before and now
+static void update_channel (uint8_t chan, bool fast) {
+	if (fast && dw1000_channel_switch(chan)) return;
+	driver_configure(chan);
+	dw1000_channel_configured(chan);
+}
+
+typedef struct {
+	double transfers;
+	double bytes;
+	double us;
+} switch_cost_t;
+
+// Hop between the ranging channels like the subsequences do. With same,
+// switch to the channel it is already on instead, like Glossy does.
+static switch_cost_t run_switches (bool fast, bool same, int* wrong) {
+	if (same) update_channel(hop_channels[0], fast);
+
+	int64_t start_ns = now_ns, start_bytes = spi_bytes;
+	int start_transactions = dw_transactions;
+
+	memcpy(expected_regs, dw_regs, sizeof(dw_regs));
+	for (int i = 0; i < cfg.hops; i++) {
+		uint8_t chan = hop_channels[(same ? 0 : i) % sizeof(hop_channels)];
+
+		// What the full configuration would have left
+		config_regs = expected_regs;
+		driver_configure(chan);
+		config_regs = NULL;
+
+		update_channel(chan, fast);
+
+		for (int reg = 0; reg < 64; reg++) {
+			if (touched[reg] && memcmp(expected_regs[reg], dw_regs[reg], REGISTER_LEN) != 0) {
+				(*wrong)++;
+				break;
+			}
+		}
+	}
+
+	return (switch_cost_t) {
+		.transfers = (double) (dw_transactions - start_transactions) / cfg.hops,
+		.bytes = (double) (spi_bytes - start_bytes) / cfg.hops,
+		.us = (now_ns - start_ns) / 1000.0 / cfg.hops,
+	};
+}
+
+static int check_switches () {
+	int wrong = 0;
+
+	// What dw1000_configure_settings() does first
+	for (uint8_t chan = 1; chan <= DW1000_CHANNEL_FAST_MAX; chan++) {
+		update_channel(chan, FALSE);
+	}
+	update_channel(2, FALSE);
+
+	switch_cost_t full = run_switches(FALSE, FALSE, &wrong);
+	switch_cost_t fast = run_switches(TRUE, FALSE, &wrong);
+	switch_cost_t same = run_switches(TRUE, TRUE, &wrong);
+
+	printf("%d channel switches between 1, 4 and 3\n", cfg.hops);
+	printf("Full:        %.1f transfers, %.1f SPI bytes, %.1f us per switch\n",
+	       full.transfers, full.bytes, full.us);
+	printf("Fast:        %.1f transfers, %.1f SPI bytes, %.1f us per switch\n",
+	       fast.transfers, fast.bytes, fast.us);
+	printf("Same:        %.1f transfers, %.1f SPI bytes, %.1f us per switch\n",
+	       same.transfers, same.bytes, same.us);
+	printf("Registers:   %d switches left them different from the full configuration\n", wrong);
+
+	return wrong || fast.transfers >= full.transfers || same.transfers != 0;
+}
+
+/******************************************************************************/
+// Main
+/******************************************************************************/
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-n transfers] [-e events] [-b broadcasts] [-f frame_len]\n"
+	                "       [-p period_us] [-c handle_us] [-F final_len] [-m mine_every]\n"
+	                "       [-H hops] [-s seed]\n", name);
+}
+
+int main (int argc, char** argv) {
+	int opt;
+
+	cfg = (bench_config_t) {
+		.ops = 20000,
+		.events = 100,
+		.broadcasts = 30,
+		.frame_len = 26,
+		.final_len = 117,
+		.mine_every = 4,
+		.period_us = 1000,
+		.handle_us = 20,
+		.hops = 3000,
+		.seed = 1,
+	};
+
+	while ((opt = getopt(argc, argv, "n:e:b:f:p:c:F:m:H:s:h")) != -1) {
+		switch (opt) {
+			case 'n': cfg.ops = atoi(optarg); break;
+			case 'e': cfg.events = atoi(optarg); break;
+			case 'b': cfg.broadcasts = atoi(optarg); break;
+			case 'f': cfg.frame_len = atoi(optarg); break;
+			case 'p': cfg.period_us = atof(optarg); break;
+			case 'c': cfg.handle_us = atof(optarg); break;
+			case 'F': cfg.final_len = atoi(optarg); break;
+			case 'm': cfg.mine_every = atoi(optarg); break;
+			case 'H': cfg.hops = atoi(optarg); break;
+			case 's': cfg.seed = atol(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (cfg.ops < 1 || cfg.ops > MAX_OPS || cfg.events < 1 || cfg.broadcasts < 1 ||
+	    cfg.frame_len < 1 || cfg.frame_len > MAX_OP_LEN || cfg.final_len <= HEAD_LEN ||
+	    cfg.final_len > MAX_OP_LEN || cfg.mine_every < 1 || cfg.period_us < 1 || cfg.hops < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand48(cfg.seed);
+	dw1000_spi_init();
+
+	int failed = check_ordering();
+
+	int frames = cfg.events * cfg.broadcasts;
+	event_cost_t blocking = run_events(READ_BLOCKING, FALSE, cfg.frame_len, frames);
+	event_cost_t queued = run_events(READ_QUEUED, FALSE, cfg.frame_len, frames);
+
+	printf("%d ranging events of %d broadcasts, %d byte frames, %.0f us apart\n",
+	       cfg.events, cfg.broadcasts, cfg.frame_len, cfg.period_us);
+	printf("Blocking:    %.1f us CPU per event, %.1f us of SPI\n", blocking.cpu_us, blocking.spi_us);
+	printf("Queued:      %.1f us CPU per event, %.1f us of SPI, %d DMA interrupts\n",
+	       queued.cpu_us, queued.spi_us, queued.dma_isrs);
+	printf("Recovered:   %.1f us per event (%.0f%%)\n", blocking.cpu_us - queued.cpu_us,
+	       100.0 * (blocking.cpu_us - queued.cpu_us) / blocking.cpu_us);
+	printf("Frames:      %d handled, %d read wrong\n", frames_handled, frames_bad);
+
+	failed |= frames_bad || frames_handled != 2 * frames;
+
+	frames_handled = frames_mine = 0;
+	event_cost_t whole = run_events(READ_QUEUED, TRUE, cfg.final_len, frames);
+	event_cost_t head = run_events(READ_HEAD, TRUE, cfg.final_len, frames);
+
+	printf("%d ANC_FINALs of %d bytes, 1 in %d for this tag\n",
+	       frames, cfg.final_len, cfg.mine_every);
+	printf("Whole:       %.1f SPI bytes per frame, %.1f us CPU per event\n", whole.spi_bytes, whole.cpu_us);
+	printf("Head first:  %.1f SPI bytes per frame, %.1f us CPU per event\n", head.spi_bytes, head.cpu_us);
+	printf("Frames:      %d handled, %d for this tag, %d read wrong\n", frames_handled, frames_mine, frames_bad);
+
+	failed |= frames_bad || frames_handled != 2 * frames;
+	failed |= check_switches();
+	return failed ? 1 : 0;
+}
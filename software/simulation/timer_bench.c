@@ -0,0 +1,787 @@
+// Run the firmware's source/timer.c against a model of TIM17 and measure how
+// late the timer callbacks are.
+//
+// The model counts 1 us ticks, sets the wrap and compare flags when the
+// counter gets there and runs TIM17_IRQHandler when an enabled flag is set
+// and interrupts aren't masked. Every register access and the interrupt
+// entry take some time, and so does every callback, during which the
+// interrupt can still fire. The main loop calls timer_fired() when the
+// interrupt asks it to, like firmware/main.c.
+//
+// Some of the timers are periodic, the others one shots that start again
+// with a new random delay when they fire. The callbacks also stop and
+// restart other one shots at random, to check that stopped timers stay
+// quiet.
+//
+// With -i the main loop calls timer_idle() like firmware/main.c does between
+// events, and stop mode is modeled too: TIM17 stops counting, the RTC keeps
+// going off an LSI that isn't at its nominal 40kHz, and the core comes back
+// on the HSI until the PLL locks. Other interrupts (the DW1000, the host)
+// wake it up at random. Lateness is then measured against timer_now(), and
+// how far timer_now() drifts from the real time is reported separately.
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+#include "firmware.h"
+
+#define NS(_us) ((int64_t) ((_us) * 1000))
+
+// Time some things take on the MCU
+#define REGISTER_ACCESS_NS 100
+#define ISR_ENTRY_NS       500
+
+// Waking up from stop mode before the core runs, and how much slower TIM17
+// counts on the HSI than on the PLL
+#define STOP_WAKEUP_NS 5000
+#define HSI_SLOWDOWN   6
+
+#define MAX_TIMERS 64
+
+#define NEVER INT64_MAX
+
+typedef struct {
+	int timers;
+	double seconds;
+	double callback_us;
+	double oneshot_fraction;
+	double min_period_us;
+	double max_period_us;
+	long seed;
+	bool idle;
+	double lsi_hz;
+	double pll_lock_us;
+	double wake_hz;
+} bench_config_t;
+
+typedef struct {
+	stm_timer_t timer;
+	bool periodic;
+	bool stopped;
+	int64_t start_ns;
+	int64_t period_ns;
+	int64_t last_deadline;
+	double start_error_us;
+} bench_timer_t;
+
+typedef struct {
+	double* lateness_us;
+	int num;
+	int max;
+	int early;
+	int missed;
+	int stopped_fired;
+	int isrs;
+	int stops;
+	int external_wakes;
+	double max_clock_error_us;
+} bench_stats_t;
+
+static bench_config_t cfg;
+static bench_stats_t stats;
+static bench_timer_t bench_timers[MAX_TIMERS];
+
+// The main loop doesn't run while the timers are being started, so the
+// deadlines before then don't count
+static int64_t started_ns;
+
+static double uniform ();
+
+/******************************************************************************/
+// TIM17 and the NVIC
+/******************************************************************************/
+
+TIM_TypeDef sim_tim17;
+uint32_t SystemCoreClock = 500000;
+
+static int64_t now_ns;
+static bool tim_enabled;
+static uint16_t tim_sr;
+static uint16_t tim_dier;
+static uint16_t tim_ccr1;
+static bool nvic_tim;
+static bool nvic_rtc;
+static uint32_t primask;
+static bool in_isr;
+static bool timer_interrupt;
+
+// TIM17 counts 1us ticks with the core on the PLL, slower on the HSI right
+// after stop mode, and not at all in stop mode. tim_base_ns is when that
+// last changed and tim_base_count where the counter was then, in thousandths
+// of a tick. tim_slowdown is 0 while stopped.
+static int64_t tim_origin_ns;
+static int64_t tim_base_ns;
+static int64_t tim_base_count;
+static int tim_slowdown = 1;
+
+static void spend (int64_t ns);
+
+void TIM17_IRQHandler (void);
+void RTC_IRQHandler (void);
+
+static int64_t tim_count (int64_t at_ns) {
+	if (tim_slowdown == 0) return tim_base_count;
+	return tim_base_count + (at_ns - tim_base_ns) / tim_slowdown;
+}
+
+static int64_t ticks () {
+	return tim_count(now_ns) / 1000;
+}
+
+static void set_tim_slowdown (int slowdown) {
+	tim_base_count = tim_count(now_ns);
+	tim_base_ns = now_ns;
+	tim_slowdown = slowdown;
+}
+
+// When the counter next gets to a value that sets a flag
+static int64_t next_edge_ns () {
+	if (!tim_enabled || tim_slowdown == 0) return NEVER;
+	int64_t t = ticks();
+	int64_t wrap = (t / 0x10000 + 1) * 0x10000;
+	int64_t compare = t + 1 + ((tim_ccr1 - (t + 1)) & 0xFFFF);
+	int64_t next = wrap < compare ? wrap : compare;
+	return tim_base_ns + (next * 1000 - tim_base_count) * tim_slowdown;
+}
+
+static void set_edge_flags () {
+	int64_t t = ticks();
+	if ((t & 0xFFFF) == 0) tim_sr |= TIM_IT_Update;
+	if ((t & 0xFFFF) == tim_ccr1) tim_sr |= TIM_IT_CC1;
+}
+
+static bool irq_pending () {
+	return nvic_tim && (tim_sr & tim_dier) != 0;
+}
+
+/******************************************************************************/
+// RTC and clocks
+/******************************************************************************/
+
+// The RTC counts LSI cycles divided by the asynchronous prescaler. Its time
+// is only kept within the minute, which is all source/timer.c looks at.
+static int64_t rtc_origin_ns;
+static uint32_t rtc_async = 128;
+static uint32_t rtc_sync = 256;
+static bool rtc_alarm_enabled;
+static uint32_t rtc_alarm_seconds;
+static uint32_t rtc_alarm_ss;
+static int64_t rtc_alarm_ns = NEVER;
+static bool rtc_alarm_flag;
+static bool rtc_alarm_it;
+static bool exti_line17;
+
+static uint8_t sysclk = 0x08;
+static bool pll_on = TRUE;
+static int64_t pll_ready_ns;
+
+// The DW1000 and the host wake us up now and then
+static int64_t external_wake_ns = NEVER;
+
+static int64_t rtc_count (int64_t at_ns) {
+	return (at_ns - rtc_origin_ns) * cfg.lsi_hz / (rtc_async * INT64_C(1000000000));
+}
+
+static int64_t rtc_count_ns (int64_t count) {
+	int64_t per = rtc_async * INT64_C(1000000000);
+	return rtc_origin_ns + (count * per + cfg.lsi_hz - 1) / cfg.lsi_hz;
+}
+
+// The RTC registers take a couple of LSI cycles to catch up
+static int64_t lsi_cycles_ns (int cycles) {
+	return (int64_t) (cycles * 1e9 / cfg.lsi_hz);
+}
+
+static bool rtc_irq_pending () {
+	return nvic_rtc && exti_line17 && rtc_alarm_it && rtc_alarm_flag;
+}
+
+static void next_external_wake () {
+	if (cfg.wake_hz <= 0) return;
+	external_wake_ns = now_ns + (int64_t) (-log(1 - uniform()) / cfg.wake_hz * 1e9);
+}
+
+static void run_isr () {
+	in_isr = TRUE;
+	stats.isrs++;
+	spend(ISR_ENTRY_NS);
+	TIM17_IRQHandler();
+	in_isr = FALSE;
+}
+
+static void run_rtc_isr () {
+	in_isr = TRUE;
+	spend(ISR_ENTRY_NS);
+	RTC_IRQHandler();
+	in_isr = FALSE;
+}
+
+// Move time up to the next counter edge or alarm, if it comes before end
+static bool advance (int64_t end) {
+	int64_t edge = next_edge_ns();
+	int64_t next = (rtc_alarm_ns < edge) ? rtc_alarm_ns : edge;
+	if (next > end) return FALSE;
+
+	now_ns = next;
+	if (next == edge) set_edge_flags();
+	if (next == rtc_alarm_ns) {
+		rtc_alarm_flag = TRUE;
+		rtc_alarm_ns = NEVER;
+	}
+	return TRUE;
+}
+
+// Let time go by, taking the interrupts whenever they can. Time spent in
+// the interrupts doesn't count.
+static void spend (int64_t ns) {
+	int64_t end = now_ns + ns;
+	while (1) {
+		if (!primask && !in_isr && (irq_pending() || rtc_irq_pending())) {
+			int64_t start = now_ns;
+			if (irq_pending()) run_isr();
+			else run_rtc_isr();
+			end += now_ns - start;
+			continue;
+		}
+		if (!advance(end)) break;
+	}
+	now_ns = end;
+}
+
+// WFI. Interrupts wake the core up even while masked. In stop mode TIM17
+// has no clock, and the core comes back on the HSI.
+static void wait_for_interrupt (bool stop) {
+	if (stop) {
+		stats.stops++;
+		set_tim_slowdown(0);
+	}
+
+	if (external_wake_ns == NEVER || external_wake_ns < now_ns) next_external_wake();
+	while (!irq_pending() && !rtc_irq_pending()) {
+		if (external_wake_ns != NEVER && external_wake_ns <= next_edge_ns() &&
+		    external_wake_ns <= rtc_alarm_ns) {
+			now_ns = external_wake_ns;
+			next_external_wake();
+			if (stop) stats.external_wakes++;
+			break;
+		}
+		if (!advance(NEVER - 1)) break;
+	}
+
+	if (stop) {
+		spend(STOP_WAKEUP_NS);
+		sysclk = 0x00;
+		pll_on = FALSE;
+		set_tim_slowdown(HSI_SLOWDOWN);
+	}
+	spend(ISR_ENTRY_NS);
+}
+
+void RCC_APB1PeriphClockCmd (uint32_t periph, FunctionalState state) {
+	(void) periph;
+	(void) state;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void RCC_LSICmd (FunctionalState state) {
+	(void) state;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void RCC_HSEConfig (uint8_t hse) {
+	(void) hse;
+	spend(REGISTER_ACCESS_NS);
+}
+
+ErrorStatus RCC_WaitForHSEStartUp (void) {
+	return ERROR;
+}
+
+void RCC_PLLCmd (FunctionalState state) {
+	if (state == ENABLE && !pll_on) {
+		pll_ready_ns = now_ns + NS(cfg.pll_lock_us);
+	}
+	pll_on = state == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+FlagStatus RCC_GetFlagStatus (uint8_t flag) {
+	FlagStatus status = RESET;
+	if (flag == RCC_FLAG_LSIRDY) status = SET;
+	if (flag == RCC_FLAG_PLLRDY && pll_on && now_ns >= pll_ready_ns) status = SET;
+	spend(REGISTER_ACCESS_NS);
+	return status;
+}
+
+void RCC_SYSCLKConfig (uint32_t source) {
+	if (source == RCC_SYSCLKSource_PLLCLK && pll_on && now_ns >= pll_ready_ns) {
+		sysclk = 0x08;
+		set_tim_slowdown(1);
+	}
+	spend(REGISTER_ACCESS_NS);
+}
+
+uint8_t RCC_GetSYSCLKSource (void) {
+	spend(REGISTER_ACCESS_NS);
+	return sysclk;
+}
+
+void RCC_RTCCLKConfig (uint32_t source) {
+	(void) source;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void RCC_RTCCLKCmd (FunctionalState state) {
+	(void) state;
+	rtc_origin_ns = now_ns;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void PWR_BackupAccessCmd (FunctionalState state) {
+	(void) state;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void PWR_EnterSleepMode (uint8_t entry) {
+	(void) entry;
+	wait_for_interrupt(FALSE);
+}
+
+void PWR_EnterSTOPMode (uint32_t regulator, uint8_t entry) {
+	(void) regulator;
+	(void) entry;
+	wait_for_interrupt(TRUE);
+}
+
+void EXTI_Init (EXTI_InitTypeDef* init) {
+	if (init->EXTI_Line == EXTI_Line17) exti_line17 = init->EXTI_LineCmd == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void EXTI_ClearITPendingBit (uint32_t line) {
+	(void) line;
+	spend(REGISTER_ACCESS_NS);
+}
+
+ErrorStatus RTC_WaitForSynchro (void) {
+	spend(lsi_cycles_ns(2));
+	return SUCCESS;
+}
+
+void RTC_StructInit (RTC_InitTypeDef* init) {
+	init->RTC_HourFormat = 0;
+	init->RTC_AsynchPrediv = 0x7F;
+	init->RTC_SynchPrediv = 0xFF;
+}
+
+ErrorStatus RTC_Init (RTC_InitTypeDef* init) {
+	rtc_async = init->RTC_AsynchPrediv + 1;
+	rtc_sync = init->RTC_SynchPrediv + 1;
+	rtc_origin_ns = now_ns;
+	spend(REGISTER_ACCESS_NS * 10);
+	return SUCCESS;
+}
+
+ErrorStatus RTC_BypassShadowCmd (FunctionalState state) {
+	(void) state;
+	spend(REGISTER_ACCESS_NS);
+	return SUCCESS;
+}
+
+void RTC_ITConfig (uint32_t it, FunctionalState state) {
+	if (it == RTC_IT_ALRA) rtc_alarm_it = state == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+ITStatus RTC_GetITStatus (uint32_t it) {
+	spend(REGISTER_ACCESS_NS);
+	return (it == RTC_IT_ALRA && rtc_alarm_flag && rtc_alarm_it) ? SET : RESET;
+}
+
+void RTC_ClearITPendingBit (uint32_t it) {
+	if (it == RTC_IT_ALRA) rtc_alarm_flag = FALSE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+uint32_t RTC_GetSubSecond (void) {
+	uint32_t ss = rtc_sync - 1 - rtc_count(now_ns) % rtc_sync;
+	spend(REGISTER_ACCESS_NS);
+	return ss;
+}
+
+void RTC_GetTime (uint32_t format, RTC_TimeTypeDef* time) {
+	int64_t seconds = rtc_count(now_ns) / rtc_sync;
+	(void) format;
+	time->RTC_Hours = (seconds / 3600) % 24;
+	time->RTC_Minutes = (seconds / 60) % 60;
+	time->RTC_Seconds = seconds % 60;
+	time->RTC_H12 = 0;
+	spend(REGISTER_ACCESS_NS * 4);
+}
+
+void RTC_AlarmStructInit (RTC_AlarmTypeDef* alarm) {
+	memset(alarm, 0, sizeof(*alarm));
+}
+
+// Only the masks source/timer.c uses: the seconds and subseconds are compared
+void RTC_SetAlarm (uint32_t format, uint32_t alarm, RTC_AlarmTypeDef* init) {
+	(void) format;
+	(void) alarm;
+	rtc_alarm_seconds = init->RTC_AlarmTime.RTC_Seconds;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void RTC_AlarmSubSecondConfig (uint32_t alarm, uint32_t value, uint32_t mask) {
+	(void) alarm;
+	(void) mask;
+	rtc_alarm_ss = value;
+	spend(REGISTER_ACCESS_NS);
+}
+
+ErrorStatus RTC_AlarmCmd (uint32_t alarm, FunctionalState state) {
+	(void) alarm;
+	rtc_alarm_enabled = state == ENABLE;
+	rtc_alarm_ns = NEVER;
+	if (rtc_alarm_enabled) {
+		int64_t minute = 60 * (int64_t) rtc_sync;
+		int64_t count = rtc_count(now_ns);
+		int64_t match = count - count % minute +
+		                rtc_alarm_seconds * rtc_sync + (rtc_sync - 1 - rtc_alarm_ss);
+		if (match <= count) match += minute;
+		rtc_alarm_ns = rtc_count_ns(match);
+	} else {
+		// Disabling waits for the alarm registers to be writable
+		spend(lsi_cycles_ns(2));
+	}
+	spend(REGISTER_ACCESS_NS);
+	return SUCCESS;
+}
+
+/******************************************************************************/
+// TIM17 registers
+/******************************************************************************/
+
+void RCC_APB2PeriphClockCmd (uint32_t periph, FunctionalState state) {
+	(void) periph;
+	(void) state;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void NVIC_Init (NVIC_InitTypeDef* init) {
+	if (init->NVIC_IRQChannel == TIM17_IRQn) nvic_tim = init->NVIC_IRQChannelCmd == ENABLE;
+	if (init->NVIC_IRQChannel == RTC_IRQn) nvic_rtc = init->NVIC_IRQChannelCmd == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void TIM_TimeBaseInit (TIM_TypeDef* tim, TIM_TimeBaseInitTypeDef* init) {
+	(void) tim;
+	(void) init;
+	// Loading the prescalar sets the update flag, like on the chip
+	tim_origin_ns = now_ns;
+	tim_base_ns = now_ns;
+	tim_base_count = 0;
+	tim_sr |= TIM_IT_Update;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void TIM_Cmd (TIM_TypeDef* tim, FunctionalState state) {
+	(void) tim;
+	tim_enabled = state == ENABLE;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void TIM_ITConfig (TIM_TypeDef* tim, uint16_t it, FunctionalState state) {
+	(void) tim;
+	if (state == ENABLE) tim_dier |= it;
+	else tim_dier &= ~it;
+	spend(REGISTER_ACCESS_NS);
+}
+
+ITStatus TIM_GetITStatus (TIM_TypeDef* tim, uint16_t it) {
+	(void) tim;
+	spend(REGISTER_ACCESS_NS);
+	return (tim_sr & tim_dier & it) ? SET : RESET;
+}
+
+FlagStatus TIM_GetFlagStatus (TIM_TypeDef* tim, uint16_t flag) {
+	(void) tim;
+	spend(REGISTER_ACCESS_NS);
+	return (tim_sr & flag) ? SET : RESET;
+}
+
+void TIM_ClearITPendingBit (TIM_TypeDef* tim, uint16_t it) {
+	(void) tim;
+	tim_sr &= ~it;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void TIM_GenerateEvent (TIM_TypeDef* tim, uint16_t source) {
+	(void) tim;
+	tim_sr |= source;
+	spend(REGISTER_ACCESS_NS);
+}
+
+void TIM_SetCompare1 (TIM_TypeDef* tim, uint32_t compare) {
+	(void) tim;
+	tim_ccr1 = compare;
+	spend(REGISTER_ACCESS_NS);
+}
+
+uint32_t TIM_GetCounter (TIM_TypeDef* tim) {
+	(void) tim;
+	uint32_t count = tim_enabled ? ticks() & 0xFFFF : 0;
+	spend(REGISTER_ACCESS_NS);
+	return count;
+}
+
+uint32_t __get_PRIMASK (void) {
+	return primask;
+}
+
+void __set_PRIMASK (uint32_t mask) {
+	primask = mask;
+	// Anything that came up while masked is taken now
+	if (!primask) spend(0);
+}
+
+void __disable_irq (void) {
+	primask = 1;
+}
+
+void __enable_irq (void) {
+	__set_PRIMASK(0);
+}
+
+void mark_interrupt (interrupt_source_e src) {
+	if (src == INTERRUPT_TIMER) timer_interrupt = TRUE;
+}
+
+/******************************************************************************/
+// Workload
+/******************************************************************************/
+
+static double uniform () {
+	return drand48();
+}
+
+// What the firmware thinks the time is. Without -i it is the real time.
+static int64_t clock_ns () {
+	if (!cfg.idle) return now_ns;
+	return tim_origin_ns + NS((int64_t) timer_now());
+}
+
+// How far timer_now() is ahead of the real time
+static double clock_error_us () {
+	if (!cfg.idle) return 0;
+	return (clock_ns() - now_ns) / 1000.0;
+}
+
+static void add_lateness (double us) {
+	if (stats.num == stats.max) {
+		stats.max = stats.max ? stats.max*2 : 4096;
+		stats.lateness_us = realloc(stats.lateness_us, stats.max * sizeof(double));
+		if (!stats.lateness_us) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	stats.lateness_us[stats.num++] = us;
+}
+
+static void start_oneshot (int i);
+
+static void callback (int i) {
+	bench_timer_t* b = &bench_timers[i];
+
+	if (b->stopped) {
+		stats.stopped_fired++;
+		return;
+	}
+
+	// Which deadline this is. The timer counts whole microseconds from when
+	// it was started, so it can be up to one early.
+	int64_t now = clock_ns();
+	int64_t deadline;
+	if (b->periodic) {
+		int64_t k = (now - b->start_ns + 1000) / b->period_ns;
+		deadline = b->start_ns + k * b->period_ns;
+		if (b->last_deadline != NEVER && deadline > b->last_deadline + b->period_ns) {
+			stats.missed += (deadline - b->last_deadline) / b->period_ns - 1;
+		}
+		b->last_deadline = deadline;
+	} else {
+		deadline = b->start_ns + b->period_ns;
+	}
+	double late_us = (now - deadline) / 1000.0;
+	if (late_us < -1) stats.early++;
+	if (deadline >= started_ns) add_lateness(late_us);
+
+	// How much the clock drifted over the time this deadline was counted
+	double error_us = fabs(clock_error_us() - b->start_error_us);
+	if (error_us > stats.max_clock_error_us) stats.max_clock_error_us = error_us;
+
+	if (!b->periodic) start_oneshot(i);
+
+	// Now and then, move or stop someone else's one shot
+	int j = (int) (uniform() * cfg.timers);
+	if (j != i && !bench_timers[j].periodic && uniform() < 0.1) {
+		if (uniform() < 0.5) {
+			timer_stop(&bench_timers[j].timer);
+			bench_timers[j].stopped = TRUE;
+		} else {
+			start_oneshot(j);
+		}
+	}
+
+	spend(NS(cfg.callback_us));
+}
+
+// The callbacks don't get told which timer they belong to
+#define CB(_g, _i) static void callback_##_g##_##_i () { callback(_g*8 + _i); }
+#define CB8(_g) CB(_g,0) CB(_g,1) CB(_g,2) CB(_g,3) CB(_g,4) CB(_g,5) CB(_g,6) CB(_g,7)
+CB8(0) CB8(1) CB8(2) CB8(3) CB8(4) CB8(5) CB8(6) CB8(7)
+
+#define CBP(_g, _i) callback_##_g##_##_i
+#define CBP8(_g) CBP(_g,0), CBP(_g,1), CBP(_g,2), CBP(_g,3), CBP(_g,4), CBP(_g,5), CBP(_g,6), CBP(_g,7)
+static timer_callback callbacks[MAX_TIMERS] = {
+	CBP8(0), CBP8(1), CBP8(2), CBP8(3), CBP8(4), CBP8(5), CBP8(6), CBP8(7)
+};
+
+static double random_period_us () {
+	// Spread evenly over the orders of magnitude
+	return cfg.min_period_us * pow(cfg.max_period_us / cfg.min_period_us, uniform());
+}
+
+static void start_oneshot (int i) {
+	bench_timer_t* b = &bench_timers[i];
+	uint32_t delay_us = (uint32_t) random_period_us();
+	b->stopped = FALSE;
+	b->start_ns = clock_ns();
+	b->start_error_us = clock_error_us();
+	b->period_ns = NS(delay_us);
+	timer_start_once(&b->timer, delay_us, callbacks[i]);
+}
+
+static int compare_double (const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile (double p) {
+	if (stats.num == 0) return 0;
+	int i = (int) ceil(p * stats.num) - 1;
+	return stats.lateness_us[i < 0 ? 0 : i];
+}
+
+static void usage (const char* name) {
+	fprintf(stderr, "usage: %s [-n timers] [-t seconds] [-c callback_us] [-o oneshot_fraction]\n"
+	                "       [-p min_period_us] [-P max_period_us] [-s seed]\n"
+	                "       [-i] [-l lsi_hz] [-L pll_lock_us] [-w wake_hz]\n", name);
+}
+
+int main (int argc, char** argv) {
+	int opt;
+
+	cfg = (bench_config_t) {
+		.timers = 16,
+		.seconds = 10,
+		.callback_us = 20,
+		.oneshot_fraction = 0.5,
+		.min_period_us = 500,
+		.max_period_us = 500000,
+		.seed = 1,
+		.lsi_hz = 41000,
+		.pll_lock_us = 200,
+		.wake_hz = 2,
+	};
+
+	while ((opt = getopt(argc, argv, "n:t:c:o:p:P:s:il:L:w:h")) != -1) {
+		switch (opt) {
+			case 'n': cfg.timers = atoi(optarg); break;
+			case 't': cfg.seconds = atof(optarg); break;
+			case 'c': cfg.callback_us = atof(optarg); break;
+			case 'o': cfg.oneshot_fraction = atof(optarg); break;
+			case 'p': cfg.min_period_us = atof(optarg); break;
+			case 'P': cfg.max_period_us = atof(optarg); break;
+			case 's': cfg.seed = atol(optarg); break;
+			case 'i': cfg.idle = TRUE; break;
+			case 'l': cfg.lsi_hz = atof(optarg); break;
+			case 'L': cfg.pll_lock_us = atof(optarg); break;
+			case 'w': cfg.wake_hz = atof(optarg); break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (cfg.timers < 1 || cfg.timers > MAX_TIMERS || cfg.min_period_us < 1 ||
+	    cfg.max_period_us < cfg.min_period_us || cfg.max_period_us > 1e9 ||
+	    cfg.lsi_hz < 1000 || cfg.pll_lock_us < 0 ||
+	    (cfg.idle && cfg.seconds > 3600)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand48(cfg.seed);
+
+	for (int i = 0; i < cfg.timers; i++) {
+		bench_timer_t* b = &bench_timers[i];
+		b->periodic = uniform() >= cfg.oneshot_fraction;
+		b->last_deadline = NEVER;
+		if (b->periodic) {
+			uint32_t period_us = (uint32_t) random_period_us();
+			b->start_ns = clock_ns();
+			b->start_error_us = clock_error_us();
+			b->period_ns = NS(period_us);
+			timer_start(&b->timer, period_us, callbacks[i]);
+		} else {
+			start_oneshot(i);
+		}
+		spend(NS(uniform() * 100));
+	}
+
+	started_ns = clock_ns();
+
+	// The main loop
+	int64_t end = NS(cfg.seconds * 1e6);
+	while (now_ns < end) {
+		if (timer_interrupt) {
+			timer_interrupt = FALSE;
+			timer_fired();
+		} else if (cfg.idle) {
+			__disable_irq();
+			if (!timer_interrupt) {
+				timer_idle(TRUE);
+			}
+			__enable_irq();
+		} else {
+			spend(NS(1));
+		}
+	}
+
+	qsort(stats.lateness_us, stats.num, sizeof(double), compare_double);
+
+	int periodic = 0;
+	for (int i = 0; i < cfg.timers; i++) periodic += bench_timers[i].periodic;
+
+	printf("%d timers (%d periodic), %.0f to %.0f us, %.0f us callbacks, %.0f s\n",
+	       cfg.timers, periodic, cfg.min_period_us, cfg.max_period_us, cfg.callback_us, cfg.seconds);
+	printf("Callbacks:   %d, %d interrupts\n", stats.num, stats.isrs);
+	printf("Lateness:    p50 %.1f us  p99 %.1f us  max %.1f us\n",
+	       percentile(0.5), percentile(0.99), percentile(1.0));
+	printf("Errors:      %d early, %d periods missed, %d stopped timers fired\n",
+	       stats.early, stats.missed, stats.stopped_fired);
+	if (cfg.idle) {
+		const timer_idle_stats_t* idle = timer_idle_stats();
+		printf("Idle:        %.1f%% awake, %.1f%% sleep, %.1f%% stop, %u stops (%d woken early)\n",
+		       100.0 * idle->run_us / (now_ns / 1000.0), 100.0 * idle->sleep_us / (now_ns / 1000.0),
+		       100.0 * idle->stop_us / (now_ns / 1000.0), idle->stops, stats.external_wakes);
+		printf("Clock:       max %.1f us drift over a deadline\n", stats.max_clock_error_us);
+	}
+
+	free(stats.lateness_us);
+	return (stats.early || stats.stopped_fired) ? 1 : 0;
+}
@@ -5,56 +5,273 @@
 #include "timer.h"
 #include "firmware.h"
 
+// All of the timers run off of this one. It counts up through all 16 bits,
+// and every time it wraps the top half of timer_now() goes up by one. Its
+// compare channel interrupts when the first timer expires.
+#define TIMER_TIM       TIM17
+#define TIMER_TIM_CLOCK RCC_APB2Periph_TIM17
+#define TIMER_IRQN      TIM17_IRQn
+
+// Deadlines closer than this can't be left to the compare, since the counter
+// may get there before it is set. The interrupt waits them out instead.
+#define TIMER_MIN_WAIT_US 4
+
+// In stop mode TIM17 has no clock, so the RTC keeps time instead. It runs off
+// the LSI, nominally 40kHz, and counts 50us ticks in its subsecond register.
+// How long a tick really is gets measured against TIM17.
+#define TIMER_RTC_ASYNC_PREDIV  1
+#define TIMER_RTC_SYNC_PREDIV   19999
+#define TIMER_RTC_TICKS_PER_S   (TIMER_RTC_SYNC_PREDIV+1)
+#define TIMER_RTC_TICKS_PER_MIN (60*TIMER_RTC_TICKS_PER_S)
 
 static uint8_t used_timers = 0;
 
-static timer_callback timer_callbacks[TIMER_NUMBER];
-
-// Predefine all of the timer structures
-stm_timer_t timers[TIMER_NUMBER] = {
-	{
-		0, // index
-		TIM17,
-		{ // NVIC Init
-			TIM17_IRQn, // Channel
-			0x01,       // Priority
-			ENABLE      // Enable or disable
-		},
-		{ // TIM init
-			0,                  // Prescalar
-			TIM_CounterMode_Up, // Counter Mode
-			0,                  // Period
-			TIM_CKD_DIV1,       // ClockDivision
-			0                   // Repetition Counter
-		},
-		RCC_APB2Periph_TIM17,
-		1
-	},
-	{
-		1, // index
-		TIM16,
-		{ // NVIC Init
-			TIM16_IRQn, // Channel
-			0x01,       // Priority
-			ENABLE      // Enable or disable
-		},
-		{ // TIM init
-			0,                  // Prescalar
-			TIM_CounterMode_Up, // Counter Mode
-			0,                  // Period
-			TIM_CKD_DIV1,       // ClockDivision
-			0                   // Repetition Counter
-		},
-		RCC_APB2Periph_TIM16,
-		1
-	}
-};
+static stm_timer_t timers[TIMER_NUMBER];
+
+// Running timers, the one that expires first at the front
+static stm_timer_t* _queue = NULL;
+
+// Timers that expired and haven't had their callback called yet, in the
+// order they expired
+static stm_timer_t* _fired_head = NULL;
+static stm_timer_t* _fired_tail = NULL;
+static uint16_t _fired_count = 0;
+
+static uint16_t _overflows = 0;
+static bool _running = FALSE;
+
+// How much time TIM17 missed while in stop mode. timer_now() adds it to the
+// counter.
+static uint32_t _stopped_us = 0;
+
+static bool _rtc_running = FALSE;
+
+// Microseconds per RTC tick, times 2^16. Zero until it has been measured.
+static uint32_t _lsi_tick_q16 = 0;
+
+// TIM17 and the RTC at the last tick both were known to be running from. The
+// time since goes into the next measurement of the LSI.
+static uint32_t _sync_us;
+static uint32_t _sync_ticks;
+static uint32_t _cal_us = 0;
+static uint32_t _cal_ticks = 0;
+
+static timer_idle_stats_t _idle_stats;
+static uint32_t _awake_since = 0;
+
+/******************************************************************************/
+// Helper functions
+/******************************************************************************/
+
+// The queues are changed from both the interrupt and the main thread
+static uint32_t enter_critical () {
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+}
+
+static void exit_critical (uint32_t primask) {
+	__set_PRIMASK(primask);
+}
+
+static void start_hardware () {
+	NVIC_InitTypeDef nvic_init = {
+		TIMER_IRQN, // Channel
+		0x01,       // Priority
+		ENABLE      // Enable or disable
+	};
+	TIM_TimeBaseInitTypeDef tim_init = {
+		(SystemCoreClock/500000)-1, // Prescalar
+		TIM_CounterMode_Up,         // Counter Mode
+		0xFFFF,                     // Period
+		TIM_CKD_DIV1,               // ClockDivision
+		0                           // Repetition Counter
+	};
+
+	RCC_APB2PeriphClockCmd(TIMER_TIM_CLOCK, ENABLE);
+	TIM_TimeBaseInit(TIMER_TIM, &tim_init);
+
+	// Loading the prescalar counts as an update, but it isn't a wrap
+	TIM_ClearITPendingBit(TIMER_TIM, TIM_IT_Update | TIM_IT_CC1);
+	TIM_ITConfig(TIMER_TIM, TIM_IT_Update, ENABLE);
+	NVIC_Init(&nvic_init);
+
+	TIM_Cmd(TIMER_TIM, ENABLE);
+	_running = TRUE;
+}
+
+// Keep the queue in deadline order. Timers with the same deadline expire in
+// the order they were started.
+static void queue_insert (stm_timer_t* t) {
+	stm_timer_t** p = &_queue;
+	while (*p != NULL && (int32_t) ((*p)->deadline - t->deadline) <= 0) {
+		p = &(*p)->next;
+	}
+	t->next = *p;
+	*p = t;
+}
+
+static void queue_remove (stm_timer_t* t) {
+	stm_timer_t** p = &_queue;
+	while (*p != NULL) {
+		if (*p == t) {
+			*p = t->next;
+			break;
+		}
+		p = &(*p)->next;
+	}
+	t->next = NULL;
+}
+
+// A timer that expires again before its callback was called only gets it
+// called once, like the hardware interrupts
+static void fired_append (stm_timer_t* t) {
+	if (t->fired) return;
+	t->fired = TRUE;
+	t->next_fired = NULL;
+	if (_fired_tail != NULL) {
+		_fired_tail->next_fired = t;
+	} else {
+		_fired_head = t;
+	}
+	_fired_tail = t;
+	_fired_count++;
+}
+
+static void fired_remove (stm_timer_t* t) {
+	stm_timer_t* prev = NULL;
+	stm_timer_t* cur = _fired_head;
+
+	if (!t->fired) return;
+	while (cur != NULL && cur != t) {
+		prev = cur;
+		cur = cur->next_fired;
+	}
+	if (cur == NULL) return;
+
+	if (prev != NULL) {
+		prev->next_fired = t->next_fired;
+	} else {
+		_fired_head = t->next_fired;
+	}
+	if (_fired_tail == t) {
+		_fired_tail = prev;
+	}
+	t->fired = FALSE;
+	t->next_fired = NULL;
+	_fired_count--;
+}
+
+// TIM17 extended to 32 bits, without the time it spent stopped
+static uint32_t hw_now () {
+	uint32_t primask = enter_critical();
+	uint16_t high = _overflows;
+	uint16_t count = TIM_GetCounter(TIMER_TIM);
+
+	// It wrapped, but the interrupt hasn't counted it yet
+	if (TIM_GetFlagStatus(TIMER_TIM, TIM_FLAG_Update) != RESET) {
+		count = TIM_GetCounter(TIMER_TIM);
+		high++;
+	}
+
+	exit_critical(primask);
+	return ((uint32_t) high << 16) | count;
+}
+
+// Point the compare at the first deadline. If that is further off than the
+// counter goes, the interrupt when it wraps tries again.
+static void set_compare () {
+	int32_t wait;
+
+	if (_queue == NULL) {
+		TIM_ITConfig(TIMER_TIM, TIM_IT_CC1, DISABLE);
+		return;
+	}
+
+	wait = (int32_t) (_queue->deadline - timer_now());
+	if (wait > 0xFFFF) {
+		TIM_ITConfig(TIMER_TIM, TIM_IT_CC1, DISABLE);
+		return;
+	}
+
+	if (wait >= TIMER_MIN_WAIT_US) {
+		TIM_SetCompare1(TIMER_TIM, (uint16_t) (_queue->deadline - _stopped_us));
+		TIM_ClearITPendingBit(TIMER_TIM, TIM_IT_CC1);
+		TIM_ITConfig(TIMER_TIM, TIM_IT_CC1, ENABLE);
+
+		// Make sure the counter didn't pass it while it was being set
+		wait = (int32_t) (_queue->deadline - timer_now());
+		if (wait >= TIMER_MIN_WAIT_US) return;
+	}
+
+	// Interrupt right away
+	TIM_ITConfig(TIMER_TIM, TIM_IT_CC1, ENABLE);
+	TIM_GenerateEvent(TIMER_TIM, TIM_EventSource_CC1);
+}
+
+// Take the timers that are due off the queue, put the periodic ones back in
+// for their next deadline, and let the main loop know.
+static void expire () {
+	uint32_t now = timer_now();
+	bool any = FALSE;
+
+	while (_queue != NULL) {
+		stm_timer_t* t = _queue;
+		int32_t wait = (int32_t) (t->deadline - now);
+
+		if (wait > 0) {
+			if (wait >= TIMER_MIN_WAIT_US) break;
+			now = timer_now();
+			continue;
+		}
+
+		_queue = t->next;
+		t->next = NULL;
+		fired_append(t);
+		any = TRUE;
+
+		if (t->once || t->period == 0) {
+			t->running = FALSE;
+		} else {
+			// Stay in phase, skipping any periods that already went by
+			do {
+				t->deadline += t->period;
+			} while ((int32_t) (t->deadline - now) <= 0);
+			queue_insert(t);
+		}
+	}
+
+	if (any) {
+		mark_interrupt(INTERRUPT_TIMER);
+	}
+	set_compare();
+}
+
+static void schedule (stm_timer_t* t, uint32_t delay_us, uint32_t period_us, bool once, timer_callback cb) {
+	uint32_t primask;
+
+	if (!_running) {
+		start_hardware();
+	}
+
+	primask = enter_critical();
+	queue_remove(t);
+	fired_remove(t);
+	t->callback = cb;
+	t->period   = period_us;
+	t->once     = once;
+	t->running  = TRUE;
+	t->deadline = timer_now() + delay_us;
+	queue_insert(t);
+	set_compare();
+	exit_critical(primask);
+}
 
 /******************************************************************************/
 // API Functions
 /******************************************************************************/
 
-// Give the caller a pointer to a valid timer configuration struct.
+// Give the caller a pointer to a timer that isn't being used.
 stm_timer_t* timer_init () {
 	if (used_timers >= TIMER_NUMBER) {
 		return NULL;
@@ -63,120 +280,345 @@ stm_timer_t* timer_init () {
 	return &timers[used_timers-1];
 }
 
-// Start a particular timer running
+// Start a timer that fires now and then every us_period. Restarts it if it
+// was running.
 void timer_start (stm_timer_t* t, uint32_t us_period, timer_callback cb) {
-	uint32_t prescalar = (SystemCoreClock/500000)-1;
-	// Save the callback
-	timer_callbacks[t->index] = cb;
+	schedule(t, 0, us_period, FALSE, cb);
+}
 
-	// Enable the clock
-	RCC_APB2PeriphClockCmd(t->timer_clock , ENABLE);
+// Start a timer that fires once, us_delay from now
+void timer_start_once (stm_timer_t* t, uint32_t us_delay, timer_callback cb) {
+	schedule(t, us_delay, us_delay, TRUE, cb);
+}
 
-	// Setup the interrupt
-	t->nvic_init.NVIC_IRQChannelCmd = ENABLE;
-	NVIC_Init(&t->nvic_init);
+// Move a running timer as if val_us of its period (or delay) had already gone
+// by since it last fired
+void timer_reset (stm_timer_t* t, uint32_t val_us){
+	uint32_t primask = enter_critical();
 
-	// Need this to fit in 16 bits
-	t->divider = 1;
-	while (us_period > 65535) {
-		us_period = us_period >> 1;
-		prescalar = prescalar << 1;
-		t->divider = t->divider << 1;
+	if (t->running) {
+		queue_remove(t);
+		t->deadline = timer_now() + ((val_us < t->period) ? t->period - val_us : 0);
+		queue_insert(t);
+		set_compare();
 	}
 
-	// Setup the actual timer
-	t->tim_init.TIM_Period    = us_period;
-	t->tim_init.TIM_Prescaler = prescalar;
-	TIM_TimeBaseInit(t->tim_ptr, &t->tim_init);
+	exit_critical(primask);
+}
+
+// Stop a timer. Its callback won't be called, even if it already expired.
+void timer_stop (stm_timer_t* t) {
+	uint32_t primask = enter_critical();
 
-	// Enable the interrupt
-	TIM_ITConfig(t->tim_ptr, TIM_IT_Update , ENABLE);
-	TIM_ClearITPendingBit(t->tim_ptr, TIM_IT_Update);
+	queue_remove(t);
+	fired_remove(t);
+	t->running = FALSE;
+	t->callback = NULL;
+	set_compare();
 
-	// Enable the timer
-	TIM_Cmd(t->tim_ptr, ENABLE);
+	exit_critical(primask);
 }
 
-void timer_disable_interrupt(stm_timer_t* t){
-	TIM_ITConfig(t->tim_ptr, TIM_IT_Update, DISABLE);
+// Microseconds since the first timer was started. Wraps after ~71 minutes,
+// so compare times by the signed difference.
+uint32_t timer_now () {
+	return hw_now() + _stopped_us;
 }
 
-void timer_enable_interrupt(stm_timer_t* t){
-	TIM_ITConfig(t->tim_ptr, TIM_IT_Update, ENABLE);
+/******************************************************************************/
+// Idle
+/******************************************************************************/
+
+static void rtc_start () {
+	RTC_InitTypeDef rtc_init;
+	EXTI_InitTypeDef exti_init;
+	NVIC_InitTypeDef nvic_init = {
+		RTC_IRQn, // Channel
+		0x01,     // Priority
+		ENABLE    // Enable or disable
+	};
+
+	RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR, ENABLE);
+	PWR_BackupAccessCmd(ENABLE);
+	RCC_LSICmd(ENABLE);
+	while (RCC_GetFlagStatus(RCC_FLAG_LSIRDY) == RESET);
+	RCC_RTCCLKConfig(RCC_RTCCLKSource_LSI);
+	RCC_RTCCLKCmd(ENABLE);
+	RTC_WaitForSynchro();
+
+	RTC_StructInit(&rtc_init);
+	rtc_init.RTC_AsynchPrediv = TIMER_RTC_ASYNC_PREDIV;
+	rtc_init.RTC_SynchPrediv  = TIMER_RTC_SYNC_PREDIV;
+	RTC_Init(&rtc_init);
+
+	// Read the counters themselves, the shadow copies are stale after stop
+	// mode until the next RTC clock
+	RTC_BypassShadowCmd(ENABLE);
+
+	// The alarm wakes us up through EXTI line 17
+	exti_init.EXTI_Line    = EXTI_Line17;
+	exti_init.EXTI_Mode    = EXTI_Mode_Interrupt;
+	exti_init.EXTI_Trigger = EXTI_Trigger_Rising;
+	exti_init.EXTI_LineCmd = ENABLE;
+	EXTI_Init(&exti_init);
+	RTC_ITConfig(RTC_IT_ALRA, ENABLE);
+	NVIC_Init(&nvic_init);
+
+	_rtc_running = TRUE;
 }
 
-void timer_reset (stm_timer_t* t, uint32_t val_us){
+// RTC ticks since the start of the minute
+static uint32_t rtc_ticks () {
+	RTC_TimeTypeDef time;
+	uint32_t ss;
 
-	val_us /= t->divider;
-	//val_us /= t->tim_init.TIM_Prescaler;
-	TIM_SetCounter(t->tim_ptr, val_us);
+	// Try again if it ticked between reading the two
+	do {
+		ss = RTC_GetSubSecond();
+		RTC_GetTime(RTC_Format_BIN, &time);
+	} while (ss != RTC_GetSubSecond());
 
-	// Clear the interrupt pending bit for good measure
-	TIM_ClearITPendingBit(t->tim_ptr, TIM_IT_Update);
+	return (time.RTC_Seconds * TIMER_RTC_TICKS_PER_S) + (TIMER_RTC_SYNC_PREDIV - ss);
 }
 
-// Disable everything that timer_start enabled
-void timer_stop (stm_timer_t* t) {
-	// Disable the timer
-	TIM_Cmd(t->tim_ptr, DISABLE);
+static uint32_t rtc_ticks_between (uint32_t from, uint32_t to) {
+	return (to + TIMER_RTC_TICKS_PER_MIN - from) % TIMER_RTC_TICKS_PER_MIN;
+}
 
-	// Disable the interrupt
-	TIM_ITConfig(t->tim_ptr, TIM_IT_Update , DISABLE);
+// Wait for the RTC to tick and get the time from TIM17 right then. A tick
+// can be up to 50us off otherwise, which would add up over many stops.
+static uint32_t rtc_sync (uint32_t* hw_us) {
+	uint32_t ticks = rtc_ticks();
+	uint32_t next;
 
-	// Disable the interrupt channel
-	t->nvic_init.NVIC_IRQChannelCmd = DISABLE;
-	NVIC_Init(&t->nvic_init);
+	while ((next = rtc_ticks()) == ticks);
+	*hw_us = hw_now();
+	return next;
+}
 
-	// Disable the clock
-	RCC_APB2PeriphClockCmd(t->timer_clock , DISABLE);
+static void rtc_set_alarm (uint32_t ticks) {
+	RTC_AlarmTypeDef alarm;
+
+	ticks %= TIMER_RTC_TICKS_PER_MIN;
+
+	RTC_AlarmCmd(RTC_Alarm_A, DISABLE);
+	RTC_AlarmStructInit(&alarm);
+	alarm.RTC_AlarmTime.RTC_Seconds = ticks / TIMER_RTC_TICKS_PER_S;
+	alarm.RTC_AlarmMask = RTC_AlarmMask_DateWeekDay | RTC_AlarmMask_Hours | RTC_AlarmMask_Minutes;
+	RTC_SetAlarm(RTC_Format_BIN, RTC_Alarm_A, &alarm);
+	RTC_AlarmSubSecondConfig(RTC_Alarm_A,
+	                         TIMER_RTC_SYNC_PREDIV - (ticks % TIMER_RTC_TICKS_PER_S),
+	                         RTC_AlarmSubSecondMask_None);
+	RTC_ClearITPendingBit(RTC_IT_ALRA);
+	EXTI_ClearITPendingBit(EXTI_Line17);
+	RTC_AlarmCmd(RTC_Alarm_A, ENABLE);
+}
 
-	// Remove the callback
-	timer_callbacks[t->index] = NULL;
+static uint32_t rtc_ticks_to_us (uint32_t ticks) {
+	return ((uint64_t) ticks * _lsi_tick_q16) >> 16;
 }
 
-/******************************************************************************/
-// Interrupt handling
-/******************************************************************************/
+// TIM17 and the RTC both ran since the last sync. Add that to the
+// measurement of how long an RTC tick is.
+static void lsi_measure (uint32_t hw_us, uint32_t ticks) {
+	uint32_t us = hw_us - _sync_us;
 
-// Call the timer callback from main thread context
-void timer_17_fired () {
-	if (timer_callbacks[0] != NULL) {
-		timer_callbacks[0]();
+	// Too long to tell how many minutes the RTC went around
+	if (us < TIMER_STOP_MAX_US) {
+		_cal_us += us;
+		_cal_ticks += rtc_ticks_between(_sync_ticks, ticks);
+	}
+	_sync_us = hw_us;
+	_sync_ticks = ticks;
+
+	if (_cal_us >= TIMER_LSI_CAL_US && _cal_ticks > 0) {
+		uint32_t tick_q16 = ((uint64_t) _cal_us << 16) / _cal_ticks;
+
+		// The LSI moves with temperature and voltage, follow it slowly
+		if (_lsi_tick_q16 == 0) {
+			_lsi_tick_q16 = tick_q16;
+		} else {
+			_lsi_tick_q16 = _lsi_tick_q16 - (_lsi_tick_q16 >> 2) + (tick_q16 >> 2);
+		}
+		_cal_us = 0;
+		_cal_ticks = 0;
 	}
 }
 
-// Call the timer callback from main thread context
-void timer_16_fired () {
-	if (timer_callbacks[1] != NULL) {
-		timer_callbacks[1]();
+// The core comes out of stop mode running on the HSI. Put it back on the
+// clock it was using.
+static void restore_clocks (uint8_t sysclk, bool hse) {
+	if (hse) {
+		RCC_HSEConfig(RCC_HSE_ON);
+		RCC_WaitForHSEStartUp();
 	}
+	if (sysclk == 0x08) {
+		RCC_PLLCmd(ENABLE);
+		while (RCC_GetFlagStatus(RCC_FLAG_PLLRDY) == RESET);
+		RCC_SYSCLKConfig(RCC_SYSCLKSource_PLLCLK);
+	} else if (sysclk == 0x04) {
+		RCC_SYSCLKConfig(RCC_SYSCLKSource_HSE);
+	}
+	while (RCC_GetSYSCLKSource() != sysclk);
 }
 
-// Raw interrupt handlers from vector table
-void TIM17_IRQHandler(void) {
-	if (TIM_GetITStatus(TIM17, TIM_IT_Update) != RESET) {
+// Stop until the RTC alarm shortly before the next deadline, or until the
+// DW1000 or the host wakes us up. Both of those come in on EXTI lines (the
+// I2C is clocked from the HSI for this), so they are already set up.
+static void stop (uint32_t wait_us) {
+	uint8_t sysclk = RCC_GetSYSCLKSource();
+	bool hse = RCC_GetFlagStatus(RCC_FLAG_HSERDY) != RESET;
+	uint32_t start_us = hw_now();
+	uint32_t before_us, after_us;
+	uint32_t before_ticks, after_ticks;
+	uint32_t wake_ticks;
+	int32_t stopped_us;
+
+	before_ticks = rtc_sync(&before_us);
+	lsi_measure(before_us, before_ticks);
+
+	// Leave time for the clocks to start and to wait for the next tick
+	wait_us -= (before_us - start_us) + TIMER_STOP_WAKE_US;
+	wake_ticks = ((uint64_t) wait_us << 16) / _lsi_tick_q16;
+	if (wake_ticks < 2) return;
+	rtc_set_alarm(before_ticks + wake_ticks - 1);
+
+	PWR_EnterSTOPMode(PWR_Regulator_LowPower, PWR_STOPEntry_WFI);
+
+	restore_clocks(sysclk, hse);
+	RTC_AlarmCmd(RTC_Alarm_A, DISABLE);
+
+	// TIM17 only counted the time awake between the two ticks
+	after_ticks = rtc_sync(&after_us);
+	stopped_us = (int32_t) (rtc_ticks_to_us(rtc_ticks_between(before_ticks, after_ticks)) -
+	                        (after_us - before_us));
+	if (stopped_us > 0) {
+		_stopped_us += stopped_us;
+		_idle_stats.stop_us += stopped_us;
+	}
+	_idle_stats.stops++;
+	_sync_us = after_us;
+	_sync_ticks = after_ticks;
 
-		// Notify main loop that we got a timer interrupt
-		// We save the index of the callback in our interrupt slot
-		// so that when the main thread gets back to us we know what
-		// to call.
-		mark_interrupt(INTERRUPT_TIMER_17);
+	// Deadlines that went by while stopped interrupt as soon as interrupts
+	// are unmasked
+	set_compare();
+}
+
+// Sleep until the next interrupt, in stop mode if stop_ok and the next
+// deadline is far enough away for it. Interrupts have to be masked so that
+// nothing can be queued for the main loop between checking and sleeping. A
+// pending interrupt still wakes the core, and is taken after the clocks are
+// back.
+void timer_idle (bool stop_ok) {
+	uint32_t now;
+
+	if (!_running) {
+		PWR_EnterSleepMode(PWR_SLEEPEntry_WFI);
+		return;
+	}
+
+	now = timer_now();
+	_idle_stats.run_us += now - _awake_since;
+
+	if (stop_ok && !_rtc_running) {
+		rtc_start();
+		_sync_ticks = rtc_sync(&_sync_us);
+	}
+
+	if (stop_ok && _lsi_tick_q16 == 0) {
+		// Measure the LSI before it is relied on
+		if (hw_now() - _sync_us >= TIMER_LSI_CAL_US) {
+			uint32_t hw_us;
+			uint32_t ticks = rtc_sync(&hw_us);
+			lsi_measure(hw_us, ticks);
+		}
+	}
+
+	if (stop_ok && _lsi_tick_q16 != 0) {
+		uint32_t wait_us = TIMER_STOP_MAX_US;
+
+		if (_queue != NULL) {
+			int32_t wait = (int32_t) (_queue->deadline - timer_now());
+			wait_us = (wait < 0) ? 0 : (uint32_t) wait;
+			if (wait_us > TIMER_STOP_MAX_US) wait_us = TIMER_STOP_MAX_US;
+		}
+
+		if (wait_us >= TIMER_STOP_MIN_US) {
+			stop(wait_us);
+			_awake_since = timer_now();
+			return;
+		}
+	}
+
+	now = timer_now();
+	PWR_EnterSleepMode(PWR_SLEEPEntry_WFI);
+	_awake_since = timer_now();
+	_idle_stats.sleep_us += _awake_since - now;
+}
+
+const timer_idle_stats_t* timer_idle_stats () {
+	return &_idle_stats;
+}
+
+/******************************************************************************/
+// Interrupt handling
+/******************************************************************************/
 
-		// Clear Timer interrupt pending bit
-		TIM_ClearITPendingBit(TIM17, TIM_IT_Update);
+// Call the callbacks of the timers that expired from main thread context.
+// Only the ones that expired before this was called, so that a fast timer
+// can't keep the main loop here.
+void timer_fired () {
+	uint16_t count;
+	uint32_t primask;
+
+	primask = enter_critical();
+	count = _fired_count;
+	exit_critical(primask);
+
+	while (count-- > 0) {
+		stm_timer_t* t;
+		timer_callback cb = NULL;
+
+		primask = enter_critical();
+		t = _fired_head;
+		if (t != NULL) {
+			cb = t->callback;
+			fired_remove(t);
+		}
+		exit_critical(primask);
+
+		if (t == NULL) break;
+		if (cb != NULL) {
+			cb();
+		}
 	}
 }
 
-void TIM16_IRQHandler(void) {
-	if (TIM_GetITStatus(TIM16, TIM_IT_Update) != RESET) {
+// The RTC alarm only has to wake us up from stop mode
+void RTC_IRQHandler(void) {
+	if (RTC_GetITStatus(RTC_IT_ALRA) != RESET) {
+		RTC_ClearITPendingBit(RTC_IT_ALRA);
+	}
+	EXTI_ClearITPendingBit(EXTI_Line17);
+}
 
-		// Notify main loop that we got a timer interrupt
-		// We save the index of the callback in our interrupt slot
-		// so that when the main thread gets back to us we know what
-		// to call.
-		mark_interrupt(INTERRUPT_TIMER_16);
+// Raw interrupt handler from vector table
+void TIM17_IRQHandler(void) {
+	// timer_now() must not see the wrap flag cleared before it is counted
+	uint32_t primask = enter_critical();
 
-		// Clear Timer interrupt pending bit
-		TIM_ClearITPendingBit(TIM16, TIM_IT_Update);
+	if (TIM_GetITStatus(TIMER_TIM, TIM_IT_Update) != RESET) {
+		TIM_ClearITPendingBit(TIMER_TIM, TIM_IT_Update);
+		_overflows++;
 	}
+	if (TIM_GetITStatus(TIMER_TIM, TIM_IT_CC1) != RESET) {
+		TIM_ClearITPendingBit(TIMER_TIM, TIM_IT_CC1);
+	}
+
+	// The deadlines are checked on every wrap too, for the ones more than a
+	// wrap away
+	expire();
+
+	exit_critical(primask);
 }